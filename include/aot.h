@@ -0,0 +1,53 @@
+#ifndef AOT_H_INCLUDED
+#define AOT_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jit.h"
+
+/*
+ * Writes a C translation unit to out which, when compiled together with vm.c
+ * and linked against the rest of the interpreter's objects (see make aot), runs
+ * the program at path without reading anything from ~/.ty or the working
+ * directory.
+ *
+ * The program is compiled (but not run) in the process, and the image of every
+ * unit that the bytecode cache could save (see cache.h) is embedded, so the
+ * binary loads the prelude, the modules and the program instead of compiling
+ * them. The sources are embedded too, for error messages and for the units that
+ * have to be compiled at startup after all.
+ *
+ * Each function body and loop in the bytecode is also translated to a C
+ * function that does what the JIT's templates (see jit.h) do, one instruction
+ * after another with C control flow between them, for as long as it can, and
+ * returns to vm_exec() at the first instruction that doesn't have a template.
+ */
+bool
+aot_emit_c(FILE *out, char const *path);
+
+/* A unit embedded by aot_emit_c(); image is NULL if it gets compiled at startup */
+struct aot_unit {
+        char const *name;
+        char const *source;
+        unsigned char const *image;
+        size_t size;
+};
+
+struct aot_program {
+        struct aot_unit program;
+        struct aot_unit const *modules;
+        int module_count;
+        JitUnit const *units;
+        int unit_count;
+        uint64_t build; /* the cache_build_id() of the ty that wrote the images */
+};
+
+/* The main() of a binary from make aot */
+int
+aot_main(int argc, char **argv, struct aot_program const *p);
+
+#endif
+
+/* vim: set sts=8 sw=8 expandtab: */
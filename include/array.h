@@ -5,6 +5,8 @@
 
 struct value (*get_array_method(char const *))(struct value *, int, struct value *);
 
+struct value (*get_array_method_i(int))(struct value *, int, struct value *);
+
 int
 array_get_completions(char const *prefix, char **out, int max);
 
@@ -622,6 +622,9 @@
 {.module = "ty", .name = "lock", .value = BUILTIN(builtin_ty_lock)},
 {.module = "ty", .name = "unlock", .value = BUILTIN(builtin_ty_unlock)},
 {.module = "ty", .name = "gc", .value = BUILTIN(builtin_ty_gc)},
+{.module = "ty", .name = "gcStats", .value = BUILTIN(builtin_ty_gc_stats)},
+{.module = "ty", .name = "heapSnapshot", .value = BUILTIN(builtin_ty_heap_snapshot)},
+{.module = "ty", .name = "typedArray", .value = BUILTIN(builtin_typed_array)},
 {.module = "ty/token", .name = "next", .value = BUILTIN(builtin_token_next)},
 {.module = "ty/token", .name = "peek", .value = BUILTIN(builtin_token_peek)},
 {.module = "ty/parse", .name = "source", .value = BUILTIN(builtin_parse_source)},
@@ -0,0 +1,167 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vec.h"
+
+/*
+ * Compiled modules and the prelude are saved to ~/.ty/cache/<module>.tyc so that
+ * later runs can load them instead of parsing and compiling them again. An image
+ * is tied to the build of the interpreter that wrote it, and compiler.c checks
+ * that its source and everything it was compiled against are unchanged.
+ *
+ * Some operands in the bytecode depend on what else had been compiled first:
+ * member ids, inline cache sites, global slots, and class and tag ids. Those are
+ * saved as relocations, with ids relative to the unit that owns them, and are
+ * patched when the image is loaded.
+ */
+
+extern bool UseCache;
+
+enum {
+        CACHE_ABSOLUTE = -2, /* one of the interpreter's own, the same in every run */
+        CACHE_OWN      = -1  /* defined by this unit */
+};
+
+struct cache_ref {
+        int unit; /* CACHE_ABSOLUTE, CACHE_OWN or an index into deps */
+        int id;
+};
+
+enum {
+        RELOC_MEMBER, /* id is an index into members */
+        RELOC_SITE,
+        RELOC_GLOBAL,
+        RELOC_CLASS,
+        RELOC_TAG,
+        RELOC_REGEX   /* id is an index into regexes */
+};
+
+struct cache_reloc {
+        size_t offset;
+        int kind;
+        struct cache_ref ref;
+};
+
+/* Another unit this one refers to, and the key it had */
+struct cache_dep {
+        char const *name;
+        uint64_t key;
+};
+
+struct cache_import {
+        char const *module;
+        char const *as;
+        vec(char *) identifiers;
+};
+
+struct cache_operator {
+        char const *name;
+        int prec;
+};
+
+struct cache_regex {
+        char const *pattern;
+        int flags;
+};
+
+struct cache_class {
+        char const *name;
+        struct cache_ref super;
+};
+
+enum {
+        CACHE_SYM_PUBLIC = 1 << 0,
+        CACHE_SYM_CONST  = 1 << 1,
+        CACHE_SYM_MACRO  = 1 << 2
+};
+
+/*
+ * A location is saved as an offset into the unit's source, or -1 if it points
+ * somewhere else (e.g. into a macro's module).
+ */
+struct cache_location {
+        int line;
+        int col;
+        intptr_t s;
+};
+
+/* A symbol in the unit's module scope, with its global slot relative to the unit's first */
+struct cache_symbol {
+        char const *identifier;
+        int i;
+        int flags;
+        struct cache_ref tag;
+        struct cache_ref class;
+        struct cache_location loc;
+};
+
+struct cache_eloc {
+        size_t start_off;
+        size_t end_off;
+        struct cache_location start;
+        struct cache_location end;
+};
+
+struct cache_image {
+        uint64_t source;
+        uint64_t key;
+
+        vec(struct cache_dep) deps;
+        vec(struct cache_import) imports;
+        vec(struct cache_operator) operators;
+
+        vec(char const *) members;
+        vec(struct cache_regex) regexes;
+        vec(struct cache_class) classes;
+        vec(char const *) tags;
+        int globals;
+        vec(struct cache_symbol) symbols;
+
+        vec(char) code;
+        vec(size_t) entries;
+        vec(struct cache_reloc) relocs;
+        vec(struct cache_eloc) locations;
+};
+
+uint64_t
+cache_hash(void const *p, size_t n, uint64_t seed);
+
+/* Identifies the running build of the interpreter */
+uint64_t
+cache_build_id(void);
+
+/*
+ * Makes cache_build_id() return id instead, for a binary from make aot that
+ * carries images written by the ty that generated it.
+ */
+void
+cache_set_build_id(uint64_t id);
+
+/* Returns an image the way cache_store() writes it, in a buffer for free() */
+unsigned char *
+cache_encode(struct cache_image const *img, size_t *n);
+
+/* Like cache_load(), but from n bytes at data, which img then points into */
+bool
+cache_decode(unsigned char const *data, size_t n, struct cache_image *img);
+
+/*
+ * Reads the cached image for a module, or returns false if there isn't one that
+ * this build wrote. Strings in the image point into a buffer that is never freed.
+ */
+bool
+cache_load(char const *name, struct cache_image *img);
+
+void
+cache_store(char const *name, struct cache_image const *img);
+
+void
+cache_free(struct cache_image *img);
+
+#endif
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -6,6 +6,8 @@
 #include "value.h"
 #include "util.h"
 
+extern _Atomic unsigned *ClassVersions;
+
 int
 class_new(char const *name);
 
@@ -60,9 +62,21 @@ class_method_name(int class, char const *name);
 void
 class_set_super(int class, int super);
 
+int
+class_get_super(int class);
+
+int
+class_count(void);
+
 bool
 class_is_subclass(int sub, int super);
 
+inline static unsigned
+class_version(int class)
+{
+        return atomic_load_explicit(&ClassVersions[class], memory_order_relaxed);
+}
+
 int
 class_get_completions(int class, char const *prefix, char **out, int max);
 
@@ -5,12 +5,57 @@
 
 extern bool CheckConstraints;
 
+/* Whether the image of every unit that can be cached is kept for compiler_unit_images() */
+extern bool KeepImages;
+
 struct location;
 struct expression;
 
+struct module_source {
+        char const *name;
+        char const *source;
+};
+
+/* The bytecode of a source file, module or the prelude, and where vm_exec() can enter native code in it */
+struct compiled_unit {
+        char const *name;
+        char *code;
+        size_t size;
+        size_t const *entries;
+        int entry_count;
+};
+
+/*
+ * A unit as the bytecode cache saves it (see cache.h). name is the module's
+ * name, or "prelude", or the path of the program; filename is the name its
+ * compiled_unit has.
+ */
+struct unit_image {
+        char const *name;
+        char const *filename;
+        unsigned char const *data;
+        size_t size;
+};
+
 char const *
 compiler_error(void);
 
+void
+compiler_embed_module(char const *name, char const *source);
+
+struct module_source const *
+compiler_loaded_modules(int *n);
+
+/* Used instead of compiling the unit called name, if it matches its source */
+void
+compiler_embed_image(char const *name, unsigned char const *data, size_t size);
+
+struct unit_image const *
+compiler_unit_images(int *n);
+
+struct compiled_unit const *
+compiler_compiled_units(int *n);
+
 void
 compiler_init(void);
 
@@ -3,9 +3,29 @@
 
 #include "value.h"
 
+/* Bytes per index slot in a dict with size slots: enough for any entry number */
+inline static size_t
+dict_index_width(size_t size)
+{
+        if (size <= (1UL << 8))  return 1;
+        if (size <= (1UL << 16)) return 2;
+        if (size <= (1UL << 32)) return 4;
+        return 8;
+}
+
 struct dict *
 dict_new(void);
 
+struct dict *
+dict_new_sized(size_t n);
+
+/* The value of entry i; until a dict has a values array, they're all nil */
+inline static struct value
+dict_value(struct dict const *d, size_t i)
+{
+        return (d->values != NULL) ? d->values[i] : NIL;
+}
+
 struct value *
 dict_get_value(struct dict *obj, struct value *key);
 
@@ -15,6 +35,10 @@ dict_put_value(struct dict *obj, struct value key, struct value value);
 bool
 dict_has_value(struct dict *d, struct value *key);
 
+/* Puts key in d with a nil value, unless it's already there. Returns whether it was added */
+bool
+dict_add(struct dict *d, struct value key);
+
 struct value *
 dict_get_member(struct dict *obj, char const *key);
 
@@ -42,6 +66,18 @@ dict_subtract(struct value *d, int argc, struct value *kwargs);
 struct value
 dict_clone(struct value *d, int argc, struct value *kwargs);
 
+struct dict *
+dict_union(struct dict *d, struct dict *u);
+
+struct dict *
+dict_difference(struct dict *d, struct dict *u);
+
+struct dict *
+dict_intersection(struct dict *d, struct dict *u);
+
+bool
+dict_subset(struct dict const *d, struct dict const *u);
+
 void
 dict_mark(struct dict *obj);
 
@@ -50,6 +86,8 @@ dict_free(struct dict *obj);
 
 struct value (*get_dict_method(char const *))(struct value *, int, struct value *);
 
+struct value (*get_dict_method_i(int))(struct value *, int, struct value *);
+
 int
 dict_get_completions(char const *prefix, char **out, int max);
 
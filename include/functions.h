@@ -628,6 +628,12 @@ builtin_ty_gensym(int argc, struct value *kwargs);
 struct value
 builtin_ty_gc(int argc, struct value *kwargs);
 
+struct value
+builtin_ty_gc_stats(int argc, struct value *kwargs);
+
+struct value
+builtin_ty_heap_snapshot(int argc, struct value *kwargs);
+
 struct value
 builtin_token_next(int argc, struct value *kwargs);
 
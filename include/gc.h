@@ -2,7 +2,9 @@
 #define GC_H_INCLUDED
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdatomic.h>
 #include <pthread.h>
 
@@ -12,6 +14,8 @@
 #include "value.h"
 
 void DoGC(void);
+void DoMinorGC(void);
+void DoFullGC(void);
 
 #define ALLOC_OF(p) ((struct alloc *)(((char *)(p)) - offsetof(struct alloc, data)))
 
@@ -19,31 +23,206 @@ void DoGC(void);
 #define resize_unchecked(ptr, n) ((ptr) = gc_resize_unchecked((ptr), (n)))
 #define resize_nogc(ptr, n) ((ptr) = mrealloc((ptr), (n)))
 
-//#define MARKED(v) ((ALLOC_OF(v))->mark & GC_MARK)
-//#define MARK(v)   ((ALLOC_OF(v))->mark |= GC_MARK)
-//#define UNMARK(v) ((ALLOC_OF(v))->mark &= ~GC_MARK)
-
-#define MARKED(v) atomic_load(&(ALLOC_OF(v))->mark)
-#define MARK(v)   atomic_store(&(ALLOC_OF(v))->mark, 1)
+/*
+ * During a minor collection GCMarkMask also includes GC_OLD, so old objects
+ * count as marked: marking stops at them and leaves their mark bit alone.
+ */
+#define MARKED(v) gc_marked(ALLOC_OF(v))
+#define MARK(v)   gc_mark(ALLOC_OF(v))
 
 #define NOGC(v)   atomic_fetch_add(&(ALLOC_OF(v))->hard, 1)
-#define OKGC(v)   atomic_fetch_sub(&(ALLOC_OF(v))->hard, 1)
+#define OKGC(v)   gc_release(ALLOC_OF(v))
 
 #define GC_INITIAL_LIMIT (1ULL << 22)
+#define GC_NURSERY_SIZE  (1ULL << 21)
+#define GC_MIN_STEP      (1ULL << 14)
+
+/*
+ * Objects of up to GC_SLAB_MAX bytes (header included) are carved out of
+ * GC_PAGE_SIZE-aligned pages, one size class per page. The page header keeps
+ * one bit per GC_GRANULE bytes in each of its bitmaps, so the bit for a cell is
+ * found from its address alone.
+ */
+#define GC_PAGE_SIZE     (1UL << 16)
+#define GC_GRANULE       16
+#define GC_PAGE_WORDS    (GC_PAGE_SIZE / GC_GRANULE / 64)
+#define GC_SLAB_MAX      1024
+#define GC_SIZE_CLASSES  20
 
 typedef vec(struct alloc *) AllocList;
 
+typedef struct gc_page GCPage;
+
+struct gc_page {
+        GCPage *next;
+        void *free;
+        uint32_t cell;
+        uint16_t class;
+
+        /*
+         * Set once the page has been allocated from since it was last swept.
+         * Minor collections only sweep these pages, since they're the only
+         * ones that can hold young objects.
+         */
+        bool young;
+
+        /*
+         * About how many bytes of garbage the page holds if the last major
+         * collection left it to be swept later.
+         */
+        uint32_t garbage;
+
+        /* Cells that are allocated */
+        uint64_t used[GC_PAGE_WORDS];
+
+        /* Mark bits: only ever set during a collection (or by Forget()) */
+        atomic_uint_least64_t marks[GC_PAGE_WORDS];
+
+        /*
+         * Cells that were sent to another thread. They're swept from that
+         * thread's AllocLists, and handed back by clearing the bit.
+         */
+        atomic_uint_least64_t lent[GC_PAGE_WORDS];
+};
+
+/*
+ * A major collection only sweeps the pages that can hold young objects. The
+ * rest are moved from pages to the unswept lists, and the allocator sweeps them as it needs
+ * them, along with pace others each time, so that there's usually nothing left
+ * by the time the next collection starts. Whatever is left is swept before it
+ * marks anything.
+ */
+typedef struct {
+        void *free[GC_SIZE_CLASSES];
+        GCPage *avail[GC_SIZE_CLASSES];
+        GCPage *unswept[GC_SIZE_CLASSES];
+        vec(GCPage *) pages;
+        vec(GCPage *) empty;
+        size_t pending;
+        size_t garbage;
+        size_t pace;
+} GCHeap;
+
+/*
+ * Marking never recurses on the C stack: reaching an object's children pushes
+ * a grey work item that covers them instead, so there's no limit on how deep
+ * the heap can be. Work items are spread over every thread taking part in a
+ * collection. Each thread pushes onto its own stack and moves the oldest half
+ * of it to its shared queue whenever that runs dry, and threads that run out of
+ * work steal from the others' shared queues. The stacks live on the heap and
+ * grow as needed.
+ */
+#define GC_MARK_CHUNK 128
+
+typedef struct {
+        int kind;
+        void const *p;
+        size_t i;
+        size_t n;
+} GCWork;
+
+typedef struct {
+        vec(GCWork) local;
+        pthread_mutex_t lock;
+        vec(GCWork) shared;
+        atomic_size_t available;
+} GCMarker;
+
+typedef struct {
+        GCMarker **markers;
+        int capacity;
+        int n;
+        atomic_int joined;
+        atomic_int idle;
+} GCMarkGroup;
+
+/*
+ * Objects allocated since the last collection are young and live in allocs.
+ * Once they survive a collection they're moved to OldAllocs, and minor
+ * collections only mark and sweep young objects. Storing a reference into an
+ * old object must be followed by gc_barrier() so that the object goes into the
+ * RememberedSet, whose members are treated as roots by the next minor
+ * collection.
+ */
 extern _Thread_local AllocList allocs;
+extern _Thread_local AllocList OldAllocs;
+extern _Thread_local AllocList RememberedSet;
+extern _Thread_local GCHeap Heap;
+
+/*
+ * Objects whose class has a __free__ method are kept on Finalizable. When a
+ * collection finds one of them dead, it's moved to FinalizerQueue and marked
+ * instead of being freed, and the finalizer is run by the thread later on,
+ * outside of the pause.
+ */
+extern _Thread_local AllocList Finalizable;
+extern _Thread_local AllocList FinalizerQueue;
+extern uint8_t const GCSizeClass[GC_SLAB_MAX / GC_GRANULE + 1];
 extern _Thread_local int GC_OFF_COUNT;
 
 extern _Thread_local size_t MemoryUsed;
 extern _Thread_local size_t MemoryLimit;
+extern _Thread_local size_t MemoryCeiling;
+extern _Thread_local size_t NurseryUsed;
+extern size_t NurserySize;
+extern bool GCVerify;
+
+/*
+ * How the limits are paced (see GCPace()). TY_GC_GROWTH is how much the heap
+ * can grow past what survived the last major collection, TY_MAX_HEAP caps the
+ * heap of each thread group, and a thread group that hasn't had a major
+ * collection for TY_GC_QUIET_MS has one anyway, so that its limits can come
+ * back down after a spike.
+ */
+extern double GCGrowth;
+extern size_t GCMaxHeap;
+extern uint64_t GCQuietTime;
+
+extern _Thread_local unsigned char GCMarkMask;
+extern _Thread_local size_t GCMarkedBytes;
+
+/* Outside of a collection, Forget() has everything it marks logged here */
+extern _Thread_local AllocList *GCMarkLog;
+
+/*
+ * With TY_GC_PAUSE_MS set, a major collection marks a little at a time while the
+ * program keeps running, in steps that stop the world for about GCPauseBudget
+ * ns. While that's going on, *GCIncremental is true for every thread in the
+ * group, stores into young objects have to be remembered too, and allocating
+ * pays for the next step instead of running a minor collection. The final pause
+ * goes back over everything that was remembered, since it may have changed
+ * after it was marked.
+ */
+extern uint64_t GCPauseBudget;
+extern _Thread_local atomic_bool *GCIncremental;
+
+/* How many heaps have pages that are waiting to be swept */
+extern atomic_int GCUnsweptHeaps;
+
+/* Set by TY_GC_TRACE=path: each collection writes a line of JSON to it */
+extern FILE *GCTraceFile;
+
+/*
+ * Bits of struct alloc's mark. Objects that live in a GCPage have GC_SLAB set
+ * and keep their mark bit in the page's bitmap instead of in GC_MARK. Cells that
+ * were lent to another thread have GC_LENT set instead, and are marked through
+ * their header like any other object on an AllocList.
+ */
+enum {
+        GC_MARK       = 1 << 0,
+        GC_OLD        = 1 << 1,
+        GC_REMEMBERED = 1 << 2,
+        GC_SLAB       = 1 << 3,
+        GC_LENT       = 1 << 4,
+
+        GC_PLACEMENT  = GC_SLAB | GC_LENT
+};
 
 struct alloc {
         union {
                 struct {
                         char type;
-                        atomic_bool mark;
+                        atomic_uchar mark;
                         atomic_uint_least16_t hard;
                         uint32_t size;
                 };
@@ -64,15 +243,149 @@ enum {
         GC_GENERATOR,
         GC_THREAD,
         GC_REGEX,
-        GC_ANY
+        GC_TYPED_ARRAY,
+        GC_ANY,
+        GC_FREE
 };
 
+/* Bytes allocated by this thread since GCFlushAllocated() last added them up */
+extern _Thread_local uint64_t GCAllocated[GC_FREE];
+
 void
 gc(void);
 
+void
+gc_init(void);
+
+void
+GCRemember(AllocList *remembered, struct alloc *a);
+
 inline static void *
 mrealloc(void *p, size_t n);
 
+void *
+GCRefill(int class);
+
+inline static GCPage *
+GCPageOf(void const *p)
+{
+        return (GCPage *)((uintptr_t)p & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+}
+
+inline static size_t
+GCBitOf(void const *p)
+{
+        return ((uintptr_t)p & (GC_PAGE_SIZE - 1)) / GC_GRANULE;
+}
+
+inline static bool
+gc_marked(struct alloc *a)
+{
+        unsigned char m = atomic_load(&a->mark);
+
+        if (m & GCMarkMask) {
+                return true;
+        }
+
+        if (m & GC_SLAB) {
+                size_t bit = GCBitOf(a);
+                return (atomic_load(&GCPageOf(a)->marks[bit / 64]) >> (bit % 64)) & 1;
+        }
+
+        return false;
+}
+
+inline static void
+gc_mark(struct alloc *a)
+{
+        unsigned char m = atomic_load(&a->mark);
+
+        if (m & GCMarkMask) {
+                return;
+        }
+
+        if (m & GC_SLAB) {
+                size_t bit = GCBitOf(a);
+                uint64_t mask = 1ULL << (bit % 64);
+                atomic_uint_least64_t *word = &GCPageOf(a)->marks[bit / 64];
+                if (!(atomic_load(word) & mask) && !(atomic_fetch_or(word, mask) & mask)) {
+                        GCMarkedBytes += a->size;
+                        if (GCMarkLog != NULL) {
+                                vec_nogc_push(*GCMarkLog, a);
+                        }
+                }
+        } else if (!(atomic_fetch_or(&a->mark, GC_MARK) & GC_MARK)) {
+                GCMarkedBytes += a->size;
+                if (GCMarkLog != NULL) {
+                        vec_nogc_push(*GCMarkLog, a);
+                }
+        }
+}
+
+inline static struct alloc *
+GCAllocCell(size_t n)
+{
+        int class = GCSizeClass[(n + GC_GRANULE - 1) / GC_GRANULE];
+
+        void **cell = Heap.free[class];
+        if (cell == NULL) {
+                cell = GCRefill(class);
+        }
+
+        Heap.free[class] = *cell;
+
+        size_t bit = GCBitOf(cell);
+        GCPageOf(cell)->used[bit / 64] |= 1ULL << (bit % 64);
+
+        return (struct alloc *)cell;
+}
+
+inline static bool
+GCShouldRemember(struct alloc *a)
+{
+        unsigned char m = atomic_load_explicit(&a->mark, memory_order_relaxed);
+
+        if (m & GC_REMEMBERED) {
+                return false;
+        }
+
+        return (m & GC_OLD) || atomic_load_explicit(GCIncremental, memory_order_relaxed);
+}
+
+/*
+ * Call after storing a reference into the GC object at p (not before: an
+ * allocation in between could run a minor collection and empty the remembered
+ * set again).
+ */
+inline static void
+gc_barrier(void const *p)
+{
+        if (p == NULL)
+                return;
+
+        struct alloc *a = ALLOC_OF(p);
+
+        if (GCShouldRemember(a)) {
+                GCRemember(&RememberedSet, a);
+        }
+}
+
+/*
+ * The sweep remembers old objects that are held by NOGC(), since whoever holds
+ * them can fill them in without barriers. Pages left unswept by a collection
+ * may only be swept after an object on them is let go, so until they all have
+ * been, letting go of an old object remembers it instead.
+ */
+inline static void
+gc_release(struct alloc *a)
+{
+        if (atomic_load_explicit(&GCUnsweptHeaps, memory_order_relaxed) != 0 && GCShouldRemember(a)) {
+                GCRemember(&RememberedSet, a);
+        }
+
+        atomic_fetch_sub(&a->hard, 1);
+}
+
 inline static void *
 gc_resize_unchecked(void *p, size_t n) {
         struct alloc *a;
@@ -86,11 +399,24 @@ gc_resize_unchecked(void *p, size_t n) {
 
         MemoryUsed += n;
 
+        if (a == NULL) {
+                GCAllocated[GC_ANY] += n;
+        } else if (n > a->size) {
+                GCAllocated[(unsigned char)a->type] += n - a->size;
+        }
+
+        bool fresh = (a == NULL);
+
         a = realloc(a, sizeof *a + n);
         if (a == NULL) {
                 panic("Out of memory!");
         }
 
+        if (fresh) {
+                atomic_init(&a->mark, 0);
+                a->type = GC_ANY;
+        }
+
         a->size = n;
 
         return a->data;
@@ -100,21 +426,35 @@ gc_resize_unchecked(void *p, size_t n) {
 inline static void
 CheckUsed(void)
 {
-        if (GC_OFF_COUNT == 0 && MemoryUsed > MemoryLimit) {
+        if (GC_OFF_COUNT != 0)
+                return;
+
+        if (atomic_load_explicit(GCIncremental, memory_order_relaxed)) {
+                /* If the heap outgrows its ceiling before marking is done, finish it in one go */
+                if (MemoryUsed > MemoryCeiling) {
+                        GCLOG("Finishing incremental GC. Used = %zu MB", MemoryUsed / 1000000);
+                        DoGC();
+                } else if (NurseryUsed > NurserySize) {
+                        GCLOG("Running incremental GC step. Nursery = %zu KB", NurseryUsed / 1000);
+                        DoMinorGC();
+                }
+        } else if (MemoryUsed > MemoryLimit + Heap.garbage) {
+                /* Garbage on pages that haven't been swept yet doesn't count */
                 GCLOG("Running GC. Used = %zu MB, Limit = %zu MB", MemoryUsed / 1000000, MemoryLimit / 1000000);
                 DoGC();
                 GCLOG("DoGC() returned: %zu MB still in use", MemoryUsed / 1000000);
-                while ((MemoryUsed << 1) >= MemoryLimit) {
-                        MemoryLimit <<= 1;
-                        GCLOG("Increasing memory limit to %zu MB", MemoryLimit / 1000000);
-                }
+        } else if (NurseryUsed > NurserySize) {
+                GCLOG("Running minor GC. Nursery = %zu KB", NurseryUsed / 1000);
+                DoMinorGC();
         }
 }
 
 inline static void *
-gc_alloc(size_t n)
+GCAllocTyped(size_t n, char type)
 {
         MemoryUsed += n;
+        NurseryUsed += n;
+        GCAllocated[(unsigned char)type] += n;
         CheckUsed();
 
         struct alloc *a = malloc(sizeof *a + n);
@@ -123,13 +463,19 @@ gc_alloc(size_t n)
         }
 
         a->size = n;
-        a->type = GC_ANY;
-        atomic_init(&a->mark, false);
+        a->type = type;
+        atomic_init(&a->mark, 0);
         atomic_init(&a->hard, 0);
 
         return a->data;
 }
 
+inline static void *
+gc_alloc(size_t n)
+{
+        return GCAllocTyped(n, GC_ANY);
+}
+
 inline static void *
 gc_alloc_object(size_t n, char type)
 {
@@ -137,20 +483,28 @@ gc_alloc_object(size_t n, char type)
                 return NULL;
 
         MemoryUsed += n;
+        NurseryUsed += n;
+        GCAllocated[(unsigned char)type] += n;
         CheckUsed();
 
-        struct alloc *a = malloc(sizeof *a + n);
-        if (a == NULL) {
-                panic("Out of memory!");
+        struct alloc *a;
+
+        if (n <= GC_SLAB_MAX - sizeof *a) {
+                a = GCAllocCell(sizeof *a + n);
+                atomic_init(&a->mark, GC_SLAB);
+        } else {
+                a = malloc(sizeof *a + n);
+                if (a == NULL) {
+                        panic("Out of memory!");
+                }
+                atomic_init(&a->mark, 0);
+                vec_nogc_push(allocs, a);
         }
 
-        atomic_init(&a->mark, false);
         atomic_init(&a->hard, 0);
         a->type = type;
         a->size = n;
 
-        vec_nogc_push(allocs, a);
-
         return a->data;
 }
 
@@ -186,6 +540,10 @@ gc_free(void *p)
 {
         if (p != NULL) {
                 struct alloc *a = ALLOC_OF(p);
+                /* Objects that the collector tracks are left for it to free */
+                if (atomic_load(&a->mark) & GC_PLACEMENT) {
+                        return;
+                }
                 if (a->size >= MemoryUsed) {
                         MemoryUsed = 0;
                 } else {
@@ -223,14 +581,28 @@ gc_resize(void *p, size_t n) {
         }
 
         MemoryUsed += n;
+        NurseryUsed += n;
+
+        if (a == NULL) {
+                GCAllocated[GC_ANY] += n;
+        } else if (n > a->size) {
+                GCAllocated[(unsigned char)a->type] += n - a->size;
+        }
 
         CheckUsed();
 
+        bool fresh = (a == NULL);
+
         a = realloc(a, sizeof *a + n);
         if (a == NULL) {
                 panic("Out of memory!");
         }
 
+        if (fresh) {
+                atomic_init(&a->mark, 0);
+                a->type = GC_ANY;
+        }
+
         a->size = n;
 
         return a->data;
@@ -239,15 +611,88 @@ gc_resize(void *p, size_t n) {
 inline static void *
 gc_alloc_unregistered(size_t n, char type)
 {
-        void *p = gc_alloc(n);
-        ALLOC_OF(p)->type = type;
-        return p;
+        return GCAllocTyped(n, type);
 }
 
+/* Kinds of pause for GCRecordPause() */
+enum {
+        GC_PAUSE_MAJOR,
+        GC_PAUSE_MINOR,
+        GC_PAUSE_STEP
+};
+
+/*
+ * Pauses are counted in power-of-two buckets: bucket 0 holds the ones under a
+ * microsecond, bucket i the ones from 2^(i-1) up to 2^i microseconds, and the
+ * last one everything longer.
+ */
+#define GC_PAUSE_BUCKETS 24
+
+/*
+ * Everything that TY_GC_STATS reports, for ty.gcStats(). Times are in ns, and
+ * allocated counts the bytes of each kind of object allocated so far (growing
+ * an object counts what it grew by). Each thread counts its own and adds them
+ * up at collections, so other threads' counts can lag until their next one.
+ */
+typedef struct {
+        struct {
+                uint64_t count;
+                uint64_t total;
+                uint64_t max;
+                uint64_t histogram[GC_PAUSE_BUCKETS];
+        } pauses[3];
+        uint64_t allocated[GC_FREE];
+        uint64_t promoted;
+        uint64_t marked;
+        uint64_t mark_time;
+        uint64_t waits;
+        uint64_t wait_time;
+        uint64_t limit_raises;
+        uint64_t limit_cuts;
+} GCStats;
+
 void GCMark(void);
-void GCSweep(AllocList *allocs, size_t *used);
-void GCForget(AllocList *allocs, size_t *used);
+void GCSweep(AllocList *young, AllocList *old, AllocList *remembered, size_t *used, AllocList *condemned);
+void GCSweepYoung(AllocList *young, AllocList *old, AllocList *remembered, size_t *used, AllocList *condemned);
+void GCMarkRemembered(AllocList const *remembered);
+void GCRescanRemembered(AllocList const *remembered);
+void GCRememberValue(AllocList *remembered, struct value const *v);
+void GCResetRemembered(AllocList *remembered);
+void GCClearMarks(AllocList *allocs);
+void GCSweepHeap(GCHeap *heap, AllocList *remembered, bool minor, bool lazy, size_t *used, AllocList *condemned);
+void GCFinishSweep(GCHeap *heap, AllocList *remembered, size_t *used);
+void GCClearRemembered(AllocList *remembered);
+void GCClearHeapMarks(GCHeap *heap);
+void GCMergeHeap(GCHeap *dst, GCHeap *src);
+void GCGiveAway(AllocList *message, AllocList *young, AllocList *old, AllocList *remembered, AllocList *finalizable, size_t *used);
 void GCTakeOwnership(AllocList *new);
+void GCQueueFinalizers(AllocList *finalizable, AllocList *queue);
+void GCRecordPause(int kind, uint64_t ns);
+void GCRecordMark(uint64_t ns);
+void GCRecordWait(uint64_t ns);
+void GCFlushAllocated(void);
+void GCGetStats(GCStats *stats);
+void GCPace(size_t *limit, size_t *ceiling, size_t live, size_t room);
+void GCTrace(int kind, uint64_t pause, uint64_t mark, size_t before, size_t after, int threads);
+struct array;
+struct dict;
+struct object;
+struct generator;
+
+void GCMarkBegin(GCMarkGroup *group, int n);
+void GCMarkJoin(GCMarkGroup *group);
+void GCMarkDrain(void);
+void GCMarkFree(GCMarkGroup *group);
+void GCMarkStart(GCMarkGroup *group);
+bool GCMarkStep(GCMarkGroup *group, uint64_t budget, size_t *marked);
+void GCMarkAdopt(GCMarkGroup *group);
+void GCMarkValues(struct value const *vs, size_t n);
+void GCMarkRoots(struct value const *vs, size_t n);
+void GCMarkArray(struct array const *a);
+void GCMarkObject(struct object const *o);
+void GCMarkFrame(struct generator const *gen);
+void GCMarkEnv(struct value *const *env, size_t n);
+void GCMarkDict(struct dict const *d);
 
 void *GCRootSet(void);
 
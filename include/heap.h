@@ -0,0 +1,41 @@
+#ifndef HEAP_H_INCLUDED
+#define HEAP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "value.h"
+
+/*
+ * A heap snapshot is the graph of everything reachable from a set of roots:
+ * one node per allocation, with its GC_* type, its size (including buffers
+ * that only it owns, like an array's items), the class of objects, and its
+ * outgoing edges. Node 0 stands for the roots.
+ *
+ * The heap must not change while the graph is being walked, so vm.c only
+ * takes snapshots with every thread in the group stopped. Nothing here
+ * allocates through the collector.
+ */
+struct heap_snapshot;
+
+struct heap_snapshot *
+heap_snapshot_new(void);
+
+void
+heap_snapshot_root(struct heap_snapshot *snap, struct value const *v);
+
+/* Walks the graph from the roots and writes it to path, then frees snap */
+bool
+heap_snapshot_write(struct heap_snapshot *snap, char const *path);
+
+/*
+ * Reads a snapshot and prints, for each allocation type and each class, how
+ * many bytes are retained (i.e. would be freed if nothing else referred to
+ * them), followed by the allocations that dominate the most memory.
+ */
+bool
+heap_report(FILE *out, char const *path);
+
+#endif
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -0,0 +1,48 @@
+#ifndef INTERN_H_INCLUDED
+#define INTERN_H_INCLUDED
+
+#include <stdatomic.h>
+
+/*
+ * Process-wide table of interned names. Every distinct name gets a small
+ * integer id and one canonical copy of its text, so two interned names are
+ * equal iff their ids (or equivalently their name pointers) are equal.
+ *
+ * Entries are never removed or moved, so the pointers returned by intern()
+ * and intern_entry() are valid for the life of the process.
+ *
+ * Id 0 is reserved and has a NULL name, so zero-initialized ids mean "no name".
+ */
+
+#define INTERN_CHUNK_SIZE 1024
+#define INTERN_CHUNKS     4096
+
+typedef struct {
+        char const *name;
+        unsigned long hash;
+        int id;
+} InternEntry;
+
+extern InternEntry *_Atomic InternChunks[INTERN_CHUNKS];
+
+InternEntry const *
+intern(char const *name);
+
+inline static InternEntry const *
+intern_entry(int id)
+{
+        return &atomic_load_explicit(&InternChunks[id / INTERN_CHUNK_SIZE], memory_order_acquire)[id % INTERN_CHUNK_SIZE];
+}
+
+inline static char const *
+intern_name(int id)
+{
+        return intern_entry(id)->name;
+}
+
+int
+intern_count(void);
+
+#endif
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -0,0 +1,129 @@
+#ifndef JIT_H_INCLUDED
+#define JIT_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Baseline JIT.
+ *
+ * Hot bytecode (function entries and loop headers that have been reached more
+ * than JitThreshold times) is translated into native code by stringing together
+ * copies of a small machine code stencil, one per instruction, each patched with
+ * the instruction's operands and the address of a template that implements it.
+ * The templates are ordinary C functions in vm.c. Control flow between
+ * instructions is native, so there is no dispatch and no operand decoding.
+ *
+ * Only some instructions have templates. Translation stops at anything else and
+ * the native code returns the address of that instruction so vm_exec() can pick
+ * up from there.
+ *
+ * Only x86-64 Linux is supported; elsewhere jit_run() only runs what was
+ * translated to C ahead of time and passed to jit_preload().
+ */
+
+/* Template results */
+enum {
+        JIT_EXIT = -1, /* the instruction wasn't executed; leave native code here */
+        JIT_NEXT =  0, /* continue with the next instruction */
+        JIT_TAKEN = 1  /* the branch was taken */
+};
+
+/* How the instruction's operands are laid out after the opcode */
+enum {
+        JIT_OPERAND_NONE,
+        JIT_OPERAND_INT,
+        JIT_OPERAND_LOAD,     /* int, plus the variable name when logging is enabled */
+        JIT_OPERAND_INTEGER,
+        JIT_OPERAND_REAL,
+        JIT_OPERAND_BOOLEAN,
+};
+
+/* What happens to control flow after the instruction */
+enum {
+        JIT_FLOW_NEXT,
+        JIT_FLOW_JUMP,         /* unconditional relative jump; the template only runs for back-edges */
+        JIT_FLOW_BRANCH,       /* relative jump if the template returns JIT_TAKEN */
+};
+
+typedef int JitTemplate(char *next, intmax_t arg);
+
+/* Native code for an entry point; returns the address at which vm_exec() resumes */
+typedef char *JitCode(void);
+
+typedef struct {
+        JitTemplate *template;
+        char const *name; /* of the template, for ty --emit-c */
+        char operand;
+        char flow;
+} JitOp;
+
+/* Indexed by opcode; defined in vm.c */
+extern JitOp const JitOps[256];
+
+/*
+ * A compilation unit whose entry points were translated to C ahead of time by
+ * ty --emit-c (see aot.h). The bytecode is only known once the unit has been
+ * loaded or compiled at run time, so the generated functions work relative to
+ * *base, which is set then. What was translated is only used if the new
+ * bytecode has the same size, and the same bytes in each of the ranges in
+ * check (pairs of offsets) as bytes has.
+ */
+typedef struct {
+        char const *name;
+        size_t size;
+        char **base;
+        int count;
+        size_t const *entries;
+        JitCode *const *code;
+        int checks;
+        size_t const *check;
+        unsigned char const *bytes;
+} JitUnit;
+
+extern bool JitEnabled;
+extern int JitThreshold;
+
+void
+jit_init(void);
+
+void
+jit_enable(void);
+
+char *
+jit_run(char *ip);
+
+/*
+ * Decodes the operand of the instruction at pc the way its template expects it,
+ * and returns the address of the next instruction.
+ */
+char *
+jit_decode(char *pc, intmax_t *arg);
+
+/* Makes the code in units available; has to be called before vm_init() */
+void
+jit_preload(JitUnit const *units, int n);
+
+/* Called by the compiler with every unit it finishes */
+void
+jit_unit_compiled(char const *name, char *code, size_t size);
+
+/* Drops whatever was compiled from the bytecode in [start, end), which is being freed */
+void
+jit_forget(char const *start, char const *end);
+
+/*
+ * How many native frames the calling thread is inside of. An exception that
+ * unwinds out of native code has to pass the depth it was caught at to
+ * jit_unwind(), or what jit_forget() dropped would never be unmapped.
+ */
+int
+jit_depth(void);
+
+void
+jit_unwind(int depth);
+
+#endif
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -1,13 +1,134 @@
 #ifndef OBJECT_H_INCLUDED
 #define OBJECT_H_INCLUDED
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
 #include "value.h"
 #include "table.h"
 
-struct table *
+/*
+ * Objects don't carry their own hash table. Instead every object points to a
+ * shape which maps member names to slot indices, and the values themselves live
+ * in a dense slot array (inline in the object for the first few members).
+ *
+ * Shapes are shared: all objects of a class start out with the class's root
+ * shape, and adding a member moves an object along a transition to a child
+ * shape which is created once and then reused by every other object that adds
+ * the same members in the same order. Shared shapes are immutable and never
+ * freed, so a (shape, name) pair always resolves to the same slot.
+ *
+ * Objects that are used more like dictionaries (lots of members, or members
+ * with lots of different names) would create an unbounded number of shapes, so
+ * once a shape gets too big or has too many transitions the object is given a
+ * private, mutable shape of its own instead.
+ */
+
+#define SHAPE_MAX_FIELDS      64
+#define SHAPE_MAX_TRANSITIONS 32
+#define SHAPE_LINEAR_MAX      8
+
+#define OBJECT_MAX_INLINE     16
+
+struct shape {
+        int class;
+        int n;
+        int capacity;
+        bool shared;
+
+        unsigned long *hashes;
+        char const **names;
+
+        /* Open-addressed index into names[], only present when n > SHAPE_LINEAR_MAX */
+        int *index;
+        size_t mask;
+
+        struct shape *root;
+        _Atomic int expected;
+
+        _Atomic(struct shape *) last;
+        vec(struct shape *) transitions;
+};
+
+struct object {
+        struct shape *shape;
+        struct value *slots;
+        int class;
+        int capacity;
+        struct value *finalizer;
+        struct value inline_slots[];
+};
+
+struct object *
 object_new(int class);
 
 void
-object_mark(struct table *obj);
+object_mark(struct object *obj);
+
+void
+object_release(struct object *obj);
+
+struct value *
+object_add(struct object *o, char const *name, unsigned long h, struct value v);
+
+int
+object_get_completions(struct object const *o, char const *prefix, char **out, int max);
+
+inline static struct value *
+object_put(struct object *o, char const *name, struct value v)
+{
+        return object_add(o, name, strhash(name), v);
+}
+
+inline static int
+shape_slot(struct shape const *s, char const *name, unsigned long h)
+{
+        if (s->index == NULL) {
+                for (int i = 0; i < s->n; ++i) {
+                        if (s->hashes[i] == h && (s->names[i] == name || strcmp(s->names[i], name) == 0)) {
+                                return i;
+                        }
+                }
+                return -1;
+        }
+
+        for (size_t j = h & s->mask; ; j = (j + 1) & s->mask) {
+                int i = s->index[j];
+                if (i == -1) {
+                        return -1;
+                }
+                if (s->hashes[i] == h && (s->names[i] == name || strcmp(s->names[i], name) == 0)) {
+                        return i;
+                }
+        }
+}
+
+inline static struct value *
+object_lookup(struct object const *o, char const *name, unsigned long h)
+{
+        int i = shape_slot(o->shape, name, h);
+        return (i == -1) ? NULL : &o->slots[i];
+}
+
+inline static struct value *
+object_look(struct object const *o, char const *name)
+{
+        return object_lookup(o, name, strhash(name));
+}
+
+inline static int
+object_field_count(struct object const *o)
+{
+        return o->shape->n;
+}
+
+inline static char const *
+object_field_name(struct object const *o, int i)
+{
+        return o->shape->names[i];
+}
 
 #endif
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -35,4 +35,13 @@ make_with(struct expression *e, statement_vector defs, struct statement *body);
 char *
 gensym(void);
 
+void
+parse_add_operator(char const *name, int prec);
+
+int
+parse_operator_count(void);
+
+bool
+parse_get_operator(int i, char const **name, int *prec);
+
 #endif
@@ -81,6 +81,12 @@ scope_get_symbol(void);
 void
 scope_set_symbol(int s);
 
+int
+scope_get_global(void);
+
+void
+scope_set_global(int g);
+
 char const *
 scope_symbol_name(int s);
 
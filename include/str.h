@@ -5,6 +5,8 @@
 
 struct value (*get_string_method(char const *))(struct value *, int, struct value *);
 
+struct value (*get_string_method_i(int))(struct value *, int, struct value *);
+
 int
 string_get_completions(char const *prefix, char **out, int max);
 
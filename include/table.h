@@ -16,8 +16,6 @@ struct bucket {
 
 struct table {
         struct bucket buckets[TABLE_SIZE];
-        struct value finalizer;
-        int class;
 };
 
 void
@@ -11,6 +11,9 @@ tags_init(void);
 int
 tags_new(char const *);
 
+int
+tags_count(void);
+
 bool
 tags_same(int t1, int t2);
 
@@ -0,0 +1,38 @@
+#ifndef TYPED_H_INCLUDED
+#define TYPED_H_INCLUDED
+
+#include "value.h"
+
+/* Kinds of typed array. CLASS_UINT8_ARRAY + kind is the class of each one. */
+enum {
+        TYPED_U8,
+        TYPED_I32,
+        TYPED_I64,
+        TYPED_F32,
+        TYPED_F64,
+        TYPED_KINDS
+};
+
+struct typed_array *
+typed_array_new(int kind, size_t n);
+
+struct value
+typed_array_get(struct typed_array const *t, size_t i);
+
+void
+typed_array_set(struct typed_array *t, size_t i, struct value const *v);
+
+char const *
+typed_array_name(int kind);
+
+struct value
+builtin_typed_array(int argc, struct value *kwargs);
+
+struct value (*get_typed_array_method(char const *))(struct value *, int, struct value *);
+
+struct value (*get_typed_array_method_i(int))(struct value *, int, struct value *);
+
+int
+typed_array_get_completions(char const *prefix, char **out, int max);
+
+#endif
@@ -6,8 +6,10 @@ struct value;
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "vec.h"
+#include "intern.h"
 #include "ast.h"
 #include "gc.h"
 #include "tags.h"
@@ -26,11 +28,11 @@ struct value;
 #define REGEX(r)                 ((struct value){ .type = VALUE_REGEX,          .regex          = (r),                                                   .tags = 0 })
 #define FUNCTION()               ((struct value){ .type = VALUE_FUNCTION,                                                                                .tags = 0 })
 #define PTR(p)                   ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = NULL,                                   .tags = 0 })
-#define TPTR(t, p)               ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = NULL,  .extra = (t),                    .tags = 0 })
+#define TPTR(t, p)               ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = NULL,  .extra = value_extra_id(t),      .tags = 0 })
 #define GCPTR(p, gcp)            ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = (gcp),                                  .tags = 0 })
-#define TGCPTR(p, t, gcp)        ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = (gcp), .extra = (t),                    .tags = 0 })
-#define EPTR(p, gcp, ep)         ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = (gcp), .extra = (ep),                   .tags = 0 })
+#define TGCPTR(p, t, gcp)        ((struct value){ .type = VALUE_PTR,            .ptr            = (p),  .gcptr = (gcp), .extra = value_extra_id(t),      .tags = 0 })
 #define BLOB(b)                  ((struct value){ .type = VALUE_BLOB,           .blob           = (b),                                                   .tags = 0 })
+#define TYPED_ARRAY(t)           ((struct value){ .type = VALUE_TYPED_ARRAY,    .typed          = (t),                                                   .tags = 0 })
 #define REF(p)                   ((struct value){ .type = VALUE_REF,            .ptr            = (p),                                                   .tags = 0 })
 #define TAG(t)                   ((struct value){ .type = VALUE_TAG,            .tag            = (t),                                                   .tags = 0 })
 #define CLASS(c)                 ((struct value){ .type = VALUE_CLASS,          .class          = (c),  .object = NULL,                                  .tags = 0 })
@@ -44,6 +46,9 @@ struct value;
 /* Special kind of value, only used as an iteration counter in for-each loops */
 #define INDEX(ix, o, n)          ((struct value){ .type = VALUE_INDEX,          .i              = (ix), .off   = (o), .nt = (n),     .tags = 0 })
 
+/* Also only used by for-each loops: the state of a loop over an integer range */
+#define COUNTER(from, to, d)     ((struct value){ .type = VALUE_INDEX,          .counter        = (from), .limit = (to), .step = (d), .tags = 0 })
+
 /* Another special one, used for functions with multiple return values */
 #define SENTINEL                 ((struct value){ .type = VALUE_SENTINEL,       .i              = 0,    .off   = 0,                  .tags = 0 })
 
@@ -70,7 +75,15 @@ struct value;
 #define CLASS_GENERATOR 11
 #define CLASS_TAG       12
 #define CLASS_TUPLE     13
-#define CLASS_PRIMITIVE 14
+
+/* One class per kind of typed array, in the same order as the kinds in typed.h */
+#define CLASS_UINT8_ARRAY   14
+#define CLASS_INT32_ARRAY   15
+#define CLASS_INT64_ARRAY   16
+#define CLASS_FLOAT32_ARRAY 17
+#define CLASS_FLOAT64_ARRAY 18
+
+#define CLASS_PRIMITIVE 19
 
 #define TY_AST_NODES \
         X(Expr) \
@@ -171,6 +184,34 @@ enum {
                 } \
 \
                 return NULL; \
+        } \
+\
+        static struct value (**methods_by_id)(struct value *, int, struct value *); \
+        static int nmethods_by_id; \
+        static pthread_once_t methods_by_id_once = PTHREAD_ONCE_INIT; \
+\
+        static void \
+        index_methods(void) \
+        { \
+                int ids[nfuncs]; \
+\
+                for (int i = 0; i < nfuncs; ++i) { \
+                        ids[i] = intern(funcs[i].name)->id; \
+                        nmethods_by_id = max(nmethods_by_id, ids[i] + 1); \
+                } \
+\
+                methods_by_id = mrealloc(NULL, nmethods_by_id * sizeof *methods_by_id); \
+                memset(methods_by_id, 0, nmethods_by_id * sizeof *methods_by_id); \
+\
+                for (int i = 0; i < nfuncs; ++i) { \
+                        methods_by_id[ids[i]] = funcs[i].func; \
+                } \
+        } \
+\
+        struct value (*get_ ## type ## _method_i(int id))(struct value *, int, struct value *) \
+        { \
+                pthread_once(&methods_by_id_once, index_methods); \
+                return (id < nmethods_by_id) ? methods_by_id[id] : NULL; \
         }
 
 #define DEFINE_METHOD_COMPLETER(type) \
@@ -207,6 +248,17 @@ struct blob {
         size_t capacity;
 };
 
+/*
+ * A numeric array stored unboxed: count elements of one of the kinds in
+ * typed.h, back to back in items.
+ */
+struct typed_array {
+        void *items;
+        size_t count;
+        size_t capacity;
+        int kind;
+};
+
 struct target {
         struct {
                 struct value *t;
@@ -255,12 +307,29 @@ enum {
         VALUE_REF              ,
         VALUE_THREAD           ,
         VALUE_TUPLE            ,
+        VALUE_TYPED_ARRAY      ,
         VALUE_TAGGED           = 1 << 7
 };
 
+/*
+ * 24 bytes: an 8-byte header holding the type, tags and one 32-bit field whose
+ * meaning depends on the type (string length, class id, tuple length, ...), and
+ * a 16-byte payload. Anything that doesn't fit (method and builtin names, FFI
+ * pointer type info) is kept out of line and referred to by a 32-bit id.
+ */
 struct value {
         uint8_t type;
+        bool gc_names;
         uint16_t tags;
+        union {
+                uint32_t bytes;
+                int class;
+                int count;
+                int off;
+                int name;
+                int step;
+                uint32_t extra;
+        };
         union {
                 short tag;
                 double real;
@@ -268,51 +337,43 @@ struct value {
                 struct array *array;
                 struct dict *dict;
                 struct blob *blob;
+                struct typed_array *typed;
                 Thread *thread;
                 struct {
                         void *ptr;
                         void *gcptr;
-                        void *extra;
                 };
                 struct {
                         intmax_t integer;
                         char const *constant;
                 };
+                struct object *object;
                 struct {
-                        int class;
-                        struct table *object;
-                };
-                struct {
+                        struct value *this;
                         union {
-                                struct {
-                                        struct value *this;
-                                        union {
-                                                struct value *method;
-                                                struct value (*builtin_method)(struct value *, int, struct value *);
-                                        };
-                                };
-                                struct {
-                                        struct value (*builtin_function)(int, struct value *);
-                                        char const *module;
-                                };
+                                struct value *method;
+                                struct value (*builtin_method)(struct value *, int, struct value *);
                         };
-                        char const *name;
+                };
+                struct {
+                        struct value (*builtin_function)(int, struct value *);
+                        char const *module;
                 };
                 struct {
                         char const *string;
-                        uint32_t bytes;
                         char *gcstr;
                 };
                 struct {
                         intmax_t i;
-                        int off;
                         int nt;
                 };
+                struct {
+                        intmax_t counter;
+                        intmax_t limit;
+                };
                 struct {
                         struct value *items;
                         char **names;
-                        int count;
-                        bool gc_names;
                 };
                 struct regex *regex;
                 struct {
@@ -323,6 +384,8 @@ struct value {
         };
 };
 
+_Static_assert(sizeof (struct value) == 24, "struct value should be 24 bytes");
+
 struct frame {
         size_t fp;
         struct value f;
@@ -356,17 +419,30 @@ struct channel {
         pthread_mutex_t m;
         pthread_cond_t c;
         vec(ChanVal) q;
+        size_t head;
 };
 
+/*
+ * Entries are in the order they were put in, and the ones before used that
+ * have been removed have keys[i].type == 0. The index (ctrl and index) has
+ * size slots; see dict.c.
+ */
 struct dict {
+        unsigned char *ctrl;
+        void *index;
         unsigned long *hashes;
         struct value *keys;
         struct value *values;
         size_t size;
+        size_t capacity;
+        size_t used;
         size_t count;
         struct value dflt;
 };
 
+void
+value_hash_init(void);
+
 unsigned long
 value_hash(struct value const *val);
 
@@ -421,12 +497,21 @@ value_named_tuple(char const *first, ...);
 struct value *
 tuple_get(struct value *tuple, char const *name);
 
+uint32_t
+value_extra_id(void const *p);
+
+void *
+value_extra(uint32_t id);
+
 int
 tuple_get_completions(struct value const *v, char const *prefix, char **out, int max);
 
 void
 _value_mark(struct value const *v);
 
+inline static void
+gc_barrier(void const *p);
+
 inline static void
 value_array_push(struct array *a, struct value v)
 {
@@ -436,6 +521,7 @@ value_array_push(struct array *a, struct value v)
         }
 
         a->items[a->count++] = v;
+        gc_barrier(a);
 }
 
 inline static void
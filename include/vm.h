@@ -56,6 +56,7 @@ enum instruction {
 
         INSTR_RANGE,
         INSTR_INCRANGE,
+        INSTR_INT_RANGE,
 
         INSTR_MEMBER_ACCESS,
         INSTR_TRY_MEMBER_ACCESS,
@@ -184,6 +185,45 @@ enum instruction {
         INSTR_QUESTION,
         INSTR_COUNT,
         INSTR_GET_TAG,
+
+        // binary operators specialized to int/int or float/float operands
+        INSTR_ADD_INT,
+        INSTR_ADD_REAL,
+        INSTR_SUB_INT,
+        INSTR_SUB_REAL,
+        INSTR_MUL_INT,
+        INSTR_MUL_REAL,
+        INSTR_EQ_INT,
+        INSTR_EQ_REAL,
+        INSTR_NEQ_INT,
+        INSTR_NEQ_REAL,
+        INSTR_LT_INT,
+        INSTR_LT_REAL,
+        INSTR_GT_INT,
+        INSTR_GT_REAL,
+        INSTR_LEQ_INT,
+        INSTR_LEQ_REAL,
+        INSTR_GEQ_INT,
+        INSTR_GEQ_REAL,
+
+        // the same operators at sites that have seen mixed operands; these never specialize again
+        INSTR_ADD_ANY,
+        INSTR_SUB_ANY,
+        INSTR_MUL_ANY,
+        INSTR_EQ_ANY,
+        INSTR_NEQ_ANY,
+        INSTR_LT_ANY,
+        INSTR_GT_ANY,
+        INSTR_LEQ_ANY,
+        INSTR_GEQ_ANY,
+};
+
+/* Operand of INSTR_INT_RANGE: which kind of range is being iterated over */
+enum {
+        INT_RANGE_DOT_DOT,
+        INT_RANGE_DOT_DOT_DOT,
+        INT_RANGE_UPTO,
+        INT_RANGE_DOWNTO
 };
 
 bool
@@ -228,6 +268,19 @@ vm_execute(char const *source);
 bool
 vm_execute_file(char const *path);
 
+bool
+vm_execute_named(char const *path, char const *source);
+
+bool
+vm_heap_snapshot(char const *path);
+
+/*
+ * Allocates a new inline cache site. The compiler emits one after the name of
+ * every member access and method call.
+ */
+int
+vm_ic_site(void);
+
 void
 vm_push(struct value const *v);
 
@@ -1,5 +1,6 @@
 #include "alloc.h"
 #include "panic.h"
+#include "jit.h"
 
 #define align (_Alignof(void *))
 
@@ -41,6 +42,9 @@ Allocate(size_t n)
 void
 DestroyArena(Arena old)
 {
+        /* Code compiled by eval() and macros lives in the arena */
+        jit_forget(A.base, A.end);
+
         free(A.base);
         A = old;
 }
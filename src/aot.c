@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aot.h"
+#include "cache.h"
+#include "compiler.h"
+#include "jit.h"
+#include "util.h"
+#include "vec.h"
+#include "vm.h"
+
+/* Upper bound on the number of instructions translated for one entry point */
+#define AOT_MAX_INSTRUCTIONS 2048
+
+typedef vec(char *) PcVector;
+typedef vec(size_t) OffsetVector;
+
+typedef struct {
+        size_t start;
+        size_t end;
+} Range;
+
+typedef vec(Range) RangeVector;
+
+/* What was translated from one compilation unit */
+typedef struct {
+        int unit;
+        int entries;
+        int checks;
+} Lowered;
+
+static void
+EmitString(FILE *out, char const *s)
+{
+        /*
+         * The lexer expects a 0 byte just before the start of the source, the
+         * same as slurp() provides.
+         */
+        fputs("        \"\\0\"\n        \"", out);
+
+        for (; *s != '\0'; ++s) {
+                unsigned char c = *s;
+                switch (c) {
+                case '\\': fputs("\\\\", out); break;
+                case '"':  fputs("\\\"", out); break;
+                case '\t': fputs("\\t", out);  break;
+                case '\n':
+                        fputs("\\n\"", out);
+                        if (s[1] != '\0') {
+                                fputs("\n        \"", out);
+                        } else {
+                                fputs(";\n", out);
+                                return;
+                        }
+                        break;
+                default:
+                        if (c < 32 || c == 127 || c == '?') {
+                                /* '?' too, so that nothing can turn into a trigraph */
+                                fprintf(out, "\\%03o", c);
+                        } else {
+                                fputc(c, out);
+                        }
+                }
+        }
+
+        fputs("\";\n", out);
+}
+
+static void
+EmitBytes(FILE *out, unsigned char const *p, size_t n)
+{
+        for (size_t i = 0; i < n; ++i) {
+                fprintf(out, "%s%s%d", (i == 0) ? "" : ",", (i % 12 == 0) ? "\n        " : " ", p[i]);
+        }
+}
+
+static void
+EmitCString(FILE *out, char const *s)
+{
+        fputc('"', out);
+        for (; *s != '\0'; ++s) {
+                if (*s == '"' || *s == '\\') {
+                        fputc('\\', out);
+                }
+                fputc(*s, out);
+        }
+        fputc('"', out);
+}
+
+static bool
+Contains(PcVector const *v, char const *pc)
+{
+        for (size_t i = 0; i < v->count; ++i) {
+                if (v->items[i] == pc) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static int
+CompareOffsets(void const *a, void const *b)
+{
+        size_t x = *(size_t const *)a;
+        size_t y = *(size_t const *)b;
+        return (x > y) - (x < y);
+}
+
+static void
+SortUnique(OffsetVector *v)
+{
+        size_t n = 0;
+
+        qsort(v->items, v->count, sizeof *v->items, CompareOffsets);
+
+        for (size_t i = 0; i < v->count; ++i) {
+                if (n == 0 || v->items[i] != v->items[n - 1]) {
+                        v->items[n++] = v->items[i];
+                }
+        }
+
+        v->count = n;
+}
+
+static int
+CompareRanges(void const *a, void const *b)
+{
+        return CompareOffsets(&((Range const *)a)->start, &((Range const *)b)->start);
+}
+
+/* Sorts v and merges ranges that overlap or touch */
+static void
+MergeRanges(RangeVector *v)
+{
+        size_t n = 0;
+
+        qsort(v->items, v->count, sizeof *v->items, CompareRanges);
+
+        for (size_t i = 0; i < v->count; ++i) {
+                if (n > 0 && v->items[i].start <= v->items[n - 1].end) {
+                        if (v->items[i].end > v->items[n - 1].end) {
+                                v->items[n - 1].end = v->items[i].end;
+                        }
+                } else {
+                        v->items[n++] = v->items[i];
+                }
+        }
+
+        v->count = n;
+}
+
+static void
+EmitArg(FILE *out, intmax_t arg)
+{
+        if (arg >= INT32_MIN && arg <= INT32_MAX) {
+                fprintf(out, "%jd", arg);
+        } else {
+                fprintf(out, "(intmax_t)0x%jxu", (uintmax_t)arg);
+        }
+}
+
+static void
+EmitGoto(FILE *out, char const *indent, struct compiled_unit const *u, char *pc, PcVector *targets)
+{
+        if (out == NULL) {
+                vec_nogc_push(*targets, pc);
+        } else {
+                fprintf(out, "%sgoto L%zu;\n", indent, (size_t)(pc - u->code));
+        }
+}
+
+/*
+ * Translates the code reachable from entry the same way jit.c does, but to C:
+ * the template of each instruction, called by name so that it's inlined, with C
+ * control flow between them, up to the first instruction that has no template,
+ * where the function returns so that vm_exec() can take over.
+ *
+ * This is done twice. With out == NULL it only collects the jump targets (so
+ * only those get labels) and returns the number of instructions translated, or
+ * -1 if the code turns out not to be what the compiler said it was. The second
+ * time it writes the body of the function, and adds the bytes of each
+ * instruction it translated to checks.
+ */
+static int
+Walk(FILE *out, struct compiled_unit const *u, char *entry, PcVector *targets, RangeVector *checks)
+{
+        PcVector pending;
+        PcVector labels;
+        int translated = 0;
+
+        vec_init(pending);
+        vec_init(labels);
+
+        vec_nogc_push(pending, entry);
+
+        while (pending.count > 0) {
+                char *pc = *vec_pop(pending);
+
+                if (Contains(&labels, pc)) {
+                        continue;
+                }
+
+                for (;;) {
+                        if (pc < u->code || pc >= u->code + u->size) {
+                                translated = -1;
+                                goto End;
+                        }
+
+                        if (Contains(&labels, pc)) {
+                                EmitGoto(out, "        ", u, pc, targets);
+                                break;
+                        }
+
+                        vec_nogc_push(labels, pc);
+
+                        size_t off = pc - u->code;
+                        unsigned char opcode = *pc;
+                        JitOp const *op = &JitOps[opcode];
+
+                        if (out != NULL && Contains(targets, pc)) {
+                                fprintf(out, "L%zu:\n", off);
+                        }
+
+                        if (op->template == NULL || translated == AOT_MAX_INSTRUCTIONS) {
+                                if (out != NULL) {
+                                        fprintf(out, "        return b + %zu;\n", off);
+                                }
+                                break;
+                        }
+
+                        translated += 1;
+
+                        intmax_t arg;
+                        char *next = jit_decode(pc, &arg);
+                        size_t noff = next - u->code;
+
+                        if (checks != NULL) {
+                                vec_nogc_push(*checks, ((Range){ .start = off, .end = noff }));
+                        }
+
+                        switch (op->flow) {
+                        case JIT_FLOW_NEXT:
+                                if (out != NULL) {
+                                        fprintf(out, "        if (%s(b + %zu, ", op->name, noff);
+                                        EmitArg(out, arg);
+                                        fprintf(out, ") != JIT_NEXT) return b + %zu;\n", off);
+                                }
+                                pc = next;
+                                continue;
+                        case JIT_FLOW_JUMP:
+                                if (out != NULL && arg < 0) {
+                                        fprintf(out, "        %s(b + %zu, ", op->name, noff);
+                                        EmitArg(out, arg);
+                                        fputs(");\n", out);
+                                }
+                                EmitGoto(out, "        ", u, next + arg, targets);
+                                vec_nogc_push(pending, next + arg);
+                                break;
+                        case JIT_FLOW_BRANCH:
+                                if (out != NULL) {
+                                        fprintf(out, "        switch (%s(b + %zu, ", op->name, noff);
+                                        EmitArg(out, arg);
+                                        fputs(")) {\n", out);
+                                        fprintf(out, "        case JIT_EXIT:  return b + %zu;\n", off);
+                                }
+                                EmitGoto(out, "        case JIT_TAKEN: ", u, next + arg, targets);
+                                if (out != NULL) {
+                                        fputs("        }\n", out);
+                                }
+                                vec_nogc_push(pending, next + arg);
+                                pc = next;
+                                continue;
+                        }
+
+                        break;
+                }
+        }
+
+End:
+        free(pending.items);
+        free(labels.items);
+
+        return translated;
+}
+
+/*
+ * Writes a C function for every entry point of u that starts with something
+ * the JIT has a template for, followed by the tables jit_preload() needs.
+ * Returns false if there weren't any.
+ */
+static bool
+EmitUnit(FILE *out, int i, struct compiled_unit const *u, Lowered *lowered)
+{
+        OffsetVector entries;
+        OffsetVector done;
+        RangeVector checks;
+        PcVector targets;
+
+        vec_init(entries);
+        vec_init(done);
+        vec_init(checks);
+        vec_init(targets);
+
+        vec_nogc_push_n(entries, u->entries, u->entry_count);
+        SortUnique(&entries);
+
+        for (size_t j = 0; j < entries.count; ++j) {
+                char *entry = u->code + entries.items[j];
+
+                targets.count = 0;
+
+                if (Walk(NULL, u, entry, &targets, NULL) <= 0) {
+                        continue;
+                }
+
+                if (done.count == 0) {
+                        fprintf(out, "/* %s */\nstatic char *Base%d;\n\n", u->name, i);
+                }
+
+                fprintf(out, "static char *\nUnit%dAt%zu(void)\n{\n", i, entries.items[j]);
+                fprintf(out, "        char *b = Base%d;\n\n", i);
+                Walk(out, u, entry, &targets, &checks);
+                fputs("}\n\n", out);
+
+                vec_nogc_push(done, entries.items[j]);
+        }
+
+        if (done.count > 0) {
+                MergeRanges(&checks);
+
+                fprintf(out, "static size_t const Entries%d[] = {", i);
+                for (size_t j = 0; j < done.count; ++j) {
+                        fprintf(out, "%s%s%zu", (j == 0) ? "" : ",", (j % 8 == 0) ? "\n        " : " ", done.items[j]);
+                }
+                fputs("\n};\n\n", out);
+
+                fprintf(out, "static JitCode *const Code%d[] = {", i);
+                for (size_t j = 0; j < done.count; ++j) {
+                        fprintf(out, "%s\n        Unit%dAt%zu", (j == 0) ? "" : ",", i, done.items[j]);
+                }
+                fputs("\n};\n\n", out);
+
+                fprintf(out, "static size_t const Check%d[] = {", i);
+                for (size_t j = 0; j < checks.count; ++j) {
+                        fprintf(
+                                out,
+                                "%s%s%zu, %zu",
+                                (j == 0) ? "" : ",",
+                                (j % 4 == 0) ? "\n        " : " ",
+                                checks.items[j].start,
+                                checks.items[j].end
+                        );
+                }
+                fputs("\n};\n\n", out);
+
+                fprintf(out, "static unsigned char const Bytes%d[] = {", i);
+                vec(unsigned char) bytes;
+                vec_init(bytes);
+                for (size_t j = 0; j < checks.count; ++j) {
+                        size_t start = checks.items[j].start;
+                        vec_nogc_push_n(bytes, (unsigned char *)u->code + start, checks.items[j].end - start);
+                }
+                EmitBytes(out, bytes.items, bytes.count);
+                free(bytes.items);
+                fputs("\n};\n\n", out);
+        }
+
+        *lowered = (Lowered){ .unit = i, .entries = done.count, .checks = checks.count };
+
+        bool any = done.count > 0;
+
+        free(entries.items);
+        free(done.items);
+        free(checks.items);
+        free(targets.items);
+
+        return any;
+}
+
+static struct unit_image const *
+FindImage(struct unit_image const *images, int n, char const *name, bool file)
+{
+        for (int i = 0; i < n; ++i) {
+                if (strcmp(file ? images[i].filename : images[i].name, name) == 0) {
+                        return &images[i];
+                }
+        }
+
+        return NULL;
+}
+
+static void
+EmitImage(FILE *out, char const *what, int i, struct unit_image const *image)
+{
+        if (image != NULL) {
+                fprintf(out, "static unsigned char const %sImage%d[] = {", what, i);
+                EmitBytes(out, image->data, image->size);
+                fputs("\n};\n\n", out);
+        }
+}
+
+static void
+EmitUnitEntry(FILE *out, char const *what, int i, char const *name, struct unit_image const *image)
+{
+        fputs("{ ", out);
+        EmitCString(out, name);
+        if (image != NULL) {
+                fprintf(out, ", %s%d + 1, %sImage%d, sizeof %sImage%d }", what, i, what, i, what, i);
+        } else {
+                fprintf(out, ", %s%d + 1, NULL, 0 }", what, i);
+        }
+}
+
+bool
+aot_emit_c(FILE *out, char const *path)
+{
+        char *source = slurp(path);
+        if (source == NULL) {
+                fprintf(stderr, "error: failed to read %s\n", path);
+                return false;
+        }
+
+        bool compile_only = CompileOnly;
+        CompileOnly = true;
+
+        bool ok = vm_execute_named(path, source);
+
+        CompileOnly = compile_only;
+
+        if (!ok) {
+                fprintf(stderr, "%s\n", vm_error());
+                return false;
+        }
+
+        int n;
+        struct module_source const *modules = compiler_loaded_modules(&n);
+
+        int nimages;
+        struct unit_image const *images = compiler_unit_images(&nimages);
+
+        fputs("/* Generated by ty --emit-c from ", out);
+        fputs(path, out);
+        fputs(". */\n\n", out);
+        fputs("/* The interpreter is compiled in with this, so that its templates are inlined below */\n", out);
+        fputs("#include \"vm.c\"\n\n", out);
+        fputs("#include \"aot.h\"\n\n", out);
+
+        for (int i = 0; i < n; ++i) {
+                fprintf(out, "static char const Module%d[] =\n", i);
+                EmitString(out, modules[i].source);
+                fputc('\n', out);
+                EmitImage(out, "Module", i, FindImage(images, nimages, modules[i].name, false));
+        }
+
+        struct unit_image const *program = FindImage(images, nimages, path, false);
+
+        fputs("static char const Main0[] =\n", out);
+        EmitString(out, source);
+        fputc('\n', out);
+        EmitImage(out, "Main", 0, program);
+
+        /*
+         * The bytecode is translated the way it was saved, before anything ran and
+         * rewrote it. Where it's loaded at run time is only known then, so the
+         * native code for each unit is written in terms of offsets from there.
+         */
+        int nunits;
+        struct compiled_unit const *units = compiler_compiled_units(&nunits);
+        vec(Lowered) lowered;
+
+        vec_init(lowered);
+
+        for (int i = 0; i < nunits; ++i) {
+                struct compiled_unit u = units[i];
+                struct unit_image const *image = FindImage(images, nimages, u.name, true);
+                struct cache_image img;
+                bool decoded = image != NULL && cache_decode(image->data, image->size, &img);
+
+                if (decoded) {
+                        u.code = img.code.items;
+                        u.size = img.code.count;
+                        u.entries = img.entries.items;
+                        u.entry_count = img.entries.count;
+                }
+
+                Lowered l;
+                if (EmitUnit(out, i, &u, &l)) {
+                        vec_nogc_push(lowered, l);
+                }
+
+                if (decoded) {
+                        cache_free(&img);
+                }
+        }
+
+        if (lowered.count > 0) {
+                fputs("static JitUnit const Units[] = {\n", out);
+                for (size_t i = 0; i < lowered.count; ++i) {
+                        Lowered const *l = &lowered.items[i];
+                        int k = l->unit;
+                        fputs("        { ", out);
+                        EmitCString(out, units[k].name);
+                        fprintf(
+                                out,
+                                ", %zu, &Base%d, %d, Entries%d, Code%d, %d, Check%d, Bytes%d },\n",
+                                units[k].size,
+                                k,
+                                l->entries,
+                                k,
+                                k,
+                                l->checks,
+                                k,
+                                k
+                        );
+                }
+                fputs("};\n\n", out);
+        }
+
+        fputs("static struct aot_unit const Modules[] = {\n", out);
+        for (int i = 0; i < n; ++i) {
+                fputs("        ", out);
+                EmitUnitEntry(out, "Module", i, modules[i].name, FindImage(images, nimages, modules[i].name, false));
+                fputs(",\n", out);
+        }
+        fputs("};\n\n", out);
+
+        fputs("static struct aot_program const Program = {\n", out);
+        fputs("        .program = ", out);
+        EmitUnitEntry(out, "Main", 0, path, program);
+        fprintf(out, ",\n        .modules = Modules,\n        .module_count = %d,\n", n);
+        if (lowered.count > 0) {
+                fprintf(out, "        .units = Units,\n        .unit_count = %zu,\n", lowered.count);
+        }
+        fprintf(out, "        .build = UINT64_C(0x%jx)\n};\n\n", (uintmax_t)cache_build_id());
+
+        fputs("int\nmain(int argc, char **argv)\n{\n", out);
+        fputs("        return aot_main(argc, argv, &Program);\n}\n", out);
+
+        free(lowered.items);
+
+        return true;
+}
+
+int
+aot_main(int argc, char **argv, struct aot_program const *p)
+{
+        /* Everything comes from the binary, so ~/.ty/cache isn't used either */
+        UseCache = false;
+        cache_set_build_id(p->build);
+
+        for (int i = 0; i < p->module_count; ++i) {
+                struct aot_unit const *m = &p->modules[i];
+                compiler_embed_module(m->name, m->source);
+                if (m->image != NULL) {
+                        compiler_embed_image(m->name, m->image, m->size);
+                }
+        }
+
+        if (p->program.image != NULL) {
+                compiler_embed_image(p->program.name, p->program.image, p->program.size);
+        }
+
+        if (p->unit_count > 0) {
+                jit_preload(p->units, p->unit_count);
+        }
+
+        vm_init(argc, argv);
+
+        if (!vm_execute_named(p->program.name, p->program.source)) {
+                fprintf(stderr, "%s\n", vm_error());
+                return -1;
+        }
+
+        return 0;
+}
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -570,16 +570,14 @@ array_uniq(struct value *array, int argc, struct value *kwargs)
         if (f != NULL && !CALLABLE(*f))
                 vm_panic("the argument to array.uniq() must be callable");
 
-        struct value d = DICT(dict_new());
+        struct value d = DICT(dict_new_sized(array->array->count));
         gc_push(&d);
 
         int n = 0;
         for (int i = 0; i < array->array->count; ++i) {
                 struct value e = array->array->items[i];
                 struct value k = (f == NULL) ? e : vm_eval_function(f, &e, NULL);
-                struct value *v = dict_put_key_if_not_exists(d.dict, k);
-                if (v->type == VALUE_NIL) {
-                        *v = e;
+                if (dict_add(d.dict, k)) {
                         array->array->items[n++] = e;
                 }
         }
@@ -1287,11 +1285,11 @@ array_set(struct value *array, int argc, struct value *kwargs)
         if (argc != 0)
                 vm_panic("array.set() expects 0 arguments but got %d", argc);
 
-        struct dict *d = dict_new();
+        struct dict *d = dict_new_sized(array->array->count);
         NOGC(d);
 
         for (int i = 0; i < array->array->count; ++i) {
-                dict_put_key_if_not_exists(d, array->array->items[i]);
+                dict_add(d, array->array->items[i]);
         }
 
         OKGC(d);
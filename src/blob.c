@@ -428,7 +428,7 @@ blob_hex(struct value *blob, int argc, struct value *kwargs)
         static char const digits[] = "0123456789abcdef";
 
         int n = blob->blob->count;
-        char *s = gc_alloc_object(n*2, GC_STRING);
+        char *s = value_string_alloc(n*2);
 
         for (int i = 0; i < n; ++i) {
                 unsigned char b = blob->blob->items[i];
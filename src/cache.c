@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "panic.h"
+#include "vec.h"
+
+/*
+ * The file is a magic string followed by LEB128 varints (zigzag-encoded where
+ * they can be negative), in the order the fields of struct cache_image are
+ * declared, after the id of the build that wrote it. Strings are a length, the
+ * bytes and a NUL, so a loaded image can point straight into the file.
+ */
+#define MAGIC "TYC1\n"
+
+typedef vec(unsigned char) ByteVector;
+
+typedef struct {
+        unsigned char const *p;
+        unsigned char const *end;
+        bool ok;
+} Reader;
+
+bool UseCache = true;
+
+static uint64_t
+Mix(uint64_t x)
+{
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDULL;
+        x ^= x >> 33;
+        x *= 0xC4CEB9FE1A85EC53ULL;
+        x ^= x >> 33;
+        return x;
+}
+
+uint64_t
+cache_hash(void const *p, size_t n, uint64_t seed)
+{
+        unsigned char const *s = p;
+        uint64_t h = Mix(seed ^ n);
+        uint64_t k;
+
+        for (; n >= sizeof k; n -= sizeof k, s += sizeof k) {
+                memcpy(&k, s, sizeof k);
+                h = Mix(h ^ k) + 0x9E3779B97F4A7C15ULL;
+        }
+
+        k = 0;
+        memcpy(&k, s, n);
+
+        return Mix(h ^ k);
+}
+
+static int
+FindBuildId(struct dl_phdr_info *info, size_t size, void *data)
+{
+        uint64_t *id = data;
+
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+                ElfW(Phdr) const *ph = &info->dlpi_phdr[i];
+                if (ph->p_type != PT_NOTE)
+                        continue;
+
+                char const *p = (char const *)(info->dlpi_addr + ph->p_vaddr);
+                char const *end = p + ph->p_memsz;
+
+                while (p + sizeof (ElfW(Nhdr)) <= end) {
+                        ElfW(Nhdr) const *note = (ElfW(Nhdr) const *)p;
+                        char const *name = p + sizeof *note;
+                        char const *desc = name + ((note->n_namesz + 3) & ~3);
+
+                        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                                *id = cache_hash(desc, note->n_descsz, 0);
+                                return 1;
+                        }
+
+                        p = desc + ((note->n_descsz + 3) & ~3);
+                }
+        }
+
+        /* The first object is the executable; we don't care about the rest */
+        return 1;
+}
+
+static uint64_t BuildId;
+
+uint64_t
+cache_build_id(void)
+{
+        uint64_t id = BuildId;
+
+        if (id != 0)
+                return id;
+
+        dl_iterate_phdr(FindBuildId, &id);
+
+        /* Without a build id note, the executable's size and mtime have to do */
+        struct stat st;
+        if (id == 0 && stat("/proc/self/exe", &st) == 0) {
+                uint64_t k[] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+                id = cache_hash(k, sizeof k, 1);
+        }
+
+        if (id == 0)
+                id = 1;
+
+        return BuildId = id;
+}
+
+void
+cache_set_build_id(uint64_t id)
+{
+        BuildId = id;
+}
+
+static bool
+CachePath(char *buf, size_t n, char const *name)
+{
+        char const *home = getenv("HOME");
+        if (home == NULL)
+                return false;
+
+        return snprintf(buf, n, "%s/.ty/cache/%s.tyc", home, name) < n;
+}
+
+static void
+PutVarint(ByteVector *out, uint64_t x)
+{
+        while (x >= 0x80) {
+                vec_nogc_push(*out, (unsigned char)(x | 0x80));
+                x >>= 7;
+        }
+
+        vec_nogc_push(*out, (unsigned char)x);
+}
+
+static void
+PutInt(ByteVector *out, int64_t x)
+{
+        PutVarint(out, ((uint64_t)x << 1) ^ (uint64_t)(x >> 63));
+}
+
+static void
+PutString(ByteVector *out, char const *s)
+{
+        size_t n = strlen(s);
+        PutVarint(out, n);
+        vec_nogc_push_n(*out, (unsigned char const *)s, n + 1);
+}
+
+static void
+PutRef(ByteVector *out, struct cache_ref ref)
+{
+        PutInt(out, ref.unit);
+        PutInt(out, ref.id);
+}
+
+static void
+PutLocation(ByteVector *out, struct cache_location const *loc)
+{
+        PutInt(out, loc->line);
+        PutInt(out, loc->col);
+        PutInt(out, loc->s);
+}
+
+static uint64_t
+GetVarint(Reader *r)
+{
+        uint64_t x = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (r->p == r->end) {
+                        r->ok = false;
+                        return 0;
+                }
+                unsigned char b = *r->p++;
+                x |= (uint64_t)(b & 0x7F) << shift;
+                if (!(b & 0x80)) {
+                        return x;
+                }
+        }
+
+        r->ok = false;
+
+        return 0;
+}
+
+static int64_t
+GetInt(Reader *r)
+{
+        uint64_t x = GetVarint(r);
+        return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+/* A count of things that each take at least one byte */
+static size_t
+GetCount(Reader *r)
+{
+        uint64_t n = GetVarint(r);
+
+        if (n > (size_t)(r->end - r->p)) {
+                r->ok = false;
+                return 0;
+        }
+
+        return n;
+}
+
+static char const *
+GetString(Reader *r)
+{
+        size_t n = GetCount(r);
+
+        if (!r->ok || n >= (size_t)(r->end - r->p) || r->p[n] != '\0') {
+                r->ok = false;
+                return "";
+        }
+
+        char const *s = (char const *)r->p;
+        r->p += n + 1;
+
+        return s;
+}
+
+static struct cache_ref
+GetRef(Reader *r)
+{
+        struct cache_ref ref;
+        ref.unit = GetInt(r);
+        ref.id = GetInt(r);
+        return ref;
+}
+
+static struct cache_location
+GetLocation(Reader *r)
+{
+        struct cache_location loc;
+        loc.line = GetInt(r);
+        loc.col = GetInt(r);
+        loc.s = GetInt(r);
+        return loc;
+}
+
+static void
+Encode(ByteVector *out, struct cache_image const *img)
+{
+        vec_nogc_push_n(*out, (unsigned char const *)MAGIC, strlen(MAGIC));
+
+        PutVarint(out, cache_build_id());
+        PutVarint(out, img->source);
+        PutVarint(out, img->key);
+
+        PutVarint(out, img->deps.count);
+        for (size_t i = 0; i < img->deps.count; ++i) {
+                PutString(out, img->deps.items[i].name);
+                PutVarint(out, img->deps.items[i].key);
+        }
+
+        PutVarint(out, img->imports.count);
+        for (size_t i = 0; i < img->imports.count; ++i) {
+                struct cache_import const *import = &img->imports.items[i];
+                PutString(out, import->module);
+                PutString(out, import->as);
+                PutVarint(out, import->identifiers.count);
+                for (size_t j = 0; j < import->identifiers.count; ++j) {
+                        PutString(out, import->identifiers.items[j]);
+                }
+        }
+
+        PutVarint(out, img->operators.count);
+        for (size_t i = 0; i < img->operators.count; ++i) {
+                PutString(out, img->operators.items[i].name);
+                PutInt(out, img->operators.items[i].prec);
+        }
+
+        PutVarint(out, img->members.count);
+        for (size_t i = 0; i < img->members.count; ++i) {
+                PutString(out, img->members.items[i]);
+        }
+
+        PutVarint(out, img->regexes.count);
+        for (size_t i = 0; i < img->regexes.count; ++i) {
+                PutString(out, img->regexes.items[i].pattern);
+                PutVarint(out, img->regexes.items[i].flags);
+        }
+
+        PutVarint(out, img->classes.count);
+        for (size_t i = 0; i < img->classes.count; ++i) {
+                PutString(out, img->classes.items[i].name);
+                PutRef(out, img->classes.items[i].super);
+        }
+
+        PutVarint(out, img->tags.count);
+        for (size_t i = 0; i < img->tags.count; ++i) {
+                PutString(out, img->tags.items[i]);
+        }
+
+        PutVarint(out, img->globals);
+
+        PutVarint(out, img->symbols.count);
+        for (size_t i = 0; i < img->symbols.count; ++i) {
+                struct cache_symbol const *sym = &img->symbols.items[i];
+                PutString(out, sym->identifier);
+                PutVarint(out, sym->i);
+                PutVarint(out, sym->flags);
+                PutRef(out, sym->tag);
+                PutRef(out, sym->class);
+                PutLocation(out, &sym->loc);
+        }
+
+        PutVarint(out, img->code.count);
+        vec_nogc_push_n(*out, (unsigned char const *)img->code.items, img->code.count);
+
+        PutVarint(out, img->entries.count);
+        for (size_t i = 0; i < img->entries.count; ++i) {
+                PutVarint(out, img->entries.items[i]);
+        }
+
+        PutVarint(out, img->relocs.count);
+        for (size_t i = 0; i < img->relocs.count; ++i) {
+                PutVarint(out, img->relocs.items[i].offset);
+                PutVarint(out, img->relocs.items[i].kind);
+                PutRef(out, img->relocs.items[i].ref);
+        }
+
+        PutVarint(out, img->locations.count);
+        for (size_t i = 0; i < img->locations.count; ++i) {
+                struct cache_eloc const *loc = &img->locations.items[i];
+                PutVarint(out, loc->start_off);
+                PutVarint(out, loc->end_off);
+                PutLocation(out, &loc->start);
+                PutLocation(out, &loc->end);
+        }
+}
+
+static bool
+Decode(unsigned char const *data, size_t n, struct cache_image *img)
+{
+        if (n < strlen(MAGIC) || memcmp(data, MAGIC, strlen(MAGIC)) != 0) {
+                return false;
+        }
+
+        Reader r = { data + strlen(MAGIC), data + n, true };
+
+        if (GetVarint(&r) != cache_build_id()) {
+                return false;
+        }
+
+        img->source = GetVarint(&r);
+        img->key = GetVarint(&r);
+
+        size_t count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_dep dep;
+                dep.name = GetString(&r);
+                dep.key = GetVarint(&r);
+                vec_nogc_push(img->deps, dep);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_import import = {0};
+                import.module = GetString(&r);
+                import.as = GetString(&r);
+                size_t ids = GetCount(&r);
+                for (size_t j = 0; r.ok && j < ids; ++j) {
+                        vec_nogc_push(import.identifiers, (char *)GetString(&r));
+                }
+                vec_nogc_push(img->imports, import);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_operator op;
+                op.name = GetString(&r);
+                op.prec = GetInt(&r);
+                vec_nogc_push(img->operators, op);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                vec_nogc_push(img->members, GetString(&r));
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_regex re;
+                re.pattern = GetString(&r);
+                re.flags = GetVarint(&r);
+                vec_nogc_push(img->regexes, re);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_class class;
+                class.name = GetString(&r);
+                class.super = GetRef(&r);
+                vec_nogc_push(img->classes, class);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                vec_nogc_push(img->tags, GetString(&r));
+        }
+
+        img->globals = GetVarint(&r);
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_symbol sym;
+                sym.identifier = GetString(&r);
+                sym.i = GetVarint(&r);
+                sym.flags = GetVarint(&r);
+                sym.tag = GetRef(&r);
+                sym.class = GetRef(&r);
+                sym.loc = GetLocation(&r);
+                vec_nogc_push(img->symbols, sym);
+        }
+
+        count = GetCount(&r);
+        if (r.ok) {
+                vec_nogc_push_n(img->code, (char const *)r.p, count);
+                r.p += count;
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                vec_nogc_push(img->entries, GetVarint(&r));
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_reloc reloc;
+                reloc.offset = GetVarint(&r);
+                reloc.kind = GetVarint(&r);
+                reloc.ref = GetRef(&r);
+                if (reloc.offset + sizeof (int) > img->code.count) {
+                        r.ok = false;
+                }
+                vec_nogc_push(img->relocs, reloc);
+        }
+
+        count = GetCount(&r);
+        for (size_t i = 0; r.ok && i < count; ++i) {
+                struct cache_eloc loc;
+                loc.start_off = GetVarint(&r);
+                loc.end_off = GetVarint(&r);
+                loc.start = GetLocation(&r);
+                loc.end = GetLocation(&r);
+                vec_nogc_push(img->locations, loc);
+        }
+
+        return r.ok && r.p == r.end;
+}
+
+unsigned char *
+cache_encode(struct cache_image const *img, size_t *n)
+{
+        ByteVector out = {0};
+        Encode(&out, img);
+
+        *n = out.count;
+
+        return out.items;
+}
+
+bool
+cache_decode(unsigned char const *data, size_t n, struct cache_image *img)
+{
+        *img = (struct cache_image){0};
+
+        if (!Decode(data, n, img)) {
+                cache_free(img);
+                return false;
+        }
+
+        return true;
+}
+
+bool
+cache_load(char const *name, struct cache_image *img)
+{
+        char path[512];
+        if (!CachePath(path, sizeof path, name))
+                return false;
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+                return false;
+
+        struct stat st;
+        unsigned char *data = NULL;
+        bool ok = fstat(fd, &st) == 0
+               && (data = malloc(st.st_size + 1)) != NULL
+               && read(fd, data, st.st_size) == st.st_size;
+
+        close(fd);
+
+        if (!ok || !cache_decode(data, st.st_size, img)) {
+                free(data);
+                return false;
+        }
+
+        return true;
+}
+
+void
+cache_store(char const *name, struct cache_image const *img)
+{
+        char path[512];
+        char tmp[sizeof path + 32];
+
+        if (!CachePath(path, sizeof path, name))
+                return;
+
+        /* Create ~/.ty/cache and whatever directories a module name like ty/parse needs */
+        for (char *slash = strstr(path, "/cache/") + 1; (slash = strchr(slash, '/')) != NULL; ++slash) {
+                *slash = '\0';
+                int r = mkdir(path, 0755);
+                *slash = '/';
+                if (r != 0 && errno != EEXIST)
+                        return;
+        }
+
+        size_t n;
+        unsigned char *data = cache_encode(img, &n);
+
+        /* Write to a temporary file and rename it, so that nobody sees half an image */
+        snprintf(tmp, sizeof tmp, "%s.%d.tmp", path, (int)getpid());
+
+        FILE *f = fopen(tmp, "wb");
+        bool ok = f != NULL
+               && fwrite(data, 1, n, f) == n;
+
+        if (f != NULL && fclose(f) != 0)
+                ok = false;
+
+        if (!ok || rename(tmp, path) != 0)
+                unlink(tmp);
+
+        free(data);
+}
+
+void
+cache_free(struct cache_image *img)
+{
+        for (size_t i = 0; i < img->imports.count; ++i) {
+                free(img->imports.items[i].identifiers.items);
+        }
+
+        free(img->deps.items);
+        free(img->imports.items);
+        free(img->operators.items);
+        free(img->members.items);
+        free(img->regexes.items);
+        free(img->classes.items);
+        free(img->tags.items);
+        free(img->symbols.items);
+        free(img->code.items);
+        free(img->entries.items);
+        free(img->relocs.items);
+        free(img->locations.items);
+}
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -7,6 +7,8 @@
 #include "util.h"
 #include "vec.h"
 #include "table.h"
+#include "intern.h"
+#include "class.h"
 
 static int class = 0;
 static vec(char const *) names;
@@ -17,6 +19,25 @@ static vec(struct table) gtables;
 static vec(struct table) stables;
 static vec(struct table) ctables;
 
+/*
+ * Every class has a version that is bumped whenever its method tables or its
+ * superclass change, and so does every subclass of it, since they inherit
+ * whatever it resolves to. Lookups that are cached by the VM are only valid for
+ * the version of the class they were made for.
+ */
+static vec(_Atomic unsigned) versions;
+_Atomic unsigned *ClassVersions;
+
+static void
+invalidate(int class)
+{
+        for (int c = 0; c < versions.count; ++c) {
+                if (class_is_subclass(c, class)) {
+                        atomic_fetch_add_explicit(&versions.items[c], 1, memory_order_relaxed);
+                }
+        }
+}
+
 int
 class_new(char const *name)
 {
@@ -31,6 +52,9 @@ class_new(char const *name)
         vec_push(stables, t);
         vec_push(ctables, t);
 
+        vec_push(versions, 1);
+        ClassVersions = versions.items;
+
         return class++;
 }
 
@@ -44,6 +68,20 @@ class_set_super(int class, int super)
          */
         if (class != 0)
                 supers.items[class] = super;
+
+        invalidate(class);
+}
+
+int
+class_get_super(int class)
+{
+        return supers.items[class];
+}
+
+int
+class_count(void)
+{
+        return class;
 }
 
 int
@@ -65,29 +103,34 @@ class_name(int class)
 void
 class_add_static(int class, char const *name, struct value f)
 {
-        table_put(&ctables.items[class], name, f);
+        table_put(&ctables.items[class], intern(name)->name, f);
+        invalidate(class);
 }
 
 void
 class_add_method(int class, char const *name, struct value f)
 {
-        table_put(&mtables.items[class], name, f);
+        table_put(&mtables.items[class], intern(name)->name, f);
 
         if (strcmp(name, "__free__") == 0) {
                 finalizers.items[class] = f;
         }
+
+        invalidate(class);
 }
 
 void
 class_add_getter(int class, char const *name, struct value f)
 {
-        table_put(&gtables.items[class], name, f);
+        table_put(&gtables.items[class], intern(name)->name, f);
+        invalidate(class);
 }
 
 void
 class_add_setter(int class, char const *name, struct value f)
 {
-        table_put(&stables.items[class], name, f);
+        table_put(&stables.items[class], intern(name)->name, f);
+        invalidate(class);
 }
 
 void
@@ -96,6 +139,7 @@ class_copy_methods(int dst, int src)
         table_copy(&mtables.items[dst], &mtables.items[src]);
         table_copy(&gtables.items[dst], &gtables.items[src]);
         table_copy(&stables.items[dst], &stables.items[src]);
+        invalidate(dst);
 }
 
 struct value *
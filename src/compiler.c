@@ -24,6 +24,10 @@
 #include "class.h"
 #include "vm.h"
 #include "compiler.h"
+#include "intern.h"
+#include "jit.h"
+#include "scope.h"
+#include "cache.h"
 
 #define emit_instr(i) do { LOG("emitting instr: %s", #i); _emit_instr(i); } while (false)
 
@@ -40,18 +44,21 @@
 
 #define JUMP(loc) \
         do { \
+                VPush(state.entries, loc); \
                 emit_instr(INSTR_JUMP); \
                 emit_int(loc - state.code.count - sizeof (int)); \
         } while (false)
 
 #define JUMP_IF(loc) \
         do { \
+                VPush(state.entries, loc); \
                 emit_instr(INSTR_JUMP_IF); \
                 emit_int(loc - state.code.count - sizeof (int)); \
         } while (false)
 
 #define JUMP_IF_NOT(loc) \
         do { \
+                VPush(state.entries, loc); \
                 emit_instr(INSTR_JUMP_IF_NOT); \
                 emit_int(loc - state.code.count - sizeof (int)); \
         } while (false)
@@ -96,6 +103,44 @@ struct import {
         struct scope *scope;
 };
 
+/*
+ * How far the global, class, tag and operator counters have got. A unit owns
+ * whatever is created between the end of its imports and the end of its
+ * compilation.
+ */
+struct counters {
+        int globals;
+        int classes;
+        int tags;
+        int operators;
+};
+
+/* An operand of the unit being compiled that the bytecode cache has to patch */
+struct reloc {
+        size_t offset;
+        int kind;
+        intptr_t value;
+};
+
+/* What the bytecode cache needs to know about a unit while it's being compiled */
+struct record {
+        char const *name;
+        bool module; /* compiled into a scope of its own */
+        bool ok;
+        struct counters start;
+        vec(struct statement const *) imports;
+        vec(struct statement *) macros;
+        vec(struct reloc) relocs;
+};
+
+/* A module, the prelude or a program, and the range of ids it owns */
+struct unit {
+        char const *name;
+        uint64_t key;
+        struct counters base;
+        struct counters end;
+};
+
 typedef vec(struct import)    import_vector;
 typedef vec(struct eloc)      location_vector;
 typedef vec(struct symbol *)  symbol_vector;
@@ -109,6 +154,12 @@ typedef vec(unsigned)         info_vector;
 struct state {
         byte_vector code;
 
+        /*
+         * Where vm_exec() looks for native code: the start of each function body
+         * and the target of each backward jump.
+         */
+        offset_vector entries;
+
         offset_vector selfs;
         offset_vector breaks;
         offset_vector continues;
@@ -150,9 +201,13 @@ struct state {
         struct location mend;
 
         location_vector expression_locations;
+
+        /* NULL unless this unit is going to be saved in the bytecode cache */
+        struct record *record;
 };
 
 bool CheckConstraints = true;
+bool KeepImages = false;
 
 static jmp_buf jb;
 static char const *Error;
@@ -166,6 +221,10 @@ static struct state state;
 
 static vec(location_vector) location_lists;
 
+static vec(struct unit) units;
+static struct counters Builtins;
+static int GlobalCount;
+
 static struct scope *global;
 
 static uint64_t t;
@@ -221,6 +280,9 @@ invoke_macro(struct expression *e, struct scope *scope);
 static void
 compile(char const *source);
 
+static void
+save_unit(char const *source);
+
 noreturn static void
 fail(char const *fmt, ...)
 {
@@ -337,9 +399,73 @@ _emit_instr(char c)
         VPush(state.code, c);
 }
 
+/*
+ * Module sources compiled into the binary by `ty --emit-c` take precedence over
+ * anything on disk. Every source that does get read from disk is remembered so
+ * that --emit-c knows what to embed.
+ */
+static vec(struct module_source) embedded_modules;
+static vec(struct module_source) loaded_modules;
+static vec(struct compiled_unit) compiled_units;
+
+/* The same for compiled units: what --emit-c embeds, and what it has kept */
+static vec(struct unit_image) embedded_images;
+static vec(struct unit_image) kept_images;
+
+void
+compiler_embed_module(char const *name, char const *source)
+{
+        vec_nogc_push(embedded_modules, ((struct module_source){ .name = name, .source = source }));
+}
+
+struct module_source const *
+compiler_loaded_modules(int *n)
+{
+        *n = loaded_modules.count;
+        return loaded_modules.items;
+}
+
+void
+compiler_embed_image(char const *name, unsigned char const *data, size_t size)
+{
+        vec_nogc_push(embedded_images, ((struct unit_image){ .name = name, .data = data, .size = size }));
+}
+
+struct unit_image const *
+compiler_unit_images(int *n)
+{
+        *n = kept_images.count;
+        return kept_images.items;
+}
+
+static struct unit_image const *
+find_image(char const *name)
+{
+        for (int i = 0; i < embedded_images.count; ++i) {
+                if (strcmp(embedded_images.items[i].name, name) == 0) {
+                        return &embedded_images.items[i];
+                }
+        }
+
+        return NULL;
+}
+
+struct compiled_unit const *
+compiler_compiled_units(int *n)
+{
+        *n = compiled_units.count;
+        return compiled_units.items;
+}
+
 static char *
 try_slurp_module(char const *name)
 {
+        for (int i = 0; i < embedded_modules.count; ++i) {
+                if (strcmp(embedded_modules.items[i].name, name) == 0) {
+                        return (char *)embedded_modules.items[i].source;
+                }
+        }
+
         char pathbuf[512];
         char const *home = getenv("HOME");
         if (home == NULL)
@@ -353,6 +479,10 @@ try_slurp_module(char const *name)
                 source = slurp(pathbuf);
         }
 
+        if (source != NULL) {
+                vec_nogc_push(loaded_modules, ((struct module_source){ .name = name, .source = source }));
+        }
+
         return source;
 }
 
@@ -555,6 +685,7 @@ freshstate(void)
         struct state s;
 
         vec_init(s.code);
+        vec_init(s.entries);
 
         vec_init(s.selfs);
         vec_init(s.bound_symbols);
@@ -590,6 +721,8 @@ freshstate(void)
 
         vec_init(s.expression_locations);
 
+        s.record = NULL;
+
         return s;
 }
 
@@ -1614,8 +1747,12 @@ invoke_macro(struct expression *e, struct scope *scope)
         symbolize_expression(scope, e->macro.m);
 
         byte_vector code_save = state.code;
+        offset_vector entries_save = state.entries;
+        struct record *record_save = state.record;
 
         vec_init(state.code);
+        vec_init(state.entries);
+        state.record = NULL;
 
         emit_expression(e->macro.m);
         emit_instr(INSTR_HALT);
@@ -1626,6 +1763,8 @@ invoke_macro(struct expression *e, struct scope *scope)
         vm_pop();
 
         state.code = code_save;
+        state.entries = entries_save;
+        state.record = record_save;
 
         struct value node = tyexpr(e->macro.e);
         vm_push(&node);
@@ -1649,6 +1788,9 @@ patch_jumps_to(offset_vector const *js, size_t location)
         for (int i = 0; i < js->count; ++i) {
                 int distance = location - js->items[i] - sizeof (int);
                 memcpy(state.code.items + js->items[i], &distance, sizeof distance);
+                if (distance < 0) {
+                        VPush(state.entries, location);
+                }
         }
 }
 
@@ -1735,6 +1877,82 @@ emit_string(char const *s)
         VPushN(state.code, s, strlen(s) + 1);
 }
 
+/*
+ * Operands that depend on what else has been compiled in this process are
+ * recorded, so that the bytecode cache can patch them when it loads the unit.
+ */
+inline static void
+emit_reloc(int kind, intptr_t value)
+{
+        if (state.record != NULL) {
+                vec_nogc_push(state.record->relocs, ((struct reloc){ .offset = state.code.count, .kind = kind, .value = value }));
+        }
+}
+
+/* Something that only exists in this process, which rules out caching the unit */
+inline static void
+emit_pointer(void const *p)
+{
+        if (state.record != NULL) {
+                state.record->ok = false;
+        }
+
+        emit_symbol((uintptr_t)p);
+}
+
+inline static void
+emit_global(int i)
+{
+        emit_reloc(RELOC_GLOBAL, i);
+        emit_int(i);
+}
+
+inline static void
+emit_class(int class)
+{
+        emit_reloc(RELOC_CLASS, class);
+        emit_int(class);
+}
+
+inline static void
+emit_tag(int tag)
+{
+        emit_reloc(RELOC_TAG, tag);
+        emit_int(tag);
+}
+
+inline static void
+emit_regex(struct regex const *re)
+{
+        emit_reloc(RELOC_REGEX, (intptr_t)re);
+        emit_symbol((uintptr_t)re);
+}
+
+/*
+ * Member and method names are emitted as interned ids rather than inline strings,
+ * so the VM can find the name and its hash without scanning the instruction stream.
+ */
+inline static void
+emit_member(char const *name)
+{
+        LOG("emitting member: %s", name);
+        int id = intern(name)->id;
+        emit_reloc(RELOC_MEMBER, id);
+        emit_int(id);
+}
+
+/*
+ * A member name that is looked up on whatever the receiver turns out to be,
+ * followed by the id of the inline cache site the VM keeps its lookups in.
+ */
+inline static void
+emit_member_site(char const *name)
+{
+        emit_member(name);
+        emit_reloc(RELOC_SITE, 0);
+        emit_int(vm_ic_site());
+}
+
 #ifndef TY_NO_LOG
 #define emit_load_instr(id, inst, i) \
         do { \
@@ -1758,7 +1976,11 @@ emit_load(struct symbol const *s, struct scope const *scope)
         LOG("Emitting LOAD for %s", s->identifier);
 
         if (s->global) {
-                emit_load_instr(s->identifier, INSTR_LOAD_GLOBAL, s->i);
+                emit_instr(INSTR_LOAD_GLOBAL);
+                emit_global(s->i);
+#ifndef TY_NO_LOG
+                emit_string(s->identifier);
+#endif
         } else if (local && !s->captured) {
                 emit_load_instr(s->identifier, INSTR_LOAD_LOCAL, s->i);
         } else if (!local && s->captured) {
@@ -1780,7 +2002,7 @@ emit_tgt(struct symbol const *s, struct scope const *scope, bool def)
 
         if (s->global) {
                 emit_instr(INSTR_TARGET_GLOBAL);
-                emit_int(s->i);
+                emit_global(s->i);
         } else if (def || (local && !s->captured)) {
                 emit_instr(INSTR_TARGET_LOCAL);
                 emit_int(s->i);
@@ -1917,7 +2139,7 @@ emit_function(struct expression const *e, int class)
                 VPush(state.code, 0x00);
         }
 
-        emit_int(class);
+        emit_class(class);
 
         emit_string(e->name == NULL ? "(anonymous function)" : e->name);
         LOG("COMPILING FUNCTION: %s.%s", class == -1 ? "TOP" : class_name(class), (e->name == NULL ? "(anonymous function)" : e->name));
@@ -1938,6 +2160,7 @@ emit_function(struct expression const *e, int class)
          * the relative offset of references to non-local variables.
          */
         size_t start_offset = state.code.count;
+        VPush(state.entries, start_offset);
 
         for (int i = 0; i < e->param_symbols.count; ++i) {
                 if (e->dflts.items[i] == NULL)
@@ -2502,7 +2725,7 @@ emit_try_match(struct expression const *pattern)
         case EXPRESSION_TAG_APPLICATION:
                 emit_instr(INSTR_DUP);
                 emit_instr(INSTR_TRY_TAG_POP);
-                emit_int(pattern->symbol->tag);
+                emit_tag(pattern->symbol->tag);
                 VPush(state.match_fails, state.code.count);
                 emit_int(0);
 
@@ -2513,7 +2736,7 @@ emit_try_match(struct expression const *pattern)
         case EXPRESSION_REGEX:
                 emit_tgt(pattern->match_symbol, state.fscope, true);
                 emit_instr(INSTR_TRY_REGEX);
-                emit_symbol((uintptr_t) pattern->regex);
+                emit_regex(pattern->regex);
                 VPush(state.match_fails, state.code.count);
                 emit_int(0);
                 need_loc = true;
@@ -3026,8 +3249,7 @@ emit_target(struct expression *target, bool def)
         case EXPRESSION_SELF_ACCESS:
                 emit_expression(target->object);
                 emit_instr(INSTR_TARGET_MEMBER);
-                emit_string(target->member_name);
-                emit_ulong(strhash(target->member_name));
+                emit_member(target->member_name);
                 break;
         case EXPRESSION_SUBSCRIPT:
                 emit_expression(target->container);
@@ -3042,6 +3264,60 @@ emit_target(struct expression *target, bool def)
                 add_location(target, start, state.code.count);
 }
 
+/*
+ * Emits the value iterated over by a for-each loop or comprehension. Integer
+ * ranges (a..b, a...b, and k.upto(n) or k.downto(n) on an integer literal k)
+ * are turned into a plain counter by INSTR_INT_RANGE instead of going through
+ * a Range object and a generator. If the bounds turn out not to be integers at
+ * run time, INSTR_INT_RANGE falls back to doing what the expression would have
+ * done on its own.
+ */
+static void
+emit_iterable(struct expression const *e)
+{
+        int kind;
+
+        switch (e->type) {
+        case EXPRESSION_DOT_DOT:
+                kind = INT_RANGE_DOT_DOT;
+                emit_expression(e->left);
+                emit_expression(e->right);
+                break;
+        case EXPRESSION_DOT_DOT_DOT:
+                kind = INT_RANGE_DOT_DOT_DOT;
+                emit_expression(e->left);
+                emit_expression(e->right);
+                break;
+        case EXPRESSION_METHOD_CALL:
+                if (e->object->type != EXPRESSION_INTEGER ||
+                    e->maybe ||
+                    is_variadic(e) ||
+                    e->method_args.count != 1 ||
+                    e->method_kwargs.count != 0 ||
+                    e->mconds.items[0] != NULL) {
+                        emit_expression(e);
+                        return;
+                }
+                if (strcmp(e->method_name, "upto") == 0) {
+                        kind = INT_RANGE_UPTO;
+                } else if (strcmp(e->method_name, "downto") == 0) {
+                        kind = INT_RANGE_DOWNTO;
+                } else {
+                        emit_expression(e);
+                        return;
+                }
+                emit_expression(e->object);
+                emit_expression(e->method_args.items[0]);
+                break;
+        default:
+                emit_expression(e);
+                return;
+        }
+
+        emit_instr(INSTR_INT_RANGE);
+        emit_int(kind);
+}
+
 static void
 emit_dict_compr2(struct expression const *e)
 {
@@ -3070,7 +3346,7 @@ emit_dict_compr2(struct expression const *e)
                 emit_int(1);
         }
 
-        emit_expression(e->dcompr.iter);
+        emit_iterable(e->dcompr.iter);
 
         size_t start = state.code.count;
         emit_instr(INSTR_SAVE_STACK_POS);
@@ -3163,7 +3439,7 @@ emit_dict_compr(struct expression const *e)
                 emit_int(1);
         }
 
-        emit_expression(e->dcompr.iter);
+        emit_iterable(e->dcompr.iter);
 
         size_t start = state.code.count;
 
@@ -3235,7 +3511,7 @@ emit_array_compr2(struct expression const *e)
                 emit_int(1);
         }
 
-        emit_expression(e->compr.iter);
+        emit_iterable(e->compr.iter);
 
         size_t start = state.code.count;
         emit_instr(INSTR_SAVE_STACK_POS);
@@ -3332,7 +3608,7 @@ emit_array_compr(struct expression const *e)
                 emit_int(1);
         }
 
-        emit_expression(e->compr.iter);
+        emit_iterable(e->compr.iter);
 
         size_t start = state.code.count;
 
@@ -3453,7 +3729,7 @@ emit_for_each2(struct statement const *s, bool want_result)
         emit_instr(INSTR_PUSH_INDEX);
         emit_int((int)s->each.target->es.count);
 
-        emit_expression(s->each.array);
+        emit_iterable(s->each.array);
 
         size_t start = state.code.count;
         emit_instr(INSTR_SAVE_STACK_POS);
@@ -3554,7 +3830,7 @@ emit_for_each(struct statement const *s)
                 emit_int(1);
         }
 
-        emit_expression(s->each.array);
+        emit_iterable(s->each.array);
 
         size_t start = state.code.count;
 
@@ -3657,7 +3933,7 @@ emit_assignment2(struct expression *target, bool maybe, bool def)
                 break;
         case EXPRESSION_TAG_APPLICATION:
                 emit_instr(INSTR_UNTAG_OR_DIE);
-                emit_int(target->symbol->tag);
+                emit_tag(target->symbol->tag);
                 emit_assignment2(target->tagged, maybe, def);
                 break;
         case EXPRESSION_VIEW_PATTERN:
@@ -3780,7 +4056,7 @@ emit_expr(struct expression const *e, bool need_loc)
                 break;
         case EXPRESSION_VALUE:
                 emit_instr(INSTR_VALUE);
-                emit_symbol((uintptr_t)e->v);
+                emit_pointer(e->v);
                 break;
         case EXPRESSION_MATCH:
                 emit_match_expression(e);
@@ -3788,7 +4064,7 @@ emit_expr(struct expression const *e, bool need_loc)
         case EXPRESSION_TAG_APPLICATION:
                 emit_expression(e->tagged);
                 emit_instr(INSTR_TAG_PUSH);
-                emit_int(e->symbol->tag);
+                emit_tag(e->symbol->tag);
                 break;
         case EXPRESSION_DOT_DOT:
                 emit_expression(e->left);
@@ -3828,15 +4104,15 @@ emit_expr(struct expression const *e, bool need_loc)
         case EXPRESSION_EVAL:
                 emit_expression(e->operand);
                 emit_instr(INSTR_EVAL);
-                emit_symbol((uintptr_t)e->escope);
+                emit_pointer(e->escope);
                 break;
         case EXPRESSION_TAG:
                 emit_instr(INSTR_TAG);
-                emit_int(e->symbol->tag);
+                emit_tag(e->symbol->tag);
                 break;
         case EXPRESSION_REGEX:
                 emit_instr(INSTR_REGEX);
-                emit_symbol((uintptr_t)e->regex);
+                emit_regex(e->regex);
                 break;
         case EXPRESSION_ARRAY:
                 emit_instr(INSTR_SAVE_STACK_POS);
@@ -3899,8 +4175,7 @@ emit_expr(struct expression const *e, bool need_loc)
                         emit_instr(INSTR_TRY_MEMBER_ACCESS);
                 else
                         emit_instr(INSTR_MEMBER_ACCESS);
-                emit_string(e->member_name);
-                emit_ulong(strhash(e->member_name));
+                emit_member_site(e->member_name);
                 break;
         case EXPRESSION_SUBSCRIPT:
                 emit_expression(e->container);
@@ -3966,8 +4241,7 @@ emit_expr(struct expression const *e, bool need_loc)
                 } else {
                         emit_int(e->method_args.count);
                 }
-                emit_string(e->method_name);
-                emit_ulong(strhash(e->method_name));
+                emit_member_site(e->method_name);
 
                 emit_int(e->method_kwargs.count);
                 for (size_t i = e->method_kws.count; i > 0; --i) {
@@ -3996,8 +4270,7 @@ emit_expr(struct expression const *e, bool need_loc)
                 emit_instr(INSTR_SWAP);
                 emit_instr(INSTR_CALL_METHOD);
                 emit_int(1);
-                emit_string(e->op_name);
-                emit_ulong(strhash(e->op_name));
+                emit_member_site(e->op_name);
                 emit_int(0);
                 if (e->sc != NULL) {
                         PATCH_JUMP(sc);
@@ -4015,8 +4288,7 @@ emit_expr(struct expression const *e, bool need_loc)
                 emit_expression(e->left);
                 emit_instr(INSTR_CALL_METHOD);
                 emit_int(1);
-                emit_string(method);
-                emit_ulong(strhash(method));
+                emit_member_site(method);
                 emit_int(0);
                 break;
         case EXPRESSION_IN:
@@ -4026,8 +4298,7 @@ emit_expr(struct expression const *e, bool need_loc)
                 emit_expression(e->right);
                 emit_instr(INSTR_CALL_METHOD);
                 emit_int(1);
-                emit_string(method);
-                emit_ulong(strhash(method));
+                emit_member_site(method);
                 emit_int(0);
                 if (e->type == EXPRESSION_NOT_IN) {
                         emit_instr(INSTR_NOT);
@@ -4201,9 +4472,9 @@ emit_expr(struct expression const *e, bool need_loc)
                 emit_instr(INSTR_TUPLE);
                 for (int i = 0; i < e->names.count; ++i) {
                         if (e->names.items[i] != NULL) {
-                                emit_string(e->names.items[i]);
+                                emit_member(e->names.items[i]);
                         } else {
-                                VPush(state.code, 0);
+                                emit_int(-1);
                         }
                 }
                 break;
@@ -4284,8 +4555,8 @@ emit_statement(struct statement const *s, bool want_result)
                 }
 
                 emit_instr(INSTR_DEFINE_TAG);
-                emit_int(s->tag.symbol);
-                emit_int(s->tag.super == NULL ? -1 : s->tag.super->symbol->tag);
+                emit_tag(s->tag.symbol);
+                emit_tag(s->tag.super == NULL ? -1 : s->tag.super->symbol->tag);
                 emit_int(s->tag.methods.count);
 
                 for (int i = s->tag.methods.count; i > 0; --i)
@@ -4311,7 +4582,7 @@ emit_statement(struct statement const *s, bool want_result)
                 }
 
                 emit_instr(INSTR_DEFINE_CLASS);
-                emit_int(s->class.symbol);
+                emit_class(s->class.symbol);
                 emit_int(s->class.statics.count);
                 emit_int(s->class.methods.count);
                 emit_int(s->class.getters.count);
@@ -4396,8 +4667,7 @@ emit_statement(struct statement const *s, bool want_result)
                         emit_load(s->drop.items[i], state.fscope);
                         emit_instr(INSTR_TRY_CALL_METHOD);
                         emit_int(0);
-                        emit_string("__drop__");
-                        emit_ulong(strhash("__drop__"));
+                        emit_member_site("__drop__");
                         emit_int(0);
                         emit_instr(INSTR_POP);
                 }
@@ -4421,24 +4691,22 @@ emit_statement(struct statement const *s, bool want_result)
 static void
 emit_new_globals(void)
 {
-        static int GlobalCount = 0;
-
         for (int i = GlobalCount; i < global->owned.count; ++i) {
                 struct symbol *s = global->owned.items[i];
                 if (s->i < BuiltinCount)
                         continue;
                 if (s->tag != -1) {
                         emit_instr(INSTR_TAG);
-                        emit_int(s->tag);
+                        emit_tag(s->tag);
                         emit_instr(INSTR_TARGET_GLOBAL);
-                        emit_int(s->i);
+                        emit_global(s->i);
                         emit_instr(INSTR_ASSIGN);
                         emit_instr(INSTR_POP);
                 } else if (s->class != -1) {
                         emit_instr(INSTR_CLASS);
-                        emit_int(s->class);
+                        emit_class(s->class);
                         emit_instr(INSTR_TARGET_GLOBAL);
-                        emit_int(s->i);
+                        emit_global(s->i);
                         emit_instr(INSTR_ASSIGN);
                         emit_instr(INSTR_POP);
                 }
@@ -4486,6 +4754,31 @@ declare_classes(struct statement *s)
         }
 }
 
+/*
+ * Makes the unit that's just been compiled (or loaded from the cache) known to
+ * the VM and the JIT.
+ */
+static void
+finish_unit(void)
+{
+        /*
+         * Add all of the location information from this compliation unit to the global list.
+         */
+        patch_location_info();
+        VPush(location_lists, state.expression_locations);
+
+        struct compiled_unit unit = {
+                .name = state.filename,
+                .code = state.code.items,
+                .size = state.code.count,
+                .entries = state.entries.items,
+                .entry_count = state.entries.count
+        };
+
+        vec_nogc_push(compiled_units, unit);
+        jit_unit_compiled(unit.name, unit.code, unit.size);
+}
+
 static void
 compile(char const *source)
 {
@@ -4520,6 +4813,16 @@ compile(char const *source)
 
         emit_new_globals();
 
+        /*
+         * Macros were defined while the unit was being parsed, but a cached unit
+         * isn't parsed, so its code has to define them too.
+         */
+        if (state.record != NULL) {
+                for (int i = 0; i < state.record->macros.count; ++i) {
+                        emit_statement(state.record->macros.items[i], false);
+                }
+        }
+
         /*
          * Move all function definitions to the beginning so that top-level functions have file scope.
          * This allows us to write programs such as
@@ -4554,19 +4857,640 @@ compile(char const *source)
 
         emit_instr(INSTR_HALT);
 
-        /*
-         * Add all of the location information from this compliation unit to the global list.
-         */
-        //struct location end = { 0 };
-        //add_location(end, end, state);
-        patch_location_info();
-        VPush(location_lists, state.expression_locations);
+        if (state.record != NULL) {
+                save_unit(source);
+        }
+
+        finish_unit();
 
         state.generator_returns.count = 0;
         state.breaks.count = 0;
         state.continues.count = 0;
 }
 
+static struct counters
+counters(void)
+{
+        return (struct counters) {
+                .globals = scope_get_global(),
+                .classes = class_count(),
+                .tags = tags_count(),
+                .operators = parse_operator_count()
+        };
+}
+
+static int
+counter(struct counters const *c, int kind)
+{
+        switch (kind) {
+        case RELOC_GLOBAL: return c->globals;
+        case RELOC_CLASS:  return c->classes;
+        case RELOC_TAG:    return c->tags;
+        default:           return c->operators;
+        }
+}
+
+static bool
+same_counters(struct counters const *a, struct counters const *b)
+{
+        return a->globals == b->globals
+            && a->classes == b->classes
+            && a->tags == b->tags
+            && a->operators == b->operators;
+}
+
+static struct unit const *
+find_unit(char const *name)
+{
+        for (int i = units.count - 1; i >= 0; --i) {
+                if (strcmp(units.items[i].name, name) == 0) {
+                        return &units.items[i];
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Everything a unit's bytecode depends on besides its imports: its source, the
+ * flags it was compiled with, the operators that were defined when it was
+ * parsed, and the prelude.
+ */
+static uint64_t
+unit_key(uint64_t source, int operators)
+{
+        uint64_t h = 0;
+
+        for (int i = 0; i < operators; ++i) {
+                char const *name;
+                int prec;
+                parse_get_operator(i, &name, &prec);
+                h = cache_hash(name, strlen(name), h + prec);
+        }
+
+        struct unit const *prelude = find_unit("prelude");
+
+        uint64_t k[] = { source, CheckConstraints, h, prelude == NULL ? 0 : prelude->key };
+
+        return cache_hash(k, sizeof k, cache_build_id());
+}
+
+static uint64_t
+unit_key_import(uint64_t key, char const *module)
+{
+        struct unit const *u = find_unit(module);
+
+        if (u == NULL) {
+                return cache_hash(module, strlen(module), key);
+        } else {
+                return cache_hash(&u->key, sizeof u->key, key);
+        }
+}
+
+static struct cache_location
+save_location(struct location loc, char const *source, size_t n)
+{
+        intptr_t s;
+
+        if (loc.s == NULL) {
+                s = -1;
+        } else if ((uintptr_t)loc.s >= (uintptr_t)source && (uintptr_t)loc.s <= (uintptr_t)(source + n)) {
+                s = loc.s - source;
+        } else {
+                s = -2;
+        }
+
+        return (struct cache_location){ .line = loc.line, .col = loc.col, .s = s };
+}
+
+static struct location
+load_location(struct cache_location loc, char const *source, size_t n)
+{
+        char const *s;
+
+        if (loc.s == -1) {
+                s = NULL;
+        } else if (loc.s >= 0 && loc.s <= n) {
+                s = source + loc.s;
+        } else {
+                s = EmptyString + 1;
+        }
+
+        return (struct location){ .line = loc.line, .col = loc.col, .s = s };
+}
+
+/*
+ * Expresses an id that's going into the image relative to the unit that owns
+ * it, adding that unit to the image's dependencies if it's another one.
+ */
+static bool
+save_ref(struct cache_image *img, struct counters const *end, int kind, int id, struct cache_ref *ref)
+{
+        struct counters const *start = &state.record->start;
+
+        if (id < counter(&Builtins, kind)) {
+                *ref = (struct cache_ref){ .unit = CACHE_ABSOLUTE, .id = id };
+                return true;
+        }
+
+        if (id >= counter(start, kind) && id < counter(end, kind)) {
+                *ref = (struct cache_ref){ .unit = CACHE_OWN, .id = id - counter(start, kind) };
+                return true;
+        }
+
+        for (int i = units.count - 1; i >= 0; --i) {
+                struct unit const *u = &units.items[i];
+
+                if (id < counter(&u->base, kind) || id >= counter(&u->end, kind))
+                        continue;
+
+                int dep = 0;
+                while (dep < img->deps.count && strcmp(img->deps.items[dep].name, u->name) != 0)
+                        dep += 1;
+
+                if (dep == img->deps.count) {
+                        vec_nogc_push(img->deps, ((struct cache_dep){ .name = u->name, .key = u->key }));
+                }
+
+                *ref = (struct cache_ref){ .unit = dep, .id = id - counter(&u->base, kind) };
+
+                return true;
+        }
+
+        return false;
+}
+
+static bool
+load_ref(struct cache_ref ref, int kind, struct unit const *own, struct unit const *deps, int ndeps, int *id)
+{
+        struct unit const *u;
+
+        if (ref.unit == CACHE_ABSOLUTE) {
+                *id = ref.id;
+                return ref.id < counter(&Builtins, kind);
+        } else if (ref.unit == CACHE_OWN) {
+                u = own;
+        } else if (ref.unit >= 0 && ref.unit < ndeps) {
+                u = &deps[ref.unit];
+        } else {
+                return false;
+        }
+
+        *id = counter(&u->base, kind) + ref.id;
+
+        return ref.id >= 0 && *id < counter(&u->end, kind);
+}
+
+static struct regex const *
+load_regex(struct cache_regex const *r)
+{
+        char const *err;
+        int offset;
+
+        pcre *re = pcre_compile(r->pattern, r->flags, &err, &offset, NULL);
+        if (re == NULL)
+                return NULL;
+
+        pcre_extra *extra = pcre_study(re, PCRE_STUDY_EXTRA_NEEDED | PCRE_STUDY_JIT_COMPILE, &err);
+        if (extra == NULL)
+                return NULL;
+
+        if (JITStack != NULL)
+                pcre_assign_jit_stack(extra, NULL, JITStack);
+
+        struct regex *regex = Allocate(sizeof *regex);
+        regex->pattern = r->pattern;
+        regex->pcre = re;
+        regex->extra = extra;
+        regex->gc = false;
+
+        return regex;
+}
+
+static int
+compare_symbols(void const *a, void const *b)
+{
+        struct symbol const *x = *(struct symbol const **)a;
+        struct symbol const *y = *(struct symbol const **)b;
+
+        return (x->i > y->i) - (x->i < y->i);
+}
+
+/*
+ * Called once the unit being recorded has been compiled, but before it's run,
+ * since the VM rewrites some instructions as it goes. The unit is registered
+ * even if it can't be saved, so that units which use it can refer to it.
+ */
+static void
+save_unit(char const *source)
+{
+        struct record *r = state.record;
+        struct counters end = counters();
+        struct cache_image img = {0};
+        size_t n = strlen(source);
+
+        img.source = cache_hash(source, n, 0);
+        img.key = unit_key(img.source, r->start.operators);
+
+        for (int i = 0; i < r->imports.count; ++i) {
+                struct statement const *s = r->imports.items[i];
+                struct cache_import import = { .module = s->import.module, .as = s->import.as };
+                for (int j = 0; j < s->import.identifiers.count; ++j) {
+                        vec_nogc_push(import.identifiers, s->import.identifiers.items[j]);
+                }
+                vec_nogc_push(img.imports, import);
+                img.key = unit_key_import(img.key, import.module);
+
+                /*
+                 * The prelude and programs share their scope with what comes after
+                 * them, which we couldn't take these back out of if we had to fall
+                 * back to compiling the unit.
+                 */
+                if (!r->module && import.identifiers.count > 0) {
+                        r->ok = false;
+                }
+        }
+
+        for (int i = r->start.operators; i < end.operators; ++i) {
+                struct cache_operator op;
+                r->ok &= parse_get_operator(i, &op.name, &op.prec);
+                vec_nogc_push(img.operators, op);
+        }
+
+        for (int i = r->start.classes; i < end.classes; ++i) {
+                struct cache_class class = { .name = class_name(i) };
+                r->ok &= save_ref(&img, &end, RELOC_CLASS, class_get_super(i), &class.super);
+                vec_nogc_push(img.classes, class);
+        }
+
+        for (int i = r->start.tags; i < end.tags; ++i) {
+                vec_nogc_push(img.tags, tags_name(i));
+        }
+
+        img.globals = end.globals - r->start.globals;
+
+        symbol_vector symbols = {0};
+        for (int i = 0; i < SYMBOL_TABLE_SIZE; ++i) {
+                for (struct symbol *sym = state.global->table[i]; sym != NULL; sym = sym->next) {
+                        if (sym->global && sym->i >= r->start.globals && sym->i < end.globals) {
+                                vec_nogc_push(symbols, sym);
+                        }
+                }
+        }
+
+        /* Adding them back in the same order recreates the same hash chains */
+        qsort(symbols.items, symbols.count, sizeof *symbols.items, compare_symbols);
+
+        for (int i = 0; i < symbols.count; ++i) {
+                struct symbol const *sym = symbols.items[i];
+                struct cache_symbol s = {
+                        .identifier = sym->identifier,
+                        .i = sym->i - r->start.globals,
+                        .flags = (sym->public ? CACHE_SYM_PUBLIC : 0)
+                               | (sym->cnst ? CACHE_SYM_CONST : 0)
+                               | (sym->macro ? CACHE_SYM_MACRO : 0),
+                        .loc = save_location(sym->loc, source, n)
+                };
+                r->ok &= save_ref(&img, &end, RELOC_TAG, sym->tag, &s.tag);
+                r->ok &= save_ref(&img, &end, RELOC_CLASS, sym->class, &s.class);
+                vec_nogc_push(img.symbols, s);
+        }
+
+        free(symbols.items);
+
+        /* Where each member name is in img.members, or -1 */
+        int *members = malloc(intern_count() * sizeof (int));
+        if (members == NULL) {
+                panic("Out of memory!");
+        }
+
+        memset(members, -1, intern_count() * sizeof (int));
+
+        for (int i = 0; i < r->relocs.count; ++i) {
+                struct reloc const *reloc = &r->relocs.items[i];
+                struct cache_reloc out = { .offset = reloc->offset, .kind = reloc->kind };
+                struct regex const *re;
+                unsigned long flags;
+
+                switch (reloc->kind) {
+                case RELOC_MEMBER:
+                        if (members[reloc->value] == -1) {
+                                members[reloc->value] = img.members.count;
+                                vec_nogc_push(img.members, intern_name(reloc->value));
+                        }
+                        out.ref.id = members[reloc->value];
+                        break;
+                case RELOC_SITE:
+                        break;
+                case RELOC_REGEX:
+                        re = (struct regex const *)reloc->value;
+                        pcre_fullinfo(re->pcre, NULL, PCRE_INFO_OPTIONS, &flags);
+                        out.ref.id = img.regexes.count;
+                        vec_nogc_push(img.regexes, ((struct cache_regex){ .pattern = re->pattern, .flags = flags }));
+                        break;
+                default:
+                        r->ok &= save_ref(&img, &end, reloc->kind, reloc->value, &out.ref);
+                }
+
+                vec_nogc_push(img.relocs, out);
+        }
+
+        free(members);
+
+        img.code.items = state.code.items;
+        img.code.count = state.code.count;
+        img.entries.items = state.entries.items;
+        img.entries.count = state.entries.count;
+
+        for (int i = 0; i < state.expression_locations.count; ++i) {
+                struct eloc const *loc = &state.expression_locations.items[i];
+                vec_nogc_push(img.locations, ((struct cache_eloc){
+                        .start_off = loc->start_off,
+                        .end_off = loc->end_off,
+                        .start = save_location(loc->start, source, n),
+                        .end = save_location(loc->end, source, n)
+                }));
+        }
+
+        if (r->ok && UseCache) {
+                cache_store(r->name, &img);
+        }
+
+        if (r->ok && KeepImages) {
+                struct unit_image image = { .name = r->name, .filename = state.filename };
+                image.data = cache_encode(&img, &image.size);
+                vec_nogc_push(kept_images, image);
+        }
+
+        vec_nogc_push(units, ((struct unit){ .name = r->name, .key = img.key, .base = r->start, .end = end }));
+
+        img.code.items = NULL;
+        img.entries.items = NULL;
+        cache_free(&img);
+}
+
+/*
+ * Sets up a unit from its image in the bytecode cache, as though it had just
+ * been compiled: its imports, operators, classes, tags and module-scope symbols
+ * are recreated and its bytecode is relocated to match. Returns false, without
+ * having touched anything but the unit's imports, if there isn't an image or it
+ * was compiled from a different source or against different dependencies.
+ */
+static bool
+load_unit(char const *name, char const *source)
+{
+        struct cache_image img;
+        struct unit_image const *embedded = find_image(name);
+        size_t n = strlen(source);
+
+        if (embedded != NULL) {
+                if (!cache_decode(embedded->data, embedded->size, &img))
+                        return false;
+        } else if (!UseCache || !cache_load(name, &img)) {
+                return false;
+        }
+
+        if (img.source != cache_hash(source, n, 0)) {
+                cache_free(&img);
+                return false;
+        }
+
+        for (int i = 0; i < img.imports.count; ++i) {
+                struct statement s = { .type = STATEMENT_IMPORT };
+                s.import.module = (char *)img.imports.items[i].module;
+                s.import.as = (char *)img.imports.items[i].as;
+                s.import.identifiers.items = img.imports.items[i].identifiers.items;
+                s.import.identifiers.count = img.imports.items[i].identifiers.count;
+                import_module(&s);
+        }
+
+        struct unit own = { .name = name, .base = counters() };
+
+        own.key = unit_key(img.source, own.base.operators);
+        for (int i = 0; i < img.imports.count; ++i) {
+                own.key = unit_key_import(own.key, img.imports.items[i].module);
+        }
+
+        own.end = (struct counters) {
+                .globals = own.base.globals + img.globals,
+                .classes = own.base.classes + img.classes.count,
+                .tags = own.base.tags + img.tags.count,
+                .operators = own.base.operators + img.operators.count
+        };
+
+        bool ok = own.key == img.key;
+
+        struct unit *deps = malloc((img.deps.count + 1) * sizeof *deps);
+        if (deps == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (int i = 0; ok && i < img.deps.count; ++i) {
+                struct unit const *u = find_unit(img.deps.items[i].name);
+                ok = u != NULL && u->key == img.deps.items[i].key;
+                if (ok) {
+                        deps[i] = *u;
+                }
+        }
+
+        /* Check every reference before changing anything */
+        int id;
+
+        for (int i = 0; ok && i < img.classes.count; ++i) {
+                ok = load_ref(img.classes.items[i].super, RELOC_CLASS, &own, deps, img.deps.count, &id);
+        }
+
+        for (int i = 0; ok && i < img.symbols.count; ++i) {
+                struct cache_symbol const *s = &img.symbols.items[i];
+                ok = s->i >= 0 && s->i < img.globals
+                  && load_ref(s->tag, RELOC_TAG, &own, deps, img.deps.count, &id)
+                  && load_ref(s->class, RELOC_CLASS, &own, deps, img.deps.count, &id);
+        }
+
+        struct regex const **regexes = malloc((img.regexes.count + 1) * sizeof *regexes);
+        if (regexes == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (int i = 0; ok && i < img.regexes.count; ++i) {
+                ok = (regexes[i] = load_regex(&img.regexes.items[i])) != NULL;
+        }
+
+        for (int i = 0; ok && i < img.relocs.count; ++i) {
+                struct cache_reloc const *reloc = &img.relocs.items[i];
+                switch (reloc->kind) {
+                case RELOC_MEMBER:
+                        ok = reloc->ref.id >= 0 && reloc->ref.id < img.members.count;
+                        break;
+                case RELOC_SITE:
+                        break;
+                case RELOC_REGEX:
+                        ok = reloc->ref.id >= 0 && reloc->ref.id < img.regexes.count
+                          && reloc->offset + sizeof (uintptr_t) <= img.code.count;
+                        break;
+                case RELOC_GLOBAL:
+                case RELOC_CLASS:
+                case RELOC_TAG:
+                        ok = load_ref(reloc->ref, reloc->kind, &own, deps, img.deps.count, &id);
+                        break;
+                default:
+                        ok = false;
+                }
+        }
+
+        for (int i = 0; ok && i < img.locations.count; ++i) {
+                ok = img.locations.items[i].start_off <= img.code.count
+                  && img.locations.items[i].end_off <= img.code.count;
+        }
+
+        for (int i = 0; ok && i < img.entries.count; ++i) {
+                ok = img.entries.items[i] < img.code.count;
+        }
+
+        if (!ok) {
+                free(deps);
+                free(regexes);
+                cache_free(&img);
+                return false;
+        }
+
+        for (int i = 0; i < img.operators.count; ++i) {
+                parse_add_operator(img.operators.items[i].name, img.operators.items[i].prec);
+        }
+
+        for (int i = 0; i < img.classes.count; ++i) {
+                class_new(img.classes.items[i].name);
+        }
+
+        for (int i = 0; i < img.classes.count; ++i) {
+                load_ref(img.classes.items[i].super, RELOC_CLASS, &own, deps, img.deps.count, &id);
+                if (id != -1) {
+                        class_set_super(own.base.classes + i, id);
+                }
+        }
+
+        for (int i = 0; i < img.tags.count; ++i) {
+                tags_new(img.tags.items[i]);
+        }
+
+        for (int i = 0; i < img.symbols.count; ++i) {
+                struct cache_symbol const *s = &img.symbols.items[i];
+                struct symbol *sym = scope_add(state.global, s->identifier);
+                sym->i = own.base.globals + s->i;
+                sym->public = s->flags & CACHE_SYM_PUBLIC;
+                sym->cnst = s->flags & CACHE_SYM_CONST;
+                sym->macro = s->flags & CACHE_SYM_MACRO;
+                load_ref(s->tag, RELOC_TAG, &own, deps, img.deps.count, &sym->tag);
+                load_ref(s->class, RELOC_CLASS, &own, deps, img.deps.count, &sym->class);
+                sym->file = state.filename;
+                sym->loc = load_location(s->loc, source, n);
+        }
+
+        scope_set_global(own.end.globals);
+
+        /* The classes and tags this unit defines are already assigned to their globals */
+        GlobalCount = global->owned.count;
+
+        char *code = img.code.items;
+
+        for (int i = 0; i < img.relocs.count; ++i) {
+                struct cache_reloc const *reloc = &img.relocs.items[i];
+                switch (reloc->kind) {
+                case RELOC_MEMBER:
+                        id = intern(img.members.items[reloc->ref.id])->id;
+                        break;
+                case RELOC_SITE:
+                        id = vm_ic_site();
+                        break;
+                case RELOC_REGEX:
+                        memcpy(code + reloc->offset, &regexes[reloc->ref.id], sizeof (uintptr_t));
+                        continue;
+                default:
+                        load_ref(reloc->ref, reloc->kind, &own, deps, img.deps.count, &id);
+                }
+                memcpy(code + reloc->offset, &id, sizeof id);
+        }
+
+        state.code.items = code;
+        state.code.count = state.code.capacity = img.code.count;
+        state.entries.items = img.entries.items;
+        state.entries.count = state.entries.capacity = img.entries.count;
+
+        for (int i = 0; i < img.locations.count; ++i) {
+                struct cache_eloc const *loc = &img.locations.items[i];
+                VPush(state.expression_locations, ((struct eloc) {
+                        .start_off = loc->start_off,
+                        .end_off = loc->end_off,
+                        .start = load_location(loc->start, source, n),
+                        .end = load_location(loc->end, source, n),
+                        .filename = state.filename,
+                        .e = NULL
+                }));
+        }
+
+        finish_unit();
+
+        vec_nogc_push(units, own);
+
+        img.code.items = NULL;
+        img.entries.items = NULL;
+        free(deps);
+        free(regexes);
+        cache_free(&img);
+
+        return true;
+}
+
+/*
+ * Compiles a module, the prelude or a program, unless the bytecode cache or the
+ * binary has an image of it that can be used instead.
+ */
+static void
+compile_unit(char const *name, char const *source, bool module)
+{
+        /*
+         * Images are keyed on those of their imports, so once there are any to
+         * load or keep, every unit has to be recorded, even the ones that
+         * don't have an image themselves.
+         */
+        if (!UseCache && !KeepImages && embedded_images.count == 0) {
+                compile(source);
+                return;
+        }
+
+        int imports = state.imports.count;
+
+        if (load_unit(name, source))
+                return;
+
+        /* Start again without whatever the image's imports left behind */
+        if (module) {
+                char const *filename = state.filename;
+                state = freshstate();
+                state.filename = filename;
+        } else {
+                state.imports.count = imports;
+        }
+
+        struct record *record = Allocate(sizeof *record);
+        *record = (struct record) {
+                .name = name,
+                .module = module,
+                .ok = true,
+                .start = counters()
+        };
+
+        state.record = record;
+
+        compile(source);
+
+        state.record = NULL;
+
+        free(record->imports.items);
+        free(record->macros.items);
+        free(record->relocs.items);
+}
+
 static struct scope *
 load_module(char const *name, struct scope *scope)
 {
@@ -4584,7 +5508,7 @@ load_module(char const *name, struct scope *scope)
         state = freshstate();
         state.filename = name;
 
-        compile(source);
+        compile_unit(name, source, true);
 
         struct scope *module_scope;
         char *code = state.code.items;
@@ -4621,6 +5545,16 @@ import_module(struct statement const *s)
         char const *as = s->import.as;
 
         struct scope *module_scope = get_module_scope(name);
+        struct record *record = state.record;
+
+        /*
+         * A unit only owns what it creates after its imports, so it can't be
+         * cached if it creates anything before one.
+         */
+        if (record != NULL) {
+                struct counters now = counters();
+                record->ok &= same_counters(&record->start, &now);
+        }
 
         /* First make sure we haven't already imported this module, or imported another module
          * with the same local alias.
@@ -4666,6 +5600,11 @@ import_module(struct statement const *s)
         }
 
         VPush(state.imports, ((struct import){ .name = as, .scope = module_scope }));
+
+        if (record != NULL) {
+                vec_nogc_push(record->imports, s);
+                record->start = counters();
+        }
 }
 
 char const *
@@ -4704,7 +5643,8 @@ compiler_load_prelude(void)
         }
 
         state.filename = "(prelude)";
-        compile(slurp_module("prelude"));
+        Builtins = counters();
+        compile_unit("prelude", slurp_module("prelude"), false);
 
         state.global = scope_new(state.global, false);
 
@@ -4801,6 +5741,7 @@ char *
 compiler_compile_source(char const *source, char const *filename)
 {
         vec_init(state.code);
+        vec_init(state.entries);
         vec_init(state.selfs);
         vec_init(state.expression_locations);
 
@@ -4812,7 +5753,15 @@ compiler_compile_source(char const *source, char const *filename)
                 return NULL;
         }
 
-        compile(source);
+        /*
+         * A program only goes through the cache for --emit-c, and in the binary
+         * that makes; the REPL would give every line the same name.
+         */
+        if (KeepImages || find_image(filename) != NULL) {
+                compile_unit(filename, source, false);
+        } else {
+                compile(source);
+        }
 
         return state.code.items;
 }
@@ -4843,7 +5792,8 @@ compiler_find_definition(char const *file, int line, int col)
 
 
         for (int i = 0; i < locs->count; ++i) {
-                if (locs->items[i].e->type == EXPRESSION_IDENTIFIER &&
+                if (locs->items[i].e != NULL &&
+                    locs->items[i].e->type == EXPRESSION_IDENTIFIER &&
                     locs->items[i].start.line == line &&
                     locs->items[i].start.col == col) {
                         return (struct location) {
@@ -5963,18 +6913,31 @@ tyeval(struct expression *e)
                 symbolize_expression(state.macro_scope, e);
 
         byte_vector code_save = state.code;
+        offset_vector entries_save = state.entries;
         vec_init(state.code);
+        vec_init(state.entries);
 
         location_vector locations_save = state.expression_locations;
         vec_init(state.expression_locations);
 
+        /*
+         * Whatever this does happens at compile time, so a cached copy of the
+         * unit wouldn't do it.
+         */
+        struct record *record_save = state.record;
+        if (record_save != NULL)
+                record_save->ok = false;
+        state.record = NULL;
+
         emit_expression(e);
         emit_instr(INSTR_HALT);
 
         struct value v = vm_exec_or_nil(state.code.items);
 
         state.code = code_save;
+        state.entries = entries_save;
         state.expression_locations = locations_save;
+        state.record = record_save;
 
         return v;
 }
@@ -5985,13 +6948,25 @@ typarse(struct expression *e, struct location const *start, struct location cons
         symbolize_expression(state.global, e);
 
         byte_vector code_save = state.code;
+        offset_vector entries_save = state.entries;
         vec_init(state.code);
+        vec_init(state.entries);
+
+        /*
+         * Expanding a macro only changes the syntax tree, and whatever it expands
+         * to is saved with the unit. If it's a compile-time value, emit_pointer()
+         * stops the unit from being cached.
+         */
+        struct record *record_save = state.record;
+        state.record = NULL;
 
         emit_expression(e);
         emit_instr(INSTR_HALT);
 
         vm_exec(state.code.items);
         state.code = code_save;
+        state.entries = entries_save;
+        state.record = record_save;
 
         struct value m = *vm_get(0);
 
@@ -6062,8 +7037,20 @@ define_macro(struct statement *s)
 
         s->type = STATEMENT_FUNCTION_DEFINITION;
 
+        /*
+         * compile() emits the definition again for a unit that's being cached,
+         * so this doesn't stop it from being cached.
+         */
+        if (state.record != NULL) {
+                vec_nogc_push(state.record->macros, s);
+        }
+
         byte_vector code_save = state.code;
+        offset_vector entries_save = state.entries;
+        struct record *record_save = state.record;
         vec_init(state.code);
+        vec_init(state.entries);
+        state.record = NULL;
 
         emit_statement(s, false);
 
@@ -6072,6 +7059,8 @@ define_macro(struct statement *s)
         vm_exec(state.code.items);
 
         state.code = code_save;
+        state.entries = entries_save;
+        state.record = record_save;
 }
 
 bool
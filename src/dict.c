@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "alloc.h"
 #include "util.h"
@@ -12,122 +13,422 @@
 #include "gc.h"
 #include "vec.h"
 
-#define INITIAL_SIZE 16
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * A dict's entries (hash, key and value) are kept in the order they were put
+ * in, and found through an open-addressed index. Each slot of the index has a
+ * control byte that says whether it's empty, deleted, or full, and a full slot
+ * holds the number of its entry along with the low 7 bits of its key's hash in
+ * the control byte. Looking a key up compares a group of 16 control bytes at
+ * once and only looks at the entries whose control byte matches. Groups are
+ * probed in triangular order, and a lookup stops at the first group with an
+ * empty slot in it.
+ *
+ * The entries grow by half at a time, separately from the index, so a small
+ * dict doesn't pay for a whole group's worth of them. Removing a key leaves a
+ * hole in the entries (keys[i].type == 0) until the next rebuild squeezes them
+ * out, so whatever walks the entries (the collector, iteration, etc.) goes from
+ * 0 to d->used and skips those.
+ *
+ * A dict doesn't get a values array until a value other than nil is put in it
+ * (or something asks for a pointer to one), so a set, whose values are all nil,
+ * only has hashes and keys.
+ */
+#define INITIAL_SIZE    16
+#define INITIAL_ENTRIES 4
+#define GROUP           16
+
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+
+#define H1(h) ((h) >> 7)
+#define H2(h) ((unsigned char)((h) & 0x7F))
+
+#define FULL(d, i) (!((d)->ctrl[i] & CTRL_EMPTY))
+
+/*
+ * There can be entries for up to 7/8 of the slots. Every full or deleted slot
+ * used up an entry, so that's as full as the index gets.
+ */
+#define MAX_ENTRIES(size) ((size) - (size) / 8)
+
+/* The slots in the group at g whose control byte is b, one bit each */
+inline static unsigned
+match(unsigned char const *g, unsigned char b)
+{
+#ifdef __SSE2__
+        __m128i group = _mm_loadu_si128((__m128i const *)g);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+#else
+        unsigned m = 0;
+        for (int i = 0; i < GROUP; ++i) {
+                m |= (unsigned)(g[i] == b) << i;
+        }
+        return m;
+#endif
+}
+
+/* The slots in the group at g that are empty or deleted: those have the top bit set */
+inline static unsigned
+match_available(unsigned char const *g)
+{
+#ifdef __SSE2__
+        return _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)g));
+#else
+        unsigned m = 0;
+        for (int i = 0; i < GROUP; ++i) {
+                m |= (unsigned)(g[i] >> 7) << i;
+        }
+        return m;
+#endif
+}
 
+/* The entry that full slot i points to */
+inline static size_t
+entry(struct dict const *d, size_t i)
+{
+        switch (dict_index_width(d->size)) {
+        case 1:  return ((uint8_t const *)d->index)[i];
+        case 2:  return ((uint16_t const *)d->index)[i];
+        case 4:  return ((uint32_t const *)d->index)[i];
+        default: return ((uint64_t const *)d->index)[i];
+        }
+}
+
+inline static void
+set_entry(struct dict *d, size_t i, size_t e)
+{
+        switch (dict_index_width(d->size)) {
+        case 1:  ((uint8_t *)d->index)[i] = e;  break;
+        case 2:  ((uint16_t *)d->index)[i] = e; break;
+        case 4:  ((uint32_t *)d->index)[i] = e; break;
+        default: ((uint64_t *)d->index)[i] = e; break;
+        }
+}
+
+/*
+ * Any of these allocations can run a collection, which marks d as it was, so
+ * nothing is changed until they're all done. The new table has no entries.
+ */
+static void
+alloc_table(struct dict *d, size_t size, size_t capacity, bool with_values)
+{
+        unsigned char *ctrl = gc_alloc(size);
+        void *index = gc_alloc(size * dict_index_width(size));
+        unsigned long *hashes = gc_alloc(sizeof (unsigned long [capacity]));
+        struct value *keys = gc_alloc(sizeof (struct value [capacity]));
+        struct value *values = with_values ? gc_alloc(sizeof (struct value [capacity])) : NULL;
+
+        memset(ctrl, CTRL_EMPTY, size);
+
+        d->ctrl = ctrl;
+        d->index = index;
+        d->hashes = hashes;
+        d->keys = keys;
+        d->values = values;
+        d->size = size;
+        d->capacity = capacity;
+        d->used = 0;
+}
+
+/* A dict with room for n entries before it has to grow */
 struct dict *
-dict_new(void)
+dict_new_sized(size_t n)
 {
+        size_t size = INITIAL_SIZE;
+
+        while (MAX_ENTRIES(size) < n) {
+                size <<= 1;
+        }
+
         struct dict *d = gc_alloc_object(sizeof *d, GC_DICT);
         NOGC(d);
 
-        d->size = INITIAL_SIZE;
-        d->hashes = gc_alloc(sizeof (unsigned long [INITIAL_SIZE]));
-        d->keys = gc_alloc(sizeof (struct value [INITIAL_SIZE]));
-        d->values = gc_alloc(sizeof (struct value [INITIAL_SIZE]));
+        alloc_table(d, size, umax(n, INITIAL_ENTRIES), false);
         d->count = 0;
         d->dflt = NONE;
-        memset(d->keys, 0, sizeof (struct value [INITIAL_SIZE]));
 
         OKGC(d);
 
         return d;
 }
 
-inline static size_t
-find_spot(size_t size, unsigned long const *hs, struct value const *vs, unsigned long h, struct value const *v)
+struct dict *
+dict_new(void)
 {
-        size_t mask = size - 1;
-        size_t i = h & mask;
+        return dict_new_sized(0);
+}
 
-        while (vs[i].type != 0 && (hs[i] != h || !value_test_equality(&vs[i], v)))
-                i = (i + 1) & mask;
+/* Gives d a values array, with nil for every entry it already has */
+static void
+add_values(struct dict *d)
+{
+        if (d->values != NULL) {
+                return;
+        }
+
+        struct value *values = gc_alloc(sizeof (struct value [d->capacity]));
+
+        for (size_t i = 0; i < d->used; ++i) {
+                values[i] = NIL;
+        }
 
-        return i;
+        d->values = values;
 }
 
+/*
+ * Returns the slot that points to v if there is one, or else the first slot it
+ * could be put in.
+ */
 inline static size_t
-delete(struct dict *d, size_t i)
+find_spot(struct dict const *d, unsigned long h, struct value const *v)
 {
-        size_t mask = d->size - 1;
-        unsigned long h = d->hashes[i] & mask;
+        size_t mask = d->size / GROUP - 1;
+        size_t g = H1(h) & mask;
+        size_t spot = SIZE_MAX;
+
+        for (size_t step = 1; ; ++step) {
+                unsigned char const *ctrl = d->ctrl + g * GROUP;
+
+                for (unsigned m = match(ctrl, H2(h)); m != 0; m &= m - 1) {
+                        size_t i = g * GROUP + __builtin_ctz(m);
+                        size_t e = entry(d, i);
+                        if (d->hashes[e] == h && value_test_equality(&d->keys[e], v)) {
+                                return i;
+                        }
+                }
 
-        size_t j = i;
-        while ((d->hashes[(j + 1) & mask] & mask) == h && d->keys[(j + 1) & mask].type != 0)
-                j = (j + 1) & mask;
+                unsigned available = match_available(ctrl);
+
+                if (spot == SIZE_MAX && available != 0) {
+                        spot = g * GROUP + __builtin_ctz(available);
+                }
 
-        if (i != j) {
-                d->keys[i] = d->keys[j];
-                d->values[i] = d->values[j];
-                d->hashes[i] = d->hashes[j];
+                if (match(ctrl, CTRL_EMPTY) != 0) {
+                        return spot;
+                }
+
+                g = (g + step) & mask;
         }
+}
 
-        d->hashes[j] = d->keys[j].type = d->values[j].type = 0;
-        d->count -= 1;
+/* Where a key that's known not to be in the table yet goes */
+inline static size_t
+find_empty(struct dict const *d, unsigned long h)
+{
+        size_t mask = d->size / GROUP - 1;
+        size_t g = H1(h) & mask;
 
-        return min(i, j);
+        for (size_t step = 1; ; ++step) {
+                unsigned available = match_available(d->ctrl + g * GROUP);
+                if (available != 0) {
+                        return g * GROUP + __builtin_ctz(available);
+                }
+                g = (g + step) & mask;
+        }
 }
 
+/* The slot that points to entry e, without comparing any keys */
+inline static size_t
+slot_of(struct dict const *d, size_t e)
+{
+        unsigned long h = d->hashes[e];
+        size_t mask = d->size / GROUP - 1;
+        size_t g = H1(h) & mask;
+
+        for (size_t step = 1; ; ++step) {
+                unsigned char const *ctrl = d->ctrl + g * GROUP;
+                for (unsigned m = match(ctrl, H2(h)); m != 0; m &= m - 1) {
+                        size_t i = g * GROUP + __builtin_ctz(m);
+                        if (entry(d, i) == e) {
+                                return i;
+                        }
+                }
+                g = (g + step) & mask;
+        }
+}
 
+/*
+ * A deleted slot can only be made empty again if its group already has an empty
+ * slot. Otherwise a key that was put in a later group when this one was full
+ * would no longer be found.
+ */
 inline static void
-grow(struct dict *d)
+delete(struct dict *d, size_t i)
+{
+        size_t e = entry(d, i);
+
+        if (match(d->ctrl + i / GROUP * GROUP, CTRL_EMPTY) != 0) {
+                d->ctrl[i] = CTRL_EMPTY;
+        } else {
+                d->ctrl[i] = CTRL_DELETED;
+        }
+
+        d->hashes[e] = 0;
+        d->keys[e].type = 0;
+        if (d->values != NULL) {
+                d->values[e].type = 0;
+        }
+        d->count -= 1;
+}
+
+/*
+ * Rebuilds the index and squeezes the holes out of the entries, keeping them in
+ * order. The index doubles in size unless the entries are mostly holes, in
+ * which case getting rid of those is enough.
+ */
+static void
+rebuild(struct dict *d)
 {
-        size_t new_size = d->size << 1;
+        size_t used = d->used;
+        unsigned char *ctrl = d->ctrl;
+        void *index = d->index;
+        unsigned long *hashes = d->hashes;
+        struct value *keys = d->keys;
+        struct value *values = d->values;
 
-        unsigned long *hashes = gc_alloc(sizeof (unsigned long [new_size]));
-        struct value *keys = gc_alloc(sizeof (struct value [new_size]));
-        struct value *values = gc_alloc(sizeof (struct value [new_size]));
+        size_t size = (d->count >= MAX_ENTRIES(d->size) / 2) ? d->size << 1 : d->size;
 
-        memset(keys, 0, sizeof (struct value [new_size]));
+        alloc_table(d, size, umin(umax(d->count + d->count / 2, INITIAL_ENTRIES), MAX_ENTRIES(size)), values != NULL);
 
-        for (size_t i = 0; i < d->size; ++i) {
-                if (d->keys[i].type == 0)
+        for (size_t e = 0; e < used; ++e) {
+                if (keys[e].type == 0) {
                         continue;
-                size_t j = find_spot(new_size, hashes, keys, d->hashes[i], &d->keys[i]);
-                hashes[j] = d->hashes[i];
-                keys[j] = d->keys[i];
-                values[j] = d->values[i];
+                }
+                size_t i = find_empty(d, hashes[e]);
+                size_t j = d->used++;
+                d->ctrl[i] = H2(hashes[e]);
+                set_entry(d, i, j);
+                d->hashes[j] = hashes[e];
+                d->keys[j] = keys[e];
+                if (values != NULL) {
+                        d->values[j] = values[e];
+                }
         }
 
-        gc_free(d->hashes);
-        gc_free(d->keys);
-        gc_free(d->values);
+        gc_free(ctrl);
+        gc_free(index);
+        gc_free(hashes);
+        gc_free(keys);
+        gc_free(values);
+}
 
-        d->hashes = hashes;
-        d->keys = keys;
-        d->values = values;
+/*
+ * Each array is resized before the next one can run a collection, and none of
+ * them lose any of the entries before d->used.
+ */
+static void
+grow_entries(struct dict *d)
+{
+        size_t capacity = umin(d->capacity + d->capacity / 2, MAX_ENTRIES(d->size));
+
+        resize(d->hashes, sizeof (unsigned long [capacity]));
+        resize(d->keys, sizeof (struct value [capacity]));
+        if (d->values != NULL) {
+                resize(d->values, sizeof (struct value [capacity]));
+        }
 
-        d->size = new_size;
+        d->capacity = capacity;
 }
 
+/*
+ * Adds an entry for k, which isn't in d yet, at slot i, which find_spot() returned
+ * for it. Returns a pointer to its value, or NULL if d doesn't have any values.
+ */
 inline static struct value *
 put(struct dict *d, size_t i, unsigned long h, struct value k, struct value v)
 {
-        if (9*d->count >= 4*d->size) {
-                grow(d);
-                i = find_spot(d->size, d->hashes, d->keys, h, &k);
+        if (d->values == NULL && v.type != VALUE_NIL) {
+                add_values(d);
         }
 
-        d->hashes[i] = h;
-        d->keys[i] = k;
-        d->values[i] = v;
+        if (d->used == d->capacity) {
+                if (d->used < MAX_ENTRIES(d->size) && d->count > d->used / 2) {
+                        grow_entries(d);
+                } else {
+                        rebuild(d);
+                        i = find_empty(d, h);
+                }
+        }
+
+        size_t e = d->used++;
+
+        d->ctrl[i] = H2(h);
+        set_entry(d, i, e);
+        d->hashes[e] = h;
+        d->keys[e] = k;
+        if (d->values != NULL) {
+                d->values[e] = v;
+        }
         d->count += 1;
 
-        return &d->values[i];
+        gc_barrier(d);
+
+        return (d->values != NULL) ? &d->values[e] : NULL;
+}
+
+/* Like put(), for when code that could have changed d ran after find_spot() */
+static struct value *
+put_again(struct dict *d, unsigned long h, struct value k, struct value v)
+{
+        size_t i = find_spot(d, h, &k);
+
+        if (FULL(d, i)) {
+                if (d->values == NULL && v.type == VALUE_NIL) {
+                        return NULL;
+                }
+                add_values(d);
+                struct value *slot = &d->values[entry(d, i)];
+                *slot = v;
+                gc_barrier(d);
+                return slot;
+        }
+
+        return put(d, i, h, k, v);
+}
+
+/* Puts k -> v whether k is there or not, with k's hash already known */
+inline static void
+insert(struct dict *d, unsigned long h, struct value k, struct value v)
+{
+        size_t i = find_spot(d, h, &k);
+
+        if (!FULL(d, i)) {
+                put(d, i, h, k, v);
+        } else if (d->values != NULL || v.type != VALUE_NIL) {
+                add_values(d);
+                d->values[entry(d, i)] = v;
+                gc_barrier(d);
+        }
 }
 
+/*
+ * What dict_get_value() points to for a key in a dict without values, so that
+ * looking something up doesn't allocate. Callers only read through it.
+ */
+static _Thread_local struct value Nil;
+
 struct value *
 dict_get_value(struct dict *d, struct value *key)
 {
         unsigned long h = value_hash(key);
-        size_t i = find_spot(d->size, d->hashes, d->keys, h, key);
+        size_t i = find_spot(d, h, key);
 
-        if (d->keys[i].type != 0)
-                return &d->values[i];
+        if (FULL(d, i)) {
+                if (d->values == NULL) {
+                        Nil = NIL;
+                        return &Nil;
+                }
+                return &d->values[entry(d, i)];
+        }
 
         if (d->dflt.type != VALUE_NONE) {
                 struct value dflt = value_apply_callable(&d->dflt, key);
                 ++GC_OFF_COUNT;
-                struct value *v = put(d, i, h, *key, dflt);
+                struct value *v = put_again(d, h, *key, dflt);
                 --GC_OFF_COUNT;
                 return v;
         }
@@ -139,34 +440,41 @@ bool
 dict_has_value(struct dict *d, struct value *key)
 {
         unsigned long h = value_hash(key);
-        size_t i = find_spot(d->size, d->hashes, d->keys, h, key);
+        size_t i = find_spot(d, h, key);
 
-        if (d->keys[i].type != 0)
-                return true;
-
-        return false;
+        return FULL(d, i);
 }
 
 void
 dict_put_value(struct dict *d, struct value key, struct value value)
+{
+        insert(d, value_hash(&key), key, value);
+}
+
+bool
+dict_add(struct dict *d, struct value key)
 {
         unsigned long h = value_hash(&key);
-        size_t i = find_spot(d->size, d->hashes, d->keys, h, &key);
+        size_t i = find_spot(d, h, &key);
 
-        if (d->keys[i].type != 0)
-                d->values[i] = value;
-        else
-                put(d, i, h, key, value);
+        if (FULL(d, i)) {
+                return false;
+        }
+
+        put(d, i, h, key, NIL);
+
+        return true;
 }
 
 struct value *
 dict_put_value_with(struct dict *d, struct value key, struct value v, struct value const *f)
 {
         unsigned long h = value_hash(&key);
-        size_t i = find_spot(d->size, d->hashes, d->keys, h, &key);
+        size_t i = find_spot(d, h, &key);
 
-        if (d->keys[i].type != 0) {
-                return put(d, i, h, key, vm_eval_function(f, &d->values[i], &v, NULL));
+        if (FULL(d, i)) {
+                struct value old = dict_value(d, entry(d, i));
+                return put_again(d, h, key, vm_eval_function(f, &old, &v, NULL));
         } else {
                 return put(d, i, h, key, v);
         }
@@ -175,13 +483,15 @@ dict_put_value_with(struct dict *d, struct value key, struct value v, struct val
 struct value *
 dict_put_key_if_not_exists(struct dict *d, struct value key)
 {
+        add_values(d);
+
         unsigned long h = value_hash(&key);
-        size_t i = find_spot(d->size, d->hashes, d->keys, h, &key);
+        size_t i = find_spot(d, h, &key);
 
-        if (d->keys[i].type != 0) {
-                return &d->values[i];
+        if (FULL(d, i)) {
+                return &d->values[entry(d, i)];
         } else if (d->dflt.type != VALUE_NONE) {
-                return put(d, i, h, key, value_apply_callable(&d->dflt, &key));
+                return put_again(d, h, key, value_apply_callable(&d->dflt, &key));
         } else {
                 return put(d, i, h, key, NIL);
         }
@@ -217,17 +527,14 @@ dict_mark(struct dict *d)
         if (d->dflt.type != VALUE_NONE)
                 value_mark(&d->dflt);
 
-        for (size_t i = 0; i < d->size; ++i) {
-                if (d->keys[i].type != 0) {
-                        value_mark(&d->keys[i]);
-                        value_mark(&d->values[i]);
-                }
-        }
+        GCMarkDict(d);
 }
 
 void
 dict_free(struct dict *d)
 {
+        gc_free(d->ctrl);
+        gc_free(d->index);
         gc_free(d->hashes);
         gc_free(d->keys);
         gc_free(d->values);
@@ -263,9 +570,9 @@ dict_contains(struct value *d, int argc, struct value *kwargs)
 
         struct value *key = &ARG(0);
         unsigned long h = value_hash(key);
-        size_t i = find_spot(d->dict->size, d->dict->hashes, d->dict->keys, h, key);
+        size_t i = find_spot(d->dict, h, key);
 
-        return BOOLEAN(d->dict->keys[i].type != 0);
+        return BOOLEAN(FULL(d->dict, i));
 }
 
 static struct value
@@ -278,7 +585,7 @@ dict_keys(struct value *d, int argc, struct value *kwargs)
 
         gc_push(&keys);
 
-        for (size_t i = 0; i < d->dict->size; ++i)
+        for (size_t i = 0; i < d->dict->used; ++i)
                 if (d->dict->keys[i].type != 0)
                         value_array_push(keys.array, d->dict->keys[i]);
 
@@ -297,28 +604,85 @@ dict_values(struct value *d, int argc, struct value *kwargs)
 
         gc_push(&values);
 
-        for (size_t i = 0; i < d->dict->size; ++i)
+        for (size_t i = 0; i < d->dict->used; ++i)
                 if (d->dict->keys[i].type != 0)
-                        value_array_push(values.array, d->dict->values[i]);
+                        value_array_push(values.array, dict_value(d->dict, i));
 
         gc_pop();
 
         return values;
 }
 
+/*
+ * Sets in[i] for each of d's entries (up to used) whose key is also in u, and
+ * returns how many there are. *live gets how many entries d has in all.
+ */
+static size_t
+membership(struct dict const *d, size_t used, struct dict const *u, unsigned char *in, size_t *live)
+{
+        size_t n = 0;
+
+        *live = 0;
+
+        for (size_t i = 0; i < used; ++i) {
+                in[i] = 0;
+                if (d->keys[i].type == 0) {
+                        continue;
+                }
+                *live += 1;
+                if (FULL(u, find_spot(u, d->hashes[i], &d->keys[i]))) {
+                        in[i] = 1;
+                        n += 1;
+                }
+        }
+
+        return n;
+}
+
+/*
+ * Adds d's entries before used for which in[i] == want (all of them, if in is
+ * NULL) to r, which has room for them and none of their keys. This doesn't
+ * compare any keys or allocate anything.
+ */
+static void
+copy_entries(struct dict *r, struct dict const *d, size_t used, unsigned char const *in, unsigned char want)
+{
+        for (size_t i = 0; i < used; ++i) {
+                if (d->keys[i].type == 0 || (in != NULL && in[i] != want)) {
+                        continue;
+                }
+
+                size_t j = find_empty(r, d->hashes[i]);
+                size_t e = r->used++;
+
+                r->ctrl[j] = H2(d->hashes[i]);
+                set_entry(r, j, e);
+                r->hashes[e] = d->hashes[i];
+                r->keys[e] = d->keys[i];
+                if (r->values != NULL) {
+                        r->values[e] = dict_value(d, i);
+                }
+                r->count += 1;
+        }
+
+        gc_barrier(r);
+}
+
 struct value
 dict_clone(struct value *d, int argc, struct value *kwargs)
 {
         if (argc != 0)
                 vm_panic("dict.clone() expects 0 arguments but got %d", argc);
 
-        struct dict *new = dict_new();
+        struct dict *new = dict_new_sized(d->dict->count);
         new->dflt = d->dict->dflt;
         NOGC(new);
 
-        for (size_t i = 0; i < d->dict->size; ++i)
-                if (d->dict->keys[i].type != 0)
-                        dict_put_value(new, d->dict->keys[i], d->dict->values[i]);
+        if (d->dict->values != NULL) {
+                add_values(new);
+        }
+
+        copy_entries(new, d->dict, d->dict->used, NULL, 1);
 
         OKGC(new);
         return DICT(new);
@@ -330,55 +694,123 @@ dict_same_keys(struct dict const *d, struct dict const *u)
         if (d->count != u->count)
                 return false;
 
-        for (size_t i = 0; i < d->size;) {
+        for (size_t i = 0; i < d->used; ++i) {
                 if (d->keys[i].type == 0) {
-                        i += 1;
                         continue;
                 }
-                size_t j = find_spot(
-                        u->size,
-                        u->hashes,
-                        u->keys,
-                        d->hashes[i],
-                        &d->keys[i]
-                );
-                if (u->keys[j].type == 0) {
+                size_t j = find_spot(u, d->hashes[i], &d->keys[i]);
+                if (!FULL(u, j)) {
                         return false;
                 }
-                i += 1;
         }
 
         return true;
 }
 
-inline static void
-copy_unique(struct dict *diff, struct dict const *d, struct dict const *u)
+/*
+ * d and u need to be reachable from somewhere else. The result is sized for
+ * exactly the entries that go in it, which are found before it's allocated.
+ */
+struct dict *
+dict_union(struct dict *d, struct dict *u)
 {
-        for (size_t i = 0; i < d->size; ++i) {
-                if (d->keys[i].type == 0) {
-                        continue;
+        size_t used = u->used;
+        size_t live;
+        unsigned char *in = gc_alloc(umax(used, 1));
+        size_t both = membership(u, used, d, in, &live);
+
+        struct dict *r = dict_new_sized(d->count + live - both);
+        NOGC(r);
+
+        r->dflt = d->dflt;
+        if (d->values != NULL || u->values != NULL) {
+                add_values(r);
+        }
+
+        copy_entries(r, d, d->used, NULL, 1);
+        copy_entries(r, u, used, in, 0);
+
+        /* Like update(), the values from u win */
+        if (r->values != NULL && both != 0) {
+                for (size_t i = 0; i < used; ++i) {
+                        if (in[i] && u->keys[i].type != 0) {
+                                size_t j = find_spot(r, u->hashes[i], &u->keys[i]);
+                                if (FULL(r, j)) {
+                                        r->values[entry(r, j)] = dict_value(u, i);
+                                }
+                        }
                 }
+                gc_barrier(r);
+        }
+
+        gc_free(in);
+        OKGC(r);
+
+        return r;
+}
+
+struct dict *
+dict_difference(struct dict *d, struct dict *u)
+{
+        size_t used = d->used;
+        size_t live;
+        unsigned char *in = gc_alloc(umax(used, 1));
+        size_t both = membership(d, used, u, in, &live);
+
+        struct dict *r = dict_new_sized(live - both);
+        NOGC(r);
 
-                size_t j = find_spot(
-                        u->size,
-                        u->hashes,
-                        u->keys,
-                        d->hashes[i],
-                        &d->keys[i]
-                );
-
-                if (u->keys[j].type == 0) {
-                        size_t k = find_spot(
-                                diff->size,
-                                diff->hashes,
-                                diff->keys,
-                                d->hashes[i],
-                                &d->keys[i]
-                        );
-
-                        put(diff, k, d->hashes[i], d->keys[i], d->values[i]);
+        r->dflt = d->dflt;
+        if (d->values != NULL) {
+                add_values(r);
+        }
+
+        copy_entries(r, d, used, in, 0);
+
+        gc_free(in);
+        OKGC(r);
+
+        return r;
+}
+
+struct dict *
+dict_intersection(struct dict *d, struct dict *u)
+{
+        size_t used = d->used;
+        size_t live;
+        unsigned char *in = gc_alloc(umax(used, 1));
+        size_t both = membership(d, used, u, in, &live);
+
+        struct dict *r = dict_new_sized(both);
+        NOGC(r);
+
+        r->dflt = d->dflt;
+        if (d->values != NULL) {
+                add_values(r);
+        }
+
+        copy_entries(r, d, used, in, 1);
+
+        gc_free(in);
+        OKGC(r);
+
+        return r;
+}
+
+bool
+dict_subset(struct dict const *d, struct dict const *u)
+{
+        if (d->count > u->count) {
+                return false;
+        }
+
+        for (size_t i = 0; i < d->used; ++i) {
+                if (d->keys[i].type != 0 && !FULL(u, find_spot(u, d->hashes[i], &d->keys[i]))) {
+                        return false;
                 }
         }
+
+        return true;
 }
 
 struct value
@@ -393,13 +825,27 @@ dict_diff(struct value *d, int argc, struct value *kwargs)
                 vm_panic("Dict.diff(): expected Dict but got %s", value_show(&u));
         }
 
-        struct dict *diff = dict_new();
+        size_t d_used = d->dict->used;
+        size_t u_used = u.dict->used;
+        size_t d_live;
+        size_t u_live;
+        unsigned char *d_in = gc_alloc(umax(d_used, 1));
+        unsigned char *u_in = gc_alloc(umax(u_used, 1));
+        size_t d_both = membership(d->dict, d_used, u.dict, d_in, &d_live);
+        size_t u_both = membership(u.dict, u_used, d->dict, u_in, &u_live);
 
+        struct dict *diff = dict_new_sized((d_live - d_both) + (u_live - u_both));
         NOGC(diff);
 
-        copy_unique(diff, d->dict, u.dict);
-        copy_unique(diff, u.dict, d->dict);
+        if (d->dict->values != NULL || u.dict->values != NULL) {
+                add_values(diff);
+        }
+
+        copy_entries(diff, d->dict, d_used, d_in, 0);
+        copy_entries(diff, u.dict, u_used, u_in, 0);
 
+        gc_free(d_in);
+        gc_free(u_in);
         OKGC(diff);
 
         return DICT(diff);
@@ -417,22 +863,13 @@ dict_intersect(struct value *d, int argc, struct value *kwargs)
                 vm_panic("the first argument to dict.intersect() must be a dict");
 
         if (argc == 1) {
-                for (size_t i = 0; i < d->dict->size;) {
+                for (size_t i = 0; i < d->dict->used; ++i) {
                         if (d->dict->keys[i].type == 0) {
-                                i += 1;
                                 continue;
                         }
-                        size_t j = find_spot(
-                                u.dict->size,
-                                u.dict->hashes,
-                                u.dict->keys,
-                                d->dict->hashes[i],
-                                &d->dict->keys[i]
-                        );
-                        if (u.dict->keys[j].type == 0) {
-                                i = delete(d->dict, i);
-                        } else {
-                                i += 1;
+                        size_t j = find_spot(u.dict, d->dict->hashes[i], &d->dict->keys[i]);
+                        if (!FULL(u.dict, j)) {
+                                delete(d->dict, slot_of(d->dict, i));
                         }
                 }
         } else {
@@ -440,28 +877,23 @@ dict_intersect(struct value *d, int argc, struct value *kwargs)
                 if (!CALLABLE(f)) {
                         vm_panic("the second argument to dict.intersect() must be callable");
                 }
-                for (size_t i = 0; i < d->dict->size;) {
+                for (size_t i = 0; i < d->dict->used; ++i) {
                         if (d->dict->keys[i].type == 0) {
-                                i += 1;
                                 continue;
                         }
-                        size_t j = find_spot(
-                                u.dict->size,
-                                u.dict->hashes,
-                                u.dict->keys,
-                                d->dict->hashes[i],
-                                &d->dict->keys[i]
-                        );
-                        if (u.dict->keys[j].type == 0) {
-                                i = delete(d->dict, i);
+                        size_t j = find_spot(u.dict, d->dict->hashes[i], &d->dict->keys[i]);
+                        if (!FULL(u.dict, j)) {
+                                delete(d->dict, slot_of(d->dict, i));
                         } else {
+                                struct value v = dict_value(u.dict, entry(u.dict, j));
+                                add_values(d->dict);
                                 d->dict->values[i] = vm_eval_function(
                                         &f,
                                         &d->dict->values[i],
-                                        &u.dict->values[j],
+                                        &v,
                                         NULL
                                 );
-                                i += 1;
+                                gc_barrier(d->dict);
                         }
                 }
 
@@ -473,6 +905,10 @@ dict_intersect(struct value *d, int argc, struct value *kwargs)
 struct value
 dict_intersect_copy(struct value *d, int argc, struct value *kwargs)
 {
+        if (argc == 1 && ARG(0).type == VALUE_DICT) {
+                return DICT(dict_intersection(d->dict, ARG(0).dict));
+        }
+
         struct value copy = dict_clone(d, 0, NULL);
         return dict_intersect(&copy, argc, kwargs);
 }
@@ -489,9 +925,9 @@ dict_update(struct value *d, int argc, struct value *kwargs)
                 vm_panic("the first argument to dict.update() must be a dict");
 
         if (argc == 1) {
-                for (size_t i = 0; i < u.dict->size; ++i) {
+                for (size_t i = 0; i < u.dict->used; ++i) {
                         if (u.dict->keys[i].type != 0) {
-                                dict_put_value(d->dict, u.dict->keys[i], u.dict->values[i]);
+                                insert(d->dict, u.dict->hashes[i], u.dict->keys[i], dict_value(u.dict, i));
                         }
                 }
         } else {
@@ -499,12 +935,12 @@ dict_update(struct value *d, int argc, struct value *kwargs)
                 if (!CALLABLE(f)) {
                         vm_panic("the second argument to dict.update() must be callable");
                 }
-                for (size_t i = 0; i < u.dict->size; ++i) {
+                for (size_t i = 0; i < u.dict->used; ++i) {
                         if (u.dict->keys[i].type != 0) {
                                 dict_put_value_with(
                                         d->dict,
                                         u.dict->keys[i],
-                                        u.dict->values[i],
+                                        dict_value(u.dict, i),
                                         &f
                                 );
                         }
@@ -527,16 +963,10 @@ dict_subtract(struct value *d, int argc, struct value *kwargs)
                 vm_panic("the first argument to dict.subtract() must be a dict");
 
         if (argc == 1) {
-                for (size_t i = 0; i < u.dict->size; ++i) {
+                for (size_t i = 0; i < u.dict->used; ++i) {
                         if (u.dict->keys[i].type != 0) {
-                                size_t j = find_spot(
-                                        d->dict->size,
-                                        d->dict->hashes,
-                                        d->dict->keys,
-                                        u.dict->hashes[i],
-                                        &u.dict->keys[i]
-                                );
-                                if (d->dict->keys[j].type != 0) {
+                                size_t j = find_spot(d->dict, u.dict->hashes[i], &u.dict->keys[i]);
+                                if (FULL(d->dict, j)) {
                                         delete(d->dict, j);
                                 }
                         }
@@ -546,23 +976,18 @@ dict_subtract(struct value *d, int argc, struct value *kwargs)
                 if (!CALLABLE(f)) {
                         vm_panic("the second argument to dict.subtract() must be callable");
                 }
-                for (size_t i = 0; i < u.dict->size; ++i) {
+                for (size_t i = 0; i < u.dict->used; ++i) {
                         if (u.dict->keys[i].type != 0) {
-                                size_t j = find_spot(
-                                        d->dict->size,
-                                        d->dict->hashes,
-                                        d->dict->keys,
-                                        u.dict->hashes[i],
-                                        &u.dict->keys[i]
-                                );
-                                if (d->dict->keys[j].type != 0) {
-                                        vm_eval_function(
-                                                &f,
-                                                &d->dict->values[i],
-                                                &u.dict->values[j],
-                                                NULL
-                                        );
-                                        delete(d->dict, j);
+                                size_t j = find_spot(d->dict, u.dict->hashes[i], &u.dict->keys[i]);
+                                if (FULL(d->dict, j)) {
+                                        struct value a = dict_value(d->dict, entry(d->dict, j));
+                                        struct value b = dict_value(u.dict, i);
+                                        vm_eval_function(&f, &a, &b, NULL);
+                                        /* f could have changed d */
+                                        j = find_spot(d->dict, u.dict->hashes[i], &u.dict->keys[i]);
+                                        if (FULL(d->dict, j)) {
+                                                delete(d->dict, j);
+                                        }
                                 }
                         }
                 }
@@ -594,23 +1019,50 @@ dict_remove(struct value *d, int argc, struct value *kwargs)
         struct value k = ARG(0);
         unsigned long h = value_hash(&k);
 
-        size_t i = find_spot(
-                d->dict->size,
-                d->dict->hashes,
-                d->dict->keys,
-                h,
-                &k
-        );
+        size_t i = find_spot(d->dict, h, &k);
 
-        if (d->dict->keys[i].type == 0) {
+        if (!FULL(d->dict, i)) {
                 return NIL;
         } else {
-                struct value v = d->dict->values[i];
+                struct value v = dict_value(d->dict, entry(d->dict, i));
                 delete(d->dict, i);
                 return v;
         }
 }
 
+static struct value
+dict_put_new(struct value *d, int argc, struct value *kwargs)
+{
+        if (argc != 1)
+                vm_panic("dict.add?() expects 1 argument but got %d", argc);
+
+        return BOOLEAN(dict_add(d->dict, ARG(0)));
+}
+
+static struct value
+dict_subset_of(struct value *d, int argc, struct value *kwargs)
+{
+        if (argc != 1)
+                vm_panic("dict.subset?() expects 1 argument but got %d", argc);
+
+        if (ARG(0).type != VALUE_DICT)
+                vm_panic("the argument to dict.subset?() must be a dict");
+
+        return BOOLEAN(dict_subset(d->dict, ARG(0).dict));
+}
+
+static struct value
+dict_superset_of(struct value *d, int argc, struct value *kwargs)
+{
+        if (argc != 1)
+                vm_panic("dict.superset?() expects 1 argument but got %d", argc);
+
+        if (ARG(0).type != VALUE_DICT)
+                vm_panic("the argument to dict.superset?() must be a dict");
+
+        return BOOLEAN(dict_subset(ARG(0).dict, d->dict));
+}
+
 static struct value
 dict_len(struct value *d, int argc, struct value *kwargs)
 {
@@ -625,6 +1077,7 @@ DEFINE_METHOD_TABLE(
         { .name = "&=",           .func = dict_intersect      },
         { .name = "<<",           .func = dict_put            },
         { .name = "?",            .func = dict_contains       },
+        { .name = "add?",         .func = dict_put_new        },
         { .name = "clone",        .func = dict_clone          },
         { .name = "contains?",    .func = dict_contains       },
         { .name = "default",      .func = dict_default        },
@@ -635,6 +1088,8 @@ DEFINE_METHOD_TABLE(
         { .name = "len",          .func = dict_len            },
         { .name = "put",          .func = dict_put            },
         { .name = "remove",       .func = dict_remove         },
+        { .name = "subset?",      .func = dict_subset_of      },
+        { .name = "superset?",    .func = dict_superset_of    },
         { .name = "update",       .func = dict_update         },
         { .name = "values",       .func = dict_values         },
         { .name = "~=",           .func = dict_remove         },
@@ -60,6 +60,9 @@ store(ffi_type *t, void *p, struct value const *v)
                 case VALUE_BLOB:
                         *(void **)p = (void *)v->blob->items;
                         break;
+                case VALUE_TYPED_ARRAY:
+                        *(void **)p = v->typed->items;
+                        break;
                 }
                 break;
         case FFI_TYPE_STRUCT:
@@ -406,7 +409,7 @@ cffi_load(int argc, struct value *kwargs)
         }
 
 		if (argc == 1) {
-			ffi_type *t = (ARG(0).extra == NULL) ? &ffi_type_uint8 : ARG(0).extra;
+			ffi_type *t = (ARG(0).extra == 0) ? &ffi_type_uint8 : value_extra(ARG(0).extra);
 			return load(t, ARG(0).ptr);
 		}
 
@@ -708,15 +711,20 @@ cffi_closure(int argc, struct value *kwargs)
                 vm_panic("ffi.closure(): ffi_closure_alloc() failed");
         }
 
-        struct value *data = gc_alloc_object(sizeof *data, GC_VALUE);
-        *data = f;
-
         void **pointers = gc_alloc(sizeof (void *[2]));
         pointers[0] = closure;
         pointers[1] = cif.ptr;
 
+        /*
+         * data[1] just carries the pointers that ffi.freeClosure() needs. Only
+         * data[0] is marked, which is fine since they aren't GC-managed.
+         */
+        struct value *data = gc_alloc_object(sizeof (struct value[2]), GC_VALUE);
+        data[0] = f;
+        data[1] = PTR(pointers);
+
         if (ffi_prep_closure_loc(closure, cif.ptr, closure_func, data, code) == FFI_OK) {
-                return EPTR(code, data, pointers);
+                return GCPTR(code, data);
         } else {
                 gc_free(data);
                 ffi_closure_free(closure);
@@ -733,7 +741,7 @@ cffi_closure_free(int argc, struct value *kwargs)
 
         struct value p = ARG(0);
 
-        void **pointers = p.extra;
+        void **pointers = ((struct value *)p.gcptr)[1].ptr;
 
         ffi_closure_free(pointers[0]);
         gc_free(pointers[1]);
@@ -546,6 +546,7 @@ Coerce:
         case VALUE_ARRAY:   v.integer = a.array->count;                   return v;
         case VALUE_DICT:    v.integer = a.dict->count;                    return v;
         case VALUE_BLOB:    v.integer = a.blob->count;                    return v;
+        case VALUE_TYPED_ARRAY: v.integer = a.typed->count;               return v;
         case VALUE_PTR:     return INTEGER((uintptr_t)a.ptr);
         case VALUE_STRING:
                 base = 0;
@@ -877,7 +878,7 @@ builtin_tuple(int argc, struct value *kwargs)
         vec(char) names = {0};
         struct dict *d = (kwargs != NULL) ? kwargs->dict : NULL;
 
-        if (d != NULL) for (int i = 0; i < d->size; ++i) {
+        if (d != NULL) for (int i = 0; i < d->used; ++i) {
                 if (d->keys[i].type != 0) {
                         named += 1;
                         vec_push_n(names, d->keys[i].string, d->keys[i].bytes);
@@ -904,9 +905,9 @@ builtin_tuple(int argc, struct value *kwargs)
 
         char *name = names.items;
 
-        if (d != NULL) for (int i = 0, n = argc; i < d->size; ++i) {
+        if (d != NULL) for (int i = 0, n = argc; i < d->used; ++i) {
                 if (d->keys[i].type != 0) {
-                        tuple.items[n] = d->values[i];
+                        tuple.items[n] = dict_value(d, i);
                         tuple.names[n] = name;
                         name += strlen(name) + 1;
                         n += 1;
@@ -2437,6 +2438,7 @@ builtin_thread_channel(int argc, struct value *kwargs)
         Channel *c = gc_alloc_object(sizeof *c, GC_ANY);
 
         c->open = true;
+        c->head = 0;
         vec_init(c->q);
         pthread_cond_init(&c->c, NULL);
         pthread_mutex_init(&c->m, NULL);
@@ -2485,7 +2487,7 @@ builtin_thread_recv(int argc, struct value *kwargs)
         pthread_mutex_lock(&chan->m);
 
         if (argc == 1) {
-                while (chan->open && chan->q.count == 0) {
+                while (chan->open && chan->q.count == chan->head) {
                         pthread_cond_wait(&chan->c, &chan->m);
                 }
         } else {
@@ -2497,7 +2499,7 @@ builtin_thread_recv(int argc, struct value *kwargs)
                 }
                 ts.tv_sec += (t.integer / 1000);
                 ts.tv_nsec += 1000 * (t.integer % 1000);
-                while (chan->open && chan->q.count == 0) {
+                while (chan->open && chan->q.count == chan->head) {
                         if (pthread_cond_timedwait(&chan->c, &chan->m, &ts) == ETIMEDOUT) {
                                 break;
                         }
@@ -2506,20 +2508,38 @@ builtin_thread_recv(int argc, struct value *kwargs)
 
         TakeLock();
 
-        if (chan->q.count == 0) {
+        if (chan->q.count == chan->head) {
                 pthread_mutex_unlock(&chan->m);
                 return None;
         }
 
-        ChanVal v = chan->q.items[0];
+        ChanVal v = chan->q.items[chan->head++];
 
-        vec_pop_ith(chan->q, 0);
+        /*
+         * Messages are taken from the front, and what's left is only moved back
+         * down once it's no more than what's been taken, so that a long queue
+         * doesn't cost O(queue) per message.
+         */
+        if (chan->head == chan->q.count) {
+                chan->head = 0;
+                chan->q.count = 0;
+        } else if (chan->head >= chan->q.count - chan->head) {
+                memmove(chan->q.items, chan->q.items + chan->head, (chan->q.count - chan->head) * sizeof *chan->q.items);
+                chan->q.count -= chan->head;
+                chan->head = 0;
+        }
 
         pthread_mutex_unlock(&chan->m);
 
         GCTakeOwnership((AllocList *)&v.as);
+        free(v.as.items);
 
-        return Some(v.v);
+        /* Some() can allocate, and nothing else refers to v.v yet */
+        gc_push(&v.v);
+        struct value some = Some(v.v);
+        gc_pop();
+
+        return some;
 }
 
 struct value
@@ -3308,6 +3328,7 @@ builtin_os_poll(int argc, struct value *kwargs)
                         "revents", INTEGER(pfds.items[i].revents),
                         NULL
                 );
+                gc_barrier(fds.array);
         }
 
         return INTEGER(ret);
@@ -3781,14 +3802,22 @@ builtin_os_listdir(int argc, struct value *kwargs)
 
         struct array *files = value_array_new();
 
+        gc_push(&ARRAY(files));
+
         struct dirent *e;
 
-        while (e = readdir(d), e != NULL)
-                if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
-                        vec_push(*files, STRING_CLONE(e->d_name, strlen(e->d_name)));
+        while (e = readdir(d), e != NULL) {
+                if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+                        /* Make room first so that pushing can't collect the new string */
+                        value_array_reserve(files, files->count + 1);
+                        value_array_push(files, STRING_CLONE(e->d_name, strlen(e->d_name)));
+                }
+        }
 
         closedir(d);
 
+        gc_pop();
+
         return ARRAY(files);
 }
 
@@ -5044,6 +5073,7 @@ builtin_type(int argc, struct value *kwargs)
         case VALUE_ARRAY:    return (struct value) { .type = VALUE_CLASS, .class = CLASS_ARRAY   };
         case VALUE_DICT:     return (struct value) { .type = VALUE_CLASS, .class = CLASS_DICT    };
         case VALUE_BLOB:     return (struct value) { .type = VALUE_CLASS, .class = CLASS_BLOB    };
+        case VALUE_TYPED_ARRAY: return (struct value) { .type = VALUE_CLASS, .class = CLASS_UINT8_ARRAY + v.typed->kind };
         case VALUE_OBJECT:   return (struct value) { .type = VALUE_CLASS, .class = v.class       };
         case VALUE_BOOLEAN:  return (struct value) { .type = VALUE_CLASS, .class = CLASS_BOOL    };
         case VALUE_REGEX:    return (struct value) { .type = VALUE_CLASS, .class = CLASS_REGEX   };
@@ -5085,11 +5115,8 @@ builtin_members(int argc, struct value *kwargs)
 
         switch (o.type) {
         case VALUE_OBJECT:
-                for (int i = 0; i < TABLE_SIZE; ++i) {
-                        for (int v = 0; v < o.object->buckets[i].values.count; ++v) {
-                                char const *key = o.object->buckets[i].names.items[v];
-                                dict_put_member(members, key, o.object->buckets[i].values.items[v]);
-                        }
+                for (int i = 0; i < object_field_count(o.object); ++i) {
+                        dict_put_member(members, object_field_name(o.object, i), o.object->slots[i]);
                 }
 
                 break;
@@ -5141,7 +5168,7 @@ builtin_member(int argc, struct value *kwargs)
 
                 struct value *np = table_look(&NameTable, buffer);
 
-                table_put(
+                object_put(
                         o.object,
                         ((np == NULL) ? table_put(&NameTable, buffer, PTR(sclone(buffer))) : np)->ptr,
                         ARG(2)
@@ -5166,7 +5193,11 @@ builtin_finalizer(int argc, struct value *kwargs)
                 vm_panic("the second argument to setFinalizer() must be callable");
         }
 
-        ARG(0).object->finalizer = ARG(1);
+        if (ARG(0).object->finalizer == NULL) {
+                ARG(0).object->finalizer = gc_alloc(sizeof (struct value));
+        }
+
+        *ARG(0).object->finalizer = ARG(1);
 
         return NIL;
 }
@@ -5175,10 +5206,100 @@ struct value
 builtin_ty_gc(int argc, struct value *kwargs)
 {
         ASSERT_ARGC("ty.gc()", 0);
-        DoGC();
+        DoFullGC();
         return NIL;
 }
 
+static struct value
+gc_pauses_tuple(GCStats const *stats, int kind)
+{
+        struct array *histogram = value_array_new();
+
+        for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+                value_array_push(histogram, INTEGER(stats->pauses[kind].histogram[i]));
+        }
+
+        return value_named_tuple(
+                "count", INTEGER(stats->pauses[kind].count),
+                "totalMs", REAL(stats->pauses[kind].total / 1.0e6),
+                "maxMs", REAL(stats->pauses[kind].max / 1.0e6),
+                "histogram", ARRAY(histogram),
+                NULL
+        );
+}
+
+struct value
+builtin_ty_gc_stats(int argc, struct value *kwargs)
+{
+        ASSERT_ARGC("ty.gcStats()", 0);
+
+        GCStats stats;
+        GCGetStats(&stats);
+
+        /* Nothing here is reachable until it's all put together */
+        ++GC_OFF_COUNT;
+
+        struct value allocated = value_named_tuple(
+                "string", INTEGER(stats.allocated[GC_STRING]),
+                "array", INTEGER(stats.allocated[GC_ARRAY]),
+                "tuple", INTEGER(stats.allocated[GC_TUPLE]),
+                "object", INTEGER(stats.allocated[GC_OBJECT]),
+                "dict", INTEGER(stats.allocated[GC_DICT]),
+                "blob", INTEGER(stats.allocated[GC_BLOB]),
+                "value", INTEGER(stats.allocated[GC_VALUE]),
+                "env", INTEGER(stats.allocated[GC_ENV]),
+                "generator", INTEGER(stats.allocated[GC_GENERATOR]),
+                "thread", INTEGER(stats.allocated[GC_THREAD]),
+                "regex", INTEGER(stats.allocated[GC_REGEX]),
+                "typedArray", INTEGER(stats.allocated[GC_TYPED_ARRAY]),
+                "other", INTEGER(stats.allocated[GC_ANY]),
+                NULL
+        );
+
+        struct value result = value_named_tuple(
+                "minor", gc_pauses_tuple(&stats, GC_PAUSE_MINOR),
+                "major", gc_pauses_tuple(&stats, GC_PAUSE_MAJOR),
+                "steps", gc_pauses_tuple(&stats, GC_PAUSE_STEP),
+                "allocated", allocated,
+                "promoted", INTEGER(stats.promoted),
+                "marked", INTEGER(stats.marked),
+                "markMs", REAL(stats.mark_time / 1.0e6),
+                "waits", INTEGER(stats.waits),
+                "waitMs", REAL(stats.wait_time / 1.0e6),
+                "used", INTEGER(MemoryUsed),
+                "limit", INTEGER(MemoryLimit),
+                "limitRaises", INTEGER(stats.limit_raises),
+                "limitCuts", INTEGER(stats.limit_cuts),
+                "maxHeap", INTEGER(GCMaxHeap),
+                NULL
+        );
+
+        --GC_OFF_COUNT;
+
+        return result;
+}
+
+struct value
+builtin_ty_heap_snapshot(int argc, struct value *kwargs)
+{
+        ASSERT_ARGC("ty.heapSnapshot()", 1);
+
+        struct value path = ARG(0);
+        if (path.type != VALUE_STRING)
+                vm_panic("the argument to ty.heapSnapshot() must be a string");
+
+        B.count = 0;
+        vec_push_n(B, path.string, path.bytes);
+        vec_push(B, '\0');
+
+        /* B can be reused by whatever runs during the collection, so copy it */
+        char *p = strdup(B.items);
+        bool ok = vm_heap_snapshot(p);
+        free(p);
+
+        return BOOLEAN(ok);
+}
+
 struct value
 builtin_ty_unlock(int argc, struct value *kwargs)
 {
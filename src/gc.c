@@ -1,4 +1,8 @@
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <time.h>
 
 #include "value.h"
 #include "gc.h"
@@ -10,11 +14,137 @@
 #include "class.h"
 
 _Thread_local AllocList allocs;
+_Thread_local AllocList OldAllocs;
+_Thread_local AllocList RememberedSet;
+_Thread_local AllocList Finalizable;
+_Thread_local AllocList FinalizerQueue;
+_Thread_local GCHeap Heap;
 _Thread_local size_t MemoryUsed = 0;
 _Thread_local size_t MemoryLimit = GC_INITIAL_LIMIT;
+_Thread_local size_t MemoryCeiling = GC_INITIAL_LIMIT << 1;
+_Thread_local size_t NurseryUsed = 0;
+_Thread_local unsigned char GCMarkMask = GC_MARK;
+_Thread_local size_t GCMarkedBytes = 0;
+_Thread_local AllocList *GCMarkLog;
+
+size_t NurserySize = GC_NURSERY_SIZE;
+bool GCVerify = false;
+
+double GCGrowth = 2.0;
+size_t GCMaxHeap = 0;
+uint64_t GCQuietTime = 5000000000ULL;
+
+uint64_t GCPauseBudget = 0;
+static atomic_bool NotIncremental;
+_Thread_local atomic_bool *GCIncremental = &NotIncremental;
+
+atomic_int GCUnsweptHeaps;
+
+static struct {
+        atomic_uint_least64_t count;
+        atomic_uint_least64_t total;
+        atomic_uint_least64_t max;
+        atomic_uint_least64_t histogram[GC_PAUSE_BUCKETS];
+} Pauses[3];
+
+static atomic_uint_least64_t Promoted;
+static atomic_uint_least64_t Marked;
+static atomic_uint_least64_t MarkTime;
+static atomic_uint_least64_t Allocated[GC_FREE];
+static atomic_uint_least64_t Waits;
+static atomic_uint_least64_t WaitTime;
+
+static atomic_uint_least64_t LimitRaises;
+static atomic_uint_least64_t LimitCuts;
+
+FILE *GCTraceFile;
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec Started;
+
+_Thread_local uint64_t GCAllocated[GC_FREE];
+
+/* What a sweep saw of the objects that were allocated since the last one */
+typedef struct {
+        size_t promoted;
+} SweepTally;
+
+static void
+Tally(SweepTally const *tally)
+{
+        atomic_fetch_add(&Promoted, tally->promoted);
+}
+
+void
+GCFlushAllocated(void)
+{
+        for (int i = 0; i < GC_FREE; ++i) {
+                if (GCAllocated[i] != 0) {
+                        atomic_fetch_add(&Allocated[i], GCAllocated[i]);
+                        GCAllocated[i] = 0;
+                }
+        }
+}
 
 static _Thread_local vec(struct value const *) RootSet;
 
+/*
+ * Small pieces of work are done right away, without going through the grey
+ * stack, until marking is this many levels deep on the C stack.
+ */
+#define MAX_MARK_DEPTH 32
+
+/*
+ * Arrays, objects, dicts and generator frames can be resized between the steps
+ * of an incremental mark, so their work items point at the container rather
+ * than at its values, and are clamped to whatever size it has when they're
+ * taken off the stack.
+ */
+enum {
+        WORK_VALUES,
+        WORK_ENV,
+        WORK_ARRAY,
+        WORK_OBJECT,
+        WORK_FRAME,
+        WORK_DICT
+};
+
+static _Thread_local GCMarkGroup *MyMarkGroup;
+static _Thread_local GCMarker *MyMarker;
+static _Thread_local int MyMarkerIndex;
+
+/* The grey stack used for marking outside of a collection */
+static _Thread_local GCMarker Alone;
+static _Thread_local int MarkDepth;
+static _Thread_local int MaxMarkDepth = MAX_MARK_DEPTH;
+
+/* How many work items an incremental step gets through between looking at the clock */
+#define STEP_CHECK_INTERVAL 16
+
+/* Cell sizes of the slab size classes, headers included */
+static uint32_t const ClassSize[GC_SIZE_CLASSES] = {
+        16,  32,  48,  64,  80,  96,  112, 128,
+        160, 192, 224, 256,
+        320, 384, 448, 512,
+        640, 768, 896, 1024
+};
+
+/* Size class for an allocation of i * GC_GRANULE bytes */
+uint8_t const GCSizeClass[GC_SLAB_MAX / GC_GRANULE + 1] = {
+        0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9,  10, 10, 11, 11,
+        12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+        16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
+        18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19
+};
+
+#define PAGE_HEADER_SIZE ((sizeof (GCPage) + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1))
+
+/* Empty pages that a heap holds on to instead of giving back to malloc */
+#define MAX_EMPTY_PAGES 32
+
+/* The bits of a page's bitmaps that correspond to the start of a cell */
+static uint64_t CellStarts[GC_SIZE_CLASSES][GC_PAGE_WORDS];
+static pthread_once_t CellStartsOnce = PTHREAD_ONCE_INIT;
+
 _Thread_local int GC_OFF_COUNT = 0;
 
 inline static void
@@ -22,13 +152,12 @@ collect(struct alloc *a)
 {
         void *p = a->data;
 
-        struct value o;
-        struct value finalizer;
         struct regex *re;
 
         switch (a->type) {
         case GC_ARRAY:     gc_free(((struct array *)p)->items);    break;
         case GC_BLOB:      gc_free(((struct blob *)p)->items);     break;
+        case GC_TYPED_ARRAY: gc_free(((struct typed_array *)p)->items); break;
         case GC_DICT:      dict_free(p);                           break;
         case GC_GENERATOR:
                 gc_free(((Generator *)p)->frame.items);
@@ -43,13 +172,7 @@ collect(struct alloc *a)
                 }
                 break;
         case GC_OBJECT:
-                o = OBJECT((struct table *)p, ((struct table *)p)->class);
-                finalizer = class_get_finalizer(o.class);
-                if (finalizer.type != VALUE_NONE) {
-                        GCLOG("Calling finalizer for: %s", value_show(&o));
-                        vm_call_method(&o, &finalizer, 0);
-                }
-                table_release(p);
+                object_release(p);
                 break;
         case GC_REGEX:
                 re = p;
@@ -60,57 +183,1501 @@ collect(struct alloc *a)
         }
 }
 
+/* Changes the age bits of a's mark, leaving the ones that say where it lives */
+inline static void
+SetMark(struct alloc *a, unsigned char m)
+{
+        atomic_store(&a->mark, (atomic_load(&a->mark) & GC_PLACEMENT) | m);
+}
+
+inline static struct alloc *
+CellAt(GCPage *page, int word, int bit)
+{
+        return (struct alloc *)((char *)page + (word * 64 + bit) * GC_GRANULE);
+}
+
+/*
+ * Called by the thread that a cell was lent to once the cell is dead. The owner
+ * of the page sees the lent bit go away and reclaims the cell the next time it
+ * sweeps the page.
+ */
+static void
+GiveBack(struct alloc *a)
+{
+        size_t bit = GCBitOf(a);
+
+        a->type = GC_FREE;
+
+        atomic_fetch_and_explicit(
+                &GCPageOf(a)->lent[bit / 64],
+                ~(1ULL << (bit % 64)),
+                memory_order_release
+        );
+}
+
+static void
+FreeAlloc(struct alloc *a)
+{
+        unsigned char m = atomic_load(&a->mark);
+
+        if (m & GC_SLAB) {
+                GCPage *page = GCPageOf(a);
+                size_t bit = GCBitOf(a);
+                page->used[bit / 64] &= ~(1ULL << (bit % 64));
+                page->young = true;
+        } else if (m & GC_LENT) {
+                GiveBack(a);
+        } else {
+                free(a);
+        }
+}
+
+static void
+InitCellStarts(void)
+{
+        for (int c = 0; c < GC_SIZE_CLASSES; ++c) {
+                for (size_t off = PAGE_HEADER_SIZE; off + ClassSize[c] <= GC_PAGE_SIZE; off += ClassSize[c]) {
+                        size_t bit = off / GC_GRANULE;
+                        CellStarts[c][bit / 64] |= 1ULL << (bit % 64);
+                }
+        }
+}
+
+/* Threads the page's free cells together in address order */
+static void *
+BuildFreeList(GCPage *page)
+{
+        void *head = NULL;
+        void **tail = &head;
+
+        for (int w = 0; w < GC_PAGE_WORDS; ++w) {
+                uint64_t free = CellStarts[page->class][w] & ~page->used[w];
+                while (free != 0) {
+                        void **cell = (void **)CellAt(page, w, __builtin_ctzll(free));
+                        *tail = cell;
+                        tail = cell;
+                        free &= free - 1;
+                }
+        }
+
+        *tail = NULL;
+
+        return head;
+}
+
+static GCPage *
+NewPage(GCHeap *heap, int class)
+{
+        GCPage *page;
+
+        pthread_once(&CellStartsOnce, InitCellStarts);
+
+        if (heap->empty.count != 0) {
+                page = *vec_pop(heap->empty);
+        } else {
+                page = aligned_alloc(GC_PAGE_SIZE, GC_PAGE_SIZE);
+                if (page == NULL) {
+                        panic("Out of memory!");
+                }
+        }
+
+        memset(page, 0, sizeof *page);
+        page->class = class;
+        page->cell = ClassSize[class];
+        page->free = BuildFreeList(page);
+
+        vec_nogc_push(heap->pages, page);
+
+        return page;
+}
+
+static bool
+SweepPage(GCPage *page, AllocList *remembered, bool minor, bool lazy, size_t *used, AllocList *condemned, SweepTally *tally);
+
+static GCPage *
+TakeUnswept(GCHeap *heap, int class)
+{
+        GCPage *page = heap->unswept[class];
+
+        if (page != NULL) {
+                heap->unswept[class] = page->next;
+        }
+
+        return page;
+}
+
+static void
+SweepUnswept(GCHeap *heap, GCPage *page, AllocList *remembered, size_t *used)
+{
+        SweepTally tally = {0};
+
+        heap->pending -= 1;
+        heap->garbage -= umin(page->garbage, heap->garbage);
+
+        page->garbage = 0;
+
+        /*
+         * Deferred pages were left out of heap->pages, so whatever is still in
+         * use goes back in, and empty pages can be given away right here.
+         */
+        if (!SweepPage(page, remembered, false, true, used, NULL, &tally)) {
+                vec_nogc_push(heap->pages, page);
+                page->free = BuildFreeList(page);
+                if (page->free != NULL) {
+                        page->next = heap->avail[page->class];
+                        heap->avail[page->class] = page;
+                }
+        } else if (heap->empty.count < MAX_EMPTY_PAGES) {
+                vec_nogc_push(heap->empty, page);
+        } else {
+                free(page);
+        }
+
+        if (heap->pending == 0) {
+                atomic_fetch_sub(&GCUnsweptHeaps, 1);
+        }
+}
+
+/*
+ * Sweeps whatever the last major collection left unswept in the heap. This has
+ * to be done before anything marks the heap again, since the page bitmaps still
+ * hold the marks from that collection.
+ */
+void
+GCFinishSweep(GCHeap *heap, AllocList *remembered, size_t *used)
+{
+        for (int c = 0; c < GC_SIZE_CLASSES && heap->pending != 0; ++c) {
+                GCPage *page;
+                while ((page = TakeUnswept(heap, c)) != NULL) {
+                        SweepUnswept(heap, page, remembered, used);
+                }
+        }
+}
+
+/*
+ * Slow path of GCAllocCell(): start allocating from another page of this size
+ * class, taking a new one if none of them has room. Unswept pages of the class
+ * are swept first, and Heap.pace more of any class along with them.
+ */
+void *
+GCRefill(int class)
+{
+        if (Heap.pending != 0) {
+                GCPage *page;
+
+                while (Heap.avail[class] == NULL && (page = TakeUnswept(&Heap, class)) != NULL) {
+                        SweepUnswept(&Heap, page, &RememberedSet, &MemoryUsed);
+                }
+
+                size_t n = Heap.pace;
+
+                for (int c = 0; c < GC_SIZE_CLASSES && n != 0; ++c) {
+                        while (n != 0 && (page = TakeUnswept(&Heap, c)) != NULL) {
+                                SweepUnswept(&Heap, page, &RememberedSet, &MemoryUsed);
+                                n -= 1;
+                        }
+                }
+        }
+
+        GCPage *page = Heap.avail[class];
+
+        if (page != NULL) {
+                Heap.avail[class] = page->next;
+        } else {
+                page = NewPage(&Heap, class);
+        }
+
+        void *cell = page->free;
+
+        page->free = NULL;
+        page->next = NULL;
+        page->young = true;
+
+        return cell;
+}
+
+/*
+ * Returns true if the page ended up empty. Lent cells are skipped: the thread
+ * that they were lent to decides when they die.
+ *
+ * A lazy sweep happens after the program has carried on from the collection
+ * that marked the page, so it leaves the marks of the survivors alone: some of
+ * them may have been remembered since.
+ */
+static bool
+SweepPage(GCPage *page, AllocList *remembered, bool minor, bool lazy, size_t *used, AllocList *condemned, SweepTally *tally)
+{
+        bool young = false;
+        bool empty = true;
+
+        for (int w = 0; w < GC_PAGE_WORDS; ++w) {
+                uint64_t live = page->used[w] & ~atomic_load(&page->lent[w]);
+                uint64_t marks = atomic_load(&page->marks[w]);
+
+                for (; live != 0; live &= live - 1) {
+                        int b = __builtin_ctzll(live);
+                        struct alloc *a = CellAt(page, w, b);
+                        unsigned char m = atomic_load(&a->mark);
+
+                        if (a->type == GC_FREE) {
+                                page->used[w] &= ~(1ULL << b);
+                        } else if ((marks >> b) & 1) {
+                                if (!(m & GC_OLD)) {
+                                        tally->promoted += a->size;
+                                }
+                                if (minor) {
+                                        atomic_fetch_or(&a->mark, GC_OLD);
+                                } else if (!lazy) {
+                                        atomic_store(&a->mark, GC_SLAB | GC_OLD);
+                                }
+                                if (atomic_load(&a->hard) != 0) {
+                                        GCRemember(remembered, a);
+                                }
+                        } else if (atomic_load(&a->hard) != 0) {
+                                if (!(m & GC_OLD)) {
+                                        young = true;
+                                } else {
+                                        if (!minor && !lazy) {
+                                                atomic_store(&a->mark, GC_SLAB | GC_OLD);
+                                        }
+                                        GCRemember(remembered, a);
+                                }
+                        } else if (minor && (m & GC_OLD)) {
+                                continue;
+                        } else {
+                                *used -= min(a->size, *used);
+                                if (condemned != NULL) {
+                                        vec_nogc_push(*condemned, a);
+                                        young = true;
+                                } else {
+                                        collect(a);
+                                        page->used[w] &= ~(1ULL << b);
+                                }
+                        }
+                }
+
+                if (marks != 0) {
+                        atomic_store(&page->marks[w], 0);
+                }
+
+                empty &= (page->used[w] == 0);
+        }
+
+        page->young = young;
+
+        return empty;
+}
+
+/*
+ * Leaves a page that only holds old objects to be swept later. The objects on
+ * it that weren't marked but are held by NOGC() are marked now, the same as if
+ * the sweep had been done in the pause, when they were still being held. It
+ * returns roughly how many bytes of garbage are left on the page.
+ */
+static size_t
+Defer(GCPage *page, AllocList *remembered)
+{
+        size_t n = 0;
+
+        for (int w = 0; w < GC_PAGE_WORDS; ++w) {
+                uint64_t dead = page->used[w] & ~atomic_load(&page->marks[w]) & ~atomic_load(&page->lent[w]);
+                for (; dead != 0; dead &= dead - 1) {
+                        int b = __builtin_ctzll(dead);
+                        struct alloc *a = CellAt(page, w, b);
+                        if (a->type != GC_FREE && atomic_load(&a->hard) != 0) {
+                                atomic_fetch_or(&page->marks[w], 1ULL << b);
+                                GCRemember(remembered, a);
+                        } else {
+                                n += 1;
+                        }
+                }
+        }
+
+        return n * (page->cell - sizeof (struct alloc));
+}
+
+/*
+ * Sweeps the heap's pages (only the ones that could hold young objects if this
+ * is a minor collection), rebuilding their free lists as it goes. If lazy is
+ * set, a major collection leaves the pages that only hold old objects for the
+ * allocator to sweep later.
+ */
+void
+GCSweepHeap(GCHeap *heap, AllocList *remembered, bool minor, bool lazy, size_t *used, AllocList *condemned)
+{
+        SweepTally tally = {0};
+
+        /*
+         * The free lists are rebuilt from scratch, so anything allocated from
+         * here on has to come from a page that's already been swept.
+         */
+        memset(heap->free, 0, sizeof heap->free);
+        memset(heap->avail, 0, sizeof heap->avail);
+
+        size_t k = 0;
+
+        for (size_t i = 0; i < heap->pages.count; ++i) {
+                GCPage *page = heap->pages.items[i];
+                bool empty = true;
+
+                for (int w = 0; w < GC_PAGE_WORDS && empty; ++w) {
+                        empty = (page->used[w] == 0);
+                }
+
+                if (empty) {
+                        vec_nogc_push(heap->empty, page);
+                        continue;
+                }
+
+                if (lazy && !minor && !page->young) {
+                        page->garbage = Defer(page, remembered);
+                        page->next = heap->unswept[page->class];
+                        heap->unswept[page->class] = page;
+                        heap->pending += 1;
+                        heap->garbage += page->garbage;
+                        continue;
+                }
+
+                if (!minor || page->young) {
+                        if (SweepPage(page, remembered, minor, false, used, condemned, &tally)) {
+                                vec_nogc_push(heap->empty, page);
+                                continue;
+                        }
+                        page->free = BuildFreeList(page);
+                }
+
+                if (page->free != NULL) {
+                        page->next = heap->avail[page->class];
+                        heap->avail[page->class] = page;
+                }
+
+                heap->pages.items[k++] = page;
+        }
+
+        heap->pages.count = k;
+
+        while (heap->empty.count > MAX_EMPTY_PAGES) {
+                free(*vec_pop(heap->empty));
+        }
+
+        if (heap->pending != 0) {
+                heap->pace = heap->pending / umax(1, NurserySize / GC_PAGE_SIZE) + 1;
+                atomic_fetch_add(&GCUnsweptHeaps, 1);
+        }
+
+        Tally(&tally);
+}
+
+void
+GCClearHeapMarks(GCHeap *heap)
+{
+        for (size_t i = 0; i < heap->pages.count; ++i) {
+                for (int w = 0; w < GC_PAGE_WORDS; ++w) {
+                        atomic_store(&heap->pages.items[i]->marks[w], 0);
+                }
+        }
+}
+
+/* Hands the pages of a thread that's exiting over to its group */
+void
+GCMergeHeap(GCHeap *dst, GCHeap *src)
+{
+        vec_nogc_push_n(dst->pages, src->pages.items, src->pages.count);
+        vec_nogc_push_n(dst->empty, src->empty.items, src->empty.count);
+
+        free(src->pages.items);
+        free(src->empty.items);
+
+        memset(src, 0, sizeof *src);
+}
+
+/* Takes whatever Forget() marked off of one of this thread's AllocLists */
+static void
+ForgetMarked(AllocList *list)
+{
+        size_t n = 0;
+
+        for (size_t i = 0; i < list->count; ++i) {
+                if (!gc_marked(list->items[i])) {
+                        list->items[n++] = list->items[i];
+                }
+        }
+
+        list->count = n;
+}
+
+/*
+ * Gives the allocations that Forget() logged while it marked a message to the
+ * thread that's going to receive it. Cells on this thread's pages are lent to
+ * it, and everything else is taken off the AllocList it was on. Only the lists
+ * that one of them could be on are gone through, so a small message costs about
+ * the same however big the rest of the heap is.
+ */
+void
+GCGiveAway(AllocList *message, AllocList *young, AllocList *old, AllocList *remembered, AllocList *finalizable, size_t *used)
+{
+        bool in_young = false;
+        bool in_old = false;
+        bool in_remembered = false;
+        bool in_finalizable = false;
+
+        for (size_t i = 0; i < message->count; ++i) {
+                struct alloc *a = message->items[i];
+                unsigned char m = atomic_load(&a->mark);
+
+                if (m & GC_REMEMBERED) {
+                        in_remembered = true;
+                }
+
+                if (
+                        a->type == GC_OBJECT &&
+                        class_get_finalizer(((struct object *)a->data)->class).type != VALUE_NONE
+                ) {
+                        in_finalizable = true;
+                }
+
+                if (m & GC_SLAB) {
+                        continue;
+                } else if (m & GC_OLD) {
+                        in_old = true;
+                } else {
+                        in_young = true;
+                }
+        }
+
+        /* The receiver registers the ones it gets with a finalizer again */
+        if (in_finalizable) ForgetMarked(finalizable);
+        if (in_remembered)  ForgetMarked(remembered);
+        if (in_young)       ForgetMarked(young);
+        if (in_old)         ForgetMarked(old);
+
+        for (size_t i = 0; i < message->count; ++i) {
+                struct alloc *a = message->items[i];
+
+                *used -= min(a->size, *used);
+
+                if (atomic_load(&a->mark) & GC_SLAB) {
+                        GCPage *page = GCPageOf(a);
+                        size_t bit = GCBitOf(a);
+                        uint64_t mask = 1ULL << (bit % 64);
+                        atomic_fetch_or(&page->lent[bit / 64], mask);
+                        atomic_fetch_and(&page->marks[bit / 64], ~mask);
+                        atomic_store(&a->mark, GC_LENT | GC_MARK);
+                }
+        }
+}
+
+/*
+ * Sweeps the young objects, promoting the survivors to old. Objects held by
+ * NOGC() are never freed, and if they survive they go into the remembered set:
+ * whoever is holding on to them may still be filling them in without barriers.
+ *
+ * If condemned isn't NULL, dead objects are moved there instead of being freed.
+ */
+void
+GCSweepYoung(AllocList *young, AllocList *old, AllocList *remembered, size_t *used, AllocList *condemned)
+{
+        /* Take the list first, since the sweep is what gets to fill it in again */
+        AllocList list = *young;
+        vec_init(*young);
+
+        SweepTally tally = {0};
+
+        for (size_t i = 0; i < list.count; ++i) {
+                struct alloc *a = list.items[i];
+                if (atomic_load(&a->mark) & GC_MARK) {
+                        SetMark(a, GC_OLD);
+                        vec_nogc_push(*old, a);
+                        tally.promoted += a->size;
+                        if (atomic_load(&a->hard) != 0) {
+                                GCRemember(remembered, a);
+                        }
+                } else if (atomic_load(&a->hard) != 0) {
+                        SetMark(a, 0);
+                        vec_nogc_push(*young, a);
+                } else {
+                        *used -= min(a->size, *used);
+                        if (condemned != NULL) {
+                                vec_nogc_push(*condemned, a);
+                        } else {
+                                collect(a);
+                                FreeAlloc(a);
+                        }
+                }
+        }
+
+        if (young->items == NULL) {
+                *young = list;
+                young->count = 0;
+        } else {
+                free(list.items);
+        }
+
+        Tally(&tally);
+}
+
 void
-GCForget(AllocList *allocs, size_t *used)
+GCSweep(AllocList *young, AllocList *old, AllocList *remembered, size_t *used, AllocList *condemned)
 {
         size_t n = 0;
 
-        for (size_t i = 0; i < allocs->count;) {
-                if (allocs->items[i] == NULL) {
-                        abort();
+        for (size_t i = 0; i < old->count; ++i) {
+                struct alloc *a = old->items[i];
+                if (!(atomic_load(&a->mark) & GC_MARK) && atomic_load(&a->hard) == 0) {
+                        *used -= min(a->size, *used);
+                        if (condemned != NULL) {
+                                vec_nogc_push(*condemned, a);
+                        } else {
+                                collect(a);
+                                FreeAlloc(a);
+                        }
+                } else {
+                        SetMark(a, GC_OLD);
+                        old->items[n++] = a;
+                        if (atomic_load(&a->hard) != 0) {
+                                GCRemember(remembered, a);
+                        }
+                }
+        }
+
+        old->count = n;
+
+        GCSweepYoung(young, old, remembered, used, condemned);
+}
+
+void
+GCRemember(AllocList *remembered, struct alloc *a)
+{
+        if (!(atomic_fetch_or(&a->mark, GC_REMEMBERED) & GC_REMEMBERED)) {
+                vec_nogc_push(*remembered, a);
+        }
+}
+
+/*
+ * Builtins don't use barriers when they fill in an object that they're holding
+ * on to with gc_push(), so a minor collection treats the objects directly
+ * referenced by the root set as if they had been remembered.
+ */
+void
+GCRememberValue(AllocList *remembered, struct value const *v)
+{
+        void *p;
+
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_METHOD:
+        case VALUE_BUILTIN_METHOD:
+                if (v->this != NULL && v->this != v) {
+                        GCRememberValue(remembered, v->this);
                 }
-                if (!atomic_load(&allocs->items[i]->mark) && atomic_load(&allocs->items[i]->hard) == 0) {
-                        allocs->items[n++] = allocs->items[i++];
+                return;
+        case VALUE_ARRAY:     p = v->array;  break;
+        case VALUE_DICT:      p = v->dict;   break;
+        case VALUE_OBJECT:    p = v->object; break;
+        case VALUE_TUPLE:     p = v->items;  break;
+        case VALUE_GENERATOR: p = v->gen;    break;
+        case VALUE_THREAD:    p = v->thread; break;
+        case VALUE_REF:       p = v->ptr;    break;
+        default:                             return;
+        }
+
+        if (p == NULL)
+                return;
+
+        if (GCShouldRemember(ALLOC_OF(p))) {
+                GCRemember(remembered, ALLOC_OF(p));
+        }
+}
+
+static void
+MarkChildren(struct alloc *a)
+{
+        void *p = a->data;
+        struct value v;
+
+        switch (a->type) {
+        case GC_ARRAY:     v = ARRAY(p);                      break;
+        case GC_DICT:      v = DICT(p);                       break;
+        case GC_GENERATOR: v = GENERATOR(p);                  break;
+        case GC_THREAD:    v = THREAD(p);                     break;
+        case GC_OBJECT:    object_mark(p);                    return;
+        case GC_VALUE:
+        case GC_TUPLE:
+                MARK(p);
+                GCMarkValues(p, a->size / sizeof (struct value));
+                return;
+        case GC_ENV:
+                MARK(p);
+                GCMarkEnv(p, a->size / sizeof (struct value *));
+                return;
+        default:
+                MARK(p);
+                return;
+        }
+
+        value_mark(&v);
+}
+
+void
+GCMarkRemembered(AllocList const *remembered)
+{
+        for (size_t i = 0; i < remembered->count; ++i) {
+                /*
+                 * Make the object look young so that the usual marking code
+                 * goes through it once. GCResetRemembered() makes it old again.
+                 */
+                atomic_fetch_and(&remembered->items[i]->mark, ~GC_OLD);
+                MarkChildren(remembered->items[i]);
+        }
+}
+
+/*
+ * Goes back over the objects that were remembered while an incremental
+ * collection was marking. They can point to things that haven't been marked
+ * yet, so they're unmarked and marked again from scratch.
+ */
+void
+GCRescanRemembered(AllocList const *remembered)
+{
+        for (size_t i = 0; i < remembered->count; ++i) {
+                struct alloc *a = remembered->items[i];
+                if (atomic_load(&a->mark) & GC_SLAB) {
+                        size_t bit = GCBitOf(a);
+                        atomic_fetch_and(&GCPageOf(a)->marks[bit / 64], ~(1ULL << (bit % 64)));
                 } else {
-                        *used -= min(allocs->items[i]->size, *used);
-                        SWAP(struct alloc *, allocs->items[i], allocs->items[allocs->count - 1]);
-                        allocs->count -= 1;
+                        atomic_fetch_and(&a->mark, ~GC_MARK);
                 }
+                MarkChildren(a);
+        }
+}
+
+/*
+ * A major collection starts the remembered sets over. Objects on pages that are
+ * left unswept don't have their marks reset, so their GC_REMEMBERED bits are
+ * cleared here, before they could stop a barrier from remembering them again.
+ */
+void
+GCClearRemembered(AllocList *remembered)
+{
+        for (size_t i = 0; i < remembered->count; ++i) {
+                atomic_fetch_and(&remembered->items[i]->mark, ~GC_REMEMBERED);
         }
+
+        remembered->count = 0;
 }
 
 void
-GCSweep(AllocList *allocs, size_t *used)
+GCResetRemembered(AllocList *remembered)
 {
         size_t n = 0;
 
-        for (int i = 0; i < allocs->count; ++i) {
-                if (!atomic_load(&allocs->items[i]->mark) && atomic_load(&allocs->items[i]->hard) == 0) {
-                        *used -= min(allocs->items[i]->size, *used);
-                        collect(allocs->items[i]);
-                        free(allocs->items[i]);
+        for (size_t i = 0; i < remembered->count; ++i) {
+                struct alloc *a = remembered->items[i];
+                if (atomic_load(&a->mark) & GC_SLAB) {
+                        /* The page might not be swept, so clear the mark here */
+                        size_t bit = GCBitOf(a);
+                        atomic_fetch_and(&GCPageOf(a)->marks[bit / 64], ~(1ULL << (bit % 64)));
+                }
+                /* Objects held by NOGC() stay remembered until they're let go */
+                if (atomic_load(&a->hard) != 0) {
+                        SetMark(a, GC_OLD | GC_REMEMBERED);
+                        remembered->items[n++] = a;
                 } else {
-                        atomic_store(&allocs->items[i]->mark, false);
-                        allocs->items[n++] = allocs->items[i];
+                        SetMark(a, GC_OLD);
                 }
         }
 
-        allocs->count = n;
+        remembered->count = n;
+}
+
+void
+GCClearMarks(AllocList *allocs)
+{
+        for (size_t i = 0; i < allocs->count; ++i) {
+                atomic_fetch_and(&allocs->items[i]->mark, ~GC_MARK);
+        }
 }
 
 void
 GCTakeOwnership(AllocList *new)
 {
         for (size_t i = 0; i < new->count; ++i) {
-                vec_nogc_push(allocs, new->items[i]);
-                MemoryUsed += new->items[i]->size;
+                struct alloc *a = new->items[i];
+                SetMark(a, 0);
+                vec_nogc_push(allocs, a);
+                MemoryUsed += a->size;
+                NurseryUsed += a->size;
+                if (
+                        a->type == GC_OBJECT &&
+                        class_get_finalizer(((struct object *)a->data)->class).type != VALUE_NONE
+                ) {
+                        vec_nogc_push(Finalizable, a);
+                }
+        }
+}
+
+/*
+ * Called once marking is done, before anything is swept. Objects on finalizable
+ * that weren't marked go to queue, and everything they refer to is marked so
+ * that it's still there when the finalizer runs.
+ */
+void
+GCQueueFinalizers(AllocList *finalizable, AllocList *queue)
+{
+        size_t n = 0;
+        size_t k = queue->count;
+
+        for (size_t i = 0; i < finalizable->count; ++i) {
+                struct alloc *a = finalizable->items[i];
+                if (gc_marked(a) || atomic_load(&a->hard) != 0) {
+                        finalizable->items[n++] = a;
+                } else {
+                        vec_nogc_push(*queue, a);
+                }
+        }
+
+        finalizable->count = n;
+
+        for (size_t i = k; i < queue->count; ++i) {
+                struct object *o = (struct object *)queue->items[i]->data;
+                value_mark(&OBJECT(o, o->class));
+        }
+}
+
+/*
+ * Called by the thread running a collection before it lets the other n - 1
+ * threads taking part start marking.
+ */
+void
+GCMarkBegin(GCMarkGroup *group, int n)
+{
+        if (n > group->capacity) {
+                group->markers = mrealloc(group->markers, n * sizeof *group->markers);
+                for (int i = group->capacity; i < n; ++i) {
+                        GCMarker *m = mrealloc(NULL, sizeof *m);
+                        vec_init(m->local);
+                        vec_init(m->shared);
+                        pthread_mutex_init(&m->lock, NULL);
+                        group->markers[i] = m;
+                }
+                group->capacity = n;
+        }
+
+        for (int i = 0; i < n; ++i) {
+                group->markers[i]->local.count = 0;
+                group->markers[i]->shared.count = 0;
+                atomic_store(&group->markers[i]->available, 0);
+        }
+
+        group->n = n;
+        atomic_store(&group->joined, 0);
+        atomic_store(&group->idle, 0);
+}
+
+void
+GCMarkJoin(GCMarkGroup *group)
+{
+        MyMarkGroup = group;
+        MyMarkerIndex = atomic_fetch_add(&group->joined, 1);
+        MyMarker = group->markers[MyMarkerIndex];
+        GCMarkedBytes = 0;
+}
+
+void
+GCMarkFree(GCMarkGroup *group)
+{
+        for (int i = 0; i < group->capacity; ++i) {
+                free(group->markers[i]->local.items);
+                free(group->markers[i]->shared.items);
+                pthread_mutex_destroy(&group->markers[i]->lock);
+                free(group->markers[i]);
+        }
+
+        free(group->markers);
+}
+
+static void
+Push(GCWork w)
+{
+        GCMarker *m = MyMarker;
+
+        vec_nogc_push(m->local, w);
+
+        if (
+                MyMarkGroup != NULL &&
+                m->local.count >= 2 &&
+                atomic_load_explicit(&m->available, memory_order_relaxed) == 0
+        ) {
+                size_t half = m->local.count / 2;
+                pthread_mutex_lock(&m->lock);
+                vec_nogc_push_n(m->shared, m->local.items, half);
+                atomic_store(&m->available, m->shared.count);
+                pthread_mutex_unlock(&m->lock);
+                memmove(m->local.items, m->local.items + half, (m->local.count - half) * sizeof (GCWork));
+                m->local.count -= half;
+        }
+}
+
+/* Takes half of the work in m's shared queue */
+static bool
+Take(GCMarker *m)
+{
+        if (atomic_load(&m->available) == 0 || pthread_mutex_trylock(&m->lock) != 0) {
+                return false;
+        }
+
+        size_t n = (m->shared.count + 1) / 2;
+        size_t keep = m->shared.count - n;
+
+        vec_nogc_push_n(MyMarker->local, m->shared.items + keep, n);
+        m->shared.count = keep;
+        atomic_store(&m->available, keep);
+
+        pthread_mutex_unlock(&m->lock);
+
+        return n != 0;
+}
+
+static bool
+Steal(void)
+{
+        GCMarkGroup *group = MyMarkGroup;
+
+        if (Take(MyMarker)) {
+                return true;
+        }
+
+        for (int i = 1; i < group->n; ++i) {
+                if (Take(group->markers[(MyMarkerIndex + i) % group->n])) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static bool
+AnyAvailable(void)
+{
+        for (int i = 0; i < MyMarkGroup->n; ++i) {
+                if (atomic_load(&MyMarkGroup->markers[i]->available) != 0) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static void
+MarkDictEntries(struct dict const *d, size_t i, size_t n)
+{
+        for (size_t j = i; j < i + n; ++j) {
+                if (d->keys[j].type != 0) {
+                        value_mark(&d->keys[j]);
+                        if (d->values != NULL) {
+                                value_mark(&d->values[j]);
+                        }
+                }
+        }
+}
+
+inline static void
+Prefetch(struct value const *v)
+{
+        void const *p;
+
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_ARRAY:  p = v->array;  break;
+        case VALUE_DICT:   p = v->dict;   break;
+        case VALUE_OBJECT: p = v->object; break;
+        case VALUE_TUPLE:  p = v->items;  break;
+        case VALUE_STRING: p = v->gcstr;  break;
+        default:                          return;
+        }
+
+        if (p != NULL) {
+                __builtin_prefetch(ALLOC_OF(p), 1);
+        }
+}
+
+/*
+ * Prefetch everything a chunk points to before marking any of it, so the cache
+ * misses overlap instead of being taken one at a time.
+ */
+static void
+MarkValues(struct value const *vs, size_t n)
+{
+        for (size_t i = 0; i < n; ++i) {
+                Prefetch(&vs[i]);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                value_mark(&vs[i]);
+        }
+}
+
+static void
+Process(GCWork w)
+{
+        struct array const *a;
+        struct object const *o;
+        Generator const *gen;
+        struct dict const *d;
+
+        size_t n = min(w.n, GC_MARK_CHUNK);
+
+        if (w.n > n) {
+                Push((GCWork){ w.kind, w.p, w.i + n, w.n - n });
+        }
+
+        switch (w.kind) {
+        case WORK_VALUES:
+                MarkValues((struct value const *)w.p + w.i, n);
+                break;
+        case WORK_ENV:
+                for (size_t i = w.i; i < w.i + n; ++i) {
+                        struct value *v = ((struct value *const *)w.p)[i];
+                        MARK(v);
+                        value_mark(v);
+                }
+                break;
+        case WORK_ARRAY:
+                a = w.p;
+                if (w.i < a->count) {
+                        MarkValues(a->items + w.i, min(n, a->count - w.i));
+                }
+                break;
+        case WORK_OBJECT:
+                o = w.p;
+                if (w.i < (size_t)o->shape->n) {
+                        MarkValues(o->slots + w.i, min(n, (size_t)o->shape->n - w.i));
+                }
+                break;
+        case WORK_FRAME:
+                gen = w.p;
+                if (w.i < gen->frame.count) {
+                        MarkValues(gen->frame.items + w.i, min(n, gen->frame.count - w.i));
+                }
+                break;
+        case WORK_DICT:
+                d = w.p;
+                if (w.i < d->used) {
+                        MarkDictEntries(d, w.i, min(n, d->used - w.i));
+                }
+                break;
+        }
+}
+
+/*
+ * Outside of a collection (e.g. in Forget()) there's nobody to help, so the
+ * thread that starts marking finishes the job with its own stack before
+ * returning.
+ */
+static void
+MarkAlone(GCWork w)
+{
+        MyMarker = &Alone;
+
+        Push(w);
+
+        while (Alone.local.count != 0) {
+                Process(Alone.local.items[--Alone.local.count]);
+        }
+
+        MyMarker = NULL;
+}
+
+static void
+Mark(GCWork w)
+{
+        if (w.n == 0) {
+                return;
+        }
+
+        if (MyMarker == NULL) {
+                MarkAlone(w);
+        } else if (w.n <= GC_MARK_CHUNK && MarkDepth < MaxMarkDepth) {
+                MarkDepth += 1;
+                Process(w);
+                MarkDepth -= 1;
+        } else {
+                Push(w);
+        }
+}
+
+/*
+ * Marks until there's no work left anywhere. A thread only goes idle once its
+ * own queues are empty, and nobody else can add to them, so once every thread
+ * in the group is idle at the same time, marking is done.
+ */
+void
+GCMarkDrain(void)
+{
+        GCMarkGroup *group = MyMarkGroup;
+
+        for (;;) {
+                while (MyMarker->local.count != 0 || Steal()) {
+                        Process(MyMarker->local.items[--MyMarker->local.count]);
+                }
+
+                atomic_fetch_add(&group->idle, 1);
+
+                while (!AnyAvailable()) {
+                        if (atomic_load(&group->idle) == group->n) {
+                                atomic_fetch_add(&Marked, GCMarkedBytes);
+                                MyMarker = NULL;
+                                MyMarkGroup = NULL;
+                                return;
+                        }
+                        sched_yield();
+                }
+
+                atomic_fetch_sub(&group->idle, 1);
+        }
+}
+
+/*
+ * Starts an incremental mark: the calling thread is the only one in the group,
+ * and until the next call to GCMarkStep() everything it reaches goes onto the
+ * group's grey stack instead of being marked right away.
+ */
+void
+GCMarkStart(GCMarkGroup *group)
+{
+        GCMarkBegin(group, 1);
+        GCMarkJoin(group);
+        MaxMarkDepth = 0;
+}
+
+static uint64_t
+Now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/*
+ * Marks from the grey stack left by GCMarkStart() or the last step until it's
+ * empty or about budget ns have gone by. Nothing is marked without going
+ * through the stack, so no single piece of work can take very long. Adds the
+ * number of bytes marked to *marked, and returns true if there's nothing left
+ * to mark.
+ */
+bool
+GCMarkStep(GCMarkGroup *group, uint64_t budget, size_t *marked)
+{
+        uint64_t deadline = Now() + budget;
+
+        MyMarkGroup = group;
+        MyMarker = group->markers[0];
+        MyMarkerIndex = 0;
+        MaxMarkDepth = 0;
+
+        for (int n = 1; MyMarker->local.count != 0 || Steal(); ++n) {
+                Process(MyMarker->local.items[--MyMarker->local.count]);
+                if (n % STEP_CHECK_INTERVAL == 0 && Now() >= deadline) {
+                        break;
+                }
+        }
+
+        bool done = MyMarker->local.count == 0 && atomic_load(&MyMarker->available) == 0;
+
+        *marked += GCMarkedBytes;
+        atomic_fetch_add(&Marked, GCMarkedBytes);
+        GCMarkedBytes = 0;
+
+        MaxMarkDepth = MAX_MARK_DEPTH;
+        MyMarker = NULL;
+        MyMarkGroup = NULL;
+
+        return done;
+}
+
+/* Takes over whatever an incremental mark still had left to do */
+void
+GCMarkAdopt(GCMarkGroup *group)
+{
+        GCMarker *m = group->markers[0];
+
+        vec_nogc_push_n(MyMarker->local, m->local.items, m->local.count);
+        vec_nogc_push_n(MyMarker->local, m->shared.items, m->shared.count);
+
+        m->local.count = 0;
+        m->shared.count = 0;
+        atomic_store(&m->available, 0);
+}
+
+/*
+ * Big arrays, tuples, objects and stacks are split into GC_MARK_CHUNK-sized
+ * pieces when they're taken off the stack so that other threads can help with
+ * them.
+ */
+static void
+MarkContents(GCWork w, struct value const *vs)
+{
+        if (MyMarker != NULL && w.n <= GC_MARK_CHUNK && MarkDepth < MaxMarkDepth) {
+                MarkDepth += 1;
+                MarkValues(vs, w.n);
+                MarkDepth -= 1;
+        } else {
+                Mark(w);
+        }
+}
+
+void
+GCMarkValues(struct value const *vs, size_t n)
+{
+        MarkContents((GCWork){ WORK_VALUES, vs, 0, n }, vs);
+}
+
+void
+GCMarkArray(struct array const *a)
+{
+        MarkContents((GCWork){ WORK_ARRAY, a, 0, a->count }, a->items);
+}
+
+void
+GCMarkObject(struct object const *o)
+{
+        MarkContents((GCWork){ WORK_OBJECT, o, 0, o->shape->n }, o->slots);
+}
+
+void
+GCMarkFrame(struct generator const *gen)
+{
+        MarkContents((GCWork){ WORK_FRAME, gen, 0, gen->frame.count }, gen->frame.items);
+}
+
+/*
+ * Marks values that live outside of the heap, like a thread's stack. Those might
+ * be gone by the next step of an incremental mark, so then they're gone through
+ * right away, and only what they point to is left on the grey stack.
+ */
+void
+GCMarkRoots(struct value const *vs, size_t n)
+{
+        if (MaxMarkDepth == 0) {
+                for (size_t i = 0; i < n; ++i) {
+                        value_mark(&vs[i]);
+                }
+        } else {
+                GCMarkValues(vs, n);
+        }
+}
+
+void
+GCMarkEnv(struct value *const *env, size_t n)
+{
+        Mark((GCWork){ WORK_ENV, env, 0, n });
+}
+
+void
+GCMarkDict(struct dict const *d)
+{
+        Mark((GCWork){ WORK_DICT, d, 0, d->used });
+}
+
+void
+GCRecordPause(int kind, uint64_t ns)
+{
+        uint64_t us = ns / 1000;
+        int bucket = (us == 0) ? 0 : min(64 - __builtin_clzll(us), GC_PAUSE_BUCKETS - 1);
+
+        atomic_fetch_add(&Pauses[kind].count, 1);
+        atomic_fetch_add(&Pauses[kind].total, ns);
+        atomic_fetch_add(&Pauses[kind].histogram[bucket], 1);
+
+        uint64_t max = atomic_load(&Pauses[kind].max);
+        while (ns > max && !atomic_compare_exchange_weak(&Pauses[kind].max, &max, ns))
+                ;
+}
+
+void
+GCRecordMark(uint64_t ns)
+{
+        atomic_fetch_add(&MarkTime, ns);
+}
+
+void
+GCRecordWait(uint64_t ns)
+{
+        atomic_fetch_add(&Waits, 1);
+        atomic_fetch_add(&WaitTime, ns);
+}
+
+void
+GCGetStats(GCStats *stats)
+{
+        GCFlushAllocated();
+
+        for (int kind = 0; kind < 3; ++kind) {
+                stats->pauses[kind].count = atomic_load(&Pauses[kind].count);
+                stats->pauses[kind].total = atomic_load(&Pauses[kind].total);
+                stats->pauses[kind].max = atomic_load(&Pauses[kind].max);
+                for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+                        stats->pauses[kind].histogram[i] = atomic_load(&Pauses[kind].histogram[i]);
+                }
+        }
+
+        for (int i = 0; i < GC_FREE; ++i) {
+                stats->allocated[i] = atomic_load(&Allocated[i]);
+        }
+
+        stats->promoted = atomic_load(&Promoted);
+        stats->marked = atomic_load(&Marked);
+        stats->mark_time = atomic_load(&MarkTime);
+        stats->waits = atomic_load(&Waits);
+        stats->wait_time = atomic_load(&WaitTime);
+        stats->limit_raises = atomic_load(&LimitRaises);
+        stats->limit_cuts = atomic_load(&LimitCuts);
+}
+
+/*
+ * Writes a line of JSON to the TY_GC_TRACE file for a collection that just
+ * finished. Promoted and allocated are the bytes counted by every sweep since
+ * the line before, so with several thread groups they can include some of the
+ * others' collections.
+ */
+void
+GCTrace(int kind, uint64_t pause, uint64_t mark, size_t before, size_t after, int threads)
+{
+        static char const *kinds[] = {
+                [GC_PAUSE_MINOR] = "minor",
+                [GC_PAUSE_MAJOR] = "major",
+                [GC_PAUSE_STEP]  = "step"
+        };
+
+        static uint64_t promoted;
+        static uint64_t allocated;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&TraceLock);
+
+        uint64_t p = atomic_load(&Promoted);
+        uint64_t a = 0;
+        for (int i = 0; i < GC_FREE; ++i) {
+                a += atomic_load(&Allocated[i]);
+        }
+
+        fprintf(
+                GCTraceFile,
+                "{\"t\":%.3f,\"kind\":\"%s\",\"pause_ms\":%.3f,\"mark_ms\":%.3f,\"threads\":%d,"
+                "\"used_before\":%zu,\"used_after\":%zu,\"promoted\":%llu,\"allocated\":%llu,\"limit\":%zu}\n",
+                ((now.tv_sec - Started.tv_sec) * 1.0e9 + (now.tv_nsec - Started.tv_nsec)) / 1.0e6,
+                kinds[kind],
+                pause / 1.0e6,
+                mark / 1.0e6,
+                threads,
+                before,
+                after,
+                (unsigned long long)(p - promoted),
+                (unsigned long long)(a - allocated),
+                MemoryLimit
+        );
+        fflush(GCTraceFile);
+
+        promoted = p;
+        allocated = a;
+
+        pthread_mutex_unlock(&TraceLock);
+}
+
+static void
+ReportStats(void)
+{
+        static char const *names[] = {
+                [GC_PAUSE_MINOR] = "minor collections",
+                [GC_PAUSE_MAJOR] = "major collections",
+                [GC_PAUSE_STEP]  = "incremental steps"
+        };
+
+        int const order[] = { GC_PAUSE_MINOR, GC_PAUSE_MAJOR, GC_PAUSE_STEP };
+
+        for (size_t i = 0; i < sizeof order / sizeof order[0]; ++i) {
+                int kind = order[i];
+                if (kind == GC_PAUSE_STEP && GCPauseBudget == 0) {
+                        continue;
+                }
+                fprintf(
+                        stderr,
+                        "gc: %6llu %s, %9.3fms total, %8.3fms max",
+                        (unsigned long long)atomic_load(&Pauses[kind].count),
+                        names[kind],
+                        atomic_load(&Pauses[kind].total) / 1.0e6,
+                        atomic_load(&Pauses[kind].max) / 1.0e6
+                );
+                if (kind == GC_PAUSE_MINOR) {
+                        fprintf(stderr, ", %.1f MB promoted", atomic_load(&Promoted) / 1.0e6);
+                }
+                fputc('\n', stderr);
+        }
+
+        double ms = atomic_load(&MarkTime) / 1.0e6;
+        double mb = atomic_load(&Marked) / 1.0e6;
+
+        fprintf(
+                stderr,
+                "gc: %6.1f MB marked in %.3fms (%.0f MB/s)\n",
+                mb,
+                ms,
+                ms > 0 ? mb / (ms / 1000) : 0.0
+        );
+
+        fprintf(
+                stderr,
+                "gc: %6llu waits for other threads' collections, %.3fms total\n",
+                (unsigned long long)atomic_load(&Waits),
+                atomic_load(&WaitTime) / 1.0e6
+        );
+}
+
+/*
+ * Sets a thread's limits after a major collection left live bytes of its heap
+ * alive. It gets to allocate until its heap is GCGrowth times that, or
+ * GC_INITIAL_LIMIT if that's more, so the limit comes back down once whatever
+ * made the heap grow is gone. Room is the thread's share of what's left under
+ * GCMaxHeap, which neither limit goes past.
+ *
+ * While marking incrementally, the thread can keep allocating until it gets
+ * to the ceiling, and then the rest of the marking is done in one go.
+ */
+void
+GCPace(size_t *limit, size_t *ceiling, size_t live, size_t room)
+{
+        size_t target = umax(GC_INITIAL_LIMIT, live * GCGrowth);
+        size_t most = (room > SIZE_MAX - live) ? SIZE_MAX : live + room;
+
+        if (umin(target, most) > *limit) {
+                atomic_fetch_add_explicit(&LimitRaises, 1, memory_order_relaxed);
+        } else if (umin(target, most) < *limit) {
+                atomic_fetch_add_explicit(&LimitCuts, 1, memory_order_relaxed);
+        }
+
+        *limit = umin(target, most);
+        *ceiling = umin(target << 1, most);
+
+        GCLOG("Memory limit is now %zu MB (%zu MB live)", *limit / 1000000, live / 1000000);
+}
+
+/*
+ * Bytes with an optional K, M or G suffix, for TY_MAX_HEAP. Returns 0, meaning
+ * no cap, if it doesn't make sense.
+ */
+static size_t
+ParseSize(char const *s)
+{
+        char *end;
+        double n = strtod(s, &end);
+
+        switch (*end) {
+        case 'k': case 'K': n *= 1ULL << 10; ++end; break;
+        case 'm': case 'M': n *= 1ULL << 20; ++end; break;
+        case 'g': case 'G': n *= 1ULL << 30; ++end; break;
+        }
+
+        if (*end == 'B' || *end == 'b') {
+                ++end;
+        }
+
+        return (end == s || *end != '\0' || !(n > 0) || n >= (double)SIZE_MAX) ? 0 : n;
+}
+
+/*
+ * The memory limit of the cgroup we're in, or 0 if there isn't one. Cgroup v1
+ * reports something close to INT64_MAX when there's no limit.
+ */
+static size_t
+CGroupLimit(void)
+{
+        static char const *files[] = {
+                "/sys/fs/cgroup/memory.max",
+                "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+        };
+
+        for (int i = 0; i < sizeof files / sizeof files[0]; ++i) {
+                FILE *f = fopen(files[i], "r");
+                if (f == NULL) {
+                        continue;
+                }
+
+                unsigned long long limit;
+                int n = fscanf(f, "%llu", &limit);
+                fclose(f);
+
+                if (n == 1 && limit < (1ULL << 60)) {
+                        return limit;
+                }
+
+                return 0;
+        }
+
+        return 0;
+}
+
+void
+gc_init(void)
+{
+        char const *size = getenv("TY_NURSERY");
+        if (size != NULL) {
+                NurserySize = strtoull(size, NULL, 10);
+                /* TY_NURSERY=0 means every collection is a full one */
+                if (NurserySize == 0) {
+                        NurserySize = SIZE_MAX;
+                }
+        }
+
+        if (getenv("TY_GC_STATS") != NULL) {
+                atexit(ReportStats);
+        }
+
+        GCVerify = getenv("TY_GC_VERIFY") != NULL;
+
+        char const *trace = getenv("TY_GC_TRACE");
+        if (trace != NULL) {
+                GCTraceFile = fopen(trace, "w");
+                if (GCTraceFile == NULL) {
+                        fprintf(stderr, "TY_GC_TRACE: couldn't open %s\n", trace);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &Started);
+        }
+
+        char const *pause = getenv("TY_GC_PAUSE_MS");
+        if (pause != NULL) {
+                GCPauseBudget = strtod(pause, NULL) * 1.0e6;
+        }
+
+        char const *growth = getenv("TY_GC_GROWTH");
+        if (growth != NULL) {
+                GCGrowth = strtod(growth, NULL);
+                if (!(GCGrowth >= 1.1)) {
+                        GCGrowth = 1.1;
+                }
+        }
+
+        char const *quiet = getenv("TY_GC_QUIET_MS");
+        if (quiet != NULL) {
+                GCQuietTime = strtod(quiet, NULL) * 1.0e6;
+        }
+
+        /*
+         * Without TY_MAX_HEAP, a container's memory limit is the cap, less a
+         * quarter for everything other than the heap: allocator overhead, stacks,
+         * code, and so on.
+         */
+        char const *max = getenv("TY_MAX_HEAP");
+        if (max != NULL) {
+                GCMaxHeap = ParseSize(max);
+        } else {
+                GCMaxHeap = CGroupLimit() / 4 * 3;
         }
 }
 
 void
 gc(void)
 {
-        DoGC();
+        DoFullGC();
 }
 
 void
@@ -0,0 +1,940 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "heap.h"
+#include "value.h"
+#include "object.h"
+#include "class.h"
+#include "dict.h"
+#include "gc.h"
+#include "token.h"
+#include "vec.h"
+
+/*
+ * The file is a magic string followed by LEB128 varints:
+ *
+ *     classes, then that many (length, bytes) class names
+ *     nodes, then for each node:
+ *         type (GC_*, or ROOT for node 0)
+ *         class (0 if it isn't an object, otherwise an index into the names + 1)
+ *         size in bytes
+ *         edges, then that many node ids
+ */
+#define MAGIC "TYHEAP1\n"
+
+#define ROOT 0xFF
+
+#define NO_NODE UINT32_MAX
+
+/* How many of the biggest dominators the report shows, and how far down */
+#define TOP_DOMINATORS 10
+#define DOMINATOR_DEPTH 6
+
+typedef vec(unsigned char) ByteVector;
+
+struct heap_snapshot {
+        /* Node ids of the allocations seen so far, with linear probing */
+        struct alloc **keys;
+        uint32_t *ids;
+        size_t capacity;
+
+        /*
+         * Allocations in the order they were found, which is also the order
+         * they're written in. Leaves are only ever written, not looked into:
+         * a named tuple's names are GC_TUPLE, but they aren't values.
+         */
+        vec(struct alloc *) nodes;
+        vec(bool) leaf;
+
+        /* The edges of the node being visited (or of the roots, to begin with) */
+        vec(uint32_t) edges;
+
+        /* Class ids in the order they were first seen, and their index + 1 */
+        vec(int) classes;
+        vec(int) class_index;
+
+        ByteVector out;
+};
+
+static char const *TypeNames[] = {
+        [GC_STRING]    = "string",
+        [GC_ARRAY]     = "array",
+        [GC_TUPLE]     = "tuple",
+        [GC_OBJECT]    = "object",
+        [GC_DICT]      = "dict",
+        [GC_BLOB]      = "blob",
+        [GC_VALUE]     = "value",
+        [GC_ENV]       = "env",
+        [GC_GENERATOR] = "generator",
+        [GC_THREAD]    = "thread",
+        [GC_REGEX]     = "regex",
+        [GC_TYPED_ARRAY] = "typed array",
+        [GC_ANY]       = "other"
+};
+
+static void
+PutVarint(ByteVector *out, uint64_t x)
+{
+        while (x >= 0x80) {
+                vec_nogc_push(*out, (unsigned char)(x | 0x80));
+                x >>= 7;
+        }
+
+        vec_nogc_push(*out, (unsigned char)x);
+}
+
+inline static size_t
+Slot(struct heap_snapshot const *snap, struct alloc const *a)
+{
+        return (((uintptr_t)a >> 4) * 0x9E3779B97F4A7C15ULL) & (snap->capacity - 1);
+}
+
+static void
+Grow(struct heap_snapshot *snap)
+{
+        struct alloc **keys = snap->keys;
+        uint32_t *ids = snap->ids;
+        size_t capacity = snap->capacity;
+
+        snap->capacity = (capacity == 0) ? 1024 : capacity * 2;
+        snap->keys = calloc(snap->capacity, sizeof *snap->keys);
+        snap->ids = malloc(snap->capacity * sizeof *snap->ids);
+
+        if (snap->keys == NULL || snap->ids == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (size_t i = 0; i < capacity; ++i) {
+                if (keys[i] != NULL) {
+                        size_t j = Slot(snap, keys[i]);
+                        while (snap->keys[j] != NULL) {
+                                j = (j + 1) & (snap->capacity - 1);
+                        }
+                        snap->keys[j] = keys[i];
+                        snap->ids[j] = ids[i];
+                }
+        }
+
+        free(keys);
+        free(ids);
+}
+
+static uint32_t
+NodeOf(struct heap_snapshot *snap, struct alloc *a, bool leaf)
+{
+        if (2 * snap->nodes.count >= snap->capacity) {
+                Grow(snap);
+        }
+
+        size_t i = Slot(snap, a);
+
+        while (snap->keys[i] != NULL) {
+                if (snap->keys[i] == a) {
+                        return snap->ids[i];
+                }
+                i = (i + 1) & (snap->capacity - 1);
+        }
+
+        snap->keys[i] = a;
+        snap->ids[i] = snap->nodes.count;
+
+        vec_nogc_push(snap->nodes, a);
+        vec_nogc_push(snap->leaf, leaf);
+
+        return snap->ids[i];
+}
+
+static void
+Edge(struct heap_snapshot *snap, void const *p, bool leaf)
+{
+        if (p != NULL) {
+                vec_nogc_push(snap->edges, NodeOf(snap, ALLOC_OF(p), leaf));
+        }
+}
+
+/* The allocations that v refers to directly, the same ones value_mark() marks */
+static void
+ValueEdges(struct heap_snapshot *snap, struct value const *v)
+{
+        switch (v->type & ~VALUE_TAGGED) {
+        case VALUE_METHOD:
+        case VALUE_BUILTIN_METHOD:
+                Edge(snap, v->this, false);
+                break;
+        case VALUE_ARRAY:
+                Edge(snap, v->array, false);
+                break;
+        case VALUE_TUPLE:
+                Edge(snap, v->items, false);
+                Edge(snap, v->names, true);
+                if (v->names != NULL && v->gc_names) {
+                        for (int i = 0; i < v->count; ++i) {
+                                if (v->names[i] != NULL) {
+                                        Edge(snap, v->names[i], true);
+                                        break;
+                                }
+                        }
+                }
+                break;
+        case VALUE_DICT:
+                Edge(snap, v->dict, false);
+                break;
+        case VALUE_FUNCTION:
+                if (v->info[2] != 0) {
+                        Edge(snap, v->env, false);
+                }
+                break;
+        case VALUE_GENERATOR:
+                Edge(snap, v->gen, false);
+                break;
+        case VALUE_THREAD:
+                Edge(snap, v->thread, false);
+                break;
+        case VALUE_STRING:
+                Edge(snap, v->gcstr, false);
+                break;
+        case VALUE_OBJECT:
+                Edge(snap, v->object, false);
+                break;
+        case VALUE_REF:
+                Edge(snap, v->ptr, false);
+                break;
+        case VALUE_BLOB:
+                Edge(snap, v->blob, false);
+                break;
+        case VALUE_TYPED_ARRAY:
+                Edge(snap, v->typed, false);
+                break;
+        case VALUE_PTR:
+                if (v->gcptr != NULL) {
+                        Edge(snap, v->gcptr, ALLOC_OF(v->gcptr)->type != GC_VALUE);
+                }
+                break;
+        case VALUE_REGEX:
+                if (v->regex->gc) {
+                        Edge(snap, v->regex, false);
+                }
+                break;
+        }
+}
+
+static void
+ValuesEdges(struct heap_snapshot *snap, struct value const *vs, size_t n)
+{
+        for (size_t i = 0; i < n; ++i) {
+                ValueEdges(snap, &vs[i]);
+        }
+}
+
+/*
+ * Fills in snap->edges with what node i refers to, and returns its size along
+ * with the buffers that it owns.
+ */
+static size_t
+Visit(struct heap_snapshot *snap, uint32_t i, int *class)
+{
+        struct alloc *a = snap->nodes.items[i];
+        size_t size = a->size;
+
+        struct array const *array;
+        struct dict const *dict;
+        struct object const *o;
+        Generator const *gen;
+        Thread const *t;
+        struct blob const *blob;
+        struct typed_array const *typed;
+        struct value *const *env;
+
+        *class = -1;
+
+        switch (snap->leaf.items[i] ? GC_ANY : a->type) {
+        case GC_ARRAY:
+                array = (void *)a->data;
+                size += array->capacity * sizeof (struct value);
+                ValuesEdges(snap, array->items, array->count);
+                break;
+        case GC_DICT:
+                dict = (void *)a->data;
+                size += dict->size * (1 + dict_index_width(dict->size));
+                size += dict->capacity * (sizeof (struct value) + sizeof (unsigned long));
+                if (dict->values != NULL) {
+                        size += dict->capacity * sizeof (struct value);
+                }
+                if (dict->dflt.type != VALUE_NONE) {
+                        ValueEdges(snap, &dict->dflt);
+                }
+                for (size_t j = 0; j < dict->used; ++j) {
+                        if (dict->keys[j].type != 0) {
+                                ValueEdges(snap, &dict->keys[j]);
+                                if (dict->values != NULL) {
+                                        ValueEdges(snap, &dict->values[j]);
+                                }
+                        }
+                }
+                break;
+        case GC_OBJECT:
+                o = (void *)a->data;
+                *class = o->class;
+                if (o->slots != o->inline_slots && o->slots != NULL) {
+                        size += ALLOC_OF(o->slots)->size;
+                }
+                ValuesEdges(snap, o->slots, o->shape->n);
+                break;
+        case GC_GENERATOR:
+                gen = (void *)a->data;
+                size += gen->frame.capacity * sizeof (struct value);
+                ValueEdges(snap, &gen->f);
+                ValuesEdges(snap, gen->frame.items, gen->frame.count);
+                break;
+        case GC_THREAD:
+                t = (void *)a->data;
+                ValueEdges(snap, &t->v);
+                break;
+        case GC_VALUE:
+        case GC_TUPLE:
+                ValuesEdges(snap, (struct value const *)a->data, a->size / sizeof (struct value));
+                break;
+        case GC_ENV:
+                env = (void *)a->data;
+                for (size_t j = 0; j < a->size / sizeof *env; ++j) {
+                        Edge(snap, env[j], false);
+                }
+                break;
+        case GC_BLOB:
+                blob = (void *)a->data;
+                size += blob->capacity;
+                break;
+        case GC_TYPED_ARRAY:
+                typed = (void *)a->data;
+                if (typed->items != NULL) {
+                        size += ALLOC_OF(typed->items)->size;
+                }
+                break;
+        }
+
+        return size;
+}
+
+static void
+Emit(struct heap_snapshot *snap, int type, int class, size_t size)
+{
+        int index = 0;
+
+        if (class >= 0) {
+                while (snap->class_index.count <= (size_t)class) {
+                        vec_nogc_push(snap->class_index, 0);
+                }
+                if (snap->class_index.items[class] == 0) {
+                        vec_nogc_push(snap->classes, class);
+                        snap->class_index.items[class] = snap->classes.count;
+                }
+                index = snap->class_index.items[class];
+        }
+
+        PutVarint(&snap->out, type);
+        PutVarint(&snap->out, index);
+        PutVarint(&snap->out, size);
+        PutVarint(&snap->out, snap->edges.count);
+
+        for (size_t i = 0; i < snap->edges.count; ++i) {
+                PutVarint(&snap->out, snap->edges.items[i]);
+        }
+
+        snap->edges.count = 0;
+}
+
+static void
+Free(struct heap_snapshot *snap)
+{
+        free(snap->keys);
+        free(snap->ids);
+        free(snap->nodes.items);
+        free(snap->leaf.items);
+        free(snap->edges.items);
+        free(snap->classes.items);
+        free(snap->class_index.items);
+        free(snap->out.items);
+        free(snap);
+}
+
+struct heap_snapshot *
+heap_snapshot_new(void)
+{
+        struct heap_snapshot *snap = calloc(1, sizeof *snap);
+        if (snap == NULL) {
+                panic("Out of memory!");
+        }
+
+        /* Node 0 is the roots */
+        vec_nogc_push(snap->nodes, NULL);
+        vec_nogc_push(snap->leaf, true);
+
+        return snap;
+}
+
+void
+heap_snapshot_root(struct heap_snapshot *snap, struct value const *v)
+{
+        ValueEdges(snap, v);
+}
+
+bool
+heap_snapshot_write(struct heap_snapshot *snap, char const *path)
+{
+        Emit(snap, ROOT, -1, 0);
+
+        /* Visiting a node can find new ones, which go on the end */
+        for (uint32_t i = 1; i < snap->nodes.count; ++i) {
+                int class;
+                size_t size = Visit(snap, i, &class);
+                Emit(snap, snap->nodes.items[i]->type, class, size);
+        }
+
+        ByteVector header = {0};
+
+        PutVarint(&header, snap->classes.count);
+        for (size_t i = 0; i < snap->classes.count; ++i) {
+                char const *name = class_name(snap->classes.items[i]);
+                if (name == NULL) {
+                        name = "?";
+                }
+                PutVarint(&header, strlen(name));
+                vec_nogc_push_n(header, name, strlen(name));
+        }
+        PutVarint(&header, snap->nodes.count);
+
+        FILE *f = fopen(path, "wb");
+        bool ok = f != NULL
+               && fwrite(MAGIC, 1, strlen(MAGIC), f) == strlen(MAGIC)
+               && fwrite(header.items, 1, header.count, f) == header.count
+               && fwrite(snap->out.items, 1, snap->out.count, f) == snap->out.count;
+
+        if (f != NULL && fclose(f) != 0) {
+                ok = false;
+        }
+
+        free(header.items);
+        Free(snap);
+
+        return ok;
+}
+
+/*
+ * What heap_report() reads back: the nodes, with their edges in one array and
+ * node i's starting at first[i].
+ */
+typedef struct {
+        size_t n;
+        unsigned char *type;
+        uint32_t *class;
+        uint64_t *size;
+        size_t *first;
+        vec(uint32_t) edges;
+        vec(char *) classes;
+} Graph;
+
+typedef struct {
+        unsigned char const *p;
+        unsigned char const *end;
+        bool ok;
+} Reader;
+
+static uint64_t
+GetVarint(Reader *r)
+{
+        uint64_t x = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (r->p == r->end) {
+                        r->ok = false;
+                        return 0;
+                }
+                unsigned char b = *r->p++;
+                x |= (uint64_t)(b & 0x7F) << shift;
+                if (!(b & 0x80)) {
+                        return x;
+                }
+        }
+
+        r->ok = false;
+
+        return 0;
+}
+
+static void
+FreeGraph(Graph *g)
+{
+        free(g->type);
+        free(g->class);
+        free(g->size);
+        free(g->first);
+        free(g->edges.items);
+        for (size_t i = 0; i < g->classes.count; ++i) {
+                free(g->classes.items[i]);
+        }
+        free(g->classes.items);
+}
+
+static bool
+ReadGraph(Graph *g, unsigned char const *data, size_t n)
+{
+        if (n < strlen(MAGIC) || memcmp(data, MAGIC, strlen(MAGIC)) != 0) {
+                return false;
+        }
+
+        Reader r = { data + strlen(MAGIC), data + n, true };
+
+        size_t classes = GetVarint(&r);
+        for (size_t i = 0; r.ok && i < classes; ++i) {
+                size_t len = GetVarint(&r);
+                if (!r.ok || len > (size_t)(r.end - r.p)) {
+                        return false;
+                }
+                char *name = malloc(len + 1);
+                if (name == NULL) {
+                        panic("Out of memory!");
+                }
+                memcpy(name, r.p, len);
+                name[len] = '\0';
+                vec_nogc_push(g->classes, name);
+                r.p += len;
+        }
+
+        g->n = GetVarint(&r);
+
+        /* Every node takes at least 4 bytes */
+        if (!r.ok || g->n == 0 || g->n > (size_t)(r.end - r.p) / 4 + 1) {
+                return false;
+        }
+
+        g->type = malloc(g->n);
+        g->class = malloc(g->n * sizeof *g->class);
+        g->size = malloc(g->n * sizeof *g->size);
+        g->first = malloc((g->n + 1) * sizeof *g->first);
+
+        if (g->type == NULL || g->class == NULL || g->size == NULL || g->first == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (size_t i = 0; r.ok && i < g->n; ++i) {
+                g->type[i] = GetVarint(&r);
+                g->class[i] = GetVarint(&r);
+                g->size[i] = GetVarint(&r);
+                g->first[i] = g->edges.count;
+
+                if (g->class[i] > g->classes.count) {
+                        return false;
+                }
+
+                size_t edges = GetVarint(&r);
+                for (size_t j = 0; r.ok && j < edges; ++j) {
+                        uint64_t to = GetVarint(&r);
+                        if (to >= g->n) {
+                                return false;
+                        }
+                        vec_nogc_push(g->edges, to);
+                }
+        }
+
+        g->first[g->n] = g->edges.count;
+
+        return r.ok && r.p == r.end;
+}
+
+static char const *
+Describe(Graph const *g, uint32_t i)
+{
+        if (g->type[i] == ROOT) {
+                return "(roots)";
+        } else if (g->class[i] != 0) {
+                return g->classes.items[g->class[i] - 1];
+        } else if (g->type[i] < sizeof TypeNames / sizeof TypeNames[0] && TypeNames[g->type[i]] != NULL) {
+                return TypeNames[g->type[i]];
+        } else {
+                return "?";
+        }
+}
+
+static char *
+Bytes(char *buf, uint64_t n)
+{
+        if (n >= 10ULL * 1024 * 1024 * 1024) {
+                sprintf(buf, "%.1f GB", n / (1024.0 * 1024 * 1024));
+        } else if (n >= 10ULL * 1024 * 1024) {
+                sprintf(buf, "%.1f MB", n / (1024.0 * 1024));
+        } else if (n >= 10ULL * 1024) {
+                sprintf(buf, "%.1f KB", n / 1024.0);
+        } else {
+                sprintf(buf, "%llu B", (unsigned long long)n);
+        }
+
+        return buf;
+}
+
+/*
+ * Dominators by the iterative algorithm of Cooper, Harvey and Kennedy: every
+ * node's dominator is a DFS ancestor, so it finishes later, and walking two
+ * nodes up the tree by finishing order until they meet finds the nearest
+ * common dominator.
+ */
+static uint32_t
+Intersect(uint32_t const *idom, uint32_t const *order, uint32_t a, uint32_t b)
+{
+        while (a != b) {
+                while (order[a] < order[b]) {
+                        a = idom[a];
+                }
+                while (order[b] < order[a]) {
+                        b = idom[b];
+                }
+        }
+
+        return a;
+}
+
+typedef struct {
+        char const *name;
+        uint64_t count;
+        uint64_t shallow;
+        uint64_t retained;
+} Group;
+
+/* open counts how many nodes of the group are above this one in the dominator tree */
+static void
+Enter(Group *group, uint32_t *open, uint64_t size, uint64_t retained)
+{
+        group->count += 1;
+        group->shallow += size;
+
+        if ((*open)++ == 0) {
+                group->retained += retained;
+        }
+}
+
+static int
+CompareGroups(void const *a, void const *b)
+{
+        Group const *x = a;
+        Group const *y = b;
+
+        if (x->retained != y->retained) {
+                return (x->retained < y->retained) ? 1 : -1;
+        }
+
+        return (x->shallow < y->shallow) ? 1 : (x->shallow > y->shallow) ? -1 : 0;
+}
+
+static void
+PrintGroups(FILE *out, char const *title, Group *groups, size_t n)
+{
+        char b1[32], b2[32];
+
+        qsort(groups, n, sizeof *groups, CompareGroups);
+
+        fprintf(out, "\n%-24s %10s %12s %12s\n", title, "count", "shallow", "retained");
+
+        for (size_t i = 0; i < n; ++i) {
+                if (groups[i].count == 0) {
+                        continue;
+                }
+                fprintf(
+                        out,
+                        "  %-22s %10llu %12s %12s\n",
+                        groups[i].name,
+                        (unsigned long long)groups[i].count,
+                        Bytes(b1, groups[i].shallow),
+                        Bytes(b2, groups[i].retained)
+                );
+        }
+}
+
+bool
+heap_report(FILE *out, char const *path)
+{
+        FILE *f = fopen(path, "rb");
+        if (f == NULL) {
+                fprintf(stderr, "error: failed to read %s\n", path);
+                return false;
+        }
+
+        ByteVector data = {0};
+        unsigned char buf[1 << 16];
+        size_t n;
+
+        while ((n = fread(buf, 1, sizeof buf, f)) != 0) {
+                vec_nogc_push_n(data, buf, n);
+        }
+
+        fclose(f);
+
+        Graph g = {0};
+
+        if (!ReadGraph(&g, data.items, data.count)) {
+                fprintf(stderr, "error: %s isn't a heap snapshot\n", path);
+                free(data.items);
+                FreeGraph(&g);
+                return false;
+        }
+
+        free(data.items);
+
+        uint32_t *order = malloc(g.n * sizeof *order);
+        uint32_t *post = malloc(g.n * sizeof *post);
+        uint32_t *idom = malloc(g.n * sizeof *idom);
+        uint64_t *retained = malloc(g.n * sizeof *retained);
+        size_t *next = calloc(g.n, sizeof *next);
+        size_t *pfirst = calloc(g.n + 1, sizeof *pfirst);
+        uint32_t *stack = malloc(g.n * sizeof *stack);
+
+        if (order == NULL || post == NULL || idom == NULL || retained == NULL || next == NULL || pfirst == NULL || stack == NULL) {
+                panic("Out of memory!");
+        }
+
+        /* Finishing order of a DFS from the roots */
+        size_t visited = 0;
+        size_t sp = 0;
+
+        for (size_t i = 0; i < g.n; ++i) {
+                order[i] = NO_NODE;
+                idom[i] = NO_NODE;
+                next[i] = g.first[i];
+        }
+
+        stack[sp++] = 0;
+        idom[0] = 0;
+
+        while (sp != 0) {
+                uint32_t v = stack[sp - 1];
+                if (next[v] < g.first[v + 1]) {
+                        uint32_t w = g.edges.items[next[v]++];
+                        if (idom[w] == NO_NODE) {
+                                /* Not the real dominator yet, just to say it's been seen */
+                                idom[w] = v;
+                                stack[sp++] = w;
+                        }
+                } else {
+                        order[v] = visited;
+                        post[visited++] = v;
+                        sp -= 1;
+                }
+        }
+
+        /* Predecessors of the nodes that were reached */
+        vec(uint32_t) preds = {0};
+
+        for (size_t v = 0; v < g.n; ++v) {
+                if (order[v] == NO_NODE) continue;
+                for (size_t e = g.first[v]; e < g.first[v + 1]; ++e) {
+                        pfirst[g.edges.items[e] + 1] += 1;
+                }
+        }
+
+        for (size_t v = 0; v < g.n; ++v) {
+                pfirst[v + 1] += pfirst[v];
+                next[v] = pfirst[v];
+        }
+
+        preds.count = pfirst[g.n];
+        preds.items = malloc((preds.count + 1) * sizeof *preds.items);
+        if (preds.items == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (size_t v = 0; v < g.n; ++v) {
+                if (order[v] == NO_NODE) continue;
+                for (size_t e = g.first[v]; e < g.first[v + 1]; ++e) {
+                        preds.items[next[g.edges.items[e]]++] = v;
+                }
+        }
+
+        for (size_t i = 1; i < g.n; ++i) {
+                idom[i] = NO_NODE;
+        }
+
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+                for (size_t k = visited - 1; k-- > 0;) {
+                        uint32_t v = post[k];
+                        uint32_t d = NO_NODE;
+                        for (size_t e = pfirst[v]; e < pfirst[v + 1]; ++e) {
+                                uint32_t p = preds.items[e];
+                                if (idom[p] == NO_NODE) {
+                                        continue;
+                                }
+                                d = (d == NO_NODE) ? p : Intersect(idom, order, p, d);
+                        }
+                        if (idom[v] != d) {
+                                idom[v] = d;
+                                changed = true;
+                        }
+                }
+        }
+
+        /* Everything a node dominates finishes before it does */
+        uint64_t total = 0;
+
+        for (size_t k = 0; k < visited; ++k) {
+                retained[post[k]] = g.size[post[k]];
+                total += g.size[post[k]];
+        }
+
+        for (size_t k = 0; k + 1 < visited; ++k) {
+                uint32_t v = post[k];
+                retained[idom[v]] += retained[v];
+        }
+
+        /*
+         * A group's retained size only counts the nodes that aren't dominated
+         * by another node of the same group, so that a linked list's nodes
+         * don't each count the rest of the list. That needs a walk down the
+         * dominator tree, keeping count of each group on the way.
+         */
+        size_t ntypes = sizeof TypeNames / sizeof TypeNames[0];
+        size_t nclasses = g.classes.count;
+
+        Group *types = calloc(ntypes, sizeof *types);
+        Group *classes = calloc(nclasses + 1, sizeof *classes);
+        uint32_t *open_types = calloc(ntypes, sizeof *open_types);
+        uint32_t *open_classes = calloc(nclasses + 1, sizeof *open_classes);
+        size_t *cfirst = calloc(g.n + 1, sizeof *cfirst);
+        uint32_t *children = malloc(g.n * sizeof *children);
+
+        if (types == NULL || classes == NULL || open_types == NULL || open_classes == NULL || cfirst == NULL || children == NULL) {
+                panic("Out of memory!");
+        }
+
+        for (size_t i = 0; i < ntypes; ++i) {
+                types[i].name = (TypeNames[i] != NULL) ? TypeNames[i] : "?";
+        }
+
+        for (size_t i = 0; i < nclasses; ++i) {
+                classes[i + 1].name = g.classes.items[i];
+        }
+
+        for (size_t k = 0; k + 1 < visited; ++k) {
+                cfirst[idom[post[k]] + 1] += 1;
+        }
+
+        for (size_t v = 0; v < g.n; ++v) {
+                cfirst[v + 1] += cfirst[v];
+                next[v] = cfirst[v];
+        }
+
+        for (size_t k = 0; k + 1 < visited; ++k) {
+                uint32_t v = post[k];
+                children[next[idom[v]]++] = v;
+        }
+
+        for (size_t v = 0; v < g.n; ++v) {
+                next[v] = cfirst[v];
+        }
+
+        sp = 0;
+        stack[sp++] = 0;
+
+        while (sp != 0) {
+                uint32_t v = stack[sp - 1];
+                if (next[v] < cfirst[v + 1]) {
+                        uint32_t w = children[next[v]++];
+                        if (g.type[w] < ntypes) {
+                                Enter(&types[g.type[w]], &open_types[g.type[w]], g.size[w], retained[w]);
+                        }
+                        if (g.class[w] != 0) {
+                                Enter(&classes[g.class[w]], &open_classes[g.class[w]], g.size[w], retained[w]);
+                        }
+                        stack[sp++] = w;
+                } else {
+                        if (v != 0 && g.type[v] < ntypes) {
+                                open_types[g.type[v]] -= 1;
+                        }
+                        if (g.class[v] != 0) {
+                                open_classes[g.class[v]] -= 1;
+                        }
+                        sp -= 1;
+                }
+        }
+
+        char b1[32], b2[32];
+
+        fprintf(out, "%s: %zu objects, %s reachable\n", path, visited - 1, Bytes(b1, total));
+
+        PrintGroups(out, "By type", types, ntypes);
+        PrintGroups(out, "By class", classes + 1, nclasses);
+
+        /*
+         * The biggest of the nodes that only the roots dominate, each followed
+         * down through whatever it dominates that holds most of its memory.
+         */
+        fprintf(out, "\nLargest dominators:\n");
+        fprintf(out, "  %12s %12s  %s\n", "retained", "shallow", "object");
+
+        for (int shown = 0; shown < TOP_DOMINATORS; ++shown) {
+                uint32_t best = NO_NODE;
+                for (size_t e = cfirst[0]; e < cfirst[1]; ++e) {
+                        uint32_t v = children[e];
+                        if (retained[v] != 0 && (best == NO_NODE || retained[v] > retained[best])) {
+                                best = v;
+                        }
+                }
+
+                if (best == NO_NODE) {
+                        break;
+                }
+
+                uint32_t v = best;
+
+                for (int depth = 0; depth < DOMINATOR_DEPTH; ++depth) {
+                        fprintf(
+                                out,
+                                "  %12s %12s  %*s%s #%u\n",
+                                Bytes(b1, retained[v]),
+                                Bytes(b2, g.size[v]),
+                                2 * depth,
+                                "",
+                                Describe(&g, v),
+                                v
+                        );
+
+                        uint32_t biggest = NO_NODE;
+                        for (size_t e = cfirst[v]; e < cfirst[v + 1]; ++e) {
+                                uint32_t w = children[e];
+                                if (biggest == NO_NODE || retained[w] > retained[biggest]) {
+                                        biggest = w;
+                                }
+                        }
+
+                        if (biggest == NO_NODE || 2 * retained[biggest] < retained[v]) {
+                                break;
+                        }
+
+                        v = biggest;
+                }
+
+                /* So that it isn't picked again */
+                retained[best] = 0;
+        }
+
+        free(order);
+        free(post);
+        free(idom);
+        free(retained);
+        free(next);
+        free(pfirst);
+        free(stack);
+        free(preds.items);
+        free(types);
+        free(classes);
+        free(open_types);
+        free(open_classes);
+        free(cfirst);
+        free(children);
+        FreeGraph(&g);
+
+        return true;
+}
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -10,7 +10,7 @@
 #include "gc.h"
 
 static struct value
-convert_node(GumboNode const *n, struct table *p);
+convert_node(GumboNode const *n, struct object *p);
 
 inline static struct value
 S(char const *s)
@@ -27,11 +27,11 @@ convert_text(GumboText const *t)
 inline static struct value
 convert_attr(GumboAttribute const *a)
 {
-        struct table *t = object_new(0);
+        struct object *t = object_new(0);
         NOGC(t);
 
-        table_put(t, "name", S(a->name));
-        table_put(t, "value", S(a->value));
+        object_put(t, "name", S(a->name));
+        object_put(t, "value", S(a->value));
 
         OKGC(t);
 
@@ -39,9 +39,9 @@ convert_attr(GumboAttribute const *a)
 }
 
 static struct value
-convert_elem(GumboElement const *e, struct table *n)
+convert_elem(GumboElement const *e, struct object *n)
 {
-        struct table *t = object_new(0);
+        struct object *t = object_new(0);
         NOGC(t);
 
         struct array *cs = value_array_new();
@@ -52,8 +52,8 @@ convert_elem(GumboElement const *e, struct table *n)
         }
 
 
-        table_put(t, "children", ARRAY(cs));
-        table_put(t, "t", S(gumbo_normalized_tagname(e->tag)));
+        object_put(t, "children", ARRAY(cs));
+        object_put(t, "t", S(gumbo_normalized_tagname(e->tag)));
 
         struct array *as = value_array_new();
         NOGC(as);
@@ -62,7 +62,7 @@ convert_elem(GumboElement const *e, struct table *n)
                 value_array_push(as, convert_attr(e->attributes.data[i]));
         }
 
-        table_put(t, "attributes", ARRAY(as));
+        object_put(t, "attributes", ARRAY(as));
 
         OKGC(as);
         OKGC(cs);
@@ -74,36 +74,36 @@ convert_elem(GumboElement const *e, struct table *n)
 static struct value
 convert_doc(GumboDocument const *d)
 {
-        struct table *t = object_new(0);
+        struct object *t = object_new(0);
         NOGC(t);
 
-        table_put(t, "has_doctype", BOOLEAN(!!d->has_doctype));
-        table_put(t, "name", S(d->name));
-        table_put(t, "public_id", S(d->public_identifier));
-        table_put(t, "system_id", S(d->system_identifier));
+        object_put(t, "has_doctype", BOOLEAN(!!d->has_doctype));
+        object_put(t, "name", S(d->name));
+        object_put(t, "public_id", S(d->public_identifier));
+        object_put(t, "system_id", S(d->system_identifier));
 
         OKGC(t);
         return OBJECT(t, 0);
 }
 
 static struct value
-convert_node(GumboNode const *n, struct table *p)
+convert_node(GumboNode const *n, struct object *p)
 {
-        struct table *t = object_new(0);
+        struct object *t = object_new(0);
         NOGC(t);
-        table_put(t, "type", INTEGER(n->type));
-        table_put(t, "parent", (p == NULL) ? NIL : OBJECT(p, 0));
-        table_put(t, "index", INTEGER(n->index_within_parent));
+        object_put(t, "type", INTEGER(n->type));
+        object_put(t, "parent", (p == NULL) ? NIL : OBJECT(p, 0));
+        object_put(t, "index", INTEGER(n->index_within_parent));
 
         switch (n->type) {
         case GUMBO_NODE_DOCUMENT:
-                table_put(t, "document", convert_doc(&n->v.document));
+                object_put(t, "document", convert_doc(&n->v.document));
                 break;
         case GUMBO_NODE_ELEMENT:
-                table_put(t, "element", convert_elem(&n->v.element, t));
+                object_put(t, "element", convert_elem(&n->v.element, t));
                 break;
         default:
-                table_put(t, "text", convert_text(&n->v.text));
+                object_put(t, "text", convert_text(&n->v.text));
         }
 
         OKGC(t);
@@ -113,11 +113,11 @@ convert_node(GumboNode const *n, struct table *p)
 static struct value
 convert(GumboOutput const *out)
 {
-        struct table *t = object_new(0);
+        struct object *t = object_new(0);
         NOGC(t);
 
-        table_put(t, "root", convert_node(out->root, NULL));
-        table_put(t, "document", convert_node(out->document, NULL));
+        object_put(t, "root", convert_node(out->root, NULL));
+        object_put(t, "document", convert_node(out->document, NULL));
 
         OKGC(t);
 
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "intern.h"
+#include "util.h"
+#include "gc.h"
+#include "panic.h"
+
+InternEntry *_Atomic InternChunks[INTERN_CHUNKS];
+
+/*
+ * Open-addressed set of ids, keyed by the hash of the name.
+ *
+ * Names that are already interned are found without taking the lock: slots
+ * only ever go from -1 to a valid id, and when the set is grown the old one
+ * is left in place (it's small and this happens a handful of times) so that
+ * readers that are still probing it never see freed memory.
+ */
+typedef struct {
+        size_t mask;
+        _Atomic int ids[];
+} InternSet;
+
+static InternSet *_Atomic Set;
+static _Atomic int Count;
+
+static pthread_mutex_t InternLock = PTHREAD_MUTEX_INITIALIZER;
+
+static InternEntry *
+NewEntry(int id)
+{
+        if (id / INTERN_CHUNK_SIZE >= INTERN_CHUNKS) {
+                panic("too many interned names");
+        }
+
+        InternEntry *chunk = atomic_load_explicit(&InternChunks[id / INTERN_CHUNK_SIZE], memory_order_relaxed);
+        if (chunk == NULL) {
+                chunk = mrealloc(NULL, INTERN_CHUNK_SIZE * sizeof *chunk);
+                atomic_store_explicit(&InternChunks[id / INTERN_CHUNK_SIZE], chunk, memory_order_release);
+        }
+
+        return &chunk[id % INTERN_CHUNK_SIZE];
+}
+
+static void
+Grow(void)
+{
+        InternSet *old = atomic_load_explicit(&Set, memory_order_relaxed);
+        size_t size = (old == NULL) ? 1024 : 2 * (old->mask + 1);
+
+        InternSet *set = mrealloc(NULL, sizeof *set + size * sizeof (int));
+        set->mask = size - 1;
+
+        for (size_t i = 0; i < size; ++i) {
+                atomic_init(&set->ids[i], -1);
+        }
+
+        /*
+         * Id 0 is reserved (see intern.h), so the first real entry gets id 1.
+         */
+        if (old == NULL) {
+                InternEntry *e = NewEntry(0);
+                e->name = NULL;
+                e->hash = 0;
+                e->id = 0;
+                atomic_store_explicit(&Count, 1, memory_order_release);
+        }
+
+        for (int i = 1; i < Count; ++i) {
+                size_t j = intern_entry(i)->hash & set->mask;
+                while (atomic_load_explicit(&set->ids[j], memory_order_relaxed) != -1) {
+                        j = (j + 1) & set->mask;
+                }
+                atomic_store_explicit(&set->ids[j], i, memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&Set, set, memory_order_release);
+}
+
+inline static InternEntry const *
+Find(InternSet const *set, char const *name, unsigned long h, size_t *slot)
+{
+        int id;
+        size_t j = h & set->mask;
+
+        for (; (id = atomic_load_explicit(&set->ids[j], memory_order_acquire)) != -1; j = (j + 1) & set->mask) {
+                InternEntry const *e = intern_entry(id);
+                if (e->hash == h && strcmp(e->name, name) == 0) {
+                        return e;
+                }
+        }
+
+        *slot = j;
+
+        return NULL;
+}
+
+InternEntry const *
+intern(char const *name)
+{
+        unsigned long h = strhash(name);
+        InternSet *set = atomic_load_explicit(&Set, memory_order_acquire);
+        InternEntry const *e;
+        size_t j;
+
+        if (set != NULL && (e = Find(set, name, h, &j)) != NULL) {
+                return e;
+        }
+
+        pthread_mutex_lock(&InternLock);
+
+        set = atomic_load_explicit(&Set, memory_order_relaxed);
+        if (set == NULL || 2 * (size_t)Count >= set->mask) {
+                Grow();
+                set = atomic_load_explicit(&Set, memory_order_relaxed);
+        }
+
+        if ((e = Find(set, name, h, &j)) != NULL) {
+                pthread_mutex_unlock(&InternLock);
+                return e;
+        }
+
+        int id = Count;
+
+        InternEntry *new = NewEntry(id);
+        new->name = sclone_malloc(name);
+        new->hash = h;
+        new->id = id;
+
+        atomic_store_explicit(&Count, id + 1, memory_order_release);
+        atomic_store_explicit(&set->ids[j], id, memory_order_release);
+
+        pthread_mutex_unlock(&InternLock);
+
+        return new;
+}
+
+int
+intern_count(void)
+{
+        return atomic_load_explicit(&Count, memory_order_acquire);
+}
+
+/* vim: set sts=8 sw=8 expandtab: */
@@ -0,0 +1,720 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "jit.h"
+#include "vm.h"
+#include "vec.h"
+#include "util.h"
+
+#define JIT_DEFAULT_THRESHOLD 1000
+
+bool JitEnabled = false;
+int JitThreshold = JIT_DEFAULT_THRESHOLD;
+
+/* Whether hot bytecode gets compiled, as opposed to only running preloaded code */
+static bool Compiling = false;
+
+/*
+ * Entry points translated ahead of time (see jit_preload()), keyed by bytecode
+ * address once their unit has been compiled. The table is made big enough for
+ * every one of them up front, so it never fills up and lookups need no lock.
+ */
+typedef struct {
+        char *_Atomic pc;
+        JitCode *code;
+} Lowered;
+
+static Lowered *Preloaded;
+static int PreloadedBits;
+static JitUnit const *Units;
+static bool *Installed;
+static int UnitCount;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Hotness counters and compiled code, keyed by the bytecode address of an entry
+ * point. Lookups don't need a lock; slots are claimed under JitLock. Bytecode
+ * compiled by eval() and by macros is freed along with its arena, and another
+ * entry point can turn up at the same address later, so jit_forget() leaves a
+ * tombstone in the slots of the old ones for a later claim to reuse. When the
+ * table fills up, new entry points are simply never compiled.
+ */
+#define JIT_ENTRIES    (1 << 16)
+#define JIT_MAX_PROBES 32
+
+#define FORGOTTEN ((char *)1)
+
+/* Upper bound on the number of instructions translated for one entry point */
+#define JIT_MAX_INSTRUCTIONS 2048
+
+typedef struct {
+        char *_Atomic pc;
+        _Atomic int count;
+        _Atomic bool failed;
+        JitCode *_Atomic code;
+        size_t size;
+} JitEntry;
+
+typedef struct {
+        char *pc;
+        size_t off;
+} Label;
+
+typedef vec(unsigned char) Buffer;
+typedef vec(Label) LabelVector;
+
+static JitEntry *Entries;
+
+/* The slots that have been claimed, for jit_forget() */
+static vec(JitEntry *) Claimed;
+
+/*
+ * Native code can't be unmapped as soon as its bytecode is forgotten: another
+ * thread may be running it, and so may an outer frame of the thread doing the
+ * forgetting (a template calls back into vm_exec(), which frees an eval()'s
+ * bytecode). So forgotten code is unlinked right away and only retired, and the
+ * retired pages are reclaimed at the next point where no thread is running any
+ * native code. Running counts the threads that are; a thread counts itself
+ * before it looks up an entry point, so anything it can find was not retired
+ * while it was counted out.
+ */
+typedef struct {
+        JitCode *code;
+        size_t size;
+} Retiree;
+
+static vec(Retiree) Retired;
+static atomic_bool Retiring;
+static _Atomic int Running;
+static _Thread_local int Depth;
+
+static pthread_mutex_t JitLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+Slot(char const *pc)
+{
+        return ((uintptr_t)pc * 0x9E3779B97F4A7C15ULL) >> (64 - 16);
+}
+
+static JitEntry *
+Claim(char *pc)
+{
+        JitEntry *e = NULL;
+        JitEntry *slot = NULL;
+        size_t i = Slot(pc);
+
+        pthread_mutex_lock(&JitLock);
+
+        for (int n = 0; n < JIT_MAX_PROBES; ++n, i = (i + 1) & (JIT_ENTRIES - 1)) {
+                char *p = atomic_load_explicit(&Entries[i].pc, memory_order_relaxed);
+                if (p == pc) {
+                        e = &Entries[i];
+                        break;
+                }
+                if (p == FORGOTTEN && slot == NULL) {
+                        slot = &Entries[i];
+                }
+                if (p == NULL) {
+                        if (slot == NULL) {
+                                slot = &Entries[i];
+                        }
+                        break;
+                }
+        }
+
+        if (e == NULL && slot != NULL) {
+                e = slot;
+                vec_nogc_push(Claimed, e);
+                atomic_store_explicit(&e->pc, pc, memory_order_release);
+        }
+
+        pthread_mutex_unlock(&JitLock);
+
+        return e;
+}
+
+static JitEntry *
+Entry(char *pc)
+{
+        size_t i = Slot(pc);
+        bool room = false;
+
+        for (int n = 0; n < JIT_MAX_PROBES; ++n, i = (i + 1) & (JIT_ENTRIES - 1)) {
+                char *p = atomic_load_explicit(&Entries[i].pc, memory_order_acquire);
+                if (p == pc) {
+                        return &Entries[i];
+                }
+                if (p == FORGOTTEN) {
+                        room = true;
+                }
+                if (p == NULL) {
+                        room = true;
+                        break;
+                }
+        }
+
+        return room ? Claim(pc) : NULL;
+}
+
+static void
+Emit(Buffer *b, void const *bytes, size_t n)
+{
+        vec_nogc_push_n(*b, (unsigned char const *)bytes, n);
+}
+
+static void
+Emit64(Buffer *b, unsigned char const *prefix, uint64_t k)
+{
+        Emit(b, prefix, 2);
+        Emit(b, &k, sizeof k);
+}
+
+/*
+ *   mov   rax, pc
+ *   add   rsp, 8
+ *   ret
+ */
+#define EXIT_SIZE 15
+
+static void
+EmitExit(Buffer *b, char *pc)
+{
+        Emit64(b, (unsigned char[]){ 0x48, 0xB8 }, (uintptr_t)pc);
+        Emit(b, (unsigned char[]){ 0x48, 0x83, 0xC4, 0x08, 0xC3 }, 5);
+}
+
+/*
+ *   mov   rdi, next
+ *   mov   rsi, arg
+ *   mov   rax, template
+ *   call  rax
+ */
+static void
+EmitCall(Buffer *b, JitTemplate *f, char *next, intmax_t arg)
+{
+        Emit64(b, (unsigned char[]){ 0x48, 0xBF }, (uintptr_t)next);
+        Emit64(b, (unsigned char[]){ 0x48, 0xBE }, (uint64_t)arg);
+        Emit64(b, (unsigned char[]){ 0x48, 0xB8 }, (uintptr_t)f);
+        Emit(b, (unsigned char[]){ 0xFF, 0xD0 }, 2);
+}
+
+/*
+ * Emits a jump with a 32-bit displacement to pc, to be filled in once every
+ * label is known.
+ */
+static void
+EmitJump(Buffer *b, unsigned char const *op, int n, char *pc, LabelVector *fixups)
+{
+        Emit(b, op, n);
+        vec_nogc_push(*fixups, ((Label){ .pc = pc, .off = b->count }));
+        Emit(b, &(int32_t){0}, sizeof (int32_t));
+}
+
+static Label *
+FindLabel(LabelVector *labels, char *pc)
+{
+        for (size_t i = 0; i < labels->count; ++i) {
+                if (labels->items[i].pc == pc) {
+                        return &labels->items[i];
+                }
+        }
+
+        return NULL;
+}
+
+static JitCode *
+Install(Buffer const *b, size_t *mapped)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (b->count + page - 1) / page * page;
+
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                return NULL;
+        }
+
+        memcpy(p, b->items, b->count);
+
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(p, size);
+                return NULL;
+        }
+
+        *mapped = size;
+
+        return (JitCode *)p;
+}
+
+static JitCode *
+Compile(char *entry, size_t *size)
+{
+        Buffer b;
+        LabelVector labels;
+        LabelVector fixups;
+        vec(char *) pending;
+        int translated = 0;
+
+        vec_init(b);
+        vec_init(labels);
+        vec_init(fixups);
+        vec_init(pending);
+
+        /* sub rsp, 8 */
+        Emit(&b, (unsigned char[]){ 0x48, 0x83, 0xEC, 0x08 }, 4);
+
+        vec_nogc_push(pending, entry);
+
+        while (pending.count > 0) {
+                char *pc = *vec_pop(pending);
+
+                if (FindLabel(&labels, pc) != NULL) {
+                        continue;
+                }
+
+                for (;;) {
+                        if (FindLabel(&labels, pc) != NULL) {
+                                EmitJump(&b, (unsigned char[]){ 0xE9 }, 1, pc, &fixups);
+                                break;
+                        }
+
+                        vec_nogc_push(labels, ((Label){ .pc = pc, .off = b.count }));
+
+                        JitOp const *op = &JitOps[(unsigned char)*pc];
+
+                        if (op->template == NULL || translated == JIT_MAX_INSTRUCTIONS) {
+                                EmitExit(&b, pc);
+                                break;
+                        }
+
+                        translated += 1;
+
+                        intmax_t arg;
+                        char *next = jit_decode(pc, &arg);
+
+                        switch (op->flow) {
+                        case JIT_FLOW_NEXT:
+                                EmitCall(&b, op->template, next, arg);
+                                /* test eax, eax; je +EXIT_SIZE */
+                                Emit(&b, (unsigned char[]){ 0x85, 0xC0, 0x74, EXIT_SIZE }, 4);
+                                EmitExit(&b, pc);
+                                pc = next;
+                                continue;
+                        case JIT_FLOW_JUMP:
+                                if (arg < 0) {
+                                        EmitCall(&b, op->template, next, arg);
+                                }
+                                EmitJump(&b, (unsigned char[]){ 0xE9 }, 1, next + arg, &fixups);
+                                vec_nogc_push(pending, next + arg);
+                                break;
+                        case JIT_FLOW_BRANCH:
+                                EmitCall(&b, op->template, next, arg);
+                                /* test eax, eax; jns +EXIT_SIZE */
+                                Emit(&b, (unsigned char[]){ 0x85, 0xC0, 0x79, EXIT_SIZE }, 4);
+                                EmitExit(&b, pc);
+                                /* jne target */
+                                EmitJump(&b, (unsigned char[]){ 0x0F, 0x85 }, 2, next + arg, &fixups);
+                                vec_nogc_push(pending, next + arg);
+                                pc = next;
+                                continue;
+                        }
+
+                        break;
+                }
+        }
+
+        for (size_t i = 0; i < fixups.count; ++i) {
+                Label const *target = FindLabel(&labels, fixups.items[i].pc);
+                int32_t rel = (int32_t)target->off - (int32_t)(fixups.items[i].off + sizeof (int32_t));
+                memcpy(b.items + fixups.items[i].off, &rel, sizeof rel);
+        }
+
+        JitCode *code = (translated == 0) ? NULL : Install(&b, size);
+
+        free(b.items);
+        free(labels.items);
+        free(fixups.items);
+        free(pending.items);
+
+        return code;
+}
+
+/* Unmaps what was retired if nobody can be running it any more; JitLock is held */
+static void
+Reclaim(void)
+{
+        if (atomic_load(&Running) != 0) {
+                return;
+        }
+
+        for (size_t i = 0; i < Retired.count; ++i) {
+                munmap((void *)Retired.items[i].code, Retired.items[i].size);
+        }
+
+        Retired.count = 0;
+        atomic_store_explicit(&Retiring, false, memory_order_relaxed);
+}
+
+static void
+Enter(void)
+{
+        if (Depth++ == 0) {
+                atomic_fetch_add(&Running, 1);
+        }
+}
+
+static void
+Leave(void)
+{
+        if (
+                --Depth == 0 &&
+                atomic_fetch_sub(&Running, 1) == 1 &&
+                atomic_load_explicit(&Retiring, memory_order_relaxed)
+        ) {
+                pthread_mutex_lock(&JitLock);
+                Reclaim();
+                pthread_mutex_unlock(&JitLock);
+        }
+}
+
+static char *
+Execute(char *ip)
+{
+        JitEntry *e = Entry(ip);
+
+        if (e == NULL) {
+                return ip;
+        }
+
+        JitCode *code = atomic_load(&e->code);
+
+        if (code == NULL) {
+                if (atomic_fetch_add_explicit(&e->count, 1, memory_order_relaxed) < JitThreshold) {
+                        return ip;
+                }
+
+                if (atomic_load_explicit(&e->failed, memory_order_relaxed)) {
+                        return ip;
+                }
+
+                pthread_mutex_lock(&JitLock);
+
+                code = atomic_load_explicit(&e->code, memory_order_relaxed);
+                if (code == NULL && !atomic_load_explicit(&e->failed, memory_order_relaxed)) {
+                        code = Compile(ip, &e->size);
+                        if (code == NULL) {
+                                atomic_store_explicit(&e->failed, true, memory_order_relaxed);
+                        } else {
+                                atomic_store_explicit(&e->code, code, memory_order_release);
+                        }
+                }
+
+                pthread_mutex_unlock(&JitLock);
+
+                if (code == NULL) {
+                        return ip;
+                }
+        }
+
+        return code();
+}
+
+static char *
+Run(char *ip)
+{
+        Enter();
+        ip = Execute(ip);
+        Leave();
+
+        return ip;
+}
+
+static void
+ForgetCompiled(char const *start, char const *end)
+{
+        if (Entries == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&JitLock);
+
+        for (size_t i = 0; i < Claimed.count;) {
+                JitEntry *e = Claimed.items[i];
+                char const *pc = atomic_load_explicit(&e->pc, memory_order_relaxed);
+
+                if (pc < start || pc >= end) {
+                        i += 1;
+                        continue;
+                }
+
+                JitCode *code = atomic_load_explicit(&e->code, memory_order_relaxed);
+                if (code != NULL) {
+                        vec_nogc_push(Retired, ((Retiree){ .code = code, .size = e->size }));
+                        atomic_store_explicit(&Retiring, true, memory_order_relaxed);
+                }
+
+                atomic_store(&e->code, NULL);
+                atomic_store_explicit(&e->count, 0, memory_order_relaxed);
+                atomic_store_explicit(&e->failed, false, memory_order_relaxed);
+                e->size = 0;
+                atomic_store_explicit(&e->pc, FORGOTTEN, memory_order_release);
+
+                Claimed.items[i] = *vec_pop(Claimed);
+        }
+
+        Reclaim();
+
+        pthread_mutex_unlock(&JitLock);
+}
+
+int
+jit_depth(void)
+{
+        return Depth;
+}
+
+void
+jit_unwind(int depth)
+{
+        while (Depth > depth) {
+                Leave();
+        }
+}
+
+void
+jit_enable(void)
+{
+        if (Entries == NULL) {
+                Entries = calloc(JIT_ENTRIES, sizeof *Entries);
+                if (Entries == NULL) {
+                        return;
+                }
+        }
+
+        JitEnabled = true;
+        Compiling = true;
+}
+
+#else
+
+static char *
+Run(char *ip)
+{
+        return ip;
+}
+
+static void
+ForgetCompiled(char const *start, char const *end)
+{
+}
+
+int
+jit_depth(void)
+{
+        return 0;
+}
+
+void
+jit_unwind(int depth)
+{
+}
+
+void
+jit_enable(void)
+{
+}
+
+#endif
+
+char *
+jit_decode(char *pc, intmax_t *arg)
+{
+        char *next = pc + 1;
+        int k;
+        intmax_t integer;
+        float f;
+        double real;
+        bool boolean;
+
+        *arg = 0;
+
+        switch (JitOps[(unsigned char)*pc].operand) {
+        case JIT_OPERAND_INT:
+                memcpy(&k, next, sizeof k);
+                next += sizeof k;
+                *arg = k;
+                break;
+        case JIT_OPERAND_LOAD:
+                memcpy(&k, next, sizeof k);
+                next += sizeof k;
+#ifndef TY_NO_LOG
+                next += strlen(next) + 1;
+#endif
+                *arg = k;
+                break;
+        case JIT_OPERAND_INTEGER:
+                memcpy(&integer, next, sizeof integer);
+                next += sizeof integer;
+                *arg = integer;
+                break;
+        case JIT_OPERAND_REAL:
+                memcpy(&f, next, sizeof f);
+                next += sizeof f;
+                real = f;
+                memcpy(arg, &real, sizeof real);
+                break;
+        case JIT_OPERAND_BOOLEAN:
+                memcpy(&boolean, next, sizeof boolean);
+                next += sizeof boolean;
+                *arg = boolean;
+                break;
+        }
+
+        return next;
+}
+
+static size_t
+PreloadedSlot(char const *pc)
+{
+        return ((uint64_t)(uintptr_t)pc * 0x9E3779B97F4A7C15ULL) >> (64 - PreloadedBits);
+}
+
+static JitCode *
+FindPreloaded(char const *pc)
+{
+        size_t mask = ((size_t)1 << PreloadedBits) - 1;
+
+        for (size_t i = PreloadedSlot(pc);; i = (i + 1) & mask) {
+                char *p = atomic_load_explicit(&Preloaded[i].pc, memory_order_acquire);
+                if (p == pc) {
+                        return Preloaded[i].code;
+                }
+                if (p == NULL) {
+                        return NULL;
+                }
+        }
+}
+
+char *
+jit_run(char *ip)
+{
+        if (Preloaded != NULL) {
+                JitCode *code = FindPreloaded(ip);
+                if (code != NULL) {
+                        return code();
+                }
+        }
+
+        return Compiling ? Run(ip) : ip;
+}
+
+void
+jit_forget(char const *start, char const *end)
+{
+        if (Preloaded != NULL) {
+                for (size_t i = 0; i < ((size_t)1 << PreloadedBits); ++i) {
+                        char *pc = atomic_load_explicit(&Preloaded[i].pc, memory_order_relaxed);
+                        if (pc >= start && pc < end) {
+                                /* Not NULL, so that lookups still probe past it */
+                                atomic_store_explicit(&Preloaded[i].pc, (char *)1, memory_order_relaxed);
+                        }
+                }
+        }
+
+        ForgetCompiled(start, end);
+}
+
+void
+jit_preload(JitUnit const *units, int n)
+{
+        size_t total = 0;
+        for (int i = 0; i < n; ++i) {
+                total += units[i].count;
+        }
+
+        /* At most half full */
+        PreloadedBits = 4;
+        while (((size_t)1 << PreloadedBits) < 2 * total) {
+                PreloadedBits += 1;
+        }
+
+        Preloaded = calloc((size_t)1 << PreloadedBits, sizeof *Preloaded);
+        Installed = calloc(n, sizeof *Installed);
+        if (Preloaded == NULL || Installed == NULL) {
+                free(Preloaded);
+                free(Installed);
+                Preloaded = NULL;
+                return;
+        }
+
+        Units = units;
+        UnitCount = n;
+
+        JitEnabled = true;
+}
+
+void
+jit_unit_compiled(char const *name, char *code, size_t size)
+{
+        for (int i = 0; i < UnitCount; ++i) {
+                JitUnit const *u = &Units[i];
+
+                if (Installed[i] || strcmp(u->name, name) != 0) {
+                        continue;
+                }
+
+                Installed[i] = true;
+
+                if (u->size != size) {
+                        return;
+                }
+
+                unsigned char const *bytes = u->bytes;
+
+                for (int j = 0; j < u->checks; ++j) {
+                        size_t start = u->check[2 * j];
+                        size_t end = u->check[2 * j + 1];
+                        if (memcmp(code + start, bytes, end - start) != 0) {
+                                return;
+                        }
+                        bytes += end - start;
+                }
+
+                *u->base = code;
+
+                size_t mask = ((size_t)1 << PreloadedBits) - 1;
+
+                for (int j = 0; j < u->count; ++j) {
+                        char *pc = code + u->entries[j];
+                        size_t k = PreloadedSlot(pc);
+                        while (atomic_load_explicit(&Preloaded[k].pc, memory_order_relaxed) != NULL) {
+                                k = (k + 1) & mask;
+                        }
+                        Preloaded[k].code = u->code[j];
+                        atomic_store_explicit(&Preloaded[k].pc, pc, memory_order_release);
+                }
+
+                return;
+        }
+}
+
+void
+jit_init(void)
+{
+        char const *threshold = getenv("TY_JIT_THRESHOLD");
+        if (threshold != NULL) {
+                JitThreshold = atoi(threshold);
+        }
+
+        char const *enable = getenv("TY_JIT");
+        if (enable != NULL && atoi(enable) != 0) {
+                jit_enable();
+        }
+}
+
+/* vim: set sts=8 sw=8 expandtab: */
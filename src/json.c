@@ -8,6 +8,7 @@
 #include "dict.h"
 #include "util.h"
 #include "table.h"
+#include "object.h"
 #include "class.h"
 #include "vec.h"
 #include "vm.h"
@@ -347,18 +348,19 @@ encode(struct value const *v, str *out)
         case VALUE_DICT:
                 vec_push(*out, '{');
                 int last = -1;
-                for (int i = 0; i < v->dict->size; ++i)
+                for (int i = 0; i < v->dict->used; ++i)
                         if (v->dict->keys[i].type == VALUE_STRING)
                                 last = i;
                 if (!try_visit(v->dict))
                         return false;
-                for (int i = 0; i < v->dict->size; ++i) {
+                for (int i = 0; i < v->dict->used; ++i) {
                         if (v->dict->keys[i].type != VALUE_STRING)
                                 continue;
                         if (!encode(&v->dict->keys[i], out))
                                 return false;
                         vec_push(*out, ':');
-                        if (!encode(&v->dict->values[i], out))
+                        struct value value = dict_value(v->dict, i);
+                        if (!encode(&value, out))
                                 return false;
                         if (i != last)
                                 vec_push(*out, ',');
@@ -374,7 +376,7 @@ encode(struct value const *v, str *out)
                 struct value *vp = class_method(v->class, "__json__");
 
                 if (vp != NULL) {
-                        struct value method = METHOD("__json__", vp, v);
+                        struct value method = METHOD(intern("__json__")->id, vp, v);
                         struct value s = vm_eval_function(&method, NULL);
                         if (s.type == VALUE_STRING) {
                                 gc_push(&s);
@@ -385,17 +387,15 @@ encode(struct value const *v, str *out)
                         }
                 } else {
                         vec_push(*out, '{');
-                        for (int i = 0; i < TABLE_SIZE; ++i) {
-                                for (int j = 0; j < v->object->buckets[i].names.count; ++j) {
-                                        vec_push(*out, '"');
-                                        char const *name = v->object->buckets[i].names.items[j];
-                                        vec_push_n(*out, name, strlen(name));
-                                        vec_push(*out, '"');
-                                        vec_push(*out, ':');
-                                        if (!encode(&v->object->buckets[i].values.items[j], out))
-                                                return false;
-                                        vec_push(*out, ',');
-                                }
+                        for (int i = 0; i < object_field_count(v->object); ++i) {
+                                vec_push(*out, '"');
+                                char const *name = object_field_name(v->object, i);
+                                vec_push_n(*out, name, strlen(name));
+                                vec_push(*out, '"');
+                                vec_push(*out, ':');
+                                if (!encode(&v->object->slots[i], out))
+                                        return false;
+                                vec_push(*out, ',');
                         }
                         vec_pop(Visiting);
                         if (*vec_last(*out) == ',')
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "alloc.h"
 #include "util.h"
@@ -9,31 +10,335 @@
 #include "object.h"
 #include "table.h"
 #include "gc.h"
+#include "class.h"
 
-struct table *
+#define ROOT_CHUNK_SIZE 256
+#define ROOT_CHUNKS     4096
+
+/*
+ * Root shapes indexed by class. They're allocated in fixed-size chunks so that
+ * readers never see the array move out from under them.
+ */
+static _Atomic(struct shape *) *_Atomic RootShapes[ROOT_CHUNKS];
+
+/*
+ * Protects the transition lists of shared shapes and the creation of root
+ * shapes. Nothing in here may allocate through the GC, since that could try to
+ * stop the world while another thread is waiting on the lock.
+ */
+static pthread_mutex_t ShapeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+BuildIndex(struct shape *s)
+{
+        if (s->n <= SHAPE_LINEAR_MAX) {
+                free(s->index);
+                s->index = NULL;
+                return;
+        }
+
+        size_t size = 16;
+        while (size < 2 * (size_t)s->capacity) {
+                size <<= 1;
+        }
+
+        s->mask = size - 1;
+        s->index = mrealloc(s->index, size * sizeof (int));
+        memset(s->index, -1, size * sizeof (int));
+
+        for (int i = 0; i < s->n; ++i) {
+                size_t j = s->hashes[i] & s->mask;
+                while (s->index[j] != -1) {
+                        j = (j + 1) & s->mask;
+                }
+                s->index[j] = i;
+        }
+}
+
+static struct shape *
+NewShape(struct shape const *parent, int class, int capacity)
+{
+        struct shape *s = mrealloc(NULL, sizeof *s);
+
+        s->class = class;
+        s->n = (parent == NULL) ? 0 : parent->n;
+        s->capacity = max(capacity, s->n);
+        s->shared = true;
+        s->index = NULL;
+        s->mask = 0;
+        s->root = (parent == NULL) ? s : parent->root;
+
+        atomic_init(&s->expected, 0);
+        atomic_init(&s->last, NULL);
+        vec_init(s->transitions);
+
+        s->hashes = mrealloc(NULL, max(s->capacity, 1) * sizeof *s->hashes);
+        s->names = mrealloc(NULL, max(s->capacity, 1) * sizeof *s->names);
+
+        if (s->n > 0) {
+                memcpy(s->hashes, parent->hashes, s->n * sizeof *s->hashes);
+                memcpy(s->names, parent->names, s->n * sizeof *s->names);
+        }
+
+        return s;
+}
+
+static struct shape *
+RootShape(int class)
+{
+        int c = max(class, 0);
+        _Atomic(struct shape *) *chunk = atomic_load_explicit(&RootShapes[c / ROOT_CHUNK_SIZE], memory_order_acquire);
+        struct shape *s;
+
+        if (chunk != NULL && (s = atomic_load_explicit(&chunk[c % ROOT_CHUNK_SIZE], memory_order_acquire)) != NULL) {
+                return s;
+        }
+
+        if (c / ROOT_CHUNK_SIZE >= ROOT_CHUNKS) {
+                panic("too many classes");
+        }
+
+        pthread_mutex_lock(&ShapeLock);
+
+        chunk = atomic_load_explicit(&RootShapes[c / ROOT_CHUNK_SIZE], memory_order_acquire);
+        if (chunk == NULL) {
+                chunk = mrealloc(NULL, ROOT_CHUNK_SIZE * sizeof *chunk);
+                for (int i = 0; i < ROOT_CHUNK_SIZE; ++i) {
+                        atomic_init(&chunk[i], NULL);
+                }
+                atomic_store_explicit(&RootShapes[c / ROOT_CHUNK_SIZE], chunk, memory_order_release);
+        }
+
+        s = atomic_load_explicit(&chunk[c % ROOT_CHUNK_SIZE], memory_order_acquire);
+        if (s == NULL) {
+                s = NewShape(NULL, class, 0);
+                atomic_store_explicit(&chunk[c % ROOT_CHUNK_SIZE], s, memory_order_release);
+        }
+
+        pthread_mutex_unlock(&ShapeLock);
+
+        return s;
+}
+
+inline static bool
+IsTransition(struct shape const *child, char const *name, unsigned long h)
+{
+        return child->hashes[child->n - 1] == h && strcmp(child->names[child->n - 1], name) == 0;
+}
+
+/*
+ * Returns the shared shape reached from s by adding a member with the given
+ * name, or NULL if s shouldn't grow any more shared children.
+ */
+static struct shape *
+Transition(struct shape *s, char const *name, unsigned long h)
+{
+        struct shape *child = atomic_load_explicit(&s->last, memory_order_acquire);
+
+        if (child != NULL && IsTransition(child, name, h)) {
+                return child;
+        }
+
+        pthread_mutex_lock(&ShapeLock);
+
+        child = NULL;
+
+        for (int i = 0; i < s->transitions.count; ++i) {
+                if (IsTransition(s->transitions.items[i], name, h)) {
+                        child = s->transitions.items[i];
+                        break;
+                }
+        }
+
+        if (child == NULL && s->n < SHAPE_MAX_FIELDS && s->transitions.count < SHAPE_MAX_TRANSITIONS) {
+                child = NewShape(s, s->class, s->n + 1);
+                child->hashes[child->n] = h;
+                child->names[child->n] = name;
+                child->n += 1;
+                BuildIndex(child);
+                vec_nogc_push(s->transitions, child);
+        }
+
+        if (child != NULL) {
+                atomic_store_explicit(&s->last, child, memory_order_release);
+        }
+
+        pthread_mutex_unlock(&ShapeLock);
+
+        return child;
+}
+
+static void
+Unshare(struct object *o)
+{
+        struct shape *s = NewShape(o->shape, o->class, max(4, 2 * o->shape->n));
+
+        s->shared = false;
+        BuildIndex(s);
+
+        o->shape = s;
+}
+
+static void
+AppendUnshared(struct shape *s, char const *name, unsigned long h)
+{
+        if (s->n == s->capacity) {
+                s->capacity *= 2;
+                s->hashes = mrealloc(s->hashes, s->capacity * sizeof *s->hashes);
+                s->names = mrealloc(s->names, s->capacity * sizeof *s->names);
+                s->n += 1;
+                s->hashes[s->n - 1] = h;
+                s->names[s->n - 1] = name;
+                BuildIndex(s);
+                return;
+        }
+
+        s->hashes[s->n] = h;
+        s->names[s->n] = name;
+        s->n += 1;
+
+        if (s->n == SHAPE_LINEAR_MAX + 1) {
+                BuildIndex(s);
+        } else if (s->index != NULL) {
+                size_t j = h & s->mask;
+                while (s->index[j] != -1) {
+                        j = (j + 1) & s->mask;
+                }
+                s->index[j] = s->n - 1;
+        }
+}
+
+static void
+GrowSlots(struct object *o, int n)
+{
+        int capacity = max(4, o->capacity * 2);
+
+        while (capacity < n) {
+                capacity *= 2;
+        }
+
+        NOGC(o);
+
+        if (o->slots == o->inline_slots) {
+                struct value *slots = gc_alloc(capacity * sizeof (struct value));
+                memcpy(slots, o->inline_slots, o->shape->n * sizeof (struct value));
+                o->slots = slots;
+        } else {
+                resize(o->slots, capacity * sizeof (struct value));
+        }
+
+        OKGC(o);
+
+        o->capacity = capacity;
+}
+
+struct object *
 object_new(int class)
 {
-        struct table *t =  gc_alloc_object(sizeof *t, GC_OBJECT);
-        table_init(t);
-        t->class = class;
-        return t;
+        struct shape *root = RootShape(class);
+        int n = min(atomic_load_explicit(&root->expected, memory_order_relaxed), OBJECT_MAX_INLINE);
+
+        struct object *o = gc_alloc_object(sizeof *o + n * sizeof (struct value), GC_OBJECT);
+
+        o->shape = root;
+        o->slots = o->inline_slots;
+        o->class = class;
+        o->capacity = n;
+        o->finalizer = NULL;
+
+        if (class_get_finalizer(class).type != VALUE_NONE) {
+                vec_nogc_push(Finalizable, ALLOC_OF(o));
+        }
+
+        return o;
+}
+
+struct value *
+object_add(struct object *o, char const *name, unsigned long h, struct value v)
+{
+        int i = shape_slot(o->shape, name, h);
+
+        if (i != -1) {
+                o->slots[i] = v;
+                gc_barrier(o);
+                return &o->slots[i];
+        }
+
+        if (o->shape->n == o->capacity) {
+                GrowSlots(o, o->shape->n + 1);
+        }
+
+        i = o->shape->n;
+
+        if (o->shape->shared) {
+                struct shape *next = Transition(o->shape, name, h);
+                if (next == NULL) {
+                        Unshare(o);
+                        AppendUnshared(o->shape, name, h);
+                } else {
+                        o->shape = next;
+                }
+        } else {
+                AppendUnshared(o->shape, name, h);
+        }
+
+        struct shape *root = o->shape->root;
+        if (atomic_load_explicit(&root->expected, memory_order_relaxed) < o->shape->n) {
+                atomic_store_explicit(&root->expected, o->shape->n, memory_order_relaxed);
+        }
+
+        o->slots[i] = v;
+        gc_barrier(o);
+
+        return &o->slots[i];
+}
+
+int
+object_get_completions(struct object const *o, char const *prefix, char **out, int max)
+{
+        int n = 0;
+        int prefix_len = strlen(prefix);
+
+        for (int i = 0; i < o->shape->n; ++i) {
+                if (n < max && strncmp(o->shape->names[i], prefix, prefix_len) == 0) {
+                        out[n++] = sclone_malloc(o->shape->names[i]);
+                }
+        }
+
+        return n;
 }
 
 void
-object_mark(struct table *o)
+object_mark(struct object *o)
 {
         if (MARKED(o)) return;
 
         MARK(o);
 
-        for (int i = 0; i < TABLE_SIZE; ++i)
-                for (int v = 0; v < o->buckets[i].values.count; ++v)
-                        value_mark(&o->buckets[i].values.items[v]);
+        GCMarkObject(o);
 
         // FIXME: hmm?
         return;
 
-        value_mark(&o->finalizer);
+        if (o->finalizer != NULL)
+                value_mark(o->finalizer);
+}
+
+void
+object_release(struct object *o)
+{
+        if (o->slots != o->inline_slots) {
+                gc_free(o->slots);
+        }
+
+        if (!o->shape->shared) {
+                free(o->shape->hashes);
+                free(o->shape->names);
+                free(o->shape->index);
+                free(o->shape);
+        }
+
+        gc_free(o->finalizer);
 }
 
 /* vim: set sts=8 sw=8 expandtab: */
@@ -29,7 +29,7 @@ binary_operator_addition(struct value const *left, struct value const *right)
                 struct value const *f = class_method(left->class, "+");
                 if (f == NULL)
                         goto Fail;
-                struct value method = METHOD("+", f, left);
+                struct value method = METHOD(intern("+")->id, f, left);
                 return vm_eval_function(&method, right, NULL);
         }
 
@@ -38,7 +38,7 @@ binary_operator_addition(struct value const *left, struct value const *right)
                         vm_panic("attempt to add non-integer to pointer: %s", value_show_color(right));
                 }
 
-                ffi_type *t = (left->extra == NULL) ? &ffi_type_uint8 : left->extra;
+                ffi_type *t = (left->extra == 0) ? &ffi_type_uint8 : value_extra(left->extra);
 
                 return PTR((char *)left->ptr + right->integer * t->size);
         }
@@ -71,12 +71,7 @@ binary_operator_addition(struct value const *left, struct value const *right)
         case VALUE_DICT:
                 gc_push((struct value *)left);
                 gc_push((struct value *)right);
-                struct value v = dict_clone((struct value *)left, 0, NULL);
-                gc_push(&v);
-                vm_push((struct value  *)right);
-                dict_update(&v, 1, NULL);
-                vm_pop();
-                gc_pop();
+                struct value v = DICT(dict_union(left->dict, right->dict));
                 gc_pop();
                 gc_pop();
                 return v;
@@ -95,7 +90,7 @@ binary_operator_multiplication(struct value const *left, struct value const *rig
                 struct value const *f = class_method(left->class, "*");
                 if (f == NULL)
                         goto Fail;
-                struct value method = METHOD("*", f, left);
+                struct value method = METHOD(intern("*")->id, f, left);
                 return vm_eval_function(&method, right, NULL);
         }
 
@@ -143,7 +138,7 @@ binary_operator_division(struct value const *left, struct value const *right)
                 struct value const *f = class_method(left->class, "/");
                 if (f == NULL)
                         goto Fail;
-                struct value method = METHOD("/", f, left);
+                struct value method = METHOD(intern("/")->id, f, left);
                 return vm_eval_function(&method, right, NULL);
         }
 
@@ -172,7 +167,7 @@ binary_operator_subtraction(struct value const *left, struct value const *right)
                 struct value const *f = class_method(left->class, "-");
                 if (f == NULL)
                         goto Fail;
-                struct value method = METHOD("-", f, left);
+                struct value method = METHOD(intern("-")->id, f, left);
                 return vm_eval_function(&method, right, NULL);
         }
 
@@ -183,7 +178,7 @@ binary_operator_subtraction(struct value const *left, struct value const *right)
                 return REAL(left->integer - right->real);
 
         if (left->type == VALUE_PTR && right->type == VALUE_INTEGER) {
-                ffi_type *t = (left->extra == NULL) ? &ffi_type_uint8 : left->extra;
+                ffi_type *t = (left->extra == 0) ? &ffi_type_uint8 : value_extra(left->extra);
                 return PTR(((char *)left->ptr) - right->integer * t->size);
         }
 
@@ -197,12 +192,7 @@ binary_operator_subtraction(struct value const *left, struct value const *right)
         case VALUE_DICT:
                 gc_push((struct value *)left);
                 gc_push((struct value *)right);
-                struct value v = dict_clone((struct value *)left, 0, NULL);
-                gc_push(&v);
-                vm_push((struct value  *)right);
-                dict_subtract(&v, 1, NULL);
-                vm_pop();
-                gc_pop();
+                struct value v = DICT(dict_difference(left->dict, right->dict));
                 gc_pop();
                 gc_pop();
                 return v;
@@ -220,7 +210,7 @@ binary_operator_remainder(struct value const *left, struct value const *right)
                 struct value const *f = class_method(left->class, "%");
                 if (f == NULL)
                         goto Fail;
-                struct value method = METHOD("%", f, left);
+                struct value method = METHOD(intern("%")->id, f, left);
                 return vm_eval_function(&method, right, NULL);
         }
 
@@ -15,6 +15,7 @@
 #include "util.h"
 #include "alloc.h"
 #include "lex.h"
+#include "parse.h"
 #include "operators.h"
 #include "compiler.h"
 #include "value.h"
@@ -98,6 +99,15 @@ static jmp_buf jb;
 static struct table uops;
 static struct table uopcs;
 
+/* Every operator directive so far, in order, so that they can be replayed */
+struct operator_directive {
+        char const *name;
+        int prec;
+        bool constrained;
+};
+
+static vec(struct operator_directive) uop_list;
+
 static LexState CtxCheckpoint;
 static TokenVector tokens;
 
@@ -309,7 +319,7 @@ token(int i)
                 }
                 t = lex_token(lctx);
                 LOG("Adding tokens[%d] = %s", (int)tokens.count, token_show(&t));
-                VPush(tokens, t);
+                vec_nogc_push(tokens, t);
         }
 
         LOG("tokens[%d] = %s", TokenIndex + i, token_show(&tokens.items[TokenIndex + i]));
@@ -354,6 +364,23 @@ parse_sync_lex(void)
         }
 }
 
+/*
+ * Forget every token before the current one. Only safe between top-level
+ * statements, where nothing is holding on to a token index.
+ */
+static void
+drop_parsed_tokens(void)
+{
+        if (TokenIndex < 2)
+                return;
+
+        int n = TokenIndex - 1;
+
+        memmove(tokens.items, tokens.items + n, (tokens.count - n) * sizeof *tokens.items);
+        tokens.count -= n;
+        TokenIndex -= n;
+}
+
 inline static void
 setctx(int ctx)
 {
@@ -437,7 +464,9 @@ unconsume(int type)
 
         logctx();
 
-        VInsert(tokens, t, TokenIndex);
+        vec_nogc_push(tokens, t);
+        memmove(tokens.items + TokenIndex + 1, tokens.items + TokenIndex, (tokens.count - TokenIndex - 1) * sizeof t);
+        tokens.items[TokenIndex] = t;
 }
 
 noreturn static void
@@ -724,6 +753,7 @@ prefix_special_string(void)
                 }
                 consume(TOKEN_END);
                 lex_end();
+                free(tokens.items);
         }
 
         TokenIndex = ti;
@@ -3427,9 +3457,9 @@ parse_operator_directive(void)
         next();
 
         if (strcmp(assoc, "left") == 0) {
-                table_put(&uops, uop, INTEGER(p));
+                parse_add_operator(uop, p);
         } else if (strcmp(assoc, "right") == 0) {
-                table_put(&uops, uop, INTEGER(-p));
+                parse_add_operator(uop, -p);
         } else {
                 error("expected 'left' or 'right' in operator directive");
         }
@@ -3437,6 +3467,7 @@ parse_operator_directive(void)
         if (tok()->type != TOKEN_NEWLINE) {
                 struct expression *e = parse_expr(0);
                 table_put(&uopcs, uop, PTR(e));
+                vec_last(uop_list)->constrained = true;
         }
 
         consume(TOKEN_NEWLINE);
@@ -3989,6 +4020,31 @@ Expression:
         return s;
 }
 
+/*
+ * A user-defined operator's precedence is negative if it's right-associative.
+ */
+void
+parse_add_operator(char const *name, int prec)
+{
+        table_put(&uops, name, INTEGER(prec));
+        vec_nogc_push(uop_list, ((struct operator_directive){ .name = name, .prec = prec }));
+}
+
+int
+parse_operator_count(void)
+{
+        return uop_list.count;
+}
+
+/* Returns false if the directive has a constraint, which can't be replayed */
+bool
+parse_get_operator(int i, char const **name, int *prec)
+{
+        *name = uop_list.items[i].name;
+        *prec = uop_list.items[i].prec;
+        return !uop_list.items[i].constrained;
+}
+
 char const *
 parse_error(void)
 {
@@ -4027,8 +4083,12 @@ parse(char const *source, char const *file)
         depth = 0;
         filename = file;
 
+        /*
+         * Reuse the token buffer from the last call. Nested calls (for imports) are
+         * given a fresh one below so they can't clobber the tokens we're still using.
+         */
         TokenIndex = 0;
-        vec_init(tokens);
+        tokens.count = 0;
 
         lex_init(file, source);
 
@@ -4059,6 +4119,8 @@ parse(char const *source, char const *file)
         struct location EEnd_ = EEnd;
         memcpy(&jb_, &jb, sizeof jb);
 
+        vec_init(tokens);
+
         lex_save(&CtxCheckpoint);
         lex_start(&CtxCheckpoint);
 
@@ -4071,6 +4133,7 @@ parse(char const *source, char const *file)
         memcpy(&jb, &jb_, sizeof jb);
         CtxCheckpoint = CtxCheckpoint_;
         TokenIndex = TokenIndex_;
+        free(tokens.items);
         tokens = tokens_;
         filename = filename_;
         EStart = EStart_;
@@ -4131,6 +4194,12 @@ parse(char const *source, char const *file)
                 }
 
                 define_top(s);
+
+                /*
+                 * Keep the token buffer proportional to the largest statement rather than
+                 * to the whole file.
+                 */
+                drop_parsed_tokens();
         }
 
         VPush(program, NULL);
@@ -4146,7 +4215,7 @@ parse_get_token(int i)
 
         if (lex_pos().s > vec_last(tokens)->end.s) {
                 tokens.count = TokenIndex;
-                VPush(tokens, ((struct token) {
+                vec_nogc_push(tokens, ((struct token) {
                         .ctx = lctx,
                         .type = TOKEN_EXPRESSION,
                         .start = lex_pos(),
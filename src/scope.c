@@ -267,6 +267,18 @@ scope_set_symbol(int s)
         SYMBOL = s;
 }
 
+int
+scope_get_global(void)
+{
+        return GLOBAL;
+}
+
+void
+scope_set_global(int g)
+{
+        GLOBAL = g;
+}
+
 int
 scope_get_completions(struct scope *scope, char const *prefix, char **out, int max)
 {
@@ -11,9 +11,6 @@ table_init(struct table *t)
                 vec_init(t->buckets[i].names);
                 vec_init(t->buckets[i].values);
         }
-
-        t->finalizer = NIL;
-		t->class = -1;
 }
 
 struct value *
@@ -71,7 +68,7 @@ table_lookup(struct table const *t, char const *name, unsigned long h)
         for (int i = 0; i < b->hashes.count; ++i) {
                 if (b->hashes.items[i] != h)
                         continue;
-                if (strcmp(b->names.items[i], name) == 0)
+                if (b->names.items[i] == name || strcmp(b->names.items[i], name) == 0)
                         return &b->values.items[i];
         }
 
@@ -7,6 +7,7 @@
 #include "util.h"
 #include "vec.h"
 #include "table.h"
+#include "intern.h"
 
 struct tags;
 
@@ -63,6 +64,12 @@ tags_new(char const *tag)
         return tagcount++;
 }
 
+int
+tags_count(void)
+{
+        return tagcount;
+}
+
 bool
 tags_same(int t1, int t2)
 {
@@ -160,7 +167,8 @@ tags_add_method(int tag, char const *name, struct value f)
 {
         LOG("tag = %d", tag);
         LOG("adding method %s to tag %s", name, names.items[tag - 1]);
-        table_add(&tables.items[tag - 1], name, strhash(name), f);
+        InternEntry const *e = intern(name);
+        table_add(&tables.items[tag - 1], e->name, e->hash, f);
 }
 
 void
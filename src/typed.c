@@ -0,0 +1,869 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ffi.h>
+
+#include "typed.h"
+#include "value.h"
+#include "util.h"
+#include "vm.h"
+
+/*
+ * The bulk operations on typed arrays work on LANES elements at a time using
+ * GCC's vector extensions, rather than leaving it to the compiler to vectorize
+ * plain loops: the default build doesn't optimize enough for that to happen.
+ * Items are only as aligned as the allocator makes them, so vectors are loaded
+ * and stored with memcpy().
+ */
+#define LANES 8
+
+typedef uint8_t  u8v  __attribute__ ((vector_size (LANES * sizeof (uint8_t))));
+typedef int32_t  i32v __attribute__ ((vector_size (LANES * sizeof (int32_t))));
+typedef uint32_t u32v __attribute__ ((vector_size (LANES * sizeof (uint32_t))));
+typedef int64_t  i64v __attribute__ ((vector_size (LANES * sizeof (int64_t))));
+typedef uint64_t u64v __attribute__ ((vector_size (LANES * sizeof (uint64_t))));
+typedef float    f32v __attribute__ ((vector_size (LANES * sizeof (float))));
+typedef double   f64v __attribute__ ((vector_size (LANES * sizeof (double))));
+
+/*
+ * For each kind: its element type and a vector of them, the type that
+ * arithmetic is done in (unsigned for integers, so that it wraps around instead
+ * of overflowing) and a vector of that, the type that sums and dot products are
+ * accumulated in and a vector of that, and whether the elements are floats.
+ */
+#define KINDS(X) \
+        X(U8,  uint8_t, u8v,  uint8_t,  u8v,  uint64_t, u64v, false) \
+        X(I32, int32_t, i32v, uint32_t, u32v, uint64_t, u64v, false) \
+        X(I64, int64_t, i64v, uint64_t, u64v, uint64_t, u64v, false) \
+        X(F32, float,   f32v, float,    f32v, double,   f64v, true)  \
+        X(F64, double,  f64v, double,   f64v, double,   f64v, true)
+
+static char const *Names[] = {
+        [TYPED_U8]  = "UInt8Array",
+        [TYPED_I32] = "Int32Array",
+        [TYPED_I64] = "Int64Array",
+        [TYPED_F32] = "Float32Array",
+        [TYPED_F64] = "Float64Array"
+};
+
+static size_t const Sizes[] = {
+        [TYPED_U8]  = sizeof (uint8_t),
+        [TYPED_I32] = sizeof (int32_t),
+        [TYPED_I64] = sizeof (int64_t),
+        [TYPED_F32] = sizeof (float),
+        [TYPED_F64] = sizeof (double)
+};
+
+static ffi_type *const FFITypes[] = {
+        [TYPED_U8]  = &ffi_type_uint8,
+        [TYPED_I32] = &ffi_type_sint32,
+        [TYPED_I64] = &ffi_type_sint64,
+        [TYPED_F32] = &ffi_type_float,
+        [TYPED_F64] = &ffi_type_double
+};
+
+enum {
+        OP_ADD,
+        OP_SUB,
+        OP_MUL
+};
+
+enum {
+        CMP_EQ,
+        CMP_NE,
+        CMP_LT,
+        CMP_LE,
+        CMP_GT,
+        CMP_GE
+};
+
+#define BOX(flt, x) ((flt) ? REAL(x) : INTEGER((int64_t)(x)))
+
+/* ys is either an array as long as xs, or (when scalar is true) a single element */
+#define ARITH(op, V, W, U) \
+        for (; i + LANES <= n; i += LANES) { \
+                V x, y; \
+                memcpy(&x, xs + i, sizeof x); \
+                memcpy(&y, scalar ? broadcast : ys + i, sizeof y); \
+                W r = (W)x op (W)y; \
+                memcpy(out + i, &r, sizeof r); \
+        } \
+        for (; i < n; ++i) { \
+                out[i] = (U)xs[i] op (U)(scalar ? ys[0] : ys[i]); \
+        } \
+        break;
+
+#define COMPARE(op, V) \
+        for (; i + LANES <= n; i += LANES) { \
+                V x, y; \
+                memcpy(&x, xs + i, sizeof x); \
+                memcpy(&y, scalar ? broadcast : ys + i, sizeof y); \
+                u8v r = __builtin_convertvector(x op y, u8v) & 1; \
+                memcpy(out + i, &r, sizeof r); \
+        } \
+        for (; i < n; ++i) { \
+                out[i] = xs[i] op (scalar ? ys[0] : ys[i]); \
+        } \
+        break;
+
+/*
+ * NaNs are skipped: the best element so far starts out as the first one that
+ * isn't NaN, and a NaN never compares op it, so it's never taken. Only when
+ * every element is NaN is the result NaN.
+ */
+#define EXTREME(name, op, K, T, V, FLT) \
+        static struct value \
+        name ## _ ## K(void const *p, size_t n) \
+        { \
+                T const *xs = p; \
+                size_t i = 0; \
+\
+                while (i < n && xs[i] != xs[i]) { \
+                        i += 1; \
+                } \
+\
+                if (i == n) { \
+                        return BOX(FLT, xs[0]); \
+                } \
+\
+                T r = xs[i]; \
+\
+                if (i + LANES <= n) { \
+                        V m; \
+                        for (int j = 0; j < LANES; ++j) { \
+                                m[j] = r; \
+                        } \
+                        for (; i + LANES <= n; i += LANES) { \
+                                V x; \
+                                memcpy(&x, xs + i, sizeof x); \
+                                __typeof__ (x < m) c = x op m; \
+                                m = (V)(((__typeof__ (c))m & ~c) | ((__typeof__ (c))x & c)); \
+                        } \
+                        for (int j = 0; j < LANES; ++j) { \
+                                if (m[j] op r) r = m[j]; \
+                        } \
+                } \
+\
+                for (; i < n; ++i) { \
+                        if (xs[i] op r) r = xs[i]; \
+                } \
+\
+                return BOX(FLT, r); \
+        }
+
+#define KERNELS(K, T, V, U, W, S, A, FLT) \
+        static struct value \
+        sum_ ## K(void const *p, size_t n) \
+        { \
+                T const *xs = p; \
+                A acc = {0}; \
+                S s = 0; \
+                size_t i = 0; \
+\
+                for (; i + LANES <= n; i += LANES) { \
+                        V x; \
+                        memcpy(&x, xs + i, sizeof x); \
+                        acc += __builtin_convertvector(x, A); \
+                } \
+\
+                for (int j = 0; j < LANES; ++j) { \
+                        s += acc[j]; \
+                } \
+\
+                for (; i < n; ++i) { \
+                        s += xs[i]; \
+                } \
+\
+                return BOX(FLT, s); \
+        } \
+\
+        static struct value \
+        dot_ ## K(void const *p, void const *q, size_t n) \
+        { \
+                T const *xs = p; \
+                T const *ys = q; \
+                A acc = {0}; \
+                S s = 0; \
+                size_t i = 0; \
+\
+                for (; i + LANES <= n; i += LANES) { \
+                        V x, y; \
+                        memcpy(&x, xs + i, sizeof x); \
+                        memcpy(&y, ys + i, sizeof y); \
+                        acc += __builtin_convertvector(x, A) * __builtin_convertvector(y, A); \
+                } \
+\
+                for (int j = 0; j < LANES; ++j) { \
+                        s += acc[j]; \
+                } \
+\
+                for (; i < n; ++i) { \
+                        s += (S)xs[i] * (S)ys[i]; \
+                } \
+\
+                return BOX(FLT, s); \
+        } \
+\
+        EXTREME(min, <, K, T, V, FLT) \
+        EXTREME(max, >, K, T, V, FLT) \
+\
+        static void \
+        arith_ ## K(void *o, void const *p, void const *q, bool scalar, size_t n, int op) \
+        { \
+                T *out = o; \
+                T const *xs = p; \
+                T const *ys = q; \
+                T broadcast[LANES]; \
+                size_t i = 0; \
+\
+                for (int j = 0; scalar && j < LANES; ++j) { \
+                        broadcast[j] = ys[0]; \
+                } \
+\
+                switch (op) { \
+                case OP_ADD: ARITH(+, V, W, U) \
+                case OP_SUB: ARITH(-, V, W, U) \
+                case OP_MUL: ARITH(*, V, W, U) \
+                } \
+        } \
+\
+        static void \
+        compare_ ## K(uint8_t *out, void const *p, void const *q, bool scalar, size_t n, int op) \
+        { \
+                T const *xs = p; \
+                T const *ys = q; \
+                T broadcast[LANES]; \
+                size_t i = 0; \
+\
+                for (int j = 0; scalar && j < LANES; ++j) { \
+                        broadcast[j] = ys[0]; \
+                } \
+\
+                switch (op) { \
+                case CMP_EQ: COMPARE(==, V) \
+                case CMP_NE: COMPARE(!=, V) \
+                case CMP_LT: COMPARE(<,  V) \
+                case CMP_LE: COMPARE(<=, V) \
+                case CMP_GT: COMPARE(>,  V) \
+                case CMP_GE: COMPARE(>=, V) \
+                } \
+        } \
+\
+        /* NaNs sort after everything else, so that this is a total order */ \
+        static int \
+        order_ ## K(void const *p, void const *q) \
+        { \
+                T x = *(T const *)p; \
+                T y = *(T const *)q; \
+                if (x != x || y != y) { \
+                        return (x != x) - (y != y); \
+                } \
+                return (x > y) - (x < y); \
+        }
+
+KINDS(KERNELS)
+
+#define SUM_OF(K, ...)     sum_ ## K,
+#define DOT_OF(K, ...)     dot_ ## K,
+#define MIN_OF(K, ...)     min_ ## K,
+#define MAX_OF(K, ...)     max_ ## K,
+#define ARITH_OF(K, ...)   arith_ ## K,
+#define COMPARE_OF(K, ...) compare_ ## K,
+#define ORDER_OF(K, ...)   order_ ## K,
+
+static struct value (*const Sum[])(void const *, size_t) = { KINDS(SUM_OF) };
+static struct value (*const Dot[])(void const *, void const *, size_t) = { KINDS(DOT_OF) };
+static struct value (*const Min[])(void const *, size_t) = { KINDS(MIN_OF) };
+static struct value (*const Max[])(void const *, size_t) = { KINDS(MAX_OF) };
+static void (*const Arith[])(void *, void const *, void const *, bool, size_t, int) = { KINDS(ARITH_OF) };
+static void (*const Compare[])(uint8_t *, void const *, void const *, bool, size_t, int) = { KINDS(COMPARE_OF) };
+static int (*const Order[])(void const *, void const *) = { KINDS(ORDER_OF) };
+
+#define NAME(t) (Names[(t)->typed->kind])
+
+char const *
+typed_array_name(int kind)
+{
+        return Names[kind];
+}
+
+struct typed_array *
+typed_array_new(int kind, size_t n)
+{
+        /* The items aren't seen by the collector, so they can go first */
+        void *items = NULL;
+
+        if (n > 0) {
+                items = gc_resize(NULL, n * Sizes[kind]);
+                memset(items, 0, n * Sizes[kind]);
+        }
+
+        struct typed_array *t = gc_alloc_object(sizeof *t, GC_TYPED_ARRAY);
+        t->items = items;
+        t->count = n;
+        t->capacity = n;
+        t->kind = kind;
+
+        return t;
+}
+
+static void
+reserve(struct typed_array *t, size_t n)
+{
+        if (n > t->capacity) {
+                t->capacity = max(n, 2 * t->capacity);
+                resize(t->items, t->capacity * Sizes[t->kind]);
+        }
+}
+
+/*
+ * Converts v to an element of the given kind. Integers wrap around to fit
+ * like they do in C, and only the float kinds take floats.
+ */
+static bool
+element(int kind, struct value const *v, void *out)
+{
+        if (v->type == VALUE_INTEGER) {
+                switch (kind) {
+                case TYPED_U8:  *(uint8_t *)out = v->integer; return true;
+                case TYPED_I32: *(int32_t *)out = v->integer; return true;
+                case TYPED_I64: *(int64_t *)out = v->integer; return true;
+                case TYPED_F32: *(float *)out   = v->integer; return true;
+                case TYPED_F64: *(double *)out  = v->integer; return true;
+                }
+        } else if (v->type == VALUE_REAL) {
+                switch (kind) {
+                case TYPED_F32: *(float *)out   = v->real;    return true;
+                case TYPED_F64: *(double *)out  = v->real;    return true;
+                }
+        }
+
+        return false;
+}
+
+struct value
+typed_array_get(struct typed_array const *t, size_t i)
+{
+        switch (t->kind) {
+        case TYPED_U8:  return INTEGER(((uint8_t const *)t->items)[i]);
+        case TYPED_I32: return INTEGER(((int32_t const *)t->items)[i]);
+        case TYPED_I64: return INTEGER(((int64_t const *)t->items)[i]);
+        case TYPED_F32: return REAL(((float const *)t->items)[i]);
+        case TYPED_F64: return REAL(((double const *)t->items)[i]);
+        }
+
+        return NIL;
+}
+
+void
+typed_array_set(struct typed_array *t, size_t i, struct value const *v)
+{
+        if (!element(t->kind, v, (char *)t->items + i * Sizes[t->kind])) {
+                vm_panic("attempt to store %s in %s", value_show(v), Names[t->kind]);
+        }
+}
+
+static struct typed_array *
+copy(struct typed_array const *t)
+{
+        struct typed_array *r = typed_array_new(t->kind, t->count);
+
+        if (t->count > 0) {
+                memcpy(r->items, t->items, t->count * Sizes[t->kind]);
+        }
+
+        return r;
+}
+
+/*
+ * The other operand of an elementwise method: either a typed array of the same
+ * kind and length, or a number that's used for every element.
+ */
+static void const *
+operand(struct value const *self, struct value const *v, char const *method, bool *scalar, void *buf)
+{
+        struct typed_array const *t = self->typed;
+
+        if (v->type == VALUE_TYPED_ARRAY) {
+                if (v->typed->kind != t->kind) {
+                        vm_panic("%s.%s() expects a %s but got %s", NAME(self), method, NAME(self), NAME(v));
+                }
+                if (v->typed->count != t->count) {
+                        vm_panic("%s.%s(): lengths differ: %zu and %zu", NAME(self), method, t->count, v->typed->count);
+                }
+                *scalar = false;
+                return v->typed->items;
+        }
+
+        if (!element(t->kind, v, buf)) {
+                vm_panic("%s.%s(): invalid operand: %s", NAME(self), method, value_show(v));
+        }
+
+        *scalar = true;
+
+        return buf;
+}
+
+static struct value
+arith(struct value *self, int argc, struct value *kwargs, char const *method, int op, bool mut)
+{
+        if (argc != 1)
+                vm_panic("%s.%s() expects 1 argument but got %d", NAME(self), method, argc);
+
+        int64_t buf;
+        bool scalar;
+        void const *ys = operand(self, &ARG(0), method, &scalar, &buf);
+
+        struct typed_array *t = self->typed;
+        struct typed_array *r = mut ? t : typed_array_new(t->kind, t->count);
+
+        Arith[t->kind](r->items, t->items, ys, scalar, t->count, op);
+
+        return mut ? *self : TYPED_ARRAY(r);
+}
+
+static struct value
+compare(struct value *self, int argc, struct value *kwargs, char const *method, int op)
+{
+        if (argc != 1)
+                vm_panic("%s.%s() expects 1 argument but got %d", NAME(self), method, argc);
+
+        int64_t buf;
+        bool scalar;
+        void const *ys = operand(self, &ARG(0), method, &scalar, &buf);
+
+        struct typed_array *t = self->typed;
+        struct typed_array *r = typed_array_new(TYPED_U8, t->count);
+
+        Compare[t->kind](r->items, t->items, ys, scalar, t->count, op);
+
+        return TYPED_ARRAY(r);
+}
+
+static struct value
+typed_add(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "add", OP_ADD, false);
+}
+
+static struct value
+typed_add_mut(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "add!", OP_ADD, true);
+}
+
+static struct value
+typed_sub(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "sub", OP_SUB, false);
+}
+
+static struct value
+typed_sub_mut(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "sub!", OP_SUB, true);
+}
+
+static struct value
+typed_mul(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "mul", OP_MUL, false);
+}
+
+static struct value
+typed_mul_mut(struct value *self, int argc, struct value *kwargs)
+{
+        return arith(self, argc, kwargs, "mul!", OP_MUL, true);
+}
+
+static struct value
+typed_scale(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc == 1 && ARG(0).type == VALUE_TYPED_ARRAY)
+                vm_panic("%s.scale() expects a number but got %s", NAME(self), NAME(&ARG(0)));
+
+        return arith(self, argc, kwargs, "scale", OP_MUL, false);
+}
+
+static struct value
+typed_scale_mut(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc == 1 && ARG(0).type == VALUE_TYPED_ARRAY)
+                vm_panic("%s.scale!() expects a number but got %s", NAME(self), NAME(&ARG(0)));
+
+        return arith(self, argc, kwargs, "scale!", OP_MUL, true);
+}
+
+static struct value
+typed_eq(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "eq", CMP_EQ);
+}
+
+static struct value
+typed_ne(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "ne", CMP_NE);
+}
+
+static struct value
+typed_lt(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "lt", CMP_LT);
+}
+
+static struct value
+typed_le(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "le", CMP_LE);
+}
+
+static struct value
+typed_gt(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "gt", CMP_GT);
+}
+
+static struct value
+typed_ge(struct value *self, int argc, struct value *kwargs)
+{
+        return compare(self, argc, kwargs, "ge", CMP_GE);
+}
+
+static struct value
+typed_sum(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.sum() expects no arguments but got %d", NAME(self), argc);
+
+        return Sum[self->typed->kind](self->typed->items, self->typed->count);
+}
+
+static struct value
+typed_min(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.min() expects no arguments but got %d", NAME(self), argc);
+
+        if (self->typed->count == 0)
+                return NIL;
+
+        return Min[self->typed->kind](self->typed->items, self->typed->count);
+}
+
+static struct value
+typed_max(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.max() expects no arguments but got %d", NAME(self), argc);
+
+        if (self->typed->count == 0)
+                return NIL;
+
+        return Max[self->typed->kind](self->typed->items, self->typed->count);
+}
+
+static struct value
+typed_dot(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 1)
+                vm_panic("%s.dot() expects 1 argument but got %d", NAME(self), argc);
+
+        if (ARG(0).type != VALUE_TYPED_ARRAY)
+                vm_panic("%s.dot() expects a %s but got %s", NAME(self), NAME(self), value_show(&ARG(0)));
+
+        int64_t buf;
+        bool scalar;
+        void const *ys = operand(self, &ARG(0), "dot", &scalar, &buf);
+
+        return Dot[self->typed->kind](self->typed->items, ys, self->typed->count);
+}
+
+static struct value
+typed_len(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.len() expects no arguments but got %d", NAME(self), argc);
+
+        return INTEGER(self->typed->count);
+}
+
+static struct value
+typed_push(struct value *self, int argc, struct value *kwargs)
+{
+        struct typed_array *t = self->typed;
+
+        reserve(t, t->count + argc);
+
+        for (int i = 0; i < argc; ++i) {
+                typed_array_set(t, t->count, &ARG(i));
+                t->count += 1;
+        }
+
+        return NIL;
+}
+
+static struct value
+typed_pop(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.pop() expects no arguments but got %d", NAME(self), argc);
+
+        if (self->typed->count == 0)
+                return NIL;
+
+        return typed_array_get(self->typed, --self->typed->count);
+}
+
+static struct value
+typed_clone(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.clone() expects no arguments but got %d", NAME(self), argc);
+
+        return TYPED_ARRAY(copy(self->typed));
+}
+
+static struct value
+typed_slice(struct value *self, int argc, struct value *kwargs)
+{
+        intmax_t start = 0;
+        intmax_t n = self->typed->count;
+
+        switch (argc) {
+        case 2:
+                if (ARG(1).type != VALUE_INTEGER)
+                        vm_panic("the second argument to %s.slice() must be an integer", NAME(self));
+                n = ARG(1).integer;
+        case 1:
+                if (ARG(0).type != VALUE_INTEGER)
+                        vm_panic("the first argument to %s.slice() must be an integer", NAME(self));
+                start = ARG(0).integer;
+        case 0:
+                break;
+        default:
+                vm_panic("%s.slice() expects 0, 1, or 2 arguments but got %d", NAME(self), argc);
+        }
+
+        if (start < 0)
+                start += self->typed->count;
+        if (start < 0 || start > self->typed->count)
+                vm_panic("start index %jd out of range in call to %s.slice()", start, NAME(self));
+
+        if (n < 0)
+                n += self->typed->count;
+        if (n < 0)
+                vm_panic("count %jd out of range in call to %s.slice()", n, NAME(self));
+        n = min(n, self->typed->count - start);
+
+        struct typed_array *r = typed_array_new(self->typed->kind, n);
+        size_t size = Sizes[r->kind];
+
+        if (n > 0) {
+                memcpy(r->items, (char *)self->typed->items + start * size, n * size);
+        }
+
+        return TYPED_ARRAY(r);
+}
+
+static struct value
+typed_sort_mut(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.sort!() expects no arguments but got %d", NAME(self), argc);
+
+        struct typed_array *t = self->typed;
+
+        if (t->count > 1) {
+                qsort(t->items, t->count, Sizes[t->kind], Order[t->kind]);
+        }
+
+        return *self;
+}
+
+static struct value
+typed_sort(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.sort() expects no arguments but got %d", NAME(self), argc);
+
+        struct value r = TYPED_ARRAY(copy(self->typed));
+
+        return typed_sort_mut(&r, 0, NULL);
+}
+
+static struct value
+typed_list(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.list() expects no arguments but got %d", NAME(self), argc);
+
+        struct typed_array const *t = self->typed;
+        struct array *a = value_array_new();
+
+        NOGC(a);
+        vec_reserve(*a, t->count);
+
+        for (size_t i = 0; i < t->count; ++i) {
+                a->items[i] = typed_array_get(t, i);
+        }
+
+        a->count = t->count;
+        OKGC(a);
+
+        return ARRAY(a);
+}
+
+static struct value
+typed_blob(struct value *self, int argc, struct value *kwargs)
+{
+        if (argc != 0)
+                vm_panic("%s.blob() expects no arguments but got %d", NAME(self), argc);
+
+        struct blob *b = value_blob_new();
+
+        NOGC(b);
+        vec_push_n(*b, (unsigned char *)self->typed->items, self->typed->count * Sizes[self->typed->kind]);
+        OKGC(b);
+
+        return BLOB(b);
+}
+
+static struct value
+typed_ptr(struct value *self, int argc, struct value *kwargs)
+{
+        struct typed_array *t = self->typed;
+
+        if (argc == 0) {
+                return TPTR(FFITypes[t->kind], t->items);
+        }
+
+        if (argc == 1) {
+                if (ARG(0).type != VALUE_INTEGER) {
+                        vm_panic("%s.ptr() expects an integer but got %s", NAME(self), value_show(&ARG(0)));
+                }
+
+                /* One past the last element is allowed, as it is in C */
+                intmax_t i = ARG(0).integer;
+                if (i < 0 || i > t->count) {
+                        vm_panic("index %jd out of range in call to %s.ptr()", i, NAME(self));
+                }
+
+                return TPTR(FFITypes[t->kind], (char *)t->items + i * Sizes[t->kind]);
+        }
+
+        vm_panic("%s.ptr() expects 0 or 1 arguments but got %d", NAME(self), argc);
+}
+
+/*
+ * ty.typedArray(class, ...) is what the constructors of the typed array
+ * classes in the prelude call:
+ *
+ *      Float64Array()            empty
+ *      Float64Array(n)           n zeros
+ *      Float64Array(xs)          the numbers in an Array, or another typed array
+ *      Float64Array(blob)        the bytes of a Blob, taken as native elements
+ *      Float64Array(ptr, n)      n elements copied from an ffi pointer
+ */
+struct value
+builtin_typed_array(int argc, struct value *kwargs)
+{
+        struct value c = (argc > 0) ? ARG(0) : NIL;
+
+        if (c.type != VALUE_CLASS || c.class < CLASS_UINT8_ARRAY || c.class > CLASS_FLOAT64_ARRAY)
+                vm_panic("ty.typedArray() expects a typed array class but got %s", value_show(&c));
+
+        int kind = c.class - CLASS_UINT8_ARRAY;
+        size_t size = Sizes[kind];
+        struct typed_array *t;
+        struct value v, x;
+
+        switch (argc) {
+        case 1:
+                return TYPED_ARRAY(typed_array_new(kind, 0));
+        case 2:
+                break;
+        case 3:
+                if (ARG(1).type != VALUE_PTR || ARG(2).type != VALUE_INTEGER || ARG(2).integer < 0)
+                        vm_panic("%s(ptr, n) expects a pointer and a non-negative integer", Names[kind]);
+                t = typed_array_new(kind, ARG(2).integer);
+                if (t->count > 0) {
+                        memcpy(t->items, ARG(1).ptr, t->count * size);
+                }
+                return TYPED_ARRAY(t);
+        default:
+                vm_panic("%s() expects 0, 1, or 2 arguments but got %d", Names[kind], argc - 1);
+        }
+
+        v = ARG(1);
+
+        switch (v.type) {
+        case VALUE_INTEGER:
+                if (v.integer < 0)
+                        vm_panic("%s(): negative length: %jd", Names[kind], v.integer);
+                t = typed_array_new(kind, v.integer);
+                break;
+        case VALUE_ARRAY:
+                t = typed_array_new(kind, v.array->count);
+                for (size_t i = 0; i < t->count; ++i) {
+                        typed_array_set(t, i, &v.array->items[i]);
+                }
+                break;
+        case VALUE_TYPED_ARRAY:
+                t = typed_array_new(kind, v.typed->count);
+                for (size_t i = 0; i < t->count; ++i) {
+                        x = typed_array_get(v.typed, i);
+                        /* Going from floats to integers truncates, like int() */
+                        if (x.type == VALUE_REAL && kind < TYPED_F32) {
+                                x = INTEGER((intmax_t)x.real);
+                        }
+                        typed_array_set(t, i, &x);
+                }
+                break;
+        case VALUE_BLOB:
+                if (v.blob->count % size != 0)
+                        vm_panic("%s(): blob of %zu bytes isn't a whole number of elements", Names[kind], v.blob->count);
+                t = typed_array_new(kind, v.blob->count / size);
+                if (t->count > 0) {
+                        memcpy(t->items, v.blob->items, v.blob->count);
+                }
+                break;
+        default:
+                vm_panic("%s(): can't make one out of %s", Names[kind], value_show(&v));
+        }
+
+        return TYPED_ARRAY(t);
+}
+
+DEFINE_METHOD_TABLE(
+        { .name = "add",      .func = typed_add         },
+        { .name = "add!",     .func = typed_add_mut     },
+        { .name = "blob",     .func = typed_blob        },
+        { .name = "clone",    .func = typed_clone       },
+        { .name = "dot",      .func = typed_dot         },
+        { .name = "eq",       .func = typed_eq          },
+        { .name = "ge",       .func = typed_ge          },
+        { .name = "gt",       .func = typed_gt          },
+        { .name = "le",       .func = typed_le          },
+        { .name = "len",      .func = typed_len         },
+        { .name = "list",     .func = typed_list        },
+        { .name = "lt",       .func = typed_lt          },
+        { .name = "max",      .func = typed_max         },
+        { .name = "min",      .func = typed_min         },
+        { .name = "mul",      .func = typed_mul         },
+        { .name = "mul!",     .func = typed_mul_mut     },
+        { .name = "ne",       .func = typed_ne          },
+        { .name = "pop",      .func = typed_pop         },
+        { .name = "ptr",      .func = typed_ptr         },
+        { .name = "push",     .func = typed_push        },
+        { .name = "scale",    .func = typed_scale       },
+        { .name = "scale!",   .func = typed_scale_mut   },
+        { .name = "slice",    .func = typed_slice       },
+        { .name = "sort",     .func = typed_sort        },
+        { .name = "sort!",    .func = typed_sort_mut    },
+        { .name = "sub",      .func = typed_sub         },
+        { .name = "sub!",     .func = typed_sub_mut     },
+        { .name = "sum",      .func = typed_sum         },
+);
+
+DEFINE_METHOD_LOOKUP(typed_array)
+DEFINE_METHOD_COMPLETER(typed_array)
@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/random.h>
 
 #include "value.h"
 #include "test.h"
@@ -16,6 +20,7 @@
 #include "gc.h"
 #include "vm.h"
 #include "token.h"
+#include "typed.h"
 
 static bool
 arrays_equal(struct value const *v1, struct value const *v2)
@@ -53,86 +58,257 @@ tuples_equal(struct value const *v1, struct value const *v2)
         return true;
 }
 
-inline static unsigned long
-str_hash(char const *str, int n)
+/*
+ * Everything is hashed with wyhash (public domain, by Wang Yi:
+ * https://github.com/wangyi-fudan/wyhash), which reads 8 bytes at a time. The
+ * seed is picked at random when the VM starts so that a set of keys that all
+ * land in the same place can't be worked out ahead of time; TY_HASH_SEED fixes
+ * it, for runs that need to be reproducible.
+ */
+static uint64_t const HashSecret[4] = {
+        0x2d358dccaa6c78a5ULL,
+        0x8bb84b93962eacc9ULL,
+        0x4b33a62ed433d4a3ULL,
+        0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t HashSeed;
+
+inline static void
+wymum(uint64_t *a, uint64_t *b)
 {
-        unsigned long hash = 2166136261UL;
+        __uint128_t r = (__uint128_t)*a * *b;
+        *a = (uint64_t)r;
+        *b = (uint64_t)(r >> 64);
+}
 
-        for (int i = 0; i < n; ++i)
-                hash = (hash ^ str[i]) * 16777619UL;
+inline static uint64_t
+wymix(uint64_t a, uint64_t b)
+{
+        wymum(&a, &b);
+        return a ^ b;
+}
 
-        return hash;
+inline static uint64_t
+wyr8(unsigned char const *p)
+{
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
 }
 
-inline static unsigned long
-int_hash(intmax_t k)
+inline static uint64_t
+wyr4(unsigned char const *p)
 {
-        unsigned long hash = 2166136261UL;
-        char const *bytes = (char const *) &k;
-        unsigned char c;
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+}
 
-        for (int i = 0; i < sizeof k; ++i) {
-                c = bytes[i];
-                hash = (hash ^ c) * 16777619UL;
+inline static uint64_t
+wyr3(unsigned char const *p, size_t n)
+{
+        return (((uint64_t)p[0]) << 16) | (((uint64_t)p[n >> 1]) << 8) | p[n - 1];
+}
+
+static uint64_t
+wyhash(void const *key, size_t n)
+{
+        unsigned char const *p = key;
+        uint64_t seed = HashSeed;
+        uint64_t a, b;
+
+        if (n <= 16) {
+                if (n >= 4) {
+                        a = (wyr4(p) << 32) | wyr4(p + ((n >> 3) << 2));
+                        b = (wyr4(p + n - 4) << 32) | wyr4(p + n - 4 - ((n >> 3) << 2));
+                } else if (n > 0) {
+                        a = wyr3(p, n);
+                        b = 0;
+                } else {
+                        a = b = 0;
+                }
+        } else {
+                size_t i = n;
+                if (i >= 48) {
+                        uint64_t see1 = seed;
+                        uint64_t see2 = seed;
+                        do {
+                                seed = wymix(wyr8(p) ^ HashSecret[1], wyr8(p + 8) ^ seed);
+                                see1 = wymix(wyr8(p + 16) ^ HashSecret[2], wyr8(p + 24) ^ see1);
+                                see2 = wymix(wyr8(p + 32) ^ HashSecret[3], wyr8(p + 40) ^ see2);
+                                p += 48;
+                                i -= 48;
+                        } while (i >= 48);
+                        seed ^= see1 ^ see2;
+                }
+                while (i > 16) {
+                        seed = wymix(wyr8(p) ^ HashSecret[1], wyr8(p + 8) ^ seed);
+                        p += 16;
+                        i -= 16;
+                }
+                a = wyr8(p + i - 16);
+                b = wyr8(p + i - 8);
         }
 
-        return hash;
+        a ^= HashSecret[1];
+        b ^= seed;
+        wymum(&a, &b);
+
+        return wymix(a ^ HashSecret[0] ^ n, b ^ HashSecret[1]);
 }
 
-inline static unsigned long
-ptr_hash(void const *p)
+/* One word, e.g. an integer or a pointer */
+inline static uint64_t
+wyhash_word(uint64_t k)
+{
+        uint64_t a = k ^ HashSecret[0];
+        uint64_t b = HashSeed ^ HashSecret[1];
+
+        wymum(&a, &b);
+
+        return wymix(a ^ HashSecret[0], b ^ HashSecret[1]);
+}
+
+void
+value_hash_init(void)
 {
-        unsigned long hash = 2166136261UL;
-        char const *bytes = (char const *) &p;
-        unsigned char c;
+        uint64_t seed;
+        char const *fixed = getenv("TY_HASH_SEED");
 
-        for (int i = 0; i < sizeof p; ++i) {
-                c = bytes[i];
-                hash = (hash ^ c) * 16777619UL;
+        if (fixed != NULL) {
+                seed = strtoull(fixed, NULL, 0);
+        } else if (getrandom(&seed, sizeof seed, 0) != sizeof seed) {
+                seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
         }
 
-        return hash;
+        HashSeed = seed ^ wymix(seed ^ HashSecret[0], HashSecret[1]);
+}
+
+/*
+ * A string of at least STRING_HASH_MIN bytes has one of these after it, 8-byte
+ * aligned, so that it only gets hashed the first time. A value can only use it
+ * if it covers the whole allocation, i.e. it starts at gcstr and has the same
+ * length that the string was allocated with.
+ */
+#define STRING_HASH_MIN 32
+
+struct string_hash {
+        uint64_t bytes;
+        _Atomic uint64_t hash;
+};
+
+static char *
+string_alloc(size_t n, size_t bytes)
+{
+        if (n < STRING_HASH_MIN) {
+                return gc_alloc_object(n, GC_STRING);
+        }
+
+        size_t offset = (n + 7) & ~(size_t)7;
+        char *s = gc_alloc_object(offset + sizeof (struct string_hash), GC_STRING);
+        struct string_hash *h = (struct string_hash *)(s + offset);
+
+        h->bytes = bytes;
+        atomic_init(&h->hash, 0);
+
+        return s;
+}
+
+inline static struct string_hash *
+string_hash_of(struct value const *v)
+{
+        if (v->bytes < STRING_HASH_MIN || v->gcstr == NULL || v->string != v->gcstr)
+                return NULL;
+
+        struct alloc const *a = ALLOC_OF(v->gcstr);
+
+        if (a->type != GC_STRING)
+                return NULL;
+
+        struct string_hash *h = (struct string_hash *)(v->gcstr + a->size - sizeof *h);
+
+        return (h->bytes == v->bytes) ? h : NULL;
+}
+
+/* 0 means a cached hash hasn't been filled in yet, so no string hashes to 0 */
+inline static uint64_t
+wyhash_str(char const *s, size_t n)
+{
+        uint64_t hash = wyhash(s, n);
+        return hash + (hash == 0);
 }
 
 inline static unsigned long
-flt_hash(float flt)
+str_hash(struct value const *v)
 {
-        unsigned long hash = 2166136261UL;
-        char const *bytes = (char const *) &flt;
-        unsigned char c;
+        struct string_hash *cache = string_hash_of(v);
 
-        for (int i = 0; i < sizeof flt; ++i) {
-                c = bytes[i];
-                hash = (hash ^ c) * 16777619UL;
+        if (cache == NULL)
+                return wyhash_str(v->string, v->bytes);
+
+        uint64_t hash = atomic_load_explicit(&cache->hash, memory_order_relaxed);
+
+        if (hash == 0) {
+                hash = wyhash_str(v->string, v->bytes);
+                atomic_store_explicit(&cache->hash, hash, memory_order_relaxed);
         }
 
         return hash;
 }
 
+inline static unsigned long
+int_hash(intmax_t k)
+{
+        return wyhash_word(k);
+}
+
+inline static unsigned long
+ptr_hash(void const *p)
+{
+        return wyhash_word((uintptr_t)p);
+}
+
+inline static unsigned long
+flt_hash(double x)
+{
+        uint64_t bits;
+
+        /* -0.0 == 0.0, so they need to hash the same */
+        if (x == 0.0)
+                x = 0.0;
+
+        memcpy(&bits, &x, sizeof bits);
+
+        return wyhash_word(bits);
+}
+
+inline static unsigned long
+combine(uint64_t hash, uint64_t item)
+{
+        return wymix(hash ^ HashSecret[2], item ^ HashSecret[3]);
+}
+
 inline static unsigned long
 ary_hash(struct value const *a)
 {
-        unsigned long hash = 2166136261UL;
+        uint64_t hash = HashSeed;
 
-        for (int i = 0; i < a->array->count; ++i) {
-                unsigned char c = value_hash(&a->array->items[i]);
-                hash = (hash ^ c) * 16777619UL;
-        }
+        for (int i = 0; i < a->array->count; ++i)
+                hash = combine(hash, value_hash(&a->array->items[i]));
 
-        return hash;
+        return wyhash_word(hash ^ a->array->count);
 }
 
 inline static unsigned long
 tpl_hash(struct value const *t)
 {
-        unsigned long hash = 2166136261UL;
+        uint64_t hash = HashSeed ^ HashSecret[0];
 
-        for (int i = 0; i < t->count; ++i) {
-                unsigned char c = value_hash(&t->items[i]);
-                hash = (hash ^ c) * 16777619UL;
-        }
+        for (int i = 0; i < t->count; ++i)
+                hash = combine(hash, value_hash(&t->items[i]));
 
-        return hash;
+        return wyhash_word(hash ^ t->count);
 }
 
 inline static unsigned long
@@ -145,7 +321,7 @@ obj_hash(struct value const *v)
                 if (h.type != VALUE_INTEGER) {
                         vm_panic("%s.__hash__ return non-integer: %s", class_name(v->class), value_show(v));
                 }
-                return (unsigned long)h.integer;
+                return wyhash_word(h.integer);
         } else {
                 return ptr_hash(v->object);
         }
@@ -157,7 +333,7 @@ hash(struct value const *val)
         switch (val->type & ~VALUE_TAGGED) {
         case VALUE_NIL:               return 0xDEADBEEFULL;
         case VALUE_BOOLEAN:           return val->boolean ? 0xABCULL : 0xDEFULL;
-        case VALUE_STRING:            return str_hash(val->string, val->bytes);
+        case VALUE_STRING:            return str_hash(val);
         case VALUE_INTEGER:           return int_hash(val->integer);
         case VALUE_REAL:              return flt_hash(val->real);
         case VALUE_ARRAY:             return ary_hash(val);
@@ -207,13 +383,14 @@ show_dict(struct value const *d, bool color)
                 strcpy(s + len, str); \
                 len += n;
 
-        for (size_t i = 0, j = 0; i < d->dict->size; ++i) {
+        for (size_t i = 0, j = 0; i < d->dict->used; ++i) {
                 if (d->dict->keys[i].type == 0) continue;
+                struct value v = dict_value(d->dict, i);
                 char *key = color ? value_show_color(&d->dict->keys[i]) : value_show(&d->dict->keys[i]);
-                char *val = color ? value_show_color(&d->dict->values[i]) : value_show(&d->dict->values[i]);
+                char *val = color ? value_show_color(&v) : value_show(&v);
                 add(j == 0 ? "" : ", ");
                 add(key);
-                if (d->dict->values[i].type != VALUE_NIL) {
+                if (v.type != VALUE_NIL) {
                         add(": ");
                         add(val);
                 }
@@ -413,20 +590,20 @@ value_show(struct value const *v)
                 break;
         case VALUE_METHOD:
                 if (v->this == NULL)
-                        snprintf(buffer, 1024, "<method '%s' at %p>", v->name, (void *)v->method);
+                        snprintf(buffer, 1024, "<method '%s' at %p>", intern_name(v->name), (void *)v->method);
                 else
-                        snprintf(buffer, 1024, "<method '%s' at %p bound to %s>", v->name, (void *)v->method, value_show(v->this));
+                        snprintf(buffer, 1024, "<method '%s' at %p bound to %s>", intern_name(v->name), (void *)v->method, value_show(v->this));
                 break;
         case VALUE_BUILTIN_METHOD:
-                snprintf(buffer, 1024, "<bound builtin method '%s'>", v->name);
+                snprintf(buffer, 1024, "<bound builtin method '%s'>", intern_name(v->name));
                 break;
         case VALUE_BUILTIN_FUNCTION:
-                if (v->name == NULL)
+                if (v->name == 0)
                         snprintf(buffer, 1024, "<builtin function>");
                 else if (v->module == NULL)
-                        snprintf(buffer, 1024, "<builtin function '%s'>", v->name);
+                        snprintf(buffer, 1024, "<builtin function '%s'>", intern_name(v->name));
                 else
-                        snprintf(buffer, 1024, "<builtin function '%s::%s'>", v->module, v->name);
+                        snprintf(buffer, 1024, "<builtin function '%s::%s'>", v->module, intern_name(v->name));
                 break;
         case VALUE_CLASS:
                 snprintf(buffer, 1024, "<class %s>", class_name(v->class));
@@ -437,6 +614,9 @@ value_show(struct value const *v)
         case VALUE_BLOB:
                 snprintf(buffer, 1024, "<blob at %p (%zu bytes)>", (void *) v->blob, v->blob->count);
                 break;
+        case VALUE_TYPED_ARRAY:
+                snprintf(buffer, 1024, "<%s at %p (%zu items)>", typed_array_name(v->typed->kind), (void *) v->typed, v->typed->count);
+                break;
         case VALUE_PTR:
                 snprintf(buffer, 1024, "<pointer at %p>", v->ptr);
                 break;
@@ -558,7 +738,7 @@ value_show_color(struct value const *v)
                                 "%s<method %s'%s'%s at %s%p%s>%s",
                                 TERM(96),
                                 TERM(92),
-                                v->name,
+                                intern_name(v->name),
                                 TERM(96),
                                 TERM(94),
                                 (void *)v->method,
@@ -573,7 +753,7 @@ value_show_color(struct value const *v)
                                 "%s<method %s'%s'%s at %s%p%s bound to %s%s%s>%s",
                                 TERM(96),
                                 TERM(92),
-                                v->name,
+                                intern_name(v->name),
                                 TERM(96),
                                 TERM(94),
                                 (void *)v->method,
@@ -593,13 +773,13 @@ value_show_color(struct value const *v)
                         "%s<bound builtin method %s'%s'%s>%s",
                         TERM(96),
                         TERM(92),
-                        v->name,
+                        intern_name(v->name),
                         TERM(96),
                         TERM(0)
                 );
                 break;
         case VALUE_BUILTIN_FUNCTION:
-                if (v->name == NULL)
+                if (v->name == 0)
                         snprintf(
                                 buffer,
                                 sizeof buffer,
@@ -614,7 +794,7 @@ value_show_color(struct value const *v)
                                 "%s<builtin function %s'%s'%s>%s",
                                 TERM(96),
                                 TERM(92),
-                                v->name,
+                                intern_name(v->name),
                                 TERM(96),
                                 TERM(0)
                         );
@@ -626,7 +806,7 @@ value_show_color(struct value const *v)
                                 TERM(96),
                                 TERM(92),
                                 v->module,
-                                v->name,
+                                intern_name(v->name),
                                 TERM(96),
                                 TERM(0)
                         );
@@ -640,6 +820,9 @@ value_show_color(struct value const *v)
         case VALUE_BLOB:
                 snprintf(buffer, sizeof buffer, "<blob at %p (%zu bytes)>", (void *) v->blob, v->blob->count);
                 break;
+        case VALUE_TYPED_ARRAY:
+                snprintf(buffer, sizeof buffer, "<%s at %p (%zu items)>", typed_array_name(v->typed->kind), (void *) v->typed, v->typed->count);
+                break;
         case VALUE_PTR:
                 snprintf(buffer, sizeof buffer, "<pointer at %p>", v->ptr);
                 break;
@@ -738,7 +921,7 @@ value_compare(void const *_v1, void const *_v2)
                 return ((int)v1->count) - ((int)v2->count);
         case VALUE_OBJECT:;
                 struct value const *cmpfn = class_method(v1->class, "<=>");
-                struct value method = METHOD("<=>", cmpfn, v1);
+                struct value method = METHOD(intern("<=>")->id, cmpfn, v1);
                 if (cmpfn == NULL)
                         goto Fail;
                 struct value v = vm_eval_function(&method, v2, NULL);
@@ -762,6 +945,7 @@ value_truthy(struct value const *v)
         case VALUE_ARRAY:            return (v->array->count != 0);
         case VALUE_TUPLE:            return (v->count != 0);
         case VALUE_BLOB:             return (v->blob->count != 0);
+        case VALUE_TYPED_ARRAY:      return (v->typed->count != 0);
         case VALUE_REGEX:            return true;
         case VALUE_FUNCTION:         return true;
         case VALUE_BUILTIN_FUNCTION: return true;
@@ -907,6 +1091,7 @@ value_test_equality(struct value const *v1, struct value const *v2)
         case VALUE_TAG:              if (v1->tag != v2->tag)                                                        return false; break;
         case VALUE_CLASS:            if (v1->class != v2->class)                                                    return false; break;
         case VALUE_BLOB:             if (v1->blob->items != v2->blob->items)                                        return false; break;
+        case VALUE_TYPED_ARRAY:      if (v1->typed != v2->typed)                                                    return false; break;
         case VALUE_PTR:              if (v1->ptr != v2->ptr)                                                        return false; break;
         case VALUE_NIL:                                                                                                           break;
         case VALUE_OBJECT:
@@ -933,23 +1118,17 @@ value_array_mark(struct array *a)
 
         MARK(a);
 
-        for (int i = 0; i < a->count; ++i) {
-                value_mark(&a->items[i]);
-        }
+        GCMarkArray(a);
 }
 
 inline static void
 mark_tuple(struct value const *v)
 {
-        if (v->items == NULL || MARKED(v->items)) return;
-
-        MARK(v->items);
-
-        for (int i = 0; i < v->count; ++i) {
-                value_mark(&v->items[i]);
-        }
-
-        if (v->names != NULL) {
+        /*
+         * The names are allocated after the items, so they can be younger than
+         * them, and only the tuple value itself refers to them.
+         */
+        if (v->names != NULL && !MARKED(v->names)) {
                 MARK(v->names);
                 if (v->gc_names) {
                         for (int i = 0; i < v->count; ++i) {
@@ -960,6 +1139,12 @@ mark_tuple(struct value const *v)
                         }
                 }
         }
+
+        if (v->items == NULL || MARKED(v->items)) return;
+
+        MARK(v->items);
+
+        GCMarkValues(v->items, v->count);
 }
 
 inline static void
@@ -979,9 +1164,7 @@ mark_generator(struct value const *v)
 
         value_mark(&v->gen->f);
 
-        for (int i = 0; i < v->gen->frame.count; ++i) {
-                value_mark(&v->gen->frame.items[i]);
-        }
+        GCMarkFrame(v->gen);
 }
 
 inline static void
@@ -994,10 +1177,7 @@ mark_function(struct value const *v)
 
         MARK(v->env);
 
-        for (size_t i = 0; i < n; ++i) {
-                MARK(v->env[i]);
-                value_mark(v->env[i]);
-        }
+        GCMarkEnv(v->env, n);
 }
 
 inline static void
@@ -1014,7 +1194,7 @@ mark_pointer(struct value const *v)
 char *
 value_string_clone_nul(char const *src, int n)
 {
-        char *s = gc_alloc_object(n + 1, GC_STRING);
+        char *s = string_alloc(n + 1, n);
 
         memcpy(s, src, n);
         s[n] = '\0';
@@ -1029,7 +1209,7 @@ value_string_clone(char const *src, int n)
                 return NULL;
         }
 
-        char *s = gc_alloc_object(n, GC_STRING);
+        char *s = string_alloc(n, n);
         memcpy(s, src, n);
         return s;
 }
@@ -1037,15 +1217,15 @@ value_string_clone(char const *src, int n)
 char *
 value_string_alloc(int n)
 {
-        return gc_alloc_object(n, GC_STRING);
+        return string_alloc(n, n);
 }
 
 void
 _value_mark(struct value const *v)
 {
         switch (v->type & ~VALUE_TAGGED) {
-        case VALUE_METHOD:          if (!MARKED(v->this)) { MARK(v->this); value_mark(v->this); } break;
-        case VALUE_BUILTIN_METHOD:  if (!MARKED(v->this)) { MARK(v->this); value_mark(v->this); } break;
+        case VALUE_METHOD:          if (!MARKED(v->this)) { MARK(v->this); GCMarkValues(v->this, 1); } break;
+        case VALUE_BUILTIN_METHOD:  if (!MARKED(v->this)) { MARK(v->this); GCMarkValues(v->this, 1); } break;
         case VALUE_ARRAY:           value_array_mark(v->array);                                   break;
         case VALUE_TUPLE:           mark_tuple(v);                                                break;
         case VALUE_DICT:            dict_mark(v->dict);                                           break;
@@ -1054,8 +1234,9 @@ _value_mark(struct value const *v)
         case VALUE_THREAD:          mark_thread(v);                                               break;
         case VALUE_STRING:          if (v->gcstr != NULL) MARK(v->gcstr);                         break;
         case VALUE_OBJECT:          object_mark(v->object);                                       break;
-        case VALUE_REF:             MARK(v->ptr); value_mark(v->ptr);                             break;
+        case VALUE_REF:             MARK(v->ptr); GCMarkValues(v->ptr, 1);                        break;
         case VALUE_BLOB:            MARK(v->blob);                                                break;
+        case VALUE_TYPED_ARRAY:     MARK(v->typed);                                               break;
         case VALUE_PTR:             mark_pointer(v);                                              break;
         case VALUE_REGEX:           if (v->regex->gc) MARK(v->regex);                             break;
         default:                                                                                  break;
@@ -1135,7 +1316,7 @@ tuple_get(struct value *tuple, char const *name)
         }
 
         for (int i = 0; i < tuple->count; ++i) {
-                if (tuple->names[i] != NULL && strcmp(tuple->names[i], name) == 0) {
+                if (tuple->names[i] == name || (tuple->names[i] != NULL && strcmp(tuple->names[i], name) == 0)) {
                         return &tuple->items[i];
                 }
         }
@@ -1143,6 +1324,154 @@ tuple_get(struct value *tuple, char const *name)
         return NULL;
 }
 
+/*
+ * Pointer values only have room for a 32-bit id for their extra data (FFI type
+ * info, closure bookkeeping), so the pointers themselves are registered here.
+ * There are only ever a handful of distinct ones, so they're never released.
+ *
+ * Every pointer operation has to turn an id back into its pointer, so that
+ * side takes no lock: ids index an append-only table made of chunks that
+ * double in size and never move once they're published. Going the other way
+ * probes an open-addressed map from pointer to id, which is also read without
+ * a lock; only registering a new pointer takes ExtrasLock.
+ */
+enum {
+        EXTRA_CHUNK_BITS = 4,
+        EXTRA_CHUNKS     = 33 - EXTRA_CHUNK_BITS
+};
+
+struct extra_map {
+        size_t mask;
+        _Atomic uint32_t *ids;
+        void const *_Atomic keys[];
+};
+
+static void const *_Atomic *_Atomic ExtraChunks[EXTRA_CHUNKS];
+static struct extra_map *_Atomic ExtraMap;
+static uint32_t ExtraCount;
+static pthread_mutex_t ExtrasLock = PTHREAD_MUTEX_INITIALIZER;
+
+inline static void const *_Atomic *
+ExtraSlot(uint32_t i, bool create)
+{
+        uint64_t j = (uint64_t)i + (1 << EXTRA_CHUNK_BITS);
+        int k = 63 - __builtin_clzll(j) - EXTRA_CHUNK_BITS;
+        void const *_Atomic *chunk = atomic_load_explicit(&ExtraChunks[k], memory_order_acquire);
+
+        if (chunk == NULL && create) {
+                size_t n = (size_t)1 << EXTRA_CHUNK_BITS << k;
+                chunk = mrealloc(NULL, n * sizeof *chunk);
+                for (size_t s = 0; s < n; ++s) {
+                        atomic_init(&chunk[s], NULL);
+                }
+                atomic_store_explicit(&ExtraChunks[k], chunk, memory_order_release);
+        }
+
+        return &chunk[j - ((uint64_t)1 << EXTRA_CHUNK_BITS << k)];
+}
+
+static uint32_t
+ExtraFind(struct extra_map const *map, void const *p)
+{
+        if (map == NULL) {
+                return 0;
+        }
+
+        for (size_t i = ptr_hash(p) & map->mask;; i = (i + 1) & map->mask) {
+                void const *k = atomic_load_explicit(&map->keys[i], memory_order_acquire);
+                if (k == p) {
+                        return atomic_load_explicit(&map->ids[i], memory_order_relaxed);
+                }
+                if (k == NULL) {
+                        return 0;
+                }
+        }
+}
+
+static void
+ExtraInsert(struct extra_map *map, void const *p, uint32_t id)
+{
+        size_t i = ptr_hash(p) & map->mask;
+
+        while (atomic_load_explicit(&map->keys[i], memory_order_relaxed) != NULL) {
+                i = (i + 1) & map->mask;
+        }
+
+        atomic_store_explicit(&map->ids[i], id, memory_order_relaxed);
+        atomic_store_explicit(&map->keys[i], p, memory_order_release);
+}
+
+static struct extra_map *
+ExtraMapNew(size_t n)
+{
+        struct extra_map *map = mrealloc(NULL, sizeof *map + n * sizeof map->keys[0]);
+
+        map->mask = n - 1;
+        map->ids = mrealloc(NULL, n * sizeof *map->ids);
+
+        for (size_t i = 0; i < n; ++i) {
+                atomic_init(&map->keys[i], NULL);
+                atomic_init(&map->ids[i], 0);
+        }
+
+        return map;
+}
+
+uint32_t
+value_extra_id(void const *p)
+{
+        if (p == NULL) {
+                return 0;
+        }
+
+        uint32_t id = ExtraFind(atomic_load_explicit(&ExtraMap, memory_order_acquire), p);
+        if (id != 0) {
+                return id;
+        }
+
+        pthread_mutex_lock(&ExtrasLock);
+
+        struct extra_map *map = atomic_load_explicit(&ExtraMap, memory_order_relaxed);
+
+        if ((id = ExtraFind(map, p)) != 0) {
+                pthread_mutex_unlock(&ExtrasLock);
+                return id;
+        }
+
+        atomic_store_explicit(ExtraSlot(ExtraCount, true), p, memory_order_relaxed);
+        id = ++ExtraCount;
+
+        /*
+         * Readers may still be probing the old map, so it's left alone (and
+         * leaked): a miss there just sends them here, where they'll find the
+         * pointer in the new one.
+         */
+        if (map == NULL || 2 * ExtraCount > map->mask + 1) {
+                struct extra_map *new = ExtraMapNew(map == NULL ? 16 : 2 * (map->mask + 1));
+                for (uint32_t i = 0; i + 1 < ExtraCount; ++i) {
+                        ExtraInsert(new, atomic_load_explicit(ExtraSlot(i, false), memory_order_relaxed), i + 1);
+                }
+                map = new;
+        }
+
+        ExtraInsert(map, p, id);
+        atomic_store_explicit(&ExtraMap, map, memory_order_release);
+
+        pthread_mutex_unlock(&ExtrasLock);
+
+        return id;
+}
+
+void *
+value_extra(uint32_t id)
+{
+        if (id == 0) {
+                return NULL;
+        }
+
+        return (void *)atomic_load_explicit(ExtraSlot(id - 1, false), memory_order_relaxed);
+}
+
 struct array *
 value_array_clone(struct array const *a)
 {
@@ -1178,6 +1507,8 @@ value_array_extend(struct array *a, struct array const *other)
                 memcpy(a->items + a->count, other->items, other->count * sizeof (struct value));
 
         a->count = n;
+
+        gc_barrier(a);
 }
 
 int
@@ -19,6 +19,7 @@
 #include <signal.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
 #include <termios.h>
 
 #include "barrier.h"
@@ -52,26 +53,372 @@
 #include "array.h"
 #include "str.h"
 #include "blob.h"
+#include "typed.h"
 #include "tags.h"
 #include "object.h"
+#include "intern.h"
 #include "class.h"
 #include "utf8.h"
 #include "functions.h"
+#include "jit.h"
 #include "html.h"
 #include "curl.h"
 #include "sqlite.h"
 #include "queue.h"
+#include "heap.h"
 
 #define TY_LOG_VERBOSE 1
 
 #define READVALUE(s) (memcpy(&s, ip, sizeof s), (ip += sizeof s))
 
+#define READMEMBER(s, m, h) \
+        do { \
+                READVALUE(s); \
+                InternEntry const *e = intern_entry(s); \
+                (m) = e->name; \
+                (h) = e->hash; \
+        } while (0)
+
+/*
+ * Like READMEMBER followed by reading the site id of the lookup, but for method
+ * names that the VM calls implicitly. Each use gets a site of its own.
+ */
+#define SETMEMBER(s, m, h, site, lit) \
+        do { \
+                static _Atomic int id = -1; \
+                static _Atomic int ic = -1; \
+                if (((s) = atomic_load_explicit(&id, memory_order_relaxed)) == -1) { \
+                        atomic_store_explicit(&id, (s) = intern(lit)->id, memory_order_relaxed); \
+                } \
+                if (((site) = atomic_load_explicit(&ic, memory_order_relaxed)) == -1) { \
+                        atomic_store_explicit(&ic, (site) = vm_ic_site(), memory_order_relaxed); \
+                } \
+                InternEntry const *e = intern_entry(s); \
+                (m) = e->name; \
+                (h) = e->hash; \
+        } while (0)
+
+/*
+ * With GCC and Clang we dispatch through a table of label addresses (computed goto)
+ * so that every instruction ends in its own indirect jump. The switch is kept as
+ * the fallback for other compilers, and TY_NO_COMPUTED_GOTO forces it for testing.
+ */
+#if defined(__GNUC__) && !defined(TY_NO_COMPUTED_GOTO)
+  #define TY_THREADED_DISPATCH
+#endif
+
+/*
+ * Every instruction body ends in DISPATCH(). With computed goto it fetches the
+ * next opcode and jumps straight to its label, so each instruction gets its own
+ * indirect branch for the predictor to learn; with the switch it goes around the
+ * loop. It's never used inside a loop nested in an instruction body.
+ */
+#ifdef TY_THREADED_DISPATCH
+  #define DISPATCH() goto *dispatch[(unsigned char)*ip++]
+#else
+  #define DISPATCH() continue
+#endif
+
 #if defined(TY_LOG_VERBOSE) && !defined(TY_NO_LOG)
-  #define CASE(i) case INSTR_ ## i: fname = compiler_get_location(ip, &loc, &loc); LOG("%s:%d:%d: " #i, fname, loc.line + 1, loc.col + 1);
+  #ifdef TY_THREADED_DISPATCH
+    #define CASE(i) case INSTR_ ## i: Op_ ## i: fname = compiler_get_location(ip, &loc, &loc); LOG("%s:%d:%d: " #i, fname, loc.line + 1, loc.col + 1);
+  #else
+    #define CASE(i) case INSTR_ ## i: fname = compiler_get_location(ip, &loc, &loc); LOG("%s:%d:%d: " #i, fname, loc.line + 1, loc.col + 1);
+  #endif
 #else
-  #define CASE(i) case INSTR_ ## i:
+  #ifdef TY_THREADED_DISPATCH
+    #define CASE(i) case INSTR_ ## i: Op_ ## i:
+  #else
+    #define CASE(i) case INSTR_ ## i:
+  #endif
 #endif
 
+/*
+ * Threads only stop for a collection requested by another thread at safepoints:
+ * loop back-edges, calls, and instructions that allocate.
+ */
+#define SAFEPOINT() \
+        do { \
+                if (GC_OFF_COUNT == 0 && atomic_load_explicit(&MyGroup->WantGC, memory_order_relaxed)) { \
+                        WaitGC(); \
+                } \
+        } while (0)
+
+/*
+ * Objects that a collection found dead have their finalizers run at function
+ * entries and loop back-edges in the interpreter, once every thread is back to
+ * work. Native code doesn't stop for them: it may be holding on to pointers
+ * into the stack.
+ */
+#define FINALIZE() \
+        do { \
+                if (FinalizerQueue.count != 0 && GC_OFF_COUNT == 0) { \
+                        RunFinalizers(); \
+                } \
+        } while (0)
+
+/*
+ * Function entries and loop back-edges are where we check whether there's native
+ * code to run instead (see jit.h). Whatever it does, it comes back with the
+ * address of the next instruction for the interpreter.
+ */
+#define JIT_POINT() \
+        do { \
+                if (JitEnabled) { \
+                        ip = jit_run(ip); \
+                } \
+        } while (0)
+
+/*
+ * Arithmetic and comparison instructions specialize themselves to the operands
+ * they see. When the generic instruction gets two ints or two floats it rewrites
+ * its own opcode to the matching _INT or _REAL variant, which does the operation
+ * in place on the stack. If a variant is handed anything else it rewrites the
+ * opcode to the _ANY variant and takes the slow path. _ANY does exactly what the
+ * generic instruction does but never specializes again, so a site that sees
+ * mixed operands settles after one round trip instead of rewriting itself on
+ * every execution.
+ *
+ * Every variant computes exactly what the generic instruction would have, so the
+ * rewrite (a single byte store) is harmless when other threads are running the
+ * same code.
+ */
+#define QUICKEN(op) \
+        do { \
+                if (left.type == VALUE_INTEGER && right.type == VALUE_INTEGER) { \
+                        ip[-1] = INSTR_ ## op ## _INT; \
+                } else if (left.type == VALUE_REAL && right.type == VALUE_REAL) { \
+                        ip[-1] = INSTR_ ## op ## _REAL; \
+                } \
+        } while (0)
+
+#define QUICK_OP(op, variant, t, field, make, operator, slow) \
+        CASE(op ## _ ## variant) \
+                vp = top() - 1; \
+                if (vp[0].type == t && vp[1].type == t) { \
+                        vp[0] = make(vp[0].field operator vp[1].field); \
+                        stack.count -= 1; \
+                } else { \
+                        ip[-1] = INSTR_ ## op ## _ANY; \
+                        right = pop(); \
+                        left = pop(); \
+                        push(slow); \
+                } \
+                DISPATCH();
+
+#define QUICK_ANY(op, slow) \
+        CASE(op ## _ANY) \
+                right = pop(); \
+                left = pop(); \
+                push(slow); \
+                DISPATCH();
+
+#define QUICK_OPS(op, operator, make_int, make_real, slow) \
+        QUICK_OP(op, INT, VALUE_INTEGER, integer, make_int, operator, slow) \
+        QUICK_OP(op, REAL, VALUE_REAL, real, make_real, operator, slow) \
+        QUICK_ANY(op, slow)
+
+/*
+ * Ordering goes through the same three-way comparison as value_compare() so that
+ * NaN orders the same way whether or not the instruction has been specialized.
+ */
+#define QUICK_COMPARE(a, b) (((a) < (b)) ? -1 : ((a) != (b)))
+
+#define QUICK_CMP(op, variant, t, field, operator) \
+        CASE(op ## _ ## variant) \
+                vp = top() - 1; \
+                if (vp[0].type == t && vp[1].type == t) { \
+                        vp[0] = BOOLEAN(QUICK_COMPARE(vp[0].field, vp[1].field) operator 0); \
+                        stack.count -= 1; \
+                } else { \
+                        ip[-1] = INSTR_ ## op ## _ANY; \
+                        right = pop(); \
+                        left = pop(); \
+                        push(BOOLEAN(value_compare(&left, &right) operator 0)); \
+                } \
+                DISPATCH();
+
+#define QUICK_CMPS(op, operator) \
+        QUICK_CMP(op, INT, VALUE_INTEGER, integer, operator) \
+        QUICK_CMP(op, REAL, VALUE_REAL, real, operator) \
+        QUICK_ANY(op, BOOLEAN(value_compare(&left, &right) operator 0))
+
+/*
+ * Every instruction with a CASE() in vm_exec() must be listed here. The list is
+ * checked by the compiler: a missing entry leaves an unused label (-Wunused-label),
+ * and an entry without a CASE() is a jump to an undefined label.
+ */
+#define TY_VM_OPS \
+        X(NOP) \
+        X(LOAD_LOCAL) \
+        X(LOAD_REF) \
+        X(LOAD_CAPTURED) \
+        X(LOAD_GLOBAL) \
+        X(TARGET_LOCAL) \
+        X(TARGET_REF) \
+        X(TARGET_CAPTURED) \
+        X(TARGET_GLOBAL) \
+        X(TARGET_MEMBER) \
+        X(TARGET_SUBSCRIPT) \
+        X(ASSIGN) \
+        X(MAYBE_ASSIGN) \
+        X(ARRAY_REST) \
+        X(TUPLE_REST) \
+        X(INTEGER) \
+        X(REAL) \
+        X(BOOLEAN) \
+        X(STRING) \
+        X(REGEX) \
+        X(ARRAY) \
+        X(DICT) \
+        X(TUPLE) \
+        X(DICT_DEFAULT) \
+        X(NIL) \
+        X(SELF) \
+        X(TAG) \
+        X(CLASS) \
+        X(TO_STRING) \
+        X(CONCAT_STRINGS) \
+        X(RANGE) \
+        X(INCRANGE) \
+        X(INT_RANGE) \
+        X(MEMBER_ACCESS) \
+        X(TRY_MEMBER_ACCESS) \
+        X(SUBSCRIPT) \
+        X(TAIL_CALL) \
+        X(CALL) \
+        X(CALL_METHOD) \
+        X(TRY_CALL_METHOD) \
+        X(GET_NEXT) \
+        X(PUSH_INDEX) \
+        X(READ_INDEX) \
+        X(POP) \
+        X(UNPOP) \
+        X(DUP) \
+        X(LEN) \
+        X(ARRAY_COMPR) \
+        X(DICT_COMPR) \
+        X(THROW_IF_NIL) \
+        X(PRE_INC) \
+        X(POST_INC) \
+        X(PRE_DEC) \
+        X(POST_DEC) \
+        X(FUNCTION) \
+        X(JUMP) \
+        X(JUMP_IF) \
+        X(JUMP_IF_NIL) \
+        X(JUMP_IF_NOT) \
+        X(JUMP_IF_NONE) \
+        X(RETURN) \
+        X(RETURN_PRESERVE_CTX) \
+        X(EXEC_CODE) \
+        X(HALT) \
+        X(MULTI_RETURN) \
+        X(SENTINEL) \
+        X(FIX_TO) \
+        X(REVERSE) \
+        X(SWAP) \
+        X(NONE) \
+        X(NONE_IF_NIL) \
+        X(CLEAR_RC) \
+        X(GET_EXTRA) \
+        X(PUSH_NTH) \
+        X(PUSH_ARRAY_ELEM) \
+        X(PUSH_TUPLE_ELEM) \
+        X(PUSH_TUPLE_MEMBER) \
+        X(MULTI_ASSIGN) \
+        X(MAYBE_MULTI) \
+        X(JUMP_IF_SENTINEL) \
+        X(CLEAR_EXTRA) \
+        X(FIX_EXTRA) \
+        X(PUSH_ALL) \
+        X(FUCK) \
+        X(FUCK2) \
+        X(FUCK3) \
+        X(VALUE) \
+        X(EVAL) \
+        X(SAVE_STACK_POS) \
+        X(RESTORE_STACK_POS) \
+        X(YIELD) \
+        X(MAKE_GENERATOR) \
+        X(THROW) \
+        X(RETHROW) \
+        X(TRY) \
+        X(POP_TRY) \
+        X(POP_THROW) \
+        X(FINALLY) \
+        X(PUSH_DEFER_GROUP) \
+        X(DEFER) \
+        X(CLEANUP) \
+        X(TAG_PUSH) \
+        X(DEFINE_TAG) \
+        X(DEFINE_CLASS) \
+        X(TRY_INDEX) \
+        X(TRY_INDEX_TUPLE) \
+        X(TRY_TUPLE_MEMBER) \
+        X(TRY_TAG_POP) \
+        X(TRY_REGEX) \
+        X(TRY_ASSIGN_NON_NIL) \
+        X(BAD_MATCH) \
+        X(BAD_CALL) \
+        X(BAD_ASSIGN) \
+        X(UNTAG_OR_DIE) \
+        X(ENSURE_LEN) \
+        X(ENSURE_LEN_TUPLE) \
+        X(ENSURE_EQUALS_VAR) \
+        X(ENSURE_DICT) \
+        X(ENSURE_CONTAINS) \
+        X(ENSURE_SAME_KEYS) \
+        X(ADD) \
+        X(SUB) \
+        X(MUL) \
+        X(DIV) \
+        X(MOD) \
+        X(EQ) \
+        X(NEQ) \
+        X(LT) \
+        X(GT) \
+        X(LEQ) \
+        X(GEQ) \
+        X(CMP) \
+        X(CHECK_MATCH) \
+        X(MUT_ADD) \
+        X(MUT_MUL) \
+        X(MUT_DIV) \
+        X(MUT_SUB) \
+        X(NEG) \
+        X(NOT) \
+        X(QUESTION) \
+        X(COUNT) \
+        X(GET_TAG) \
+        X(ADD_INT) \
+        X(ADD_REAL) \
+        X(SUB_INT) \
+        X(SUB_REAL) \
+        X(MUL_INT) \
+        X(MUL_REAL) \
+        X(EQ_INT) \
+        X(EQ_REAL) \
+        X(NEQ_INT) \
+        X(NEQ_REAL) \
+        X(LT_INT) \
+        X(LT_REAL) \
+        X(GT_INT) \
+        X(GT_REAL) \
+        X(LEQ_INT) \
+        X(LEQ_REAL) \
+        X(GEQ_INT) \
+        X(GEQ_REAL) \
+        X(ADD_ANY) \
+        X(SUB_ANY) \
+        X(MUL_ANY) \
+        X(EQ_ANY) \
+        X(NEQ_ANY) \
+        X(LT_ANY) \
+        X(GT_ANY) \
+        X(LEQ_ANY) \
+        X(GEQ_ANY)
+
 #define inline __attribute__((always_inline)) inline
 
 #define MatchError \
@@ -83,6 +430,7 @@ static char next_fix[] = { INSTR_NONE_IF_NIL, INSTR_RETURN_PRESERVE_CTX };
 static char iter_fix[] = { INSTR_SENTINEL, INSTR_RETURN_PRESERVE_CTX };
 
 static char const *MISSING = "__missing__";
+static int MissingId;
 
 static _Thread_local jmp_buf jb;
 
@@ -101,6 +449,7 @@ struct try {
         int cs;
         int ts;
         int ctxs;
+        int jit;
         char *catch;
         char *finally;
         char *end;
@@ -138,17 +487,6 @@ static _Thread_local vec(ThrowCtx) throw_stack;
 static _Thread_local ValueStack defer_stack;
 static _Thread_local char *ip;
 
-typedef struct {
-        ValueStack stack;
-        CallStack calls;
-        FrameStack frames;
-        SPStack sp_stack;
-        TargetStack targets;
-        TryStack try_stack;
-        char *ip;
-        bool waiting;
-} TyThread;
-
 typedef struct {
         ValueStack *stack;
         FrameStack *frames;
@@ -156,12 +494,17 @@ typedef struct {
         ValueStack *defer_stack;
         void *root_set;
         AllocList *allocs;
+        AllocList *old;
+        AllocList *remembered;
+        AllocList *finalizable;
+        AllocList *finalizers;
+        GCHeap *heap;
         size_t *MemoryUsed;
+        size_t *MemoryLimit;
+        size_t *MemoryCeiling;
+        size_t *NurseryUsed;
 } ThreadStorage;
 
-static vec(TyThread) Threads;
-static int ThreadIndex;
-
 static char const *filename;
 static char const *Error;
 bool CompileOnly = false;
@@ -181,13 +524,28 @@ typedef struct thread_group {
         vec(ThreadStorage) ThreadStorages;
         vec(_Atomic bool *) ThreadStates;
         atomic_bool WantGC;
+        atomic_bool MinorGC;
+        atomic_bool Stepping;
+        atomic_bool IncrementalMarking;
+        bool IncrementalMarked;
+        size_t IncrementalTarget;
+        size_t IncrementalProgress;
         pthread_barrier_t GCBarrierStart;
         pthread_barrier_t GCBarrierMark;
         pthread_barrier_t GCBarrierSweep;
         pthread_barrier_t GCBarrierDone;
         pthread_mutex_t DLock;
         AllocList DeadAllocs;
+        AllocList DeadYoung;
+        AllocList DeadRemembered;
+        AllocList DeadFinalizable;
+        AllocList Condemned;
+        GCHeap DeadHeap;
+        GCMarkGroup Marking;
+        GCMarkGroup Incremental;
         size_t DeadUsed;
+        size_t Live;
+        struct timespec LastMajor;
 } ThreadGroup;
 
 typedef struct {
@@ -208,9 +566,20 @@ static _Thread_local _Atomic bool *MyState;
 static _Thread_local ThreadStorage MyStorage;
 static _Thread_local ThreadGroup *MyGroup;
 static _Thread_local bool GCInProgress;
+static _Thread_local bool Finalizing;
+
+/* Set by ty.heapSnapshot() for the next full collection this thread runs */
+static _Thread_local char const *SnapshotPath;
+static _Thread_local bool SnapshotWritten;
 
 void
-MarkStorage(ThreadStorage const *storage);
+MarkStorage(ThreadStorage const *storage, bool minor);
+
+static void
+Collect(bool minor, bool full);
+
+static void
+FreeSites(void);
 
 static void
 LockThreads(int *threads, int n)
@@ -237,14 +606,27 @@ SetState(bool blocking)
 void
 Forget(struct value *v, AllocList *allocs)
 {
-        size_t n = MyStorage.allocs->count;
+        /* Marks left by an unfinished incremental collection would get in the way */
+        while (atomic_load(&MyGroup->IncrementalMarking)) {
+                Collect(false, true);
+        }
 
-        value_mark(v);
-        GCForget(MyStorage.allocs, MyStorage.MemoryUsed);
+        /* So would the ones left on pages that haven't been swept yet */
+        GCFinishSweep(MyStorage.heap, MyStorage.remembered, MyStorage.MemoryUsed);
 
-        for (size_t i = MyStorage.allocs->count; i < n; ++i) {
-                vec_push_unchecked(*allocs, MyStorage.allocs->items[i]);
-        }
+        /* The message is whatever marking v marks for the first time */
+        GCMarkLog = allocs;
+        value_mark(v);
+        GCMarkLog = NULL;
+
+        GCGiveAway(
+                allocs,
+                MyStorage.allocs,
+                MyStorage.old,
+                MyStorage.remembered,
+                MyStorage.finalizable,
+                MyStorage.MemoryUsed
+        );
 }
 
 static void
@@ -255,10 +637,23 @@ InitThreadGroup(ThreadGroup *g)
         vec_init(g->ThreadStorages);
         vec_init(g->ThreadLocks);
         vec_init(g->DeadAllocs);
+        vec_init(g->DeadYoung);
+        vec_init(g->DeadRemembered);
+        vec_init(g->DeadFinalizable);
+        vec_init(g->Condemned);
+        memset(&g->DeadHeap, 0, sizeof g->DeadHeap);
+        memset(&g->Marking, 0, sizeof g->Marking);
+        memset(&g->Incremental, 0, sizeof g->Incremental);
         pthread_mutex_init(&g->Lock, NULL);
         pthread_mutex_init(&g->GCLock, NULL);
         pthread_mutex_init(&g->DLock, NULL);
         atomic_store(&g->WantGC, false);
+        atomic_store(&g->MinorGC, false);
+        atomic_store(&g->Stepping, false);
+        atomic_store(&g->IncrementalMarking, false);
+        g->IncrementalMarked = false;
+        g->IncrementalTarget = 0;
+        g->IncrementalProgress = 0;
         g->DeadUsed = 0;
 
 }
@@ -271,6 +666,180 @@ NewThreadGroup(void)
         return g;
 }
 
+/*
+ * A target can still be assigned through after a collection has emptied the
+ * remembered set, and a builtin can keep filling in whatever it has on the root
+ * set, so those objects are remembered again after every collection.
+ */
+static void
+RememberRoots(ThreadStorage const *storage)
+{
+        vec(struct value const *) *root_set = storage->root_set;
+
+        for (size_t i = 0; i < storage->targets->count; ++i) {
+                void *gc = storage->targets->items[i].gc;
+                if (gc != NULL && GCShouldRemember(ALLOC_OF(gc))) {
+                        GCRemember(storage->remembered, ALLOC_OF(gc));
+                }
+        }
+
+        for (int i = 0; i < root_set->count; ++i) {
+                GCRememberValue(storage->remembered, root_set->items[i]);
+        }
+}
+
+static void
+SweepStorage(ThreadStorage const *storage, bool minor)
+{
+        AllocList condemned = {0};
+
+        if (minor) {
+                GCResetRemembered(storage->remembered);
+                GCSweepYoung(
+                        storage->allocs,
+                        storage->old,
+                        storage->remembered,
+                        storage->MemoryUsed,
+                        GCVerify ? &condemned : NULL
+                );
+                GCSweepHeap(
+                        storage->heap,
+                        storage->remembered,
+                        true,
+                        false,
+                        storage->MemoryUsed,
+                        GCVerify ? &condemned : NULL
+                );
+        } else {
+                GCSweep(
+                        storage->allocs,
+                        storage->old,
+                        storage->remembered,
+                        storage->MemoryUsed,
+                        GCVerify ? &condemned : NULL
+                );
+                /* Verifying needs to see everything that died right away */
+                GCSweepHeap(
+                        storage->heap,
+                        storage->remembered,
+                        false,
+                        !GCVerify,
+                        storage->MemoryUsed,
+                        GCVerify ? &condemned : NULL
+                );
+        }
+
+        *storage->NurseryUsed = 0;
+
+        RememberRoots(storage);
+
+        if (condemned.count != 0) {
+                pthread_mutex_lock(&MyGroup->DLock);
+                vec_nogc_push_n(MyGroup->Condemned, condemned.items, condemned.count);
+                pthread_mutex_unlock(&MyGroup->DLock);
+        }
+
+        free(condemned.items);
+}
+
+static void
+SweepDead(bool minor)
+{
+        pthread_mutex_lock(&MyGroup->DLock);
+
+        if (minor) {
+                GCResetRemembered(&MyGroup->DeadRemembered);
+                GCSweepYoung(
+                        &MyGroup->DeadYoung,
+                        &MyGroup->DeadAllocs,
+                        &MyGroup->DeadRemembered,
+                        &MyGroup->DeadUsed,
+                        GCVerify ? &MyGroup->Condemned : NULL
+                );
+                GCSweepHeap(
+                        &MyGroup->DeadHeap,
+                        &MyGroup->DeadRemembered,
+                        true,
+                        false,
+                        &MyGroup->DeadUsed,
+                        GCVerify ? &MyGroup->Condemned : NULL
+                );
+        } else {
+                GCSweep(
+                        &MyGroup->DeadYoung,
+                        &MyGroup->DeadAllocs,
+                        &MyGroup->DeadRemembered,
+                        &MyGroup->DeadUsed,
+                        GCVerify ? &MyGroup->Condemned : NULL
+                );
+                GCSweepHeap(
+                        &MyGroup->DeadHeap,
+                        &MyGroup->DeadRemembered,
+                        false,
+                        false,
+                        &MyGroup->DeadUsed,
+                        GCVerify ? &MyGroup->Condemned : NULL
+                );
+        }
+
+        pthread_mutex_unlock(&MyGroup->DLock);
+}
+
+/*
+ * With TY_GC_VERIFY set, the objects that a collection found dead are kept
+ * around until every thread has finished sweeping. Then the whole heap is
+ * marked, and if that reaches any of them, an object was written to without a
+ * gc_barrier() (an old one, or any one during an incremental collection).
+ */
+static void
+VerifyCollection(void)
+{
+        size_t used = 0;
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                MarkStorage(&MyGroup->ThreadStorages.items[i], false);
+        }
+
+        if (MyGroup == &MainGroup) {
+                for (int i = 0; i < Globals.count; ++i) {
+                        value_mark(&Globals.items[i]);
+                }
+        }
+
+        for (size_t i = 0; i < MyGroup->Condemned.count; ++i) {
+                struct alloc *a = MyGroup->Condemned.items[i];
+                if (gc_marked(a)) {
+                        fprintf(
+                                stderr,
+                                "TY_GC_VERIFY: collection found a reachable object (type %d, %u bytes) dead\n",
+                                a->type,
+                                a->size
+                        );
+                        abort();
+                }
+        }
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                GCClearMarks(MyGroup->ThreadStorages.items[i].allocs);
+                GCClearMarks(MyGroup->ThreadStorages.items[i].old);
+                GCClearHeapMarks(MyGroup->ThreadStorages.items[i].heap);
+        }
+
+        GCClearMarks(&MyGroup->DeadYoung);
+        GCClearMarks(&MyGroup->DeadAllocs);
+        GCClearHeapMarks(&MyGroup->DeadHeap);
+
+        GCSweepYoung(&MyGroup->Condemned, &MyGroup->DeadAllocs, &MyGroup->DeadRemembered, &used, NULL);
+}
+
+static void
+RecordWait(struct timespec const *since)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        GCRecordWait((now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec);
+}
+
 static void
 WaitGC()
 {
@@ -279,53 +848,319 @@ WaitGC()
 
         GCLOG("Waiting for GC on thread %llu", TID);
 
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
         ReleaseLock(false);
 
         while (!atomic_load(MyState)) {
                 if (!atomic_load(&MyGroup->WantGC)) {
                         SetState(true);
                         TakeLock();
+                        RecordWait(&start);
                         return;
                 }
+                /*
+                 * Minor collections make these waits much more frequent, so
+                 * don't starve the threads we're waiting on.
+                 */
+                sched_yield();
         }
 
         TakeLock();
 
+        GCFlushAllocated();
+
+        /* Nothing can be marked until the last collection's sweep is done */
+        GCFinishSweep(&Heap, &RememberedSet, &MemoryUsed);
+
         GCLOG("Waiting to mark: %llu", TID);
         pthread_barrier_wait(&MyGroup->GCBarrierStart);
+
+        /* The thread running an incremental step does all of the work itself */
+        if (atomic_load(&MyGroup->Stepping)) {
+                pthread_barrier_wait(&MyGroup->GCBarrierSweep);
+                pthread_barrier_wait(&MyGroup->GCBarrierDone);
+                GCLOG("Continuing execution: %llu", TID);
+                RecordWait(&start);
+                return;
+        }
+
+        bool minor = atomic_load(&MyGroup->MinorGC);
         GCLOG("Marking: %llu", TID);
-        MarkStorage(&MyStorage);
+        GCMarkMask = minor ? (GC_MARK | GC_OLD) : GC_MARK;
+        GCMarkJoin(&MyGroup->Marking);
+        MarkStorage(&MyStorage, minor);
+        GCMarkDrain();
 
-        GCLOG("Waiting to sweep: %llu", TID);
+        /* Wait for the objects that need finalizing to be marked too */
         pthread_barrier_wait(&MyGroup->GCBarrierMark);
+        GCMarkMask = GC_MARK;
+
         GCLOG("Sweeping: %llu", TID);
-        GCSweep(MyStorage.allocs, MyStorage.MemoryUsed);
+        SweepStorage(&MyStorage, minor);
 
         GCLOG("Waiting to continue execution: %llu", TID);
         pthread_barrier_wait(&MyGroup->GCBarrierSweep);
         pthread_barrier_wait(&MyGroup->GCBarrierDone);
         GCLOG("Continuing execution: %llu", TID);
+
+        RecordWait(&start);
 }
 
-void
-DoGC()
+/*
+ * One pause of an incremental collection. The first one marks every thread's
+ * roots, and the ones after that go on from where the last one stopped.
+ */
+static void
+MarkIncrementally(bool started)
+{
+        if (!started) {
+                GCMarkStart(&MyGroup->Incremental);
+
+                MyGroup->IncrementalTarget = 0;
+                MyGroup->IncrementalProgress = 0;
+
+                for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                        MarkStorage(&MyGroup->ThreadStorages.items[i], false);
+                        MyGroup->IncrementalTarget += *MyGroup->ThreadStorages.items[i].MemoryUsed;
+                }
+
+                if (MyGroup == &MainGroup) {
+                        for (int i = 0; i < Globals.count; ++i) {
+                                value_mark(&Globals.items[i]);
+                        }
+                }
+
+                atomic_store(&MyGroup->IncrementalMarking, true);
+        }
+
+        size_t marked = 0;
+        MyGroup->IncrementalMarked = GCMarkStep(&MyGroup->Incremental, GCPauseBudget, &marked);
+        MyGroup->IncrementalProgress += marked;
+
+        /*
+         * The next step comes after the nursery fills up again, or sooner if
+         * steps this size wouldn't finish marking the heap as it was when the
+         * cycle started before some thread reaches its ceiling. Whatever's left is
+         * then marked in one go, which is the pause we're trying to avoid.
+         */
+        size_t headroom = SIZE_MAX;
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                ThreadStorage const *storage = &MyGroup->ThreadStorages.items[i];
+                size_t ceiling = *storage->MemoryCeiling;
+                headroom = umin(headroom, ceiling - umin(ceiling, *storage->MemoryUsed));
+        }
+
+        size_t left = MyGroup->IncrementalTarget - umin(MyGroup->IncrementalTarget, MyGroup->IncrementalProgress);
+        size_t steps = left / umax(marked, 1) + 1;
+        size_t interval = umax(GC_MIN_STEP, umin(NurserySize, headroom / 2 / steps));
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                *MyGroup->ThreadStorages.items[i].NurseryUsed = NurserySize - interval;
+        }
+}
+
+/*
+ * The final pause of an incremental collection marks the roots again, and then
+ * whatever was remembered since marking started. Roots that RememberRoots()
+ * would remember after a collection are remembered here too: builtins can fill
+ * them in without barriers.
+ */
+static void
+RescanRemembered(void)
+{
+        GCMarkAdopt(&MyGroup->Incremental);
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                RememberRoots(&MyGroup->ThreadStorages.items[i]);
+                GCRescanRemembered(MyGroup->ThreadStorages.items[i].remembered);
+        }
+
+        pthread_mutex_lock(&MyGroup->DLock);
+        GCRescanRemembered(&MyGroup->DeadRemembered);
+        pthread_mutex_unlock(&MyGroup->DLock);
+}
+
+static void
+SnapshotStorage(struct heap_snapshot *snap, ThreadStorage const *storage)
+{
+        vec(struct value const *) *root_set = storage->root_set;
+
+        for (int i = 0; i < root_set->count; ++i) {
+                heap_snapshot_root(snap, root_set->items[i]);
+        }
+
+        for (int i = 0; i < storage->stack->count; ++i) {
+                heap_snapshot_root(snap, &storage->stack->items[i]);
+        }
+
+        for (int i = 0; i < storage->defer_stack->count; ++i) {
+                heap_snapshot_root(snap, &storage->defer_stack->items[i]);
+        }
+
+        for (int i = 0; i < storage->targets->count; ++i) {
+                if ((((uintptr_t)storage->targets->items[i].t) & 0x07) == 0) {
+                        heap_snapshot_root(snap, storage->targets->items[i].t);
+                }
+        }
+
+        for (int i = 0; i < storage->frames->count; ++i) {
+                heap_snapshot_root(snap, &storage->frames->items[i].f);
+        }
+
+        for (size_t i = 0; i < storage->finalizers->count; ++i) {
+                struct object *o = (struct object *)storage->finalizers->items[i]->data;
+                heap_snapshot_root(snap, &OBJECT(o, o->class));
+        }
+}
+
+/*
+ * Walks the same roots as MarkStorage(), for every thread in the group. It's
+ * done at the end of a full collection, while they're all still stopped, so
+ * nothing moves or dies while the graph is being written.
+ */
+static void
+TakeSnapshot(void)
+{
+        struct heap_snapshot *snap = heap_snapshot_new();
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                SnapshotStorage(snap, &MyGroup->ThreadStorages.items[i]);
+        }
+
+        if (MyGroup == &MainGroup) {
+                for (int i = 0; i < Globals.count; ++i) {
+                        heap_snapshot_root(snap, &Globals.items[i]);
+                }
+        }
+
+        SnapshotWritten = heap_snapshot_write(snap, SnapshotPath);
+        SnapshotPath = NULL;
+}
+
+/* Only called with every thread in the group stopped */
+static size_t
+GroupUsed(void)
+{
+        size_t used = MyGroup->DeadUsed;
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                used += *MyGroup->ThreadStorages.items[i].MemoryUsed;
+        }
+
+        return used;
+}
+
+inline static size_t
+StorageLive(ThreadStorage const *storage)
+{
+        return *storage->MemoryUsed - umin(*storage->MemoryUsed, storage->heap->garbage);
+}
+
+/*
+ * Sets every thread's limits from what survived a major collection, with what's
+ * left under TY_MAX_HEAP split evenly between them. Only called with every
+ * thread in the group stopped, after they've all swept.
+ */
+static void
+Pace(void)
+{
+        size_t live = MyGroup->DeadUsed;
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                live += StorageLive(&MyGroup->ThreadStorages.items[i]);
+        }
+
+        size_t room = SIZE_MAX;
+        if (GCMaxHeap != 0) {
+                room = (GCMaxHeap - umin(GCMaxHeap, live)) / MyGroup->ThreadStorages.count;
+        }
+
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                ThreadStorage const *storage = &MyGroup->ThreadStorages.items[i];
+                GCPace(storage->MemoryLimit, storage->MemoryCeiling, StorageLive(storage), room);
+        }
+
+        MyGroup->Live = live;
+        clock_gettime(CLOCK_MONOTONIC, &MyGroup->LastMajor);
+}
+
+/*
+ * A program that stops allocating much after a spike could otherwise go on
+ * forever without another major collection, holding on to limits sized for the
+ * spike. So once TY_GC_QUIET_MS have gone by without one, the next minor
+ * collection is made a major one, if the limits have anywhere to come down to.
+ */
+static bool
+Quiet(void)
+{
+        if (GCQuietTime == 0 || MyGroup->Live * GCGrowth <= GC_INITIAL_LIMIT) {
+                return false;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        uint64_t elapsed = (now.tv_sec - MyGroup->LastMajor.tv_sec) * 1000000000ULL
+                         + now.tv_nsec - MyGroup->LastMajor.tv_nsec;
+
+        return elapsed >= GCQuietTime;
+}
+
+/*
+ * With TY_GC_PAUSE_MS set, a major collection only starts marking, and the minor
+ * collections after that are steps of it instead. The step after the one that
+ * runs out of things to mark finishes it as an ordinary major collection. So
+ * does a full collection (ty.gc()), or running out of headroom first.
+ */
+static void
+Collect(bool minor, bool full)
 {
         GCLOG("Trying to do GC. Used = %zu, DeadUsed = %zu", MemoryUsed, MyGroup->DeadUsed);
 
+        GCFlushAllocated();
+
+        /*
+         * What's left of the last collection's sweep is finished before anything
+         * is marked: by each thread for itself while the others keep running
+         * if it can, and in the pause for the threads that are blocked.
+         */
+        GCFinishSweep(&Heap, &RememberedSet, &MemoryUsed);
+
         if (pthread_mutex_trylock(&MyGroup->GCLock) != 0) {
                 GCLOG("Couldn't take GC lock: calling WaitGC() on thread %llu", TID);
                 WaitGC();
                 return;
         }
 
+        struct timespec start, marking, marked, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
         GCInProgress = true;
 
         pthread_mutex_lock(&MyGroup->Lock);
 
-        GCLOG("Doing GC: MyGroup = %p, (%zu threads)", MyGroup, MyGroup->ThreadList.count);
+        bool incremental = atomic_load(&MyGroup->IncrementalMarking);
+        bool step;
+
+        if (incremental) {
+                step = minor && !full && !MyGroup->IncrementalMarked;
+                minor = false;
+        } else {
+                if (minor && Quiet()) {
+                        GCLOG("No major GC in %.1fs: doing one now", GCQuietTime / 1.0e9);
+                        minor = false;
+                }
+                step = !minor && !full && GCPauseBudget != 0;
+        }
+
+        GCLOG("Doing %s GC: MyGroup = %p, (%zu threads)", minor ? "minor" : "major", MyGroup, MyGroup->ThreadList.count);
 
         GCLOG("Took threads lock on thread %llu to do GC", TID);
 
+        atomic_store(&MyGroup->MinorGC, minor);
+        atomic_store(&MyGroup->Stepping, step);
+
         GCLOG("Storing true in WantGC on thread %llu", TID);
         atomic_store(&MyGroup->WantGC, true);
 
@@ -355,6 +1190,8 @@ DoGC()
                 if (atomic_load(MyGroup->ThreadStates.items[i])) {
                         GCLOG("Thread %llu is blocked", (long long unsigned)MyGroup->ThreadList.items[i]);
                         blockedThreads[nBlocked++] = i;
+                        ThreadStorage const *storage = &MyGroup->ThreadStorages.items[i];
+                        GCFinishSweep(storage->heap, storage->remembered, storage->MemoryUsed);
                 } else {
                         GCLOG("Thread %llu is running", (long long unsigned)MyGroup->ThreadList.items[i]);
                         runningThreads[nRunning++] = i;
@@ -369,17 +1206,65 @@ DoGC()
         pthread_barrier_init(&MyGroup->GCBarrierSweep, NULL, nRunning + 1);
         pthread_barrier_init(&MyGroup->GCBarrierDone, NULL, nRunning + 1);
 
+        if (!step) {
+                GCMarkBegin(&MyGroup->Marking, nRunning + 1);
+        }
+
         UnlockThreads(runningThreads, nRunning);
 
         pthread_barrier_wait(&MyGroup->GCBarrierStart);
 
+        clock_gettime(CLOCK_MONOTONIC, &marking);
+
+        size_t before = (GCTraceFile != NULL) ? GroupUsed() : 0;
+
+        if (step) {
+                MarkIncrementally(incremental);
+
+                clock_gettime(CLOCK_MONOTONIC, &marked);
+
+                atomic_store(&MyGroup->WantGC, false);
+
+                pthread_barrier_wait(&MyGroup->GCBarrierSweep);
+
+                UnlockThreads(blockedThreads, nBlocked);
+
+                pthread_mutex_unlock(&MyGroup->Lock);
+                pthread_mutex_unlock(&MyGroup->GCLock);
+
+                pthread_barrier_wait(&MyGroup->GCBarrierDone);
+
+                GCInProgress = false;
+
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                uint64_t pause = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+                uint64_t mark = (marked.tv_sec - marking.tv_sec) * 1000000000ULL + marked.tv_nsec - marking.tv_nsec;
+
+                GCRecordPause(GC_PAUSE_STEP, pause);
+                GCRecordMark(mark);
+
+                if (GCTraceFile != NULL) {
+                        GCTrace(GC_PAUSE_STEP, pause, mark, before, before, nRunning + nBlocked + 1);
+                }
+
+                return;
+        }
+
+        GCMarkMask = minor ? (GC_MARK | GC_OLD) : GC_MARK;
+        GCMarkJoin(&MyGroup->Marking);
+
+        if (incremental) {
+                RescanRemembered();
+        }
+
         for (int i = 0; i < nBlocked; ++i) {
                 GCLOG("Marking thread %llu storage from thread %llu", (long long unsigned)MyGroup->ThreadList.items[blockedThreads[i]], TID);
-                MarkStorage(&MyGroup->ThreadStorages.items[blockedThreads[i]]);
+                MarkStorage(&MyGroup->ThreadStorages.items[blockedThreads[i]], minor);
         }
 
         GCLOG("Marking own storage on thread %llu", TID);
-        MarkStorage(&MyStorage);
+        MarkStorage(&MyStorage, minor);
 
         if (MyGroup == &MainGroup) {
                 for (int i = 0; i < Globals.count; ++i) {
@@ -387,41 +1272,164 @@ DoGC()
                 }
         }
 
+        if (minor) {
+                pthread_mutex_lock(&MyGroup->DLock);
+                GCMarkRemembered(&MyGroup->DeadRemembered);
+                pthread_mutex_unlock(&MyGroup->DLock);
+        } else {
+                /* Nobody looks at them again until their owners sweep */
+                for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                        GCClearRemembered(MyGroup->ThreadStorages.items[i].remembered);
+                }
+                pthread_mutex_lock(&MyGroup->DLock);
+                GCClearRemembered(&MyGroup->DeadRemembered);
+                pthread_mutex_unlock(&MyGroup->DLock);
+        }
+
+        /*
+         * Help the other threads until all of the marking is done. Nobody
+         * starts sweeping before that, so this takes the place of a barrier.
+         */
+        GCMarkDrain();
+
+        /*
+         * Objects that need finalizing are kept alive for one more cycle, and
+         * whatever they refer to is marked on this thread alone while the
+         * others wait.
+         */
+        for (int i = 0; i < MyGroup->ThreadStorages.count; ++i) {
+                ThreadStorage const *storage = &MyGroup->ThreadStorages.items[i];
+                GCQueueFinalizers(storage->finalizable, storage->finalizers);
+        }
+
+        pthread_mutex_lock(&MyGroup->DLock);
+        GCQueueFinalizers(&MyGroup->DeadFinalizable, &FinalizerQueue);
+        pthread_mutex_unlock(&MyGroup->DLock);
+
+        GCMarkMask = GC_MARK;
+
         pthread_barrier_wait(&MyGroup->GCBarrierMark);
 
+        /* The sweep empties the remembered sets */
+        atomic_store(&MyGroup->IncrementalMarking, false);
+        MyGroup->IncrementalMarked = false;
+
+        clock_gettime(CLOCK_MONOTONIC, &marked);
+
         GCLOG("Storing false in WantGC on thread %llu", TID);
         atomic_store(&MyGroup->WantGC, false);
 
         for (int i = 0; i < nBlocked; ++i) {
                 GCLOG("Sweeping thread %llu storage from thread %llu", (long long unsigned)MyGroup->ThreadList.items[blockedThreads[i]], TID);
-                GCSweep(
-                        MyGroup->ThreadStorages.items[blockedThreads[i]].allocs,
-                        MyGroup->ThreadStorages.items[blockedThreads[i]].MemoryUsed
-                );
+                SweepStorage(&MyGroup->ThreadStorages.items[blockedThreads[i]], minor);
         }
 
         GCLOG("Sweeping own storage on thread %llu", TID);
-        GCSweep(MyStorage.allocs, MyStorage.MemoryUsed);
+        SweepStorage(&MyStorage, minor);
 
         GCLOG("Sweeping objects from dead threads on thread %llu", TID);
-        pthread_mutex_lock(&MyGroup->DLock);
-        GCSweep(&MyGroup->DeadAllocs, &MyGroup->DeadUsed);
-        pthread_mutex_unlock(&MyGroup->DLock);
+        SweepDead(minor);
 
         pthread_barrier_wait(&MyGroup->GCBarrierSweep);
 
+        if (!minor) {
+                Pace();
+        }
+
+        size_t live = MyGroup->Live;
+        size_t after = (GCTraceFile != NULL) ? GroupUsed() : 0;
+
+        if (SnapshotPath != NULL && !minor) {
+                TakeSnapshot();
+        }
+
+        if (GCVerify) {
+                VerifyCollection();
+        }
+
         UnlockThreads(blockedThreads, nBlocked);
 
-        GCLOG("Unlocking ThreadsLock and GCLock. Used = %zu, DeadUsed = %zu", MemoryUsed, MyGroup->DeadUsed);
+        GCLOG("Unlocking ThreadsLock and GCLock. Used = %zu, DeadUsed = %zu", MemoryUsed, MyGroup->DeadUsed);
+
+        pthread_mutex_unlock(&MyGroup->Lock);
+        pthread_mutex_unlock(&MyGroup->GCLock);
+
+        GCLOG("Unlocked ThreadsLock and GCLock on thread %llu", TID);
+
+        pthread_barrier_wait(&MyGroup->GCBarrierDone);
+
+        GCInProgress = false;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        uint64_t pause = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+        uint64_t mark = (marked.tv_sec - marking.tv_sec) * 1000000000ULL + marked.tv_nsec - marking.tv_nsec;
+
+        GCRecordPause(minor ? GC_PAUSE_MINOR : GC_PAUSE_MAJOR, pause);
+        GCRecordMark(mark);
+
+        if (GCTraceFile != NULL) {
+                GCTrace(minor ? GC_PAUSE_MINOR : GC_PAUSE_MAJOR, pause, mark, before, after, nRunning + nBlocked + 1);
+        }
+
+        /*
+         * Over TY_MAX_HEAP, try once more with a full collection, which doesn't
+         * keep anything that died while marking incrementally, before giving up.
+         */
+        if (!minor && GCMaxHeap != 0 && live > GCMaxHeap) {
+                if (!full) {
+                        GCLOG("%zu MB live is over TY_MAX_HEAP: doing a full GC", live / 1000000);
+                        DoFullGC();
+                } else {
+                        panic(
+                                "ty: out of memory: %.1f MB still live after a full collection, TY_MAX_HEAP is %.1f MB",
+                                live / 1048576.0,
+                                GCMaxHeap / 1048576.0
+                        );
+                }
+        }
+}
+
+void
+DoGC(void)
+{
+        Collect(false, false);
+}
+
+void
+DoMinorGC(void)
+{
+        Collect(true, false);
+}
+
+/*
+ * Finishing an incremental collection keeps everything that was allocated or
+ * that died while it was marking, so a full collection that had to finish one
+ * does another.
+ */
+void
+DoFullGC(void)
+{
+        bool incremental = atomic_load(&MyGroup->IncrementalMarking);
+
+        Collect(false, true);
 
-        pthread_mutex_unlock(&MyGroup->Lock);
-        pthread_mutex_unlock(&MyGroup->GCLock);
+        if (incremental) {
+                Collect(false, true);
+        }
+}
 
-        GCLOG("Unlocked ThreadsLock and GCLock on thread %llu", TID);
+bool
+vm_heap_snapshot(char const *path)
+{
+        SnapshotPath = path;
 
-        pthread_barrier_wait(&MyGroup->GCBarrierDone);
+        /* If another thread was already collecting, ours comes after it */
+        while (SnapshotPath != NULL) {
+                DoFullGC();
+        }
 
-        GCInProgress = false;
+        return SnapshotWritten;
 }
 
 static struct {
@@ -447,7 +1455,7 @@ add_builtins(int ac, char **av)
         for (int i = 0; i < builtin_count; ++i) {
                 compiler_introduce_symbol(builtins[i].module, builtins[i].name);
                 if (builtins[i].value.type == VALUE_BUILTIN_FUNCTION) {
-                        builtins[i].value.name = builtins[i].name;
+                        builtins[i].value.name = intern(builtins[i].name)->id;
                         builtins[i].value.module = builtins[i].module;
                 }
                 vec_push(Globals, builtins[i].value);
@@ -568,6 +1576,12 @@ pushtarget(struct value *v, void *gc)
         Target t = { .t = v, .gc = gc };
         if (gc != NULL) NOGC(gc);
         vec_push(targets, t);
+        /*
+         * Whatever gets stored through v is stored into gc, so remember it now.
+         * RememberRoots() remembers it again after every collection until
+         * the target is popped.
+         */
+        gc_barrier(gc);
         LOG("TARGETS: (%zu)", targets.count);
         for (int i = 0; i < targets.count; ++i) {
                 LOG("\t%d: %p", i + 1, (void *)targets.items[i].t);
@@ -684,6 +1698,7 @@ call_co(struct value *v, int n)
                         vec_nogc_push_n(v->gen->frame, top() - (n - 1), n);
                         stack.count -= n;
                 }
+                gc_barrier(v->gen);
         }
 
         push(*v);
@@ -708,6 +1723,8 @@ call_co(struct value *v, int n)
         SWAP(SPStack, v->gen->sps, sp_stack);
         SWAP(FrameStack, v->gen->frames, frames);
 
+        RememberRoots(&MyStorage);
+
         for (int i = 0; i < v->gen->frame.count; ++i) {
                 push(v->gen->frame.items[i]);
         }
@@ -781,6 +1798,8 @@ AddThread(void)
 
         vec_push(MyGroup->ThreadList, pthread_self());
 
+        GCIncremental = &MyGroup->IncrementalMarking;
+
         MyLock = malloc(sizeof *MyLock);
         pthread_mutex_init(MyLock, NULL);
         pthread_mutex_lock(MyLock);
@@ -793,7 +1812,15 @@ AddThread(void)
                 .targets = &targets,
                 .root_set = GCRootSet(),
                 .allocs = &allocs,
-                .MemoryUsed = &MemoryUsed
+                .old = &OldAllocs,
+                .remembered = &RememberedSet,
+                .finalizable = &Finalizable,
+                .finalizers = &FinalizerQueue,
+                .heap = &Heap,
+                .MemoryUsed = &MemoryUsed,
+                .MemoryLimit = &MemoryLimit,
+                .MemoryCeiling = &MemoryCeiling,
+                .NurseryUsed = &NurseryUsed
         };
 
         vec_push(MyGroup->ThreadStorages, MyStorage);
@@ -822,10 +1849,24 @@ CleanupThread(void *ctx)
                 pthread_mutex_lock(&MyGroup->DLock);
         }
 
-        vec_push_n_unchecked(MyGroup->DeadAllocs, allocs.items, allocs.count);
+        GCFlushAllocated();
+
+        /* The dead threads' heap is always swept right away */
+        GCFinishSweep(&Heap, &RememberedSet, &MemoryUsed);
+
+        vec_nogc_push_n(MyGroup->DeadYoung, allocs.items, allocs.count);
+        vec_nogc_push_n(MyGroup->DeadAllocs, OldAllocs.items, OldAllocs.count);
+        vec_nogc_push_n(MyGroup->DeadRemembered, RememberedSet.items, RememberedSet.count);
+        vec_nogc_push_n(MyGroup->DeadFinalizable, Finalizable.items, Finalizable.count);
+        vec_nogc_push_n(MyGroup->DeadFinalizable, FinalizerQueue.items, FinalizerQueue.count);
+        GCMergeHeap(&MyGroup->DeadHeap, &Heap);
         MyGroup->DeadUsed += MemoryUsed;
 
         allocs.count = 0;
+        OldAllocs.count = 0;
+        RememberedSet.count = 0;
+        Finalizable.count = 0;
+        FinalizerQueue.count = 0;
 
         pthread_mutex_unlock(&MyGroup->DLock);
 
@@ -858,6 +1899,11 @@ CleanupThread(void *ctx)
         gc_free(throw_stack.items);
         gc_free(defer_stack.items);
         free(allocs.items);
+        free(OldAllocs.items);
+        free(RememberedSet.items);
+        FreeSites();
+        free(Finalizable.items);
+        free(FinalizerQueue.items);
 
         vec(struct value const *) *root_set = GCRootSet();
         gc_free(root_set->items);
@@ -870,7 +1916,15 @@ CleanupThread(void *ctx)
                 gc_free(MyGroup->ThreadLocks.items);
                 gc_free(MyGroup->ThreadStates.items);
                 gc_free(MyGroup->ThreadStorages.items);
-                gc_free(MyGroup->DeadAllocs.items);
+                free(MyGroup->DeadYoung.items);
+                free(MyGroup->DeadAllocs.items);
+                free(MyGroup->DeadRemembered.items);
+                free(MyGroup->DeadFinalizable.items);
+                free(MyGroup->Condemned.items);
+                free(MyGroup->DeadHeap.pages.items);
+                free(MyGroup->DeadHeap.empty.items);
+                GCMarkFree(&MyGroup->Marking);
+                GCMarkFree(&MyGroup->Incremental);
                 gc_free(MyGroup);
         }
 
@@ -912,16 +1966,20 @@ vm_run_thread(void *p)
         if (setjmp(jb) != 0) {
                 // TODO: do something useful here
                 fprintf(stderr, "Thread %p dying with error: %s\n", (void *)pthread_self(), ERR);
+                jit_unwind(0);
                 t->v = NIL;
         } else {
                 t->v = vm_call(call, argc);
+                gc_barrier(t);
         }
 
         pthread_cleanup_pop(1);
 
         free(ctx);
         gc_free(call);
-        OKGC(t);
+
+        /* Not OKGC(): there's no remembered set left to put t in */
+        atomic_fetch_sub(&ALLOC_OF(t)->hard, 1);
 
         return &t->v;
 }
@@ -1030,8 +2088,224 @@ AddTupleEntry(StringVector *names, ValueVector *values, char const *name, struct
         vec_push(*values, *v);
 }
 
-struct value
-GetMember(struct value v, char const *member, unsigned long h, bool b)
+/*
+ * Method and member resolution cache.
+ *
+ * Every instruction that looks a member up by name carries its own site id,
+ * and each site remembers the last few (class, kind) pairs it has seen along
+ * with what they resolved to, most recent first: a monomorphic site hits on
+ * its first entry and a polymorphic one falls back to the others. Entries are
+ * stamped with the version of their class, so changing a class only
+ * invalidates lookups on it and its subclasses. The slots are thread-local,
+ * so no synchronization is needed.
+ */
+enum {
+        IC_METHOD,
+        IC_STATIC,
+        IC_GETTER
+};
+
+typedef struct {
+        int key;
+        unsigned version;
+        struct value *vp;
+        struct value (*func)(struct value *, int, struct value *);
+} InlineCache;
+
+#define IC_WAYS 4
+
+typedef struct {
+        InlineCache ways[IC_WAYS];
+} ICSite;
+
+static _Atomic int ICSiteCount;
+static _Thread_local ICSite *Sites;
+static _Thread_local int SiteCount;
+
+int
+vm_ic_site(void)
+{
+        return atomic_fetch_add_explicit(&ICSiteCount, 1, memory_order_relaxed);
+}
+
+static void
+FreeSites(void)
+{
+        free(Sites);
+        Sites = NULL;
+        SiteCount = 0;
+}
+
+static void
+GrowSites(int site)
+{
+        int n = max(max(site + 1, atomic_load_explicit(&ICSiteCount, memory_order_relaxed)), 2 * SiteCount);
+
+        resize_nogc(Sites, n * sizeof *Sites);
+        memset(Sites + SiteCount, 0, (n - SiteCount) * sizeof *Sites);
+
+        SiteCount = n;
+}
+
+static void
+ICFill(InlineCache *ic, int kind, int class, int sym)
+{
+        char const *name = intern_name(sym);
+        unsigned long h = intern_entry(sym)->hash;
+
+        ic->vp = NULL;
+        ic->func = NULL;
+
+        switch (kind) {
+        case IC_METHOD:
+                switch (class) {
+                case CLASS_STRING: ic->func = get_string_method_i(sym); break;
+                case CLASS_ARRAY:  ic->func = get_array_method_i(sym);  break;
+                case CLASS_DICT:   ic->func = get_dict_method_i(sym);   break;
+                case CLASS_BLOB:   ic->func = get_blob_method_i(sym);   break;
+                case CLASS_UINT8_ARRAY:
+                case CLASS_INT32_ARRAY:
+                case CLASS_INT64_ARRAY:
+                case CLASS_FLOAT32_ARRAY:
+                case CLASS_FLOAT64_ARRAY:
+                        ic->func = get_typed_array_method_i(sym);
+                        break;
+                }
+                if (ic->func == NULL) {
+                        ic->vp = class_lookup_method(class, name, h);
+                }
+                break;
+        case IC_STATIC:
+                ic->vp = class_lookup_static(class, name, h);
+                if (ic->vp == NULL) {
+                        ic->vp = class_lookup_method(class, name, h);
+                }
+                break;
+        case IC_GETTER:
+                ic->vp = class_lookup_getter(class, name, h);
+                break;
+        }
+
+        ic->key = class * 4 + kind;
+        ic->version = class_version(class);
+}
+
+inline static InlineCache *
+ICLookup(int site, int kind, int class, int sym)
+{
+        if (site >= SiteCount) {
+                GrowSites(site);
+        }
+
+        InlineCache *ways = Sites[site].ways;
+        unsigned version = class_version(class);
+        int key = class * 4 + kind;
+
+        for (int i = 0; i < IC_WAYS; ++i) {
+                if (ways[i].key == key) {
+                        if (ways[i].version != version) {
+                                ICFill(&ways[i], kind, class, sym);
+                        }
+                        return &ways[i];
+                }
+        }
+
+        /*
+         * A miss evicts the least recently added entry. Versions start at 1,
+         * so the zeroed entries of a fresh site never match anything.
+         */
+        memmove(&ways[1], &ways[0], (IC_WAYS - 1) * sizeof *ways);
+        ICFill(&ways[0], kind, class, sym);
+
+        return &ways[0];
+}
+
+/*
+ * Resolves a method or builtin method of one of the primitive classes,
+ * through the cache of the given site when there is one (site != -1).
+ */
+inline static struct value *
+LookupMethod(int class, char const *member, unsigned long h, int sym, int site, struct value (**func)(struct value *, int, struct value *))
+{
+        if (site != -1) {
+                InlineCache *ic = ICLookup(site, IC_METHOD, class, sym);
+                if (func != NULL) {
+                        *func = ic->func;
+                }
+                return ic->vp;
+        }
+
+        struct value (*f)(struct value *, int, struct value *) = NULL;
+
+        switch (class) {
+        case CLASS_STRING: f = get_string_method(member); break;
+        case CLASS_ARRAY:  f = get_array_method(member);  break;
+        case CLASS_DICT:   f = get_dict_method(member);   break;
+        case CLASS_BLOB:   f = get_blob_method(member);   break;
+        case CLASS_UINT8_ARRAY:
+        case CLASS_INT32_ARRAY:
+        case CLASS_INT64_ARRAY:
+        case CLASS_FLOAT32_ARRAY:
+        case CLASS_FLOAT64_ARRAY:
+                f = get_typed_array_method(member);
+                break;
+        }
+
+        if (func != NULL) {
+                *func = f;
+        }
+
+        return (f == NULL) ? class_lookup_method(class, member, h) : NULL;
+}
+
+/*
+ * Cache of member slots. Shared shapes are immutable and never freed,
+ * so a (name, shape) pair always maps to the same slot. Objects with private
+ * shapes bypass the cache since their shapes can change and be freed.
+ */
+typedef struct {
+        int sym;
+        struct shape const *shape;
+        int slot;
+} FieldCache;
+
+#define FC_SIZE 1024
+
+static _Thread_local FieldCache FieldCaches[FC_SIZE];
+
+inline static struct value *
+LookupField(struct object *o, int sym)
+{
+        struct shape const *s = o->shape;
+        InternEntry const *e = intern_entry(sym);
+
+        if (!s->shared) {
+                return object_lookup(o, e->name, e->hash);
+        }
+
+        FieldCache *fc = &FieldCaches[((sym * 0x9E3779B1u) ^ (((uintptr_t)s) >> 4)) & (FC_SIZE - 1)];
+
+        if (fc->sym != sym || fc->shape != s) {
+                fc->sym = sym;
+                fc->shape = s;
+                fc->slot = shape_slot(s, e->name, e->hash);
+        }
+
+        return (fc->slot == -1) ? NULL : &o->slots[fc->slot];
+}
+
+inline static int
+MemberSym(int sym, char const *member)
+{
+        return (sym != -1) ? sym : intern(member)->id;
+}
+
+/*
+ * Lookups go through the caches when the member name is interned, i.e. when
+ * sym != -1, and through the inline cache of the site when site != -1.
+ */
+static struct value
+DoGetMember(struct value v, char const *member, unsigned long h, bool b, int sym, int site)
 {
 
         int n;
@@ -1044,7 +2318,7 @@ GetMember(struct value v, char const *member, unsigned long h, bool b)
                         struct value *this = gc_alloc_object(sizeof *this, GC_VALUE);
                         *this = v;
                         this->tags = tags;
-                        return METHOD(member, vp, this);
+                        return METHOD(MemberSym(sym, member), vp, this);
                 }
         }
 
@@ -1053,49 +2327,60 @@ GetMember(struct value v, char const *member, unsigned long h, bool b)
                 vp = tuple_get(&v, member);
                 return (vp == NULL) ? NONE : *vp;
         case VALUE_DICT:
-                func = get_dict_method(member);
+                n = CLASS_DICT;
+                vp = LookupMethod(n, member, h, sym, site, &func);
                 if (func == NULL) {
-                        n = CLASS_DICT;
-                        goto ClassLookup;
+                        goto ClassMethod;
                 }
                 v.type = VALUE_ARRAY;
                 v.tags = 0;
                 this = gc_alloc_object(sizeof *this, GC_VALUE);
                 *this = v;
-                return BUILTIN_METHOD(member, func, this);
+                return BUILTIN_METHOD(MemberSym(sym, member), func, this);
         case VALUE_ARRAY:
-                func = get_array_method(member);
+                n = CLASS_ARRAY;
+                vp = LookupMethod(n, member, h, sym, site, &func);
                 if (func == NULL) {
-                        n = CLASS_ARRAY;
-                        goto ClassLookup;
+                        goto ClassMethod;
                 }
                 v.type = VALUE_ARRAY;
                 v.tags = 0;
                 this = gc_alloc_object(sizeof *this, GC_VALUE);
                 *this = v;
-                return BUILTIN_METHOD(member, func, this);
+                return BUILTIN_METHOD(MemberSym(sym, member), func, this);
         case VALUE_STRING:
-                func = get_string_method(member);
+                n = CLASS_STRING;
+                vp = LookupMethod(n, member, h, sym, site, &func);
                 if (func == NULL) {
-                        n = CLASS_STRING;
-                        goto ClassLookup;
+                        goto ClassMethod;
                 }
                 v.type = VALUE_STRING;
                 v.tags = 0;
                 this = gc_alloc_object(sizeof *this, GC_VALUE);
                 *this = v;
-                return BUILTIN_METHOD(member, func, this);
+                return BUILTIN_METHOD(MemberSym(sym, member), func, this);
         case VALUE_BLOB:
-                func = get_blob_method(member);
+                n = CLASS_BLOB;
+                vp = LookupMethod(n, member, h, sym, site, &func);
                 if (func == NULL) {
-                        n = CLASS_BLOB;
-                        goto ClassLookup;
+                        goto ClassMethod;
                 }
                 v.type = VALUE_BLOB;
                 v.tags = 0;
                 this = gc_alloc_object(sizeof *this, GC_VALUE);
                 *this = v;
-                return BUILTIN_METHOD(member, func, this);
+                return BUILTIN_METHOD(MemberSym(sym, member), func, this);
+        case VALUE_TYPED_ARRAY:
+                n = CLASS_UINT8_ARRAY + v.typed->kind;
+                vp = LookupMethod(n, member, h, sym, site, &func);
+                if (func == NULL) {
+                        goto ClassMethod;
+                }
+                v.type = VALUE_TYPED_ARRAY;
+                v.tags = 0;
+                this = gc_alloc_object(sizeof *this, GC_VALUE);
+                *this = v;
+                return BUILTIN_METHOD(MemberSym(sym, member), func, this);
         case VALUE_GENERATOR:
                 n = CLASS_GENERATOR;
                 goto ClassLookup;
@@ -1115,9 +2400,13 @@ GetMember(struct value v, char const *member, unsigned long h, bool b)
                 n = CLASS_FUNCTION;
                 goto ClassLookup;
         case VALUE_CLASS:
-                vp = class_lookup_static(v.class, member, h);
-                if (vp == NULL) {
-                        vp = class_lookup_method(v.class, member, h);
+                if (site != -1) {
+                        vp = ICLookup(site, IC_STATIC, v.class, sym)->vp;
+                } else {
+                        vp = class_lookup_static(v.class, member, h);
+                        if (vp == NULL) {
+                                vp = class_lookup_method(v.class, member, h);
+                        }
                 }
                 if (vp == NULL) {
                         n = CLASS_CLASS;
@@ -1127,28 +2416,31 @@ GetMember(struct value v, char const *member, unsigned long h, bool b)
                 }
                 break;
         case VALUE_OBJECT:
-                vp = class_lookup_getter(v.class, member, h);
+                vp = (site != -1) ? ICLookup(site, IC_GETTER, v.class, sym)->vp
+                           : class_lookup_getter(v.class, member, h);
                 if (vp != NULL) {
-                        return vm_call(&METHOD(member, vp, &v), 0);
+                        return vm_call(&METHOD(MemberSym(sym, member), vp, &v), 0);
                 }
-                vp = table_lookup(v.object, member, h);
+                vp = (sym != -1) ? LookupField(v.object, sym)
+                                 : object_lookup(v.object, member, h);
                 if (vp != NULL) {
                         return *vp;
                 }
                 n = v.class;
 ClassLookup:
-                vp = class_lookup_method(n, member, h);
+                vp = LookupMethod(n, member, h, sym, site, NULL);
+ClassMethod:
                 if (vp != NULL) {
                         this = gc_alloc_object(sizeof *this, GC_VALUE);
                         *this = v;
-                        return METHOD(member, vp, this);
+                        return METHOD(MemberSym(sym, member), vp, this);
                 }
                 vp = b ? class_method(n, MISSING) : NULL;
                 if (vp != NULL) {
                         this = gc_alloc_object(sizeof (struct value [3]), GC_VALUE);
                         this[0] = v;
                         this[1] = STRING_NOGC(member, strlen(member));
-                        return METHOD(MISSING, vp, this);
+                        return METHOD(MissingId, vp, this);
                 }
                 break;
         case VALUE_TAG:
@@ -1159,14 +2451,21 @@ ClassLookup:
         return NONE;
 }
 
+struct value
+GetMember(struct value v, char const *member, unsigned long h, bool b)
+{
+        return DoGetMember(v, member, h, b, -1, -1);
+}
+
 inline static void
 DoMutDiv(void)
 {
         uintptr_t c, p = (uintptr_t)poptarget();
-        struct table *o;
+        struct object *o;
         struct value *vp, *vp2, x;
         void *v = vp = (void *)(p & ~0x07);
         unsigned char b;
+        struct typed_array *t;
 
         switch (p & 0x07) {
         case 0:
@@ -1176,8 +2475,10 @@ DoMutDiv(void)
                         gc_pop();
                         pop();
                 } else {
+                        void *gc = targets.items[targets.count].gc;
                         x = pop();
                         *vp = binary_operator_division(vp, &x);
+                        gc_barrier(gc);
                 }
                 push(*vp);
                 break;
@@ -1197,6 +2498,12 @@ DoMutDiv(void)
                 pop();
                 call(v, &OBJECT(o, c), 1, 0, false);
                 break;
+        case 3:
+                t = targets.items[targets.count].gc;
+                x = typed_array_get(t, ((uintptr_t)vp) >> 3);
+                *top() = binary_operator_division(&x, top());
+                typed_array_set(t, ((uintptr_t)vp) >> 3, top());
+                break;
         default:
                 vm_panic("bad target pointer :(");
         }
@@ -1205,10 +2512,11 @@ inline static void
 DoMutMul(void)
 {
         uintptr_t c, p = (uintptr_t)poptarget();
-        struct table *o;
+        struct object *o;
         struct value *vp, *vp2, x;
         void *v = vp = (void *)(p & ~0x07);
         unsigned char b;
+        struct typed_array *t;
 
         switch (p & 0x07) {
         case 0:
@@ -1218,8 +2526,10 @@ DoMutMul(void)
                         gc_pop();
                         pop();
                 } else {
+                        void *gc = targets.items[targets.count].gc;
                         x = pop();
                         *vp = binary_operator_multiplication(vp, &x);
+                        gc_barrier(gc);
                 }
                 push(*vp);
                 break;
@@ -1239,6 +2549,12 @@ DoMutMul(void)
                 pop();
                 call(v, &OBJECT(o, c), 1, 0, false);
                 break;
+        case 3:
+                t = targets.items[targets.count].gc;
+                x = typed_array_get(t, ((uintptr_t)vp) >> 3);
+                *top() = binary_operator_multiplication(&x, top());
+                typed_array_set(t, ((uintptr_t)vp) >> 3, top());
+                break;
         default:
                 vm_panic("bad target pointer :(");
         }
@@ -1248,10 +2564,11 @@ inline static void
 DoMutSub(void)
 {
         uintptr_t c, p = (uintptr_t)poptarget();
-        struct table *o;
+        struct object *o;
         struct value *vp, *vp2, x;
         void *v = vp = (void *)(p & ~0x07);
         unsigned char b;
+        struct typed_array *t;
 
         switch (p & 0x07) {
         case 0:
@@ -1266,8 +2583,10 @@ DoMutSub(void)
                         gc_pop();
                         pop();
                 } else {
+                        void *gc = targets.items[targets.count].gc;
                         x = pop();
                         *vp = binary_operator_addition(vp, &x);
+                        gc_barrier(gc);
                 }
                 push(*vp);
                 break;
@@ -1287,6 +2606,12 @@ DoMutSub(void)
                 pop();
                 call(v, &OBJECT(o, c), 1, 0, false);
                 break;
+        case 3:
+                t = targets.items[targets.count].gc;
+                x = typed_array_get(t, ((uintptr_t)vp) >> 3);
+                *top() = binary_operator_subtraction(&x, top());
+                typed_array_set(t, ((uintptr_t)vp) >> 3, top());
+                break;
         default:
                 vm_panic("bad target pointer :(");
         }
@@ -1296,10 +2621,11 @@ inline static void
 DoMutAdd(void)
 {
         uintptr_t c, p = (uintptr_t)poptarget();
-        struct table *o;
+        struct object *o;
         struct value *vp, *vp2, x;
         void *v = vp = (void *)(p & ~0x07);
         unsigned char b;
+        struct typed_array *t;
 
         switch (p & 0x07) {
         case 0:
@@ -1319,8 +2645,10 @@ DoMutAdd(void)
                         gc_pop();
                         pop();
                 } else {
+                        void *gc = targets.items[targets.count].gc;
                         x = pop();
                         *vp = binary_operator_addition(vp, &x);
+                        gc_barrier(gc);
                 }
                 push(*vp);
                 break;
@@ -1341,6 +2669,12 @@ DoMutAdd(void)
                 pop();
                 call(v, &OBJECT(o, c), 1, 0, false);
                 break;
+        case 3:
+                t = targets.items[targets.count].gc;
+                x = typed_array_get(t, ((uintptr_t)vp) >> 3);
+                *top() = binary_operator_addition(&x, top());
+                typed_array_set(t, ((uintptr_t)vp) >> 3, top());
+                break;
         default:
                 vm_panic("bad target pointer :(");
         }
@@ -1351,7 +2685,7 @@ DoAssign(void)
 {
         uintptr_t c, p = (uintptr_t)poptarget();
         void *v = (void *)(p & ~0x07);
-        struct table *o;
+        struct object *o;
 
         switch (p & 0x07) {
         case 0:
@@ -1366,11 +2700,415 @@ DoAssign(void)
                 poptarget();
                 call(v, &OBJECT(o, c), 1, 0, false);
                 break;
+        case 3:
+                typed_array_set(targets.items[targets.count].gc, ((uintptr_t)v >> 3), top());
+                break;
         default:
                 vm_panic("bad target pointer :(");
         }
 }
 
+/*
+ * Templates for the JIT (see jit.h). Each one does what vm_exec() does for its
+ * instruction, after first pointing ip just past the instruction the way the
+ * interpreter would have. Anything that would leave vm_exec() running different
+ * code (calling a setter, say) returns JIT_EXIT before touching any state so
+ * that the interpreter can take over at that instruction instead.
+ *
+ * C from ty --emit-c is compiled along with this file and calls the templates
+ * by name, so there they get inlined.
+ */
+
+inline static bool
+SetterTarget(void)
+{
+        return (((uintptr_t)targets.items[targets.count - 1].t) & 0x07) == 2;
+}
+
+inline static int
+JitLoadLocal(char *next, intmax_t n)
+{
+        ip = next;
+        push(*local(n));
+        return JIT_NEXT;
+}
+
+inline static int
+JitLoadRef(char *next, intmax_t n)
+{
+        ip = next;
+        struct value *vp = local(n);
+        push((vp->type == VALUE_REF) ? *(struct value *)vp->ptr : *vp);
+        return JIT_NEXT;
+}
+
+inline static int
+JitLoadCaptured(char *next, intmax_t n)
+{
+        ip = next;
+        push(*vec_last(frames)->f.env[n]);
+        return JIT_NEXT;
+}
+
+inline static int
+JitLoadGlobal(char *next, intmax_t n)
+{
+        ip = next;
+        while (Globals.count <= n)
+                vec_push(Globals, NIL);
+        push(Globals.items[n]);
+        return JIT_NEXT;
+}
+
+inline static int
+JitTargetGlobal(char *next, intmax_t n)
+{
+        ip = next;
+        while (Globals.count <= n)
+                vec_push(Globals, NIL);
+        pushtarget(&Globals.items[n], NULL);
+        return JIT_NEXT;
+}
+
+inline static int
+JitTargetLocal(char *next, intmax_t n)
+{
+        if (frames.count == 0)
+                return JitTargetGlobal(next, n);
+        ip = next;
+        pushtarget(local(n), NULL);
+        return JIT_NEXT;
+}
+
+inline static int
+JitTargetRef(char *next, intmax_t n)
+{
+        ip = next;
+        struct value *vp = local(n);
+        if (vp->type == VALUE_REF) {
+                pushtarget((struct value *)vp->ptr, vp->ptr);
+        } else {
+                pushtarget(vp, NULL);
+        }
+        return JIT_NEXT;
+}
+
+inline static int
+JitTargetCaptured(char *next, intmax_t n)
+{
+        ip = next;
+        pushtarget(vec_last(frames)->f.env[n], vec_last(frames)->f.env[n]);
+        return JIT_NEXT;
+}
+
+inline static int
+JitAssign(char *next, intmax_t _)
+{
+        if (SetterTarget())
+                return JIT_EXIT;
+        ip = next;
+        DoAssign();
+        return JIT_NEXT;
+}
+
+#define JIT_MUT_OP(name) \
+        inline static int \
+        JitMut ## name(char *next, intmax_t _) \
+        { \
+                if (SetterTarget()) \
+                        return JIT_EXIT; \
+                ip = next; \
+                DoMut ## name(); \
+                return JIT_NEXT; \
+        }
+
+JIT_MUT_OP(Add)
+JIT_MUT_OP(Sub)
+JIT_MUT_OP(Mul)
+JIT_MUT_OP(Div)
+
+#define JIT_INC_OP(name, pre, d) \
+        inline static int \
+        Jit ## name(char *next, intmax_t _) \
+        { \
+                if (SpecialTarget() || peektarget()->type != VALUE_INTEGER) \
+                        return JIT_EXIT; \
+                ip = next; \
+                struct value *vp = poptarget(); \
+                if (pre) { \
+                        vp->integer += (d); \
+                        push(*vp); \
+                } else { \
+                        push(*vp); \
+                        vp->integer += (d); \
+                } \
+                return JIT_NEXT; \
+        }
+
+JIT_INC_OP(PreInc,  true,   1)
+JIT_INC_OP(PostInc, false,  1)
+JIT_INC_OP(PreDec,  true,  -1)
+JIT_INC_OP(PostDec, false, -1)
+
+inline static int
+JitPop(char *next, intmax_t _)
+{
+        ip = next;
+        pop();
+        return JIT_NEXT;
+}
+
+inline static int
+JitDup(char *next, intmax_t _)
+{
+        ip = next;
+        push(peek());
+        return JIT_NEXT;
+}
+
+inline static int
+JitSaveStackPos(char *next, intmax_t _)
+{
+        ip = next;
+        vec_push(sp_stack, stack.count);
+        return JIT_NEXT;
+}
+
+inline static int
+JitRestoreStackPos(char *next, intmax_t _)
+{
+        ip = next;
+        stack.count = *vec_pop(sp_stack);
+        return JIT_NEXT;
+}
+
+inline static int
+JitNil(char *next, intmax_t _)
+{
+        ip = next;
+        push(NIL);
+        return JIT_NEXT;
+}
+
+inline static int
+JitInteger(char *next, intmax_t k)
+{
+        ip = next;
+        push(INTEGER(k));
+        return JIT_NEXT;
+}
+
+inline static int
+JitReal(char *next, intmax_t bits)
+{
+        double x;
+        memcpy(&x, &bits, sizeof x);
+        ip = next;
+        push(REAL(x));
+        return JIT_NEXT;
+}
+
+inline static int
+JitBoolean(char *next, intmax_t b)
+{
+        ip = next;
+        push(BOOLEAN(b));
+        return JIT_NEXT;
+}
+
+inline static int
+JitJump(char *next, intmax_t n)
+{
+        ip = next;
+        SAFEPOINT();
+        return JIT_NEXT;
+}
+
+inline static int
+JitJumpIf(char *next, intmax_t n)
+{
+        ip = next;
+        struct value v = pop();
+        if (!value_truthy(&v))
+                return JIT_NEXT;
+        if (n < 0)
+                SAFEPOINT();
+        return JIT_TAKEN;
+}
+
+inline static int
+JitJumpIfNot(char *next, intmax_t n)
+{
+        ip = next;
+        struct value v = pop();
+        if (value_truthy(&v))
+                return JIT_NEXT;
+        if (n < 0)
+                SAFEPOINT();
+        return JIT_TAKEN;
+}
+
+#define JIT_BINARY_OP(name, fast) \
+        inline static int \
+        Jit ## name(char *next, intmax_t _) \
+        { \
+                struct value *vp = top() - 1; \
+                ip = next; \
+                if (vp[0].type == VALUE_INTEGER && vp[1].type == VALUE_INTEGER) { \
+                        fast(integer, INTEGER); \
+                } else if (vp[0].type == VALUE_REAL && vp[1].type == VALUE_REAL) { \
+                        fast(real, REAL); \
+                } else { \
+                        struct value right = pop(); \
+                        struct value left = pop(); \
+                        push(JIT_SLOW_ ## name); \
+                        return JIT_NEXT; \
+                } \
+                stack.count -= 1; \
+                return JIT_NEXT; \
+        }
+
+#define JIT_ADD(field, make)  vp[0] = make(vp[0].field + vp[1].field)
+#define JIT_SUB(field, make)  vp[0] = make(vp[0].field - vp[1].field)
+#define JIT_MUL(field, make)  vp[0] = make(vp[0].field * vp[1].field)
+#define JIT_EQ(field, make)   vp[0] = BOOLEAN(vp[0].field == vp[1].field)
+#define JIT_NEQ(field, make)  vp[0] = BOOLEAN(vp[0].field != vp[1].field)
+#define JIT_LT(field, make)   vp[0] = BOOLEAN(QUICK_COMPARE(vp[0].field, vp[1].field) < 0)
+#define JIT_GT(field, make)   vp[0] = BOOLEAN(QUICK_COMPARE(vp[0].field, vp[1].field) > 0)
+#define JIT_LEQ(field, make)  vp[0] = BOOLEAN(QUICK_COMPARE(vp[0].field, vp[1].field) <= 0)
+#define JIT_GEQ(field, make)  vp[0] = BOOLEAN(QUICK_COMPARE(vp[0].field, vp[1].field) >= 0)
+
+#define JIT_SLOW_Add binary_operator_addition(&left, &right)
+#define JIT_SLOW_Sub binary_operator_subtraction(&left, &right)
+#define JIT_SLOW_Mul binary_operator_multiplication(&left, &right)
+#define JIT_SLOW_Eq  binary_operator_equality(&left, &right)
+#define JIT_SLOW_Neq binary_operator_non_equality(&left, &right)
+#define JIT_SLOW_Lt  BOOLEAN(value_compare(&left, &right) < 0)
+#define JIT_SLOW_Gt  BOOLEAN(value_compare(&left, &right) > 0)
+#define JIT_SLOW_Leq BOOLEAN(value_compare(&left, &right) <= 0)
+#define JIT_SLOW_Geq BOOLEAN(value_compare(&left, &right) >= 0)
+
+JIT_BINARY_OP(Add, JIT_ADD)
+JIT_BINARY_OP(Sub, JIT_SUB)
+JIT_BINARY_OP(Mul, JIT_MUL)
+JIT_BINARY_OP(Eq,  JIT_EQ)
+JIT_BINARY_OP(Neq, JIT_NEQ)
+JIT_BINARY_OP(Lt,  JIT_LT)
+JIT_BINARY_OP(Gt,  JIT_GT)
+JIT_BINARY_OP(Leq, JIT_LEQ)
+JIT_BINARY_OP(Geq, JIT_GEQ)
+
+inline static int
+JitDiv(char *next, intmax_t _)
+{
+        ip = next;
+        struct value right = pop();
+        struct value left = pop();
+        push(binary_operator_division(&left, &right));
+        return JIT_NEXT;
+}
+
+inline static int
+JitMod(char *next, intmax_t _)
+{
+        ip = next;
+        struct value right = pop();
+        struct value left = pop();
+        push(binary_operator_remainder(&left, &right));
+        return JIT_NEXT;
+}
+
+inline static int
+JitNot(char *next, intmax_t _)
+{
+        ip = next;
+        struct value v = pop();
+        push(unary_operator_not(&v));
+        return JIT_NEXT;
+}
+
+inline static int
+JitNeg(char *next, intmax_t _)
+{
+        ip = next;
+        struct value v = pop();
+        push(unary_operator_negate(&v));
+        return JIT_NEXT;
+}
+
+#define JIT_OP(i, f, operand, flow) [INSTR_ ## i] = { f, #f, JIT_OPERAND_ ## operand, JIT_FLOW_ ## flow }
+
+JitOp const JitOps[256] = {
+        JIT_OP(LOAD_LOCAL,      JitLoadLocal,      LOAD,    NEXT),
+        JIT_OP(LOAD_REF,        JitLoadRef,        LOAD,    NEXT),
+        JIT_OP(LOAD_CAPTURED,   JitLoadCaptured,   LOAD,    NEXT),
+        JIT_OP(LOAD_GLOBAL,     JitLoadGlobal,     LOAD,    NEXT),
+        JIT_OP(TARGET_LOCAL,    JitTargetLocal,    INT,     NEXT),
+        JIT_OP(TARGET_REF,      JitTargetRef,      INT,     NEXT),
+        JIT_OP(TARGET_CAPTURED, JitTargetCaptured, INT,     NEXT),
+        JIT_OP(TARGET_GLOBAL,   JitTargetGlobal,   INT,     NEXT),
+        JIT_OP(ASSIGN,          JitAssign,         NONE,    NEXT),
+        JIT_OP(MUT_ADD,         JitMutAdd,         NONE,    NEXT),
+        JIT_OP(MUT_SUB,         JitMutSub,         NONE,    NEXT),
+        JIT_OP(MUT_MUL,         JitMutMul,         NONE,    NEXT),
+        JIT_OP(MUT_DIV,         JitMutDiv,         NONE,    NEXT),
+        JIT_OP(PRE_INC,         JitPreInc,         NONE,    NEXT),
+        JIT_OP(POST_INC,        JitPostInc,        NONE,    NEXT),
+        JIT_OP(PRE_DEC,         JitPreDec,         NONE,    NEXT),
+        JIT_OP(POST_DEC,        JitPostDec,        NONE,    NEXT),
+        JIT_OP(POP,             JitPop,            NONE,    NEXT),
+        JIT_OP(DUP,             JitDup,            NONE,    NEXT),
+        JIT_OP(NIL,             JitNil,            NONE,    NEXT),
+        JIT_OP(SAVE_STACK_POS,    JitSaveStackPos,    NONE, NEXT),
+        JIT_OP(RESTORE_STACK_POS, JitRestoreStackPos, NONE, NEXT),
+        JIT_OP(INTEGER,         JitInteger,        INTEGER, NEXT),
+        JIT_OP(REAL,            JitReal,           REAL,    NEXT),
+        JIT_OP(BOOLEAN,         JitBoolean,        BOOLEAN, NEXT),
+        JIT_OP(JUMP,            JitJump,           INT,     JUMP),
+        JIT_OP(JUMP_IF,         JitJumpIf,         INT,     BRANCH),
+        JIT_OP(JUMP_IF_NOT,     JitJumpIfNot,      INT,     BRANCH),
+        JIT_OP(ADD,             JitAdd,            NONE,    NEXT),
+        JIT_OP(ADD_INT,         JitAdd,            NONE,    NEXT),
+        JIT_OP(ADD_REAL,        JitAdd,            NONE,    NEXT),
+        JIT_OP(ADD_ANY,         JitAdd,            NONE,    NEXT),
+        JIT_OP(SUB,             JitSub,            NONE,    NEXT),
+        JIT_OP(SUB_INT,         JitSub,            NONE,    NEXT),
+        JIT_OP(SUB_REAL,        JitSub,            NONE,    NEXT),
+        JIT_OP(SUB_ANY,         JitSub,            NONE,    NEXT),
+        JIT_OP(MUL,             JitMul,            NONE,    NEXT),
+        JIT_OP(MUL_INT,         JitMul,            NONE,    NEXT),
+        JIT_OP(MUL_REAL,        JitMul,            NONE,    NEXT),
+        JIT_OP(MUL_ANY,         JitMul,            NONE,    NEXT),
+        JIT_OP(EQ,              JitEq,             NONE,    NEXT),
+        JIT_OP(EQ_INT,          JitEq,             NONE,    NEXT),
+        JIT_OP(EQ_REAL,         JitEq,             NONE,    NEXT),
+        JIT_OP(EQ_ANY,          JitEq,             NONE,    NEXT),
+        JIT_OP(NEQ,             JitNeq,            NONE,    NEXT),
+        JIT_OP(NEQ_INT,         JitNeq,            NONE,    NEXT),
+        JIT_OP(NEQ_REAL,        JitNeq,            NONE,    NEXT),
+        JIT_OP(NEQ_ANY,         JitNeq,            NONE,    NEXT),
+        JIT_OP(LT,              JitLt,             NONE,    NEXT),
+        JIT_OP(LT_INT,          JitLt,             NONE,    NEXT),
+        JIT_OP(LT_REAL,         JitLt,             NONE,    NEXT),
+        JIT_OP(LT_ANY,          JitLt,             NONE,    NEXT),
+        JIT_OP(GT,              JitGt,             NONE,    NEXT),
+        JIT_OP(GT_INT,          JitGt,             NONE,    NEXT),
+        JIT_OP(GT_REAL,         JitGt,             NONE,    NEXT),
+        JIT_OP(GT_ANY,          JitGt,             NONE,    NEXT),
+        JIT_OP(LEQ,             JitLeq,            NONE,    NEXT),
+        JIT_OP(LEQ_INT,         JitLeq,            NONE,    NEXT),
+        JIT_OP(LEQ_REAL,        JitLeq,            NONE,    NEXT),
+        JIT_OP(LEQ_ANY,         JitLeq,            NONE,    NEXT),
+        JIT_OP(GEQ,             JitGeq,            NONE,    NEXT),
+        JIT_OP(GEQ_INT,         JitGeq,            NONE,    NEXT),
+        JIT_OP(GEQ_REAL,        JitGeq,            NONE,    NEXT),
+        JIT_OP(GEQ_ANY,         JitGeq,            NONE,    NEXT),
+        JIT_OP(DIV,             JitDiv,            NONE,    NEXT),
+        JIT_OP(MOD,             JitMod,            NONE,    NEXT),
+        JIT_OP(NOT,             JitNot,            NONE,    NEXT),
+        JIT_OP(NEG,             JitNeg,            NONE,    NEXT),
+};
+
 struct value
 vm_exec_or_nil(char *code)
 {
@@ -1379,6 +3117,7 @@ vm_exec_or_nil(char *code)
 
         size_t nframes = frames.count;
         size_t ntry = try_stack.count;
+        int njit = jit_depth();
         try_stack.count = 0;
 
         char *save = ip;
@@ -1387,6 +3126,7 @@ vm_exec_or_nil(char *code)
                 memcpy(&jb, &jb_, sizeof jb_);
                 frames.count = nframes;
                 try_stack.count = ntry;
+                jit_unwind(njit);
                 ip = save;
                 return NIL;
         }
@@ -1401,6 +3141,68 @@ vm_exec_or_nil(char *code)
         return pop();
 }
 
+/*
+ * Finalizers run one at a time: one that gets to a safepoint doesn't start the
+ * next. There's nobody to throw an exception from one of them to, so it's just
+ * reported.
+ */
+static void
+RunFinalizers(void)
+{
+        if (Finalizing) {
+                return;
+        }
+
+        Finalizing = true;
+
+        jmp_buf jb_;
+        memcpy(&jb_, &jb, sizeof jb_);
+
+        size_t nstack = stack.count;
+        size_t nframes = frames.count;
+        size_t ntargets = targets.count;
+        size_t ncalls = calls.count;
+        size_t nsps = sp_stack.count;
+        size_t ntry = try_stack.count;
+        size_t nroots = gc_root_set_count();
+        int njit = jit_depth();
+
+        char *save = ip;
+
+        try_stack.count = 0;
+
+        while (FinalizerQueue.count != 0) {
+                struct object *o = (struct object *)(*vec_pop(FinalizerQueue))->data;
+                struct value self = OBJECT(o, o->class);
+                struct value f = class_get_finalizer(o->class);
+
+                if (setjmp(jb) != 0) {
+                        fprintf(stderr, "Exception in finalizer for %s: %s\n", class_name(o->class), ERR);
+                        stack.count = nstack;
+                        frames.count = nframes;
+                        targets.count = ntargets;
+                        calls.count = ncalls;
+                        sp_stack.count = nsps;
+                        try_stack.count = 0;
+                        jit_unwind(njit);
+                        gc_truncate_root_set(nroots);
+                        continue;
+                }
+
+                GCLOG("Calling finalizer for: %s", value_show(&self));
+
+                gc_push(&self);
+                vm_call_method(&self, &f, 0);
+                gc_pop();
+        }
+
+        memcpy(&jb, &jb_, sizeof jb_);
+        try_stack.count = ntry;
+        ip = save;
+
+        Finalizing = false;
+}
+
 void
 vm_exec(char *code)
 {
@@ -1419,6 +3221,7 @@ vm_exec(char *code)
         struct value left, right, v, key, value, container, subscript, *vp, *vp2;
         char *str;
         char const *method, *member;
+        int sym, site;
 
         struct value (*func)(struct value *, int, struct value *);
 
@@ -1427,15 +3230,26 @@ vm_exec(char *code)
         char const *fname;
 #endif
 
-        for (;;) {
-        if (GC_OFF_COUNT == 0 && atomic_load(&MyGroup->WantGC)) {
-                WaitGC();
-        }
-        for (int N = 0; N < 10; ++N) {
+#ifdef TY_THREADED_DISPATCH
+        static void * const dispatch[256] = {
+                [0 ... 255] = &&NextInstruction,
+#define X(i) [INSTR_ ## i] = &&Op_ ## i,
+                TY_VM_OPS
+#undef X
+        };
+#endif
+
+        SAFEPOINT();
+        FINALIZE();
+
+        for (;;) {
         NextInstruction:
+#ifdef TY_THREADED_DISPATCH
+                DISPATCH();
+#endif
                 switch ((unsigned char)*ip++) {
                 CASE(NOP)
-                        continue;
+                        DISPATCH();
                 CASE(LOAD_LOCAL)
                         READVALUE(n);
 #ifndef TY_NO_LOG
@@ -1443,7 +3257,7 @@ vm_exec(char *code)
                         ip += strlen(ip) + 1;
 #endif
                         push(*local(n));
-                        break;
+                        DISPATCH();
                 CASE(LOAD_REF)
                         READVALUE(n);
 #ifndef TY_NO_LOG
@@ -1456,7 +3270,7 @@ vm_exec(char *code)
                         } else {
                                 push(*vp);
                         }
-                        break;
+                        DISPATCH();
                 CASE(LOAD_CAPTURED)
                         READVALUE(n);
 #ifndef TY_NO_LOG
@@ -1467,7 +3281,7 @@ vm_exec(char *code)
                             puts(value_show(&vec_last(frames)->f));
                         }
                         push(*vec_last(frames)->f.env[n]);
-                        break;
+                        DISPATCH();
                 CASE(LOAD_GLOBAL)
                         READVALUE(n);
 #ifndef TY_NO_LOG
@@ -1477,45 +3291,60 @@ vm_exec(char *code)
                         while (Globals.count <= n)
                                 vec_push(Globals, NIL);
                         push(Globals.items[n]);
-                        break;
+                        DISPATCH();
                 CASE(EXEC_CODE)
                         READVALUE(s);
                         vm_exec((char *) s);
-                        break;
+                        DISPATCH();
                 CASE(DUP)
                         push(peek());
-                        break;
+                        DISPATCH();
                 CASE(JUMP)
                         READVALUE(n);
                         ip += n;
-                        break;
+                        if (n < 0) {
+                                SAFEPOINT();
+                                FINALIZE();
+                                JIT_POINT();
+                        }
+                        DISPATCH();
                 CASE(JUMP_IF)
                         READVALUE(n);
                         v = pop();
                         if (value_truthy(&v)) {
                                 ip += n;
+                                if (n < 0) {
+                                        SAFEPOINT();
+                                        FINALIZE();
+                                        JIT_POINT();
+                                }
                         }
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF_NOT)
                         READVALUE(n);
                         v = pop();
                         if (!value_truthy(&v)) {
                                 ip += n;
+                                if (n < 0) {
+                                        SAFEPOINT();
+                                        FINALIZE();
+                                        JIT_POINT();
+                                }
                         }
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF_NONE)
                         READVALUE(n);
                         if (top()[-1].type == VALUE_NONE) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF_NIL)
                         READVALUE(n);
                         v = pop();
                         if (v.type == VALUE_NIL) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(TARGET_GLOBAL)
                 TargetGlobal:
                         READVALUE(n);
@@ -1523,32 +3352,30 @@ vm_exec(char *code)
                         while (Globals.count <= n)
                                 vec_push(Globals, NIL);
                         pushtarget(&Globals.items[n], NULL);
-                        break;
+                        DISPATCH();
                 CASE(TARGET_LOCAL)
                         if (frames.count == 0)
                                 goto TargetGlobal;
                         READVALUE(n);
                         LOG("Targeting %d", n);
                         pushtarget(local(n), NULL);
-                        break;
+                        DISPATCH();
                 CASE(TARGET_REF)
                         READVALUE(n);
                         vp = local(n);
                         if (vp->type == VALUE_REF) {
-                                pushtarget((struct value *)vp->ptr, NULL);
+                                pushtarget((struct value *)vp->ptr, vp->ptr);
                         } else {
                                 pushtarget(vp, NULL);
                         }
-                        break;
+                        DISPATCH();
                 CASE(TARGET_CAPTURED)
                         READVALUE(n);
-                        pushtarget(vec_last(frames)->f.env[n], NULL);
-                        break;
+                        pushtarget(vec_last(frames)->f.env[n], vec_last(frames)->f.env[n]);
+                        DISPATCH();
                 CASE(TARGET_MEMBER)
                         v = pop();
-                        member = ip;
-                        ip += strlen(ip) + 1;
-                        READVALUE(h);
+                        READMEMBER(sym, member, h);
                         if (v.type == VALUE_OBJECT) {
                                 vp = class_lookup_setter(v.class, member, h);
                                 if (vp != NULL) {
@@ -1567,13 +3394,13 @@ vm_exec(char *code)
                                         pushtarget(vp2, NULL);
                                         pushtarget((struct value *)(uintptr_t)v.class, v.object);
                                         pushtarget((struct value *)(((uintptr_t)vp) | 2), NULL);
-                                        break;
+                                        DISPATCH();
                                 }
-                                vp = table_lookup(v.object, member, h);
+                                vp = LookupField(v.object, sym);
                                 if (vp != NULL) {
                                         pushtarget(vp, v.object);
                                 } else {
-                                        pushtarget(table_add(v.object, member, h, NIL), v.object);
+                                        pushtarget(object_add(v.object, member, h, NIL), v.object);
                                 }
                         } else if (v.type == VALUE_TUPLE) {
                                 vp = tuple_get(&v, member);
@@ -1584,7 +3411,7 @@ vm_exec(char *code)
                         } else {
                                 vm_panic("assignment to member of non-object");
                         }
-                        break;
+                        DISPATCH();
                 CASE(TARGET_SUBSCRIPT)
                         subscript = top()[0];
                         container = top()[-1];
@@ -1617,6 +3444,18 @@ vm_exec(char *code)
                                         vm_panic("blob index out of range in subscript expression");
                                 }
                                 pushtarget((struct value *)((((uintptr_t)(subscript.integer)) << 3) | 1) , container.blob);
+                        } else if (container.type == VALUE_TYPED_ARRAY) {
+                                FALSE_OR (subscript.type != VALUE_INTEGER) {
+                                        vm_panic("non-integer typed array index used in subscript assignment");
+                                }
+                                if (subscript.integer < 0) {
+                                        subscript.integer += container.typed->count;
+                                }
+                                if (subscript.integer < 0 || subscript.integer >= container.typed->count) {
+                                        push(TAG(gettag(NULL, "IndexError")));
+                                        goto Throw;
+                                }
+                                pushtarget((struct value *)((((uintptr_t)(subscript.integer)) << 3) | 3) , container.typed);
                         } else {
                                 vm_panic("attempt to perform subscript assignment on something other than an object or array");
                         }
@@ -1624,20 +3463,20 @@ vm_exec(char *code)
                         pop();
                         pop();
 
-                        break;
+                        DISPATCH();
                 CASE(ASSIGN)
                         DoAssign();
-                        break;
+                        DISPATCH();
                 CASE(MAYBE_ASSIGN)
                         vp = poptarget();
                         if (vp->type == VALUE_NIL)
                                 *vp = peek();
-                        break;
+                        DISPATCH();
                 CASE(TAG_PUSH)
                         READVALUE(tag);
                         top()->tags = tags_push(top()->tags, tag);
                         top()->type |= VALUE_TAGGED;
-                        break;
+                        DISPATCH();
                 CASE(ARRAY_REST)
                         READVALUE(i);
                         READVALUE(j);
@@ -1650,9 +3489,10 @@ vm_exec(char *code)
                                 NOGC(rest);
                                 vec_push_n(*rest, top()->array->items + i, top()->array->count - (i + j));
                                 *vp = ARRAY(rest);
+                                gc_barrier(targets.items[targets.count].gc);
                                 OKGC(rest);
                         }
-                        break;
+                        DISPATCH();
                 CASE(TUPLE_REST)
                         READVALUE(i);
                         READVALUE(n);
@@ -1664,13 +3504,14 @@ vm_exec(char *code)
                                 struct value *rest = gc_alloc_object(sizeof (struct value[count]), GC_TUPLE);
                                 memcpy(rest, top()->items + i, count * sizeof (struct value));
                                 *vp = TUPLE(rest, NULL, count, false);
+                                gc_barrier(targets.items[targets.count].gc);
                         }
-                        break;
+                        DISPATCH();
                 CASE(THROW_IF_NIL)
                         if (top()->type == VALUE_NIL) {
                                 MatchError;
                         }
-                        break;
+                        DISPATCH();
                 CASE(UNTAG_OR_DIE)
                         READVALUE(tag);
                         if (!tags_same(tags_first(top()->tags), tag)) {
@@ -1679,7 +3520,7 @@ vm_exec(char *code)
                                 top()->tags = tags_pop(top()->tags);
                                 top()->type &= ~VALUE_TAGGED;
                         }
-                        break;
+                        DISPATCH();
                 CASE(BAD_MATCH)
                         MatchError;
                 CASE(BAD_CALL)
@@ -1707,7 +3548,7 @@ vm_exec(char *code)
                                 TERM(22),
                                 TERM(39)
                         );
-                        break;
+                        DISPATCH();
                 CASE(BAD_ASSIGN)
                         v = pop();
                         str = ip;
@@ -1726,7 +3567,7 @@ vm_exec(char *code)
                                 TERM(22),
                                 TERM(39)
                         );
-                        break;
+                        DISPATCH();
                 CASE(THROW)
 Throw:
                         vec_push(throw_stack, ((ThrowCtx) {
@@ -1769,6 +3610,7 @@ Throw:
                         ip = t->catch;
 
                         gc_truncate_root_set(t->gc);
+                        jit_unwind(t->jit);
 
                         longjmp(t->jb, 1);
                         /* unreachable */
@@ -1777,24 +3619,24 @@ Throw:
                 {
                         struct try *t = vec_pop(try_stack);
                         if (t->finally == NULL)
-                                break;
+                                DISPATCH();
                         *t->end = INSTR_HALT;
                         vm_exec(t->finally);
                         *t->end = INSTR_NOP;
-                        break;
+                        DISPATCH();
                 }
                 CASE(POP_TRY)
                         --try_stack.count;
-                        break;
+                        DISPATCH();
                 CASE(POP_THROW)
                         --throw_stack.count;
-                        break;
+                        DISPATCH();
                 CASE(TRY)
                 {
                         READVALUE(n);
                         struct try t;
                         if (setjmp(t.jb) != 0)
-                                break;
+                                DISPATCH();
                         t.catch = ip + n;
                         READVALUE(n);
                         t.finally = (n == -1) ? NULL : ip + n;
@@ -1805,43 +3647,44 @@ Throw:
                         t.cs = calls.count;
                         t.ts = targets.count;
                         t.ctxs = frames.count;
+                        t.jit = jit_depth();
                         t.executing = false;
                         vec_push(try_stack, t);
-                        break;
+                        DISPATCH();
                 }
                 CASE(PUSH_DEFER_GROUP)
                         vec_push(defer_stack, ARRAY(value_array_new()));
-                        break;
+                        DISPATCH();
                 CASE(DEFER)
                         v = pop();
                         value_array_push(vec_last(defer_stack)->array, v);
-                        break;
+                        DISPATCH();
                 CASE(CLEANUP)
                         v = *vec_pop(defer_stack);
                         for (int i = 0; i < v.array->count; ++i) {
                                 vm_call(&v.array->items[i], 0);
                         }
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_LEN)
                         READVALUE(n);
                         b = top()->type == VALUE_ARRAY && top()->array->count <= n;
                         READVALUE(n);
                         if (!b)
                                 ip += n;
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_LEN_TUPLE)
                         READVALUE(n);
                         b = top()->type == VALUE_TUPLE && top()->count <= n;
                         READVALUE(n);
                         if (!b)
                                 ip += n;
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_EQUALS_VAR)
                         v = pop();
                         READVALUE(n);
                         if (!value_test_equality(top(), &v))
                                 ip += n;
-                        break;
+                        DISPATCH();
                 CASE(TRY_ASSIGN_NON_NIL)
                         READVALUE(n);
                         vp = poptarget();
@@ -1849,7 +3692,7 @@ Throw:
                                 ip += n;
                         else
                                 *vp = peek();
-                        break;
+                        DISPATCH();
                 CASE(TRY_REGEX)
                         READVALUE(s);
                         READVALUE(n);
@@ -1865,27 +3708,27 @@ Throw:
                                         vp[i] = value.array->items[i];
                                 }
                         }
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_DICT)
                         READVALUE(n);
                         if (top()->type != VALUE_DICT) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_CONTAINS)
                         READVALUE(n);
                         v = pop();
                         if (!dict_has_value(top()->dict, &v)) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(ENSURE_SAME_KEYS)
                         READVALUE(n);
                         v = pop();
                         if (!dict_same_keys(top()->dict, v.dict)) {
                                 ip += n;
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_INDEX)
                         READVALUE(i);
                         READVALUE(b);
@@ -1893,7 +3736,7 @@ Throw:
                         //LOG("trying to index: %s", value_show(top()));
                         if (top()->type != VALUE_ARRAY) {
                                 ip += n;
-                                break;
+                                DISPATCH();
                         }
                         if (i < 0) {
                                 i += top()->array->count;
@@ -1907,7 +3750,7 @@ Throw:
                         } else {
                                 push(top()->array->items[i]);
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_INDEX_TUPLE)
                         READVALUE(i);
                         READVALUE(n);
@@ -1916,7 +3759,7 @@ Throw:
                         } else {
                                 push(top()->items[i]);
                         }
-                        break;
+                        DISPATCH();
                 CASE(TRY_TUPLE_MEMBER)
                         // b => required
                         READVALUE(b);
@@ -1928,7 +3771,7 @@ Throw:
 
                         if (top()->type != VALUE_TUPLE) {
                                 ip += n;
-                                break;
+                                DISPATCH();
                         }
 
                         for (int i = 0; top()->names != NULL && i < top()->count; ++i) {
@@ -1945,7 +3788,7 @@ Throw:
 
                         ip += n;
 
-                        break;
+                        DISPATCH();
                 CASE(TRY_TAG_POP)
                         READVALUE(tag);
                         READVALUE(n);
@@ -1957,44 +3800,45 @@ Throw:
                                         top()->type &= ~VALUE_TAGGED;
                                 }
                         }
-                        break;
+                        DISPATCH();
                 CASE(POP)
                         pop();
-                        break;
+                        DISPATCH();
                 CASE(UNPOP)
                         stack.count += 1;
-                        break;
+                        DISPATCH();
                 CASE(INTEGER)
                         READVALUE(k);
                         push(INTEGER(k));
-                        break;
+                        DISPATCH();
                 CASE(REAL)
                         READVALUE(f);
                         push(REAL(f));
-                        break;
+                        DISPATCH();
                 CASE(BOOLEAN)
                         READVALUE(b);
                         push(BOOLEAN(b));
-                        break;
+                        DISPATCH();
                 CASE(STRING)
                         n = strlen(ip);
                         push(STRING_NOGC(ip, n));
                         ip += n + 1;
-                        break;
+                        DISPATCH();
                 CASE(CLASS)
                         READVALUE(tag);
                         push(CLASS(tag));
-                        break;
+                        DISPATCH();
                 CASE(TAG)
                         READVALUE(tag);
                         push(TAG(tag));
-                        break;
+                        DISPATCH();
                 CASE(REGEX)
                         READVALUE(s);
                         v = REGEX((struct regex const *) s);
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(ARRAY)
+                        SAFEPOINT();
                         v = ARRAY(value_array_new());
                         n = stack.count - *vec_pop(sp_stack);
 
@@ -2017,9 +3861,11 @@ Throw:
                         push(v);
                         OKGC(v.array);
 
-                        break;
+                        DISPATCH();
                 CASE(TUPLE)
                 {
+                        SAFEPOINT();
+
                         static _Thread_local StringVector names;
                         static _Thread_local ValueVector values;
 
@@ -2030,9 +3876,12 @@ Throw:
 
                         n = stack.count - *vec_pop(sp_stack);
 
-                        for (int i = 0; i < n; ++i, ip += strlen(ip) + 1) {
+                        for (int i = 0; i < n; ++i) {
                                 struct value *v = &stack.items[stack.count - n + i];
-                                if (v->type == VALUE_TUPLE && strcmp(ip, "*") == 0) {
+                                int id;
+                                READVALUE(id);
+                                char const *name = (id == -1) ? NULL : intern_name(id);
+                                if (v->type == VALUE_TUPLE && name != NULL && strcmp(name, "*") == 0) {
                                         for (int j = 0; j < v->count; ++j) {
                                                 if (v->names != NULL && v->names[j] != NULL) {
                                                         AddTupleEntry(&names, &values, v->names[j], &v->items[j]);
@@ -2043,18 +3892,20 @@ Throw:
                                                 }
                                         }
                                 } else if (v->type != VALUE_NONE) {
-                                        if (ip[0] == '\0') {
+                                        if (name == NULL) {
                                                 vec_push(names, NULL);
                                                 vec_push(values, *v);
                                         } else {
-                                                AddTupleEntry(&names, &values, ip, v);
+                                                AddTupleEntry(&names, &values, name, v);
                                                 have_names = true;
                                         }
                                 }
                         }
 
-                        stack.count -= n;
-
+                        /*
+                         * The elements stay on the stack until the tuple has
+                         * been allocated so that a collection can't free them.
+                         */
                         k = values.count;
                         vp = gc_alloc_object(sizeof (struct value[k]), GC_TUPLE);
 
@@ -2070,11 +3921,13 @@ Throw:
                                 }
                         }
 
+                        stack.count -= n;
                         push(v);
 
-                        break;
+                        DISPATCH();
                 }
                 CASE(DICT)
+                        SAFEPOINT();
                         v = DICT(dict_new());
                         NOGC(v.dict);
 
@@ -2089,20 +3942,20 @@ Throw:
 
                         OKGC(v.dict);
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(DICT_DEFAULT)
                         v = pop();
                         top()->dict->dflt = v;
-                        break;
+                        DISPATCH();
                 CASE(SELF)
                         if (frames.count == 0) {
                         } else {
                                 push(NIL);
                         }
-                        break;
+                        DISPATCH();
                 CASE(NIL)
                         push(NIL);
-                        break;
+                        DISPATCH();
                 CASE(TO_STRING)
                         str = ip;
                         n = strlen(str);
@@ -2111,19 +3964,18 @@ Throw:
                             char *s = value_show(top());
                             pop();
                             push(STRING_NOGC(s, strlen(s)));
-                            break;
+                            DISPATCH();
                         } else if (n > 0) {
                                 v = pop();
                                 push(STRING_NOGC(str, n));
                                 push(v);
                                 n = 1;
-                                method = "__fmt__";
+                                SETMEMBER(sym, method, h, site, "__fmt__");
                         } else {
                                 n = 0;
-                                method = "__str__";
+                                SETMEMBER(sym, method, h, site, "__str__");
                         }
                         b = false;
-                        h = strhash(method);
                         goto CallMethod;
                 CASE(YIELD)
                         n = frames.items[0].fp;
@@ -2142,6 +3994,8 @@ Throw:
                         SWAP(FrameStack, v.gen->frames, frames);
 
                         vec_nogc_push_n(v.gen->frame, stack.items + n, stack.count - n - 1);
+                        gc_barrier(v.gen);
+                        RememberRoots(&MyStorage);
 
                         stack.items[n - 1] = peek();
                         stack.count = n;
@@ -2150,8 +4004,9 @@ Throw:
 
                         ip = *vec_pop(calls);
 
-                        break;
+                        DISPATCH();
                 CASE(MAKE_GENERATOR)
+                        SAFEPOINT();
                         v.type = VALUE_GENERATOR;
                         v.tags = 0;
                         v.gen = gc_alloc_object(sizeof *v.gen, GC_GENERATOR);
@@ -2171,7 +4026,7 @@ Throw:
                 CASE(VALUE)
                         READVALUE(s);
                         push(*(struct value *)s);
-                        break;
+                        DISPATCH();
                 CASE(EVAL)
                         READVALUE(s);
                         push(PTR((void *)s));
@@ -2179,11 +4034,11 @@ Throw:
                         pop();
                         pop();
                         push(v);
-                        break;
+                        DISPATCH();
                 CASE(FUCK)
                 CASE(FUCK2)
                 CASE(FUCK3)
-                        break;
+                        DISPATCH();
                 CASE(GET_NEXT)
                         v = top()[-1];
                         i = top()[-2].i++;
@@ -2200,13 +4055,13 @@ Throw:
                                 break;
                         case VALUE_DICT:
                                 off = top()[-2].off;
-                                while (off < v.dict->size && v.dict->keys[off].type == 0) {
+                                while (off < v.dict->used && v.dict->keys[off].type == 0) {
                                         off += 1;
                                 }
-                                if (off < v.dict->size) {
+                                if (off < v.dict->used) {
                                         top()[-2].off = off + 1;
                                         push(v.dict->keys[off]);
-                                        push(v.dict->values[off]);
+                                        push(dict_value(v.dict, off));
                                         rc = 1;
                                         pop();
                                 } else {
@@ -2227,11 +4082,21 @@ Throw:
                                         vec_push(calls, ip - 1);
                                         call(vp, &v, 0, 0, false);
                                         *vec_last(calls) = iter_fix;
-                                        continue;
+                                        DISPATCH();
                                 } else {
                                         goto NoIter;
                                 }
                                 break;
+                        case VALUE_INDEX:
+                                /* Integer range, see INT_RANGE */
+                                k = v.counter;
+                                if ((v.step > 0) ? (k <= v.limit) : (k >= v.limit)) {
+                                        top()[-1].counter += v.step;
+                                        push(INTEGER(k));
+                                } else {
+                                        push(NONE);
+                                }
+                                break;
                         case VALUE_BLOB:
                                 if (i < v.blob->count) {
                                         push(INTEGER(v.blob->items[i]));
@@ -2239,6 +4104,13 @@ Throw:
                                         push(NONE);
                                 }
                                 break;
+                        case VALUE_TYPED_ARRAY:
+                                if (i < v.typed->count) {
+                                        push(typed_array_get(v.typed, i));
+                                } else {
+                                        push(NONE);
+                                }
+                                break;
                         case VALUE_STRING:
                                 vp = top() - 2;
                                 if ((off = vp->off) < v.bytes) {
@@ -2257,14 +4129,14 @@ Throw:
                         NoIter:
                                 vm_panic("for-each loop on non-iterable value: %s", value_show(&v));
                         }
-                        break;
+                        DISPATCH();
                 CASE(ARRAY_COMPR)
                         n = stack.count - *vec_pop(sp_stack);
                         v = top()[-(n + 2)];
                         for (int i = 0; i < n; ++i)
                                 value_array_push(v.array, top()[-i]);
                         stack.count -= n;
-                        break;
+                        DISPATCH();
                 CASE(DICT_COMPR)
                         READVALUE(n);
                         v = top()[-(2*n + 2)];
@@ -2274,22 +4146,22 @@ Throw:
                                 dict_put_value(v.dict, key, value);
                         }
                         stack.count -= 2 * n;
-                        break;
+                        DISPATCH();
                 CASE(PUSH_INDEX)
                         READVALUE(n);
                         push(INDEX(0, 0, n));
-                        break;
+                        DISPATCH();
                 CASE(READ_INDEX)
                         k = top()[-3].integer - 1;
                         stack.count += rc;
                         push(INTEGER(k));
-                        break;
+                        DISPATCH();
                 CASE(SENTINEL)
                         push(SENTINEL);
-                        break;
+                        DISPATCH();
                 CASE(NONE)
                         push(NONE);
-                        break;
+                        DISPATCH();
                 CASE(NONE_IF_NIL)
                         if (top()->type == VALUE_TAG && top()->tag == TAG_NONE) {
                                 *top() = NONE;
@@ -2301,14 +4173,14 @@ Throw:
                                         top()->type &= ~VALUE_TAGGED;
                                 }
                         }
-                        break;
+                        DISPATCH();
                 CASE(CLEAR_RC)
                         rc = 0;
-                        break;
+                        DISPATCH();
                 CASE(GET_EXTRA)
                         LOG("GETTING %d EXTRA", rc);
                         stack.count += rc;
-                        break;
+                        DISPATCH();
                 CASE(FIX_EXTRA)
                         for (n = 0; top()[-n].type != VALUE_SENTINEL; ++n)
                                 ;
@@ -2317,7 +4189,7 @@ Throw:
                                 top()[-i] = top()[-j];
                                 top()[-j] = v;
                         }
-                        break;
+                        DISPATCH();
                 CASE(FIX_TO)
                         READVALUE(n);
                         for (i = 0; top()[-i].type != VALUE_SENTINEL; ++i)
@@ -2331,12 +4203,12 @@ Throw:
                                 top()[-i] = top()[-j];
                                 top()[-j] = v;
                         }
-                        break;
+                        DISPATCH();
                 CASE(SWAP)
                         v = top()[-1];
                         top()[-1] = top()[0];
                         top()[0] = v;
-                        break;
+                        DISPATCH();
                 CASE(REVERSE)
                         READVALUE(n);
                         for (--n, i = 0; i < n; ++i, --n) {
@@ -2344,7 +4216,7 @@ Throw:
                                 top()[-i] = top()[-n];
                                 top()[-n] = v;
                         }
-                        break;
+                        DISPATCH();
                 CASE(MULTI_ASSIGN)
                         print_stack(5);
                         READVALUE(n);
@@ -2358,7 +4230,7 @@ Throw:
                                 }
                         }
                         push(top()[2]);
-                        break;
+                        DISPATCH();
                 CASE(MAYBE_MULTI)
                         READVALUE(n);
                         for (i = 0, vp = top(); pop().type != VALUE_SENTINEL; ++i)
@@ -2372,21 +4244,21 @@ Throw:
                                 }
                         }
                         push(top()[2]);
-                        break;
+                        DISPATCH();
                 CASE(JUMP_IF_SENTINEL)
                         READVALUE(n);
                         if (top()->type == VALUE_SENTINEL)
                                 ip += n;
-                        break;
+                        DISPATCH();
                 CASE(CLEAR_EXTRA)
                         while (top()->type != VALUE_SENTINEL)
                                 pop();
                         pop();
-                        break;
+                        DISPATCH();
                 CASE(PUSH_NTH)
                         READVALUE(n);
                         push(top()[-n]);
-                        break;
+                        DISPATCH();
                 CASE(PUSH_ARRAY_ELEM)
                         READVALUE(n);
                         READVALUE(b);
@@ -2407,7 +4279,7 @@ Throw:
                         } else {
                                 push(top()->array->items[n]);
                         }
-                        break;
+                        DISPATCH();
                 CASE(PUSH_TUPLE_ELEM)
                         READVALUE(n);
                         FALSE_OR (top()->type != VALUE_TUPLE) {
@@ -2417,7 +4289,7 @@ Throw:
                                 vm_panic("elment index out of range in destructuring assignment");
                         }
                         push(top()->items[n]);
-                        break;
+                        DISPATCH();
                 CASE(PUSH_TUPLE_MEMBER)
                         READVALUE(b);
 
@@ -2450,8 +4322,9 @@ Throw:
                                 push(v.array->items[i]);
                         }
                         gc_pop();
-                        break;
+                        DISPATCH();
                 CASE(CONCAT_STRINGS)
+                        SAFEPOINT();
                         READVALUE(n);
                         k = 0;
                         for (i = stack.count - n; i < stack.count; ++i)
@@ -2467,8 +4340,9 @@ Throw:
                         }
                         stack.count -= n - 1;
                         stack.items[stack.count - 1] = v;
-                        break;
+                        DISPATCH();
                 CASE(RANGE)
+                Range:
                         i = class_lookup("Range");
                         if (i == -1 || (vp = class_method(i, "init")) == NULL) {
                                 vm_panic("failed to load Range class. was prelude loaded correctly?");
@@ -2479,8 +4353,9 @@ Throw:
                         call(vp, &v, 2, 0, true);
                         *top() = v;
                         OKGC(v.object);
-                        break;
+                        DISPATCH();
                 CASE(INCRANGE)
+                IncRange:
                         i = class_lookup("InclusiveRange");
                         if (i == -1 || (vp = class_method(i, "init")) == NULL) {
                                 vm_panic("failed to load InclusiveRange class. was prelude loaded correctly?");
@@ -2491,26 +4366,66 @@ Throw:
                         call(vp, &v, 2, 0, true);
                         *top() = v;
                         OKGC(v.object);
-                        break;
+                        DISPATCH();
+                CASE(INT_RANGE)
+                        READVALUE(n);
+                        left = top()[-1];
+                        right = top()[0];
+
+                        if (left.type != VALUE_INTEGER || right.type != VALUE_INTEGER) {
+                                switch (n) {
+                                case INT_RANGE_DOT_DOT:     goto Range;
+                                case INT_RANGE_DOT_DOT_DOT: goto IncRange;
+                                }
+
+                                vp = class_method(CLASS_INT, (n == INT_RANGE_UPTO) ? "upto" : "downto");
+                                if (vp == NULL) {
+                                        vm_panic("failed to load Int.upto. was prelude loaded correctly?");
+                                }
+
+                                top()[-1] = right;
+                                pop();
+                                call(vp, &left, 1, 0, true);
+                                DISPATCH();
+                        }
+
+                        switch (n) {
+                        case INT_RANGE_DOT_DOT:
+                                v = (left.integer < right.integer)
+                                  ? COUNTER(left.integer, right.integer - 1, 1)
+                                  : COUNTER(left.integer - 1, right.integer, -1);
+                                break;
+                        case INT_RANGE_DOT_DOT_DOT:
+                                v = COUNTER(left.integer, right.integer, (left.integer < right.integer) ? 1 : -1);
+                                break;
+                        case INT_RANGE_UPTO:
+                                v = COUNTER(left.integer, right.integer, 1);
+                                break;
+                        case INT_RANGE_DOWNTO:
+                                v = COUNTER(left.integer, right.integer, -1);
+                                break;
+                        }
+
+                        pop();
+                        *top() = v;
+                        DISPATCH();
                 CASE(TRY_MEMBER_ACCESS)
                 CASE(MEMBER_ACCESS)
                         value = pop();
 
                         b = ip[-1] == INSTR_TRY_MEMBER_ACCESS;
 
-                        member = ip;
-                        ip += strlen(ip) + 1;
-
-                        READVALUE(h);
+                        READMEMBER(sym, member, h);
+                        READVALUE(site);
 
                         push(NIL);
-                        v = GetMember(value, member, h, true);
+                        v = DoGetMember(value, member, h, true, sym, site);
 
                         if (v.type != VALUE_NONE) {
                                 *top() = v;
-                                break;
+                                DISPATCH();
                         } else if (b) {
-                                break;
+                                DISPATCH();
                         }
 
                         if (value.type == VALUE_TUPLE) {
@@ -2536,7 +4451,7 @@ Throw:
                                 );
                         }
 
-                        break;
+                        DISPATCH();
                 CASE(SUBSCRIPT)
                         subscript = pop();
                         container = pop();
@@ -2615,6 +4530,19 @@ ObjectSubscript:
                                 pop();
                                 push(v);
                                 break;
+                        case VALUE_TYPED_ARRAY:
+                                FALSE_OR (subscript.type != VALUE_INTEGER) {
+                                        vm_panic("non-integer typed array index used in subscript expression");
+                                }
+                                if (subscript.integer < 0) {
+                                        subscript.integer += container.typed->count;
+                                }
+                                if (subscript.integer < 0 || subscript.integer >= container.typed->count) {
+                                        push(TAG(gettag(NULL, "IndexError")));
+                                        goto Throw;
+                                }
+                                push(typed_array_get(container.typed, subscript.integer));
+                                break;
                         case VALUE_DICT:
                                 vp = dict_get_value(container.dict, &subscript);
                                 push((vp == NULL) ? NIL : *vp);
@@ -2633,14 +4561,13 @@ ObjectSubscript:
                                 push(container);
                                 n = 1;
                                 b = false;
-                                method = "__subscript__";
-                                h = strhash(method);
+                                SETMEMBER(sym, method, h, site, "__subscript__");
                                 goto CallMethod;
                         case VALUE_PTR:
                                 FALSE_OR (subscript.type != VALUE_INTEGER) {
                                         vm_panic("non-integer used to subscript pointer: %s", value_show(&subscript));
                                 }
-                                v = GCPTR((container.extra == NULL) ? &ffi_type_uint8 : container.extra, container.gcptr);
+                                v = GCPTR((container.extra == 0) ? &ffi_type_uint8 : value_extra(container.extra), container.gcptr);
                                 push(v);
                                 push(PTR(((char *)container.ptr) + ((ffi_type *)v.ptr)->size * subscript.integer));
                                 v = cffi_load(2, NULL);
@@ -2655,30 +4582,30 @@ ObjectSubscript:
 BadContainer:
                                 vm_panic("invalid container in subscript expression: %s", value_show(&container));
                         }
-                        break;
+                        DISPATCH();
                 CASE(NOT)
                         v = pop();
                         push(unary_operator_not(&v));
-                        break;
+                        DISPATCH();
                 CASE(QUESTION)
                         if (top()->type == VALUE_NIL) {
                                 *top() = BOOLEAN(false);
                         } else {
                                 n = 0;
                                 b = false;
-                                method = "__question__";
-                                h = strhash(method);
+                                SETMEMBER(sym, method, h, site, "__question__");
                                 goto CallMethod;
                         }
-                        break;
+                        DISPATCH();
                 CASE(NEG)
                         v = pop();
                         push(unary_operator_negate(&v));
-                        break;
+                        DISPATCH();
                 CASE(COUNT)
                         v = pop();
                         switch (v.type) {
                         case VALUE_BLOB:   push(INTEGER(v.blob->count));  break;
+                        case VALUE_TYPED_ARRAY: push(INTEGER(v.typed->count)); break;
                         case VALUE_ARRAY:  push(INTEGER(v.array->count)); break;
                         case VALUE_DICT:   push(INTEGER(v.dict->count));  break;
                         case VALUE_STRING:
@@ -2688,48 +4615,52 @@ BadContainer:
                                 push(v);
                                 n = 0;
                                 b = false;
-                                method = "__len__";
-                                h = strhash(method);
+                                SETMEMBER(sym, method, h, site, "__len__");
                                 goto CallMethod;
                         default: vm_panic("# applied to operand of invalid type: %s", value_show(&v));
                         }
-                        break;
+                        DISPATCH();
                 CASE(ADD)
                         right = pop();
                         left = pop();
+                        QUICKEN(ADD);
                         push(binary_operator_addition(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(SUB)
                         right = pop();
                         left = pop();
+                        QUICKEN(SUB);
                         push(binary_operator_subtraction(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(MUL)
                         right = pop();
                         left = pop();
+                        QUICKEN(MUL);
                         push(binary_operator_multiplication(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(DIV)
                         right = pop();
                         left = pop();
                         push(binary_operator_division(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(MOD)
                         right = pop();
                         left = pop();
                         push(binary_operator_remainder(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(EQ)
                         right = pop();
                         left = pop();
+                        QUICKEN(EQ);
                         push(binary_operator_equality(&left, &right));
-                        break;
+                        DISPATCH();
                 CASE(NEQ)
                         right = pop();
                         left = pop();
+                        QUICKEN(NEQ);
                         push(binary_operator_equality(&left, &right));
                         --top()->boolean;
-                        break;
+                        DISPATCH();
                 CASE(CHECK_MATCH)
                         if (top()->type == VALUE_CLASS) {
                                 v = pop();
@@ -2746,6 +4677,9 @@ BadContainer:
                                 case VALUE_ARRAY:     *top() = BOOLEAN(class_is_subclass(CLASS_ARRAY, v.class));     break;
                                 case VALUE_STRING:    *top() = BOOLEAN(class_is_subclass(CLASS_STRING, v.class));    break;
                                 case VALUE_BLOB:      *top() = BOOLEAN(class_is_subclass(CLASS_BLOB, v.class));      break;
+                                case VALUE_TYPED_ARRAY:
+                                        *top() = BOOLEAN(class_is_subclass(CLASS_UINT8_ARRAY + top()->typed->kind, v.class));
+                                        break;
                                 case VALUE_DICT:      *top() = BOOLEAN(class_is_subclass(CLASS_DICT, v.class));      break;
                                 case VALUE_METHOD:
                                 case VALUE_BUILTIN_METHOD:
@@ -2762,31 +4696,34 @@ BadContainer:
                                 n = 1;
                                 nkw = 0;
                                 b = false;
-                                method = "__match__";
-                                h = strhash(method);
+                                SETMEMBER(sym, method, h, site, "__match__");
                                 goto CallMethod;
                         }
-                        break;
+                        DISPATCH();
                 CASE(LT)
                         right = pop();
                         left = pop();
+                        QUICKEN(LT);
                         push(BOOLEAN(value_compare(&left, &right) < 0));
-                        break;
+                        DISPATCH();
                 CASE(GT)
                         right = pop();
                         left = pop();
+                        QUICKEN(GT);
                         push(BOOLEAN(value_compare(&left, &right) > 0));
-                        break;
+                        DISPATCH();
                 CASE(LEQ)
                         right = pop();
                         left = pop();
+                        QUICKEN(LEQ);
                         push(BOOLEAN(value_compare(&left, &right) <= 0));
-                        break;
+                        DISPATCH();
                 CASE(GEQ)
                         right = pop();
                         left = pop();
+                        QUICKEN(GEQ);
                         push(BOOLEAN(value_compare(&left, &right) >= 0));
-                        break;
+                        DISPATCH();
                 CASE(CMP)
                         right = pop();
                         left = pop();
@@ -2797,18 +4734,27 @@ BadContainer:
                                 push(INTEGER(1));
                         else
                                 push(INTEGER(0));
-                        break;
+                        DISPATCH();
                 CASE(GET_TAG)
                         v = pop();
                         if (v.tags == 0)
                                 push(NIL);
                         else
                                 push(TAG(tags_first(v.tags)));
-                        break;
+                        DISPATCH();
+                QUICK_OPS(ADD, +,  INTEGER, REAL,    binary_operator_addition(&left, &right))
+                QUICK_OPS(SUB, -,  INTEGER, REAL,    binary_operator_subtraction(&left, &right))
+                QUICK_OPS(MUL, *,  INTEGER, REAL,    binary_operator_multiplication(&left, &right))
+                QUICK_OPS(EQ,  ==, BOOLEAN, BOOLEAN, binary_operator_equality(&left, &right))
+                QUICK_OPS(NEQ, !=, BOOLEAN, BOOLEAN, binary_operator_non_equality(&left, &right))
+                QUICK_CMPS(LT,  <)
+                QUICK_CMPS(GT,  >)
+                QUICK_CMPS(LEQ, <=)
+                QUICK_CMPS(GEQ, >=)
                 CASE(LEN)
                         v = pop();
                         push(INTEGER(v.array->count)); // TODO
-                        break;
+                        DISPATCH();
                 CASE(PRE_INC)
                         FALSE_OR (SpecialTarget()) {
                                 vm_panic("pre-increment applied to invalid target");
@@ -2824,13 +4770,13 @@ BadContainer:
                                 }
                         case VALUE_PTR:
                                 vp = peektarget();
-                                vp->ptr = ((char *)vp->ptr) + ((ffi_type *)(vp->extra == NULL ? &ffi_type_uint8 : vp->extra))->size;
+                                vp->ptr = ((char *)vp->ptr) + ((ffi_type *)(vp->extra == 0 ? &ffi_type_uint8 : value_extra(vp->extra)))->size;
                                 break;
                         default:
                                 vm_panic("pre-increment applied to invalid type: %s", value_show(peektarget()));
                         }
                         push(*poptarget());
-                        break;
+                        DISPATCH();
                 CASE(POST_INC)
                         FALSE_OR (SpecialTarget()) {
                                 vm_panic("pre-increment applied to invalid target");
@@ -2841,12 +4787,12 @@ BadContainer:
                         case VALUE_REAL:    ++peektarget()->real;    break;
                         case VALUE_PTR:
                                 vp = peektarget();
-                                vp->ptr = ((char *)vp->ptr) + ((ffi_type *)(vp->extra == NULL ? &ffi_type_uint8 : vp->extra))->size;
+                                vp->ptr = ((char *)vp->ptr) + ((ffi_type *)(vp->extra == 0 ? &ffi_type_uint8 : value_extra(vp->extra)))->size;
                                 break;
                         default:            vm_panic("post-increment applied to invalid type: %s", value_show(peektarget()));
                         }
                         poptarget();
-                        break;
+                        DISPATCH();
                 CASE(PRE_DEC)
                         if (SpecialTarget()) {
                                 vm_panic("pre-decrement applied to invalid target");
@@ -2862,13 +4808,13 @@ BadContainer:
                                 }
                         case VALUE_PTR:
                                 vp = peektarget();
-                                vp->ptr = ((char *)vp->ptr) - ((ffi_type *)(vp->extra == NULL ? &ffi_type_uint8 : vp->extra))->size;
+                                vp->ptr = ((char *)vp->ptr) - ((ffi_type *)(vp->extra == 0 ? &ffi_type_uint8 : value_extra(vp->extra)))->size;
                                 break;
                         default:
                                 vm_panic("pre-decrement applied to invalid type: %s", value_show(peektarget()));
                         }
                         push(*poptarget());
-                        break;
+                        DISPATCH();
                 CASE(POST_DEC)
                         if (SpecialTarget()) {
                                 vm_panic("post-decrement applied to invalid target");
@@ -2879,24 +4825,24 @@ BadContainer:
                         case VALUE_REAL:    --peektarget()->real;    break;
                         case VALUE_PTR:
                                 vp = peektarget();
-                                vp->ptr = ((char *)vp->ptr) - ((ffi_type *)(vp->extra == NULL ? &ffi_type_uint8 : vp->extra))->size;
+                                vp->ptr = ((char *)vp->ptr) - ((ffi_type *)(vp->extra == 0 ? &ffi_type_uint8 : value_extra(vp->extra)))->size;
                                 break;
                         default:            vm_panic("post-decrement applied to invalid type: %s", value_show(peektarget()));
                         }
                         poptarget();
-                        break;
+                        DISPATCH();
                 CASE(MUT_ADD)
                         DoMutAdd();
-                        break;
+                        DISPATCH();
                 CASE(MUT_MUL)
                         DoMutMul();
-                        break;
+                        DISPATCH();
                 CASE(MUT_DIV)
                         DoMutDiv();
-                        break;
+                        DISPATCH();
                 CASE(MUT_SUB)
                         DoMutSub();
-                        break;
+                        DISPATCH();
                 CASE(DEFINE_TAG)
                 {
                         int tag, super, n;
@@ -2910,7 +4856,7 @@ BadContainer:
                         }
                         if (super != -1)
                                 tags_copy_methods(tag, super);
-                        break;
+                        DISPATCH();
                 }
                 CASE(DEFINE_CLASS)
                 {
@@ -2940,10 +4886,12 @@ BadContainer:
                                 class_add_setter(class, ip, v);
                                 ip += strlen(ip) + 1;
                         }
-                        break;
+                        DISPATCH();
                 }
                 CASE(FUNCTION)
                 {
+                        SAFEPOINT();
+
                         v.tags = 0;
                         v.type = VALUE_FUNCTION;
 
@@ -2998,12 +4946,14 @@ BadContainer:
                         }
 
                         push(v);
-                        break;
+                        DISPATCH();
                 }
                 CASE(TAIL_CALL)
                         tco = true;
-                        break;
+                        DISPATCH();
                 CASE(CALL)
+                        SAFEPOINT();
+
                         v = pop();
 
                         READVALUE(n);
@@ -3081,6 +5031,7 @@ BadContainer:
                                 LOG("CALLING %s with %d arguments", value_show(&v), n);
                                 print_stack(n);
                                 call(&v, NULL, n, nkw, false);
+                                JIT_POINT();
                                 break;
                         case VALUE_BUILTIN_FUNCTION:
                                 /*
@@ -3147,12 +5098,13 @@ BadContainer:
                                 }
                                 break;
                         case VALUE_METHOD:
-                                if (v.name == MISSING) {
+                                if (v.name == MissingId) {
                                         push(NIL);
                                         memmove(top() - (n - 1), top() - n, n * sizeof (struct value));
                                         top()[-n++] = v.this[1];
                                 }
                                 call(v.method, v.this, n, nkw, false);
+                                JIT_POINT();
                                 break;
                         case VALUE_REGEX:
                                 if (n != 1)
@@ -3166,19 +5118,27 @@ BadContainer:
                                 *top() = v;
                                 break;
                         case VALUE_BUILTIN_METHOD:
+                        {
+                                struct value r;
                                 if (nkw > 0) {
                                         container = pop();
                                         gc_push(&container);
                                         k = stack.count - n;
-                                        v = v.builtin_method(v.this, n, &container);
+                                        r = v.builtin_method(v.this, n, &container);
                                         gc_pop();
                                 } else {
                                         k = stack.count - n;
-                                        v = v.builtin_method(v.this, n, NULL);
+                                        r = v.builtin_method(v.this, n, NULL);
                                 }
+                                /*
+                                 * Builtin methods store into their receiver
+                                 * without barriers of their own.
+                                 */
+                                GCRememberValue(&RememberedSet, v.this);
                                 stack.count = k;
-                                push(v);
+                                push(r);
                                 break;
+                        }
                         case VALUE_NIL:
                                 stack.count -= n;
                                 push(NIL);
@@ -3188,17 +5148,17 @@ BadContainer:
                         }
                         gc_pop();
                         nkw = 0;
-                        break;
+                        DISPATCH();
                 CASE(TRY_CALL_METHOD)
                 CASE(CALL_METHOD)
                         b = ip[-1] == INSTR_TRY_CALL_METHOD;
 
-                        READVALUE(n);
+                        SAFEPOINT();
 
-                        method = ip;
-                        ip += strlen(ip) + 1;
+                        READVALUE(n);
 
-                        READVALUE(h);
+                        READMEMBER(sym, method, h);
+                        READVALUE(site);
 
                         READVALUE(nkw);
 
@@ -3207,7 +5167,7 @@ BadContainer:
                         }
 
                 /*
-                 * b, n, nkw, h, and method must all be correctly set when jumping here
+                 * b, n, nkw, h, method, sym, and site must all be correctly set when jumping here
                  */
                 CallMethod:
                         LOG("METHOD = %s, n = %d", method, n);
@@ -3250,45 +5210,40 @@ BadContainer:
                                 }
                                 break;
                         case VALUE_STRING:
-                                func = get_string_method(method);
-                                if (func == NULL)
-                                        vp = class_lookup_method(CLASS_STRING, method, h);
+                                vp = LookupMethod(CLASS_STRING, method, h, sym, site, &func);
                                 break;
                         case VALUE_DICT:
-                                func = get_dict_method(method);
-                                if (func == NULL)
-                                        vp = class_lookup_method(CLASS_DICT, method, h);
+                                vp = LookupMethod(CLASS_DICT, method, h, sym, site, &func);
                                 break;
                         case VALUE_ARRAY:
-                                func = get_array_method(method);
-                                if (func == NULL)
-                                        vp = class_lookup_method(CLASS_ARRAY, method, h);
+                                vp = LookupMethod(CLASS_ARRAY, method, h, sym, site, &func);
                                 break;
                         case VALUE_BLOB:
-                                func = get_blob_method(method);
-                                if (func == NULL)
-                                        vp = class_lookup_method(CLASS_BLOB, method, h);
+                                vp = LookupMethod(CLASS_BLOB, method, h, sym, site, &func);
+                                break;
+                        case VALUE_TYPED_ARRAY:
+                                vp = LookupMethod(CLASS_UINT8_ARRAY + value.typed->kind, method, h, sym, site, &func);
                                 break;
                         case VALUE_INTEGER:
-                                vp = class_lookup_method(CLASS_INT, method, h);
+                                vp = LookupMethod(CLASS_INT, method, h, sym, site, NULL);
                                 break;
                         case VALUE_REAL:
-                                vp = class_lookup_method(CLASS_FLOAT, method, h);
+                                vp = LookupMethod(CLASS_FLOAT, method, h, sym, site, NULL);
                                 break;
                         case VALUE_BOOLEAN:
-                                vp = class_lookup_method(CLASS_BOOL, method, h);
+                                vp = LookupMethod(CLASS_BOOL, method, h, sym, site, NULL);
                                 break;
                         case VALUE_REGEX:
-                                vp = class_lookup_method(CLASS_REGEX, method, h);
+                                vp = LookupMethod(CLASS_REGEX, method, h, sym, site, NULL);
                                 break;
                         case VALUE_FUNCTION:
                         case VALUE_BUILTIN_FUNCTION:
                         case VALUE_METHOD:
                         case VALUE_BUILTIN_METHOD:
-                                vp = class_lookup_method(CLASS_FUNCTION, method, h);
+                                vp = LookupMethod(CLASS_FUNCTION, method, h, sym, site, NULL);
                                 break;
                         case VALUE_GENERATOR:
-                                vp = class_lookup_method(CLASS_GENERATOR, method, h);
+                                vp = LookupMethod(CLASS_GENERATOR, method, h, sym, site, NULL);
                                 break;
                         case VALUE_TUPLE:
                                 vp = tuple_get(&value, method);
@@ -3301,16 +5256,13 @@ BadContainer:
                         case VALUE_CLASS: /* lol */
                                 vp = class_lookup_immediate(CLASS_CLASS, method, h);
                                 if (vp == NULL) {
-                                        vp = class_lookup_static(value.class, method, h);
-                                }
-                                if (vp == NULL) {
-                                        vp = class_lookup_method(value.class, method, h);
+                                        vp = ICLookup(site, IC_STATIC, value.class, sym)->vp;
                                 }
                                 break;
                         case VALUE_OBJECT:
-                                vp = table_lookup(value.object, method, h);
+                                vp = LookupField(value.object, sym);
                                 if (vp == NULL) {
-                                        vp = class_lookup_method(value.class, method, h);
+                                        vp = LookupMethod(value.class, method, h, sym, site, NULL);
                                 } else {
                                         self = NULL;
                                 }
@@ -3318,7 +5270,7 @@ BadContainer:
                         case VALUE_NIL:
                                 stack.count -= (n + 1 + nkw);
                                 push(NIL);
-                                continue;
+                                DISPATCH();
                         }
 
                         if (func != NULL) {
@@ -3326,7 +5278,7 @@ BadContainer:
                                 value.type &= ~VALUE_TAGGED;
                                 value.tags = 0;
                                 AutoThis = true;
-                                v = BUILTIN_METHOD(method, func, &value);
+                                v = BUILTIN_METHOD(sym, func, &value);
                                 if (nkw > 0) {
                                         goto CallKwArgs;
                                 } else {
@@ -3337,7 +5289,7 @@ BadContainer:
                                 pop();
                                 if (self != NULL) {
                                         AutoThis = true;
-                                        v = METHOD(method, vp, self);
+                                        v = METHOD(sym, vp, self);
                                 } else {
                                         v = *vp;
                                 }
@@ -3364,13 +5316,13 @@ BadContainer:
                                 }
                                 vm_panic("call to non-existent method '%s' on %s", method, value_show(&value));
                         }
-                        break;
+                        DISPATCH();
                 CASE(SAVE_STACK_POS)
                         vec_push(sp_stack, stack.count);
-                        break;
+                        DISPATCH();
                 CASE(RESTORE_STACK_POS)
                         stack.count = *vec_pop(sp_stack);
-                        break;
+                        DISPATCH();
                 CASE(MULTI_RETURN)
                 CASE(RETURN)
                 Return:
@@ -3390,47 +5342,13 @@ BadContainer:
                 CASE(RETURN_PRESERVE_CTX)
                         ip = *vec_pop(calls);
                         LOG("returning: ip = %p", ip);
-                        break;
+                        DISPATCH();
                 CASE(HALT)
                         ip = save;
                         LOG("halting: ip = %p", ip);
                         return;
                 }
         }
-
-        while (q1.n != 0) {
-                ;
-        }
-
-        continue;
-
-        TyThread *current = &Threads.items[ThreadIndex];
-
-        for (int i = 1; i < Threads.count; ++i) {
-                int j = (i + ThreadIndex) % Threads.count;
-
-                TyThread *t = &Threads.items[j];
-
-                if (!t->waiting) {
-                        current->stack = stack;
-                        current->calls = calls;
-                        current->frames = frames;
-                        current->targets = targets;
-                        current->try_stack = try_stack;
-                        current->sp_stack = sp_stack;
-                        current->ip = ip;
-
-                        stack = t->stack;
-                        calls = t->calls;
-                        frames = t->frames;
-                        targets = t->targets;
-                        try_stack = t->try_stack;
-                        sp_stack = t->sp_stack;
-                        ip = t->ip;
-                }
-        }
-
-        }
 }
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -3473,6 +5391,8 @@ vm_init(int ac, char **av)
 {
         GC_OFF_COUNT += 1;
 
+        value_hash_init();
+
         vec_init(stack);
         vec_init(calls);
         vec_init(targets);
@@ -3492,6 +5412,12 @@ vm_init(int ac, char **av)
 
         compiler_init();
 
+        MissingId = intern(MISSING)->id;
+
+        gc_init();
+
+        jit_init();
+
         add_builtins(ac, av);
 
         char *prelude = compiler_load_prelude();
@@ -3655,13 +5581,7 @@ vm_execute_file(char const *path)
                 return false;
         }
 
-        filename = path;
-
-        bool success = vm_execute(source);
-
-        GCLOG("Allocs before: %zu", allocs.count);
-        DoGC();
-        GCLOG("Allocs after: %zu", allocs.count);
+        bool success = vm_execute_named(path, source);
 
         /*
          * When we read the file, we copy into an allocated buffer with a 0 byte at
@@ -3670,6 +5590,20 @@ vm_execute_file(char const *path)
          */
         gc_free(source - 1);
 
+        return success;
+}
+
+bool
+vm_execute_named(char const *path, char const *source)
+{
+        filename = path;
+
+        bool success = vm_execute(source);
+
+        GCLOG("Allocs before: %zu", allocs.count);
+        DoGC();
+        GCLOG("Allocs after: %zu", allocs.count);
+
         filename = NULL;
 
         return success;
@@ -3797,7 +5731,10 @@ vm_call(struct value const *f, int argc)
                 stack.count = n;
                 return r;
         case VALUE_BUILTIN_METHOD:
+                gc_push(f->this);
                 r = f->builtin_method(f->this, argc, NULL);
+                gc_pop();
+                GCRememberValue(&RememberedSet, f->this);
                 stack.count = n;
                 return r;
         case VALUE_TAG:
@@ -3861,7 +5798,10 @@ vm_eval_function(struct value const *f, ...)
                 stack.count = n;
                 return r;
         case VALUE_BUILTIN_METHOD:
+                gc_push(f->this);
                 r = f->builtin_method(f->this, argc, NULL);
+                gc_pop();
+                GCRememberValue(&RememberedSet, f->this);
                 stack.count = n;
                 return r;
         default:
@@ -3870,7 +5810,7 @@ vm_eval_function(struct value const *f, ...)
 }
 
 void
-MarkStorage(ThreadStorage const *storage)
+MarkStorage(ThreadStorage const *storage, bool minor)
 {
         vec(struct value const *) *root_set = storage->root_set;
 
@@ -3880,14 +5820,10 @@ MarkStorage(ThreadStorage const *storage)
         }
 
         GCLOG("Marking stack");
-        for (int i = 0; i < storage->stack->count; ++i) {
-                value_mark(&storage->stack->items[i]);
-        }
+        GCMarkRoots(storage->stack->items, storage->stack->count);
 
         GCLOG("Marking defer_stack");
-        for (int i = 0; i < storage->defer_stack->count; ++i) {
-                value_mark(&storage->defer_stack->items[i]);
-        }
+        GCMarkRoots(storage->defer_stack->items, storage->defer_stack->count);
 
         GCLOG("Marking targets");
         for (int i = 0; i < storage->targets->count; ++i) {
@@ -3901,13 +5837,30 @@ MarkStorage(ThreadStorage const *storage)
                 value_mark(&storage->frames->items[i].f);
         }
 
+        GCLOG("Marking objects waiting to be finalized");
+        for (size_t i = 0; i < storage->finalizers->count; ++i) {
+                struct object *o = (struct object *)storage->finalizers->items[i]->data;
+                value_mark(&OBJECT(o, o->class));
+        }
+
+        if (minor) {
+                for (int i = 0; i < root_set->count; ++i) {
+                        GCRememberValue(storage->remembered, root_set->items[i]);
+                }
+                GCLOG("Marking remembered set");
+                GCMarkRemembered(storage->remembered);
+        }
+
         // FIXME: should finalizers be allowed to keep things alive?
         return;
 
         GCLOG("Marking finalizers");
         for (int i = 0; i < storage->allocs->count; ++i) {
                 if (storage->allocs->items[i]->type == GC_OBJECT) {
-                        value_mark(&((struct table *)storage->allocs->items[i]->data)->finalizer);
+                        struct object *o = (struct object *)storage->allocs->items[i]->data;
+                        if (o->finalizer != NULL) {
+                                value_mark(o->finalizer);
+                        }
                 }
         }
 }
@@ -20,9 +20,15 @@
 #include "sqlite.h"
 #include "util.h"
 #include "table.h"
+#include "object.h"
+#include "jit.h"
+#include "aot.h"
+#include "heap.h"
 #include "compiler.h"
+#include "cache.h"
 #include "class.h"
 #include "blob.h"
+#include "typed.h"
 #include "str.h"
 #include "dict.h"
 #include "array.h"
@@ -168,7 +174,7 @@ complete(char const *s, int start, int end)
                 switch (v->type) {
                 case VALUE_OBJECT:
                         n += class_get_completions(v->class, s, completions, MAX_COMPLETIONS);
-                        n += table_get_completions(v->object, s, completions + n, MAX_COMPLETIONS - n);
+                        n += object_get_completions(v->object, s, completions + n, MAX_COMPLETIONS - n);
                         break;
                 case VALUE_ARRAY:
                         n += array_get_completions(s, completions, MAX_COMPLETIONS);
@@ -186,6 +192,10 @@ complete(char const *s, int start, int end)
                         n += blob_get_completions(s, completions, MAX_COMPLETIONS);
                         n += class_get_completions(CLASS_BLOB, s, completions, MAX_COMPLETIONS - n);
                         break;
+                case VALUE_TYPED_ARRAY:
+                        n += typed_array_get_completions(s, completions, MAX_COMPLETIONS);
+                        n += class_get_completions(CLASS_UINT8_ARRAY + v->typed->kind, s, completions + n, MAX_COMPLETIONS - n);
+                        break;
                 case VALUE_TUPLE:
                         n += tuple_get_completions(v, s, completions, MAX_COMPLETIONS);
                         break;
@@ -203,6 +213,22 @@ complete(char const *s, int start, int end)
 int
 main(int argc, char **argv)
 {
+        /* These have to be known before vm_init() loads the prelude */
+        if (argc > 1 && strcmp(argv[1], "--no-cache") == 0) {
+                UseCache = false;
+                argv[1] = argv[0];
+                argv += 1;
+                argc -= 1;
+        }
+
+        /* --emit-c compiles every unit itself, and keeps their images to embed */
+        for (int i = 1; i < argc && i < 3; ++i) {
+                if (strcmp(argv[i], "--emit-c") == 0) {
+                        UseCache = false;
+                        KeepImages = true;
+                }
+        }
+
         vm_init(argc, argv);
 
         use_readline = isatty(0) && argc < 2;
@@ -217,6 +243,19 @@ main(int argc, char **argv)
 
         int i = 1;
 
+        if (i < argc && strcmp(argv[i], "--jit") == 0) {
+                jit_enable();
+                i += 1;
+        }
+
+        if (i + 1 < argc && strcmp(argv[i], "--emit-c") == 0) {
+                return aot_emit_c(stdout, argv[i + 1]) ? 0 : -1;
+        }
+
+        if (i + 1 < argc && strcmp(argv[i], "--heap-report") == 0) {
+                return heap_report(stdout, argv[i + 1]) ? 0 : -1;
+        }
+
         if (i < argc && strcmp(argv[i], "-q") == 0) {
                 CheckConstraints = false;
                 i += 1;